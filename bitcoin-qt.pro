@@ -160,6 +160,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/sync.h \
     src/util.h \
     src/hash.h \
+    src/sha256.h \
+    src/secp256k1.h \
     src/uint256.h \
     src/serialize.h \
     src/main.h \
@@ -222,6 +224,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/rpcconsole.h \
     src/version.h \
     src/netbase.h \
+    src/socketevents.h \
     src/clientversion.h \
     src/txdb.h \
     src/leveldb.h \
@@ -241,7 +244,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/sph_cubehash.h \
     src/sph_echo.h \
     src/sph_shavite.h \
-    src/sph_simd.h
+    src/sph_simd.h \
+    src/sph_aesni.h
 
 SOURCES += src/qt/bitcoin.cpp \
     src/qt/bitcoingui.cpp \
@@ -261,7 +265,11 @@ SOURCES += src/qt/bitcoin.cpp \
     src/sync.cpp \
     src/util.cpp \
     src/hash.cpp \
+    src/sha256.cpp \
+    src/secp256k1.cpp \
+    src/hashblock.cpp \
     src/netbase.cpp \
+    src/socketevents.cpp \
     src/key.cpp \
     src/script.cpp \
     src/main.cpp \
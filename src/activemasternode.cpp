@@ -105,17 +105,15 @@ void CActiveMasternode::RegisterAsMasterNode(bool stop)
 
             pwalletMain->LockCoin(vinMasternode.prevout);
 
-            bool found = false;
-            BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes)
-                if(mn.vin == vinMasternode)
-                    found = true;
-
-            if(!found) {
-                LogPrintf("CActiveMasternode::RegisterAsMasterNode() - Adding myself to masternode list %s - %s\n", masterNodeSignAddr.ToString().c_str(), vinMasternode.ToString().c_str());
-                CMasterNode mn(masterNodeSignAddr, vinMasternode, pubkeyMasterNode, vchMasterNodeSignature, masterNodeSignatureTime, pubkey2);
-                mn.UpdateLastSeen(masterNodeSignatureTime);
-                darkSendMasterNodes.push_back(mn);
-                LogPrintf("CActiveMasternode::RegisterAsMasterNode() - Masternode input = %s\n", vinMasternode.ToString().c_str());
+            {
+                WRITE_LOCK(darkSendMasterNodes.cs);
+                if(darkSendMasterNodes.Find(vinMasternode) == -1) {
+                    LogPrintf("CActiveMasternode::RegisterAsMasterNode() - Adding myself to masternode list %s - %s\n", masterNodeSignAddr.ToString().c_str(), vinMasternode.ToString().c_str());
+                    CMasterNode mn(masterNodeSignAddr, vinMasternode, pubkeyMasterNode, vchMasterNodeSignature, masterNodeSignatureTime, pubkey2);
+                    mn.UpdateLastSeen(masterNodeSignatureTime);
+                    darkSendMasterNodes.Add(mn);
+                    LogPrintf("CActiveMasternode::RegisterAsMasterNode() - Masternode input = %s\n", vinMasternode.ToString().c_str());
+                }
             }
 
             RelayDarkSendElectionEntry(vinMasternode, masterNodeSignAddr, vchMasterNodeSignature, masterNodeSignatureTime, pubkeyMasterNode, pubkey2, -1, -1, masterNodeSignatureTime);
@@ -141,12 +139,12 @@ void CActiveMasternode::RegisterAsMasterNode(bool stop)
     }
 
     bool found = false;
-    BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-        //LogPrintf(" -- %s\n", mn.vin.ToString().c_str());
-
-        if(mn.vin == vinMasternode) {
+    {
+        WRITE_LOCK(darkSendMasterNodes.cs);
+        int i = darkSendMasterNodes.Find(vinMasternode);
+        if(i >= 0) {
             found = true;
-            mn.UpdateLastSeen();
+            darkSendMasterNodes[i].UpdateLastSeen();
         }
     }
     if(!found){
@@ -190,8 +188,9 @@ bool CActiveMasternode::RegisterAsMasterNodeRemoteOnly(std::string strMasterNode
     }
 
     CService masterNodeSignAddr = CService(strMasterNodeAddr);
-    BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes){
-        if(mn.addr == masterNodeSignAddr){
+    {
+        READ_LOCK(darkSendMasterNodes.cs);
+        if(darkSendMasterNodes.Find(masterNodeSignAddr) >= 0){
             LogPrintf("CActiveMasternode::RegisterAsMasterNodeRemoteOnly() - Address in use\n");
             return false;
         }
@@ -221,10 +220,16 @@ bool CActiveMasternode::RegisterAsMasterNodeRemoteOnly(std::string strMasterNode
 
     // Choose coins to use
     while (GetMasterNodeVin(vinMasternode, pubkeyMasterNode, SecretKey)) {
-        // don't use a vin that's registered
-        BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes)
-            if(mn.vin == vinMasternode)
-                continue;
+        // don't use a vin that's registered; lock it, so the next pick is another one
+        bool fRegistered;
+        {
+            READ_LOCK(darkSendMasterNodes.cs);
+            fRegistered = (darkSendMasterNodes.Find(vinMasternode) >= 0);
+        }
+        if(fRegistered) {
+            pwalletMain->LockCoin(vinMasternode.prevout);
+            continue;
+        }
 
         if(GetInputAge(vinMasternode) < MASTERNODE_MIN_CONFIRMATIONS)
             continue;
@@ -17,7 +17,8 @@
 class CActiveMasternode;
 extern CActiveMasternode activeMasternode;
 
-// Responsible for activating the masternode and pinging the network
+// Responsible for activating the masternode and pinging the network.
+// Its state is protected by cs_main.
 class CActiveMasternode
 {
 public:
@@ -0,0 +1,172 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// ECDSA benchmarks, built with "make -f makefile.unix bench_ecdsa"
+//
+// Usage: bench_ecdsa [-iterations=<n>]
+//
+// Prints one JSON object per line with the operations per second of the
+// native secp256k1 code, and of OpenSSL for the same operation where it has
+// one:
+//   verify    DER signature checks (CPubKey::Verify, script checks)
+//   recover   public key recovery from compact signatures (CPubKey::
+//             RecoverCompact, masternode and darksend message signatures)
+//   sign      signing, and deriving a public key from a secret
+//
+
+#include "secp256k1.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+
+using namespace std;
+
+static int64_t GetTimeNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int nIterations = 2000;
+
+/** A key pair, a hash and its signatures in every form the benchmarks need */
+struct CBenchKey
+{
+    unsigned char sec[32];
+    unsigned char hash[32];
+    unsigned char pub[65];
+    size_t publen;
+    unsigned char sig[72];
+    size_t siglen;
+    unsigned char sig64[64];
+    int recid;
+    EC_KEY *pkey;
+
+    CBenchKey()
+    {
+        unsigned char nonce[32];
+        do {
+            RAND_bytes(sec, sizeof(sec));
+            RAND_bytes(nonce, sizeof(nonce));
+        } while (!ECPubKeyCreate(sec, true, pub, publen) ||
+                 !ECDSASign(hash, sec, nonce, sig, siglen) ||
+                 !ECDSASignCompact(hash, sec, nonce, sig64, recid));
+        RAND_bytes(hash, sizeof(hash));
+        RAND_bytes(nonce, sizeof(nonce));
+        ECDSASign(hash, sec, nonce, sig, siglen);
+        ECDSASignCompact(hash, sec, nonce, sig64, recid);
+
+        pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+        const unsigned char *p = pub;
+        o2i_ECPublicKey(&pkey, &p, publen);
+    }
+
+    ~CBenchKey()
+    {
+        EC_KEY_free(pkey);
+    }
+};
+
+/** Best of three runs, in operations per second */
+template<typename F>
+static double OpsPerSecond(F f, vector<CBenchKey>& vKeys)
+{
+    double dBest = 0;
+    for (int n = 0; n < 3; n++)
+    {
+        int64_t nStart = GetTimeNanos();
+        for (unsigned int i = 0; i < nIterations; i++)
+            if (!f(vKeys[i % vKeys.size()]))
+                fprintf(stderr, "benchmark operation failed\n");
+        double d = nIterations * 1e9 / (GetTimeNanos() - nStart);
+        dBest = max(dBest, d);
+    }
+    return dBest;
+}
+
+static bool NativeVerify(CBenchKey& key)
+{
+    return ECDSAVerify(key.hash, key.sig, key.siglen, key.pub, key.publen);
+}
+
+static bool OpenSSLVerify(CBenchKey& key)
+{
+    return ECDSA_verify(0, key.hash, sizeof(key.hash), key.sig, key.siglen, key.pkey) == 1;
+}
+
+static bool NativeRecover(CBenchKey& key)
+{
+    unsigned char pub[65];
+    size_t publen;
+    return ECDSARecoverCompact(key.hash, key.sig64, key.recid, true, pub, publen);
+}
+
+static bool NativeSign(CBenchKey& key)
+{
+    unsigned char nonce[32], sig[72];
+    size_t siglen;
+    memcpy(nonce, key.hash, sizeof(nonce));
+    return ECDSASign(key.hash, key.sec, nonce, sig, siglen);
+}
+
+static bool OpenSSLSign(CBenchKey& key)
+{
+    unsigned char sig[80];
+    unsigned int siglen = sizeof(sig);
+    return ECDSA_sign(0, key.hash, sizeof(key.hash), sig, &siglen, key.pkey) == 1;
+}
+
+static bool NativePubKey(CBenchKey& key)
+{
+    unsigned char pub[65];
+    size_t publen;
+    return ECPubKeyCreate(key.sec, true, pub, publen);
+}
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "-iterations=", 12) == 0)
+            nIterations = std::max(atoi(argv[i] + 12), 1);
+        else
+        {
+            fprintf(stderr, "Usage: %s [-iterations=<n>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    vector<CBenchKey> vKeys(16);
+
+    double dNative = OpsPerSecond(NativeVerify, vKeys);
+    double dOpenSSL = OpsPerSecond(OpenSSLVerify, vKeys);
+    printf("{\"bench\":\"verify\",\"native_per_sec\":%.0f,\"openssl_per_sec\":%.0f,\"speedup\":%.2f}\n",
+           dNative, dOpenSSL, dNative / dOpenSSL);
+
+    printf("{\"bench\":\"recover\",\"native_per_sec\":%.0f}\n", OpsPerSecond(NativeRecover, vKeys));
+
+    // OpenSSL needs the secret in its key for signing
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        BIGNUM *bn = BN_bin2bn(vKeys[i].sec, sizeof(vKeys[i].sec), NULL);
+        EC_KEY_set_private_key(vKeys[i].pkey, bn);
+        BN_clear_free(bn);
+    }
+    dNative = OpsPerSecond(NativeSign, vKeys);
+    dOpenSSL = OpsPerSecond(OpenSSLSign, vKeys);
+    printf("{\"bench\":\"sign\",\"native_per_sec\":%.0f,\"openssl_per_sec\":%.0f,\"speedup\":%.2f}\n",
+           dNative, dOpenSSL, dNative / dOpenSSL);
+    printf("{\"bench\":\"pubkey\",\"native_per_sec\":%.0f}\n", OpsPerSecond(NativePubKey, vKeys));
+    return 0;
+}
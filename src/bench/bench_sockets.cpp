@@ -0,0 +1,241 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Socket event benchmarks, built with "make -f makefile.unix bench_sockets"
+//
+// Usage: bench_sockets [-peers=<n>] [-rounds=<n>] [-active=<n>]
+//
+// Connects -peers loopback TCP peers (100, 1000 and 4000 if not given) and
+// services their sockets with CSocketEvents as the socket handler thread
+// does, once with epoll and once with select(). Every result is one JSON
+// object per line:
+//   idle      cost of one wait that finds nothing, with every peer idle
+//   echo      rounds per second in which -active random peers each send a
+//             small message that is read and echoed back
+// select() can only take sockets below FD_SETSIZE, so it is skipped for
+// larger peer counts.
+//
+
+#include "socketevents.h"
+
+#include <algorithm>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+static int64_t GetTimeNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const int MESSAGE_SIZE = 64;
+
+static int nRounds = 2000;
+static int nActive = 10;
+
+/** Both ends of a number of loopback connections */
+struct CLoopback
+{
+    vector<SOCKET> vServer;
+    vector<SOCKET> vClient;
+
+    ~CLoopback()
+    {
+        for (unsigned int i = 0; i < vServer.size(); i++)
+            closesocket(vServer[i]);
+        for (unsigned int i = 0; i < vClient.size(); i++)
+            closesocket(vClient[i]);
+    }
+
+    bool Connect(int nPeers)
+    {
+        SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (hListen == INVALID_SOCKET ||
+            bind(hListen, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            listen(hListen, SOMAXCONN) == SOCKET_ERROR ||
+            getsockname(hListen, (struct sockaddr*)&addr, &len) == SOCKET_ERROR)
+        {
+            fprintf(stderr, "cannot listen on loopback: %s\n", strerror(errno));
+            closesocket(hListen);
+            return false;
+        }
+
+        int nOne = 1;
+        for (int i = 0; i < nPeers; i++)
+        {
+            SOCKET hClient = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (hClient == INVALID_SOCKET || connect(hClient, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR)
+            {
+                fprintf(stderr, "cannot connect peer %d: %s\n", i, strerror(errno));
+                closesocket(hClient);
+                closesocket(hListen);
+                return false;
+            }
+            SOCKET hServer = accept(hListen, NULL, NULL);
+            if (hServer == INVALID_SOCKET)
+            {
+                fprintf(stderr, "cannot accept peer %d: %s\n", i, strerror(errno));
+                closesocket(hClient);
+                closesocket(hListen);
+                return false;
+            }
+            fcntl(hServer, F_SETFL, O_NONBLOCK);
+            setsockopt(hClient, IPPROTO_TCP, TCP_NODELAY, &nOne, sizeof(nOne));
+            setsockopt(hServer, IPPROTO_TCP, TCP_NODELAY, &nOne, sizeof(nOne));
+            vClient.push_back(hClient);
+            vServer.push_back(hServer);
+        }
+        closesocket(hListen);
+        return true;
+    }
+};
+
+// Read and echo what one server socket has, until it would block
+static int Echo(SOCKET hSocket)
+{
+    int nTotal = 0;
+    char pchBuf[0x10000];
+    while (true)
+    {
+        int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        if (nBytes <= 0)
+            break;
+        if (send(hSocket, pchBuf, nBytes, MSG_NOSIGNAL | MSG_DONTWAIT) != nBytes)
+            fprintf(stderr, "echo send failed\n");
+        nTotal += nBytes;
+    }
+    return nTotal;
+}
+
+static void Run(CLoopback& peers, bool fEpoll)
+{
+    int nPeers = peers.vServer.size();
+    CSocketEvents events(fEpoll);
+    for (int i = 0; i < nPeers; i++)
+    {
+        if (!events.Add(peers.vServer[i], &peers.vServer[i]))
+        {
+            printf("{\"bench\":\"echo\",\"backend\":\"%s\",\"peers\":%d,\"skipped\":\"socket %u not watchable\"}\n",
+                   events.GetName(), nPeers, (unsigned int)peers.vServer[i]);
+            return;
+        }
+    }
+
+    vector<CSocketEvent> vEvents;
+    bool fWakeup;
+
+    // edge triggered registration reports every socket writable once
+    events.Wait(0, vEvents, fWakeup);
+
+    int64_t nStart = GetTimeNanos();
+    int nIdle = 1000;
+    for (int i = 0; i < nIdle; i++)
+        events.Wait(0, vEvents, fWakeup);
+    double dIdleMicros = (GetTimeNanos() - nStart) * 0.001 / nIdle;
+    printf("{\"bench\":\"idle\",\"backend\":\"%s\",\"peers\":%d,\"us_per_wait\":%.2f}\n",
+           events.GetName(), nPeers, dIdleMicros);
+
+    char pchMessage[MESSAGE_SIZE];
+    memset(pchMessage, 'x', sizeof(pchMessage));
+    int nActiveRound = min(nActive, nPeers);
+    int64_t nWaits = 0;
+    int64_t nWaitNanos = 0;
+    nStart = GetTimeNanos();
+    for (int n = 0; n < nRounds; n++)
+    {
+        set<int> setActive;
+        while ((int)setActive.size() < nActiveRound)
+            setActive.insert(rand() % nPeers);
+        for (set<int>::iterator it = setActive.begin(); it != setActive.end(); ++it)
+            send(peers.vClient[*it], pchMessage, sizeof(pchMessage), MSG_NOSIGNAL);
+
+        int nExpected = nActiveRound * MESSAGE_SIZE;
+        while (nExpected > 0)
+        {
+            int64_t nWaitStart = GetTimeNanos();
+            events.Wait(1000, vEvents, fWakeup);
+            nWaitNanos += GetTimeNanos() - nWaitStart;
+            nWaits++;
+            for (unsigned int i = 0; i < vEvents.size(); i++)
+                if (vEvents[i].fRecv)
+                    nExpected -= Echo(*(SOCKET*)vEvents[i].pdata);
+        }
+
+        for (set<int>::iterator it = setActive.begin(); it != setActive.end(); ++it)
+        {
+            char pchReply[MESSAGE_SIZE];
+            int nRead = 0;
+            while (nRead < MESSAGE_SIZE)
+            {
+                int nBytes = recv(peers.vClient[*it], pchReply + nRead, MESSAGE_SIZE - nRead, 0);
+                if (nBytes <= 0)
+                    break;
+                nRead += nBytes;
+            }
+        }
+    }
+    double dSeconds = (GetTimeNanos() - nStart) * 1e-9;
+    printf("{\"bench\":\"echo\",\"backend\":\"%s\",\"peers\":%d,\"active\":%d,\"rounds_per_sec\":%.0f,\"waits_per_round\":%.2f,\"us_per_wait\":%.2f}\n",
+           events.GetName(), nPeers, nActiveRound, nRounds / dSeconds,
+           (double)nWaits / nRounds, nWaitNanos * 0.001 / nWaits);
+}
+
+int main(int argc, char* argv[])
+{
+    vector<int> vPeers;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "-peers=", 7) == 0)
+            vPeers.push_back(max(atoi(argv[i] + 7), 1));
+        else if (strncmp(argv[i], "-rounds=", 8) == 0)
+            nRounds = max(atoi(argv[i] + 8), 1);
+        else if (strncmp(argv[i], "-active=", 8) == 0)
+            nActive = max(atoi(argv[i] + 8), 1);
+        else
+        {
+            fprintf(stderr, "Usage: %s [-peers=<n>] [-rounds=<n>] [-active=<n>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (vPeers.empty())
+    {
+        vPeers.push_back(100);
+        vPeers.push_back(1000);
+        vPeers.push_back(4000);
+    }
+
+    // two descriptors per peer
+    struct rlimit limitFD;
+    if (getrlimit(RLIMIT_NOFILE, &limitFD) == 0)
+    {
+        limitFD.rlim_cur = min((rlim_t)(2 * *max_element(vPeers.begin(), vPeers.end()) + 64), limitFD.rlim_max);
+        setrlimit(RLIMIT_NOFILE, &limitFD);
+    }
+
+    for (unsigned int i = 0; i < vPeers.size(); i++)
+    {
+        CLoopback peers;
+        if (!peers.Connect(vPeers[i]))
+            return 1;
+        Run(peers, true);
+        Run(peers, false);
+    }
+    return 0;
+}
@@ -0,0 +1,372 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// X11 benchmarks, built with "make -f makefile.unix bench_x11"
+//
+// Usage: bench_x11 [-iterations=<n>] [-threads=<n>]
+//
+// Every result is printed as one JSON object per line so runs can be
+// collected and compared across builds:
+//   stage     cycles and nanoseconds per byte of each sph stage
+//   chain     full X11 hashes/sec, single threaded and on -threads threads
+//   latency   per call Hash9 latency percentiles for headers and 32-byte
+//             masternode score inputs
+//   contexts  Hash9 with fresh contexts against the per-thread context set
+//
+
+#include "hashblock.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+static int64 GetTimeNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Time stamp counter, where the compiler exposes one
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+static const bool fHaveCycles = true;
+static inline uint64 GetCycles()
+{
+    return __builtin_ia32_rdtsc();
+}
+#else
+static const bool fHaveCycles = false;
+static inline uint64 GetCycles()
+{
+    return 0;
+}
+#endif
+
+static unsigned int nIterations = 20000;
+static unsigned int nThreads = 0;
+
+/** Keep the compiler from dropping a result */
+static inline void Consume(const void* p)
+{
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+//
+// Per-stage cost
+//
+
+struct CStage
+{
+    const char* pszName;
+    void* pctx;
+    void (*update)(void*, const void*, size_t);
+    void (*close)(void*, void*);
+};
+
+static void BenchStage(const CStage& stage, unsigned int nLen)
+{
+    unsigned char data[128];
+    for (unsigned int i = 0; i < sizeof(data); i++)
+        data[i] = i;
+
+    // Best of five runs, to keep scheduler noise out of the numbers
+    int64 nBestNanos = 0;
+    uint64 nBestCycles = 0;
+    for (int n = 0; n < 5; n++)
+    {
+        int64 nStart = GetTimeNanos();
+        uint64 nStartCycles = GetCycles();
+        for (unsigned int i = 0; i < nIterations; i++)
+        {
+            stage.update(stage.pctx, data, nLen);
+            stage.close(stage.pctx, data);
+        }
+        uint64 nCycles = GetCycles() - nStartCycles;
+        int64 nNanos = GetTimeNanos() - nStart;
+        Consume(data);
+        if (n == 0 || nNanos < nBestNanos)
+        {
+            nBestNanos = nNanos;
+            nBestCycles = nCycles;
+        }
+    }
+
+    double dBytes = (double)nLen * nIterations;
+    printf("{\"bench\":\"stage\",\"stage\":\"%s\",\"bytes\":%u,", stage.pszName, nLen);
+    if (fHaveCycles)
+        printf("\"cycles_per_byte\":%.2f,", nBestCycles / dBytes);
+    else
+        printf("\"cycles_per_byte\":null,");
+    printf("\"ns_per_byte\":%.3f}\n", nBestNanos / dBytes);
+}
+
+static void BenchStages()
+{
+    CHash9Contexts ctx;
+    const CStage stages[] = {
+        {"blake",    &ctx.blake,    sph_blake512,    sph_blake512_close},
+        {"bmw",      &ctx.bmw,      sph_bmw512,      sph_bmw512_close},
+        {"groestl",  &ctx.groestl,  sph_groestl512,  sph_groestl512_close},
+        {"skein",    &ctx.skein,    sph_skein512,    sph_skein512_close},
+        {"jh",       &ctx.jh,       sph_jh512,       sph_jh512_close},
+        {"keccak",   &ctx.keccak,   sph_keccak512,   sph_keccak512_close},
+        {"luffa",    &ctx.luffa,    sph_luffa512,    sph_luffa512_close},
+        {"cubehash", &ctx.cubehash, sph_cubehash512, sph_cubehash512_close},
+        {"shavite",  &ctx.shavite,  sph_shavite512,  sph_shavite512_close},
+        {"simd",     &ctx.simd,     sph_simd512,     sph_simd512_close},
+        {"echo",     &ctx.echo,     sph_echo512,     sph_echo512_close},
+    };
+
+    // BLAKE sees the block header; every later stage the 64-byte digest
+    BenchStage(stages[0], 80);
+    for (unsigned int i = 0; i < sizeof(stages)/sizeof(stages[0]); i++)
+        BenchStage(stages[i], 64);
+}
+
+//
+// Full chain throughput
+//
+
+static void Hash9Loop(unsigned int nSeed, unsigned int nCount)
+{
+    unsigned char header[80];
+    memset(header, 0, sizeof(header));
+    header[0] = nSeed;
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        memcpy(&header[76], &i, 4);
+        uint256 hash = Hash9(header, header + sizeof(header));
+        Consume(&hash);
+    }
+}
+
+static void Hash9xNLoop(unsigned int nCount)
+{
+    const unsigned int nLanes = Hash9Lanes();
+    vector<vector<unsigned char> > vHeaders(nLanes, vector<unsigned char>(80));
+    vector<const unsigned char*> vpHeaders(nLanes);
+    vector<uint256> vHash(nLanes);
+    for (unsigned int l = 0; l < nLanes; l++)
+        vpHeaders[l] = &vHeaders[l][0];
+    for (unsigned int i = 0; i < nCount; i += nLanes)
+    {
+        for (unsigned int l = 0; l < nLanes; l++)
+        {
+            unsigned int nNonce = i + l;
+            memcpy(&vHeaders[l][76], &nNonce, 4);
+        }
+        Hash9xN(&vpHeaders[0], 80, &vHash[0], nLanes);
+        Consume(&vHash[0]);
+    }
+}
+
+static void MidstateLoop(unsigned int nCount)
+{
+    unsigned char header[80];
+    memset(header, 0, sizeof(header));
+    CHash9Midstate midstate(header);
+    const unsigned int nLanes = Hash9Lanes();
+    vector<uint256> vHash(nLanes);
+    for (unsigned int i = 0; i < nCount; i += nLanes)
+    {
+        midstate.Hashes(header, i, &vHash[0], nLanes);
+        Consume(&vHash[0]);
+    }
+}
+
+static void ReportChain(const char* pszName, unsigned int nThreadCount, int64 nNanos, uint64 nHashes)
+{
+    printf("{\"bench\":\"chain\",\"name\":\"%s\",\"threads\":%u,\"hashes_per_sec\":%.0f}\n",
+           pszName, nThreadCount, nHashes * 1e9 / nNanos);
+}
+
+static void BenchChain()
+{
+    int64 nStart = GetTimeNanos();
+    Hash9Loop(0, nIterations);
+    ReportChain("hash9", 1, GetTimeNanos() - nStart, nIterations);
+
+    nStart = GetTimeNanos();
+    Hash9xNLoop(nIterations);
+    ReportChain("hash9xn", 1, GetTimeNanos() - nStart, nIterations);
+
+    nStart = GetTimeNanos();
+    MidstateLoop(nIterations);
+    ReportChain("midstate", 1, GetTimeNanos() - nStart, nIterations);
+
+    if (nThreads > 1)
+    {
+        boost::thread_group threads;
+        nStart = GetTimeNanos();
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&Hash9Loop, i, nIterations));
+        threads.join_all();
+        ReportChain("hash9", nThreads, GetTimeNanos() - nStart, (uint64)nIterations * nThreads);
+    }
+}
+
+//
+// Latency distribution
+//
+
+static void BenchLatency(unsigned int nLen)
+{
+    unsigned char data[80];
+    memset(data, 0, sizeof(data));
+    vector<int64> vNanos(nIterations);
+    for (unsigned int i = 0; i < nIterations; i++)
+    {
+        memcpy(&data[nLen - 4], &i, 4);
+        int64 nStart = GetTimeNanos();
+        uint256 hash = Hash9(data, data + nLen);
+        vNanos[i] = GetTimeNanos() - nStart;
+        Consume(&hash);
+    }
+    sort(vNanos.begin(), vNanos.end());
+
+    printf("{\"bench\":\"latency\",\"bytes\":%u,\"samples\":%u,\"p50_ns\":%lld,\"p90_ns\":%lld,"
+           "\"p99_ns\":%lld,\"p999_ns\":%lld,\"max_ns\":%lld}\n",
+           nLen, nIterations,
+           (long long)vNanos[vNanos.size() * 50 / 100], (long long)vNanos[vNanos.size() * 90 / 100],
+           (long long)vNanos[vNanos.size() * 99 / 100], (long long)vNanos[vNanos.size() * 999 / 1000],
+           (long long)vNanos.back());
+}
+
+//
+// Fresh contexts against the per-thread context set
+//
+
+/** Hash9 as it was before the per-thread context sets: eleven contexts on
+ *  the stack, each initialised for every call */
+static uint256 Hash9FreshContexts(const unsigned char* pbegin, const unsigned char* pend)
+{
+    sph_blake512_context     ctx_blake;
+    sph_bmw512_context       ctx_bmw;
+    sph_groestl512_context   ctx_groestl;
+    sph_jh512_context        ctx_jh;
+    sph_keccak512_context    ctx_keccak;
+    sph_skein512_context     ctx_skein;
+    sph_luffa512_context     ctx_luffa;
+    sph_cubehash512_context  ctx_cubehash;
+    sph_shavite512_context   ctx_shavite;
+    sph_simd512_context      ctx_simd;
+    sph_echo512_context      ctx_echo;
+    uint512 hash[11];
+
+    sph_blake512_init(&ctx_blake);
+    sph_blake512(&ctx_blake, pbegin, pend - pbegin);
+    sph_blake512_close(&ctx_blake, &hash[0]);
+    sph_bmw512_init(&ctx_bmw);
+    sph_bmw512(&ctx_bmw, &hash[0], 64);
+    sph_bmw512_close(&ctx_bmw, &hash[1]);
+    sph_groestl512_init(&ctx_groestl);
+    sph_groestl512(&ctx_groestl, &hash[1], 64);
+    sph_groestl512_close(&ctx_groestl, &hash[2]);
+    sph_skein512_init(&ctx_skein);
+    sph_skein512(&ctx_skein, &hash[2], 64);
+    sph_skein512_close(&ctx_skein, &hash[3]);
+    sph_jh512_init(&ctx_jh);
+    sph_jh512(&ctx_jh, &hash[3], 64);
+    sph_jh512_close(&ctx_jh, &hash[4]);
+    sph_keccak512_init(&ctx_keccak);
+    sph_keccak512(&ctx_keccak, &hash[4], 64);
+    sph_keccak512_close(&ctx_keccak, &hash[5]);
+    sph_luffa512_init(&ctx_luffa);
+    sph_luffa512(&ctx_luffa, &hash[5], 64);
+    sph_luffa512_close(&ctx_luffa, &hash[6]);
+    sph_cubehash512_init(&ctx_cubehash);
+    sph_cubehash512(&ctx_cubehash, &hash[6], 64);
+    sph_cubehash512_close(&ctx_cubehash, &hash[7]);
+    sph_shavite512_init(&ctx_shavite);
+    sph_shavite512(&ctx_shavite, &hash[7], 64);
+    sph_shavite512_close(&ctx_shavite, &hash[8]);
+    sph_simd512_init(&ctx_simd);
+    sph_simd512(&ctx_simd, &hash[8], 64);
+    sph_simd512_close(&ctx_simd, &hash[9]);
+    sph_echo512_init(&ctx_echo);
+    sph_echo512(&ctx_echo, &hash[9], 64);
+    sph_echo512_close(&ctx_echo, &hash[10]);
+    return hash[10].trim256();
+}
+
+static uint256 Hash9Pooled(const unsigned char* pbegin, const unsigned char* pend)
+{
+    return Hash9(pbegin, pend);
+}
+
+/** Best of five runs of nIterations calls, in nanoseconds per call */
+static double TimeHash9(uint256 (*fn)(const unsigned char*, const unsigned char*), unsigned int nLen)
+{
+    unsigned char data[80] = {0};
+    double dBest = 0;
+    for (int n = 0; n < 5; n++)
+    {
+        int64 nStart = GetTimeNanos();
+        for (unsigned int i = 0; i < nIterations; i++)
+        {
+            memcpy(&data[nLen - 4], &i, 4);
+            uint256 hash = fn(data, data + nLen);
+            Consume(&hash);
+        }
+        double d = (double)(GetTimeNanos() - nStart) / nIterations;
+        dBest = (n == 0 ? d : min(dBest, d));
+    }
+    return dBest;
+}
+
+static void BenchContexts()
+{
+    static const unsigned int nLens[] = {32, 80};
+    for (unsigned int i = 0; i < sizeof(nLens)/sizeof(nLens[0]); i++)
+    {
+        printf("{\"bench\":\"contexts\",\"bytes\":%u,\"fresh_ns_per_call\":%.1f,\"thread_ns_per_call\":%.1f}\n",
+               nLens[i], TimeHash9(Hash9FreshContexts, nLens[i]), TimeHash9(Hash9Pooled, nLens[i]));
+    }
+
+    // What a pooled call saves: initialising the eleven contexts
+    int64 nStart = GetTimeNanos();
+    for (unsigned int i = 0; i < nIterations; i++)
+    {
+        CHash9Contexts ctx;
+        Consume(&ctx);
+    }
+    printf("{\"bench\":\"contexts\",\"init_ns\":%.1f}\n", (double)(GetTimeNanos() - nStart) / nIterations);
+}
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "-iterations=", 12) == 0)
+            nIterations = std::max(atoi(argv[i] + 12), 1);
+        else if (strncmp(argv[i], "-threads=", 9) == 0)
+            nThreads = std::max(atoi(argv[i] + 9), 1);
+        else
+        {
+            fprintf(stderr, "Usage: %s [-iterations=<n>] [-threads=<n>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nThreads == 0)
+        nThreads = std::max(boost::thread::hardware_concurrency(), 1u);
+
+    // Warm up caches and the main thread's context set
+    Hash9Loop(0, nIterations / 10);
+
+    BenchStages();
+    BenchChain();
+    BenchLatency(80);
+    BenchLatency(32);
+    BenchContexts();
+    return 0;
+}
@@ -204,6 +204,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getbestblockhash",       &getbestblockhash,       true,      false,      false },
     { "getconnectioncount",     &getconnectioncount,     true,      false,      false },
     { "getpeerinfo",            &getpeerinfo,            true,      false,      false },
+    { "getlockstats",           &getlockstats,           true,      true,       false },
     { "addnode",                &addnode,                true,      true,       false },
     { "getpoolinfo",            &getpoolinfo,            true,      false,      false },
     { "darksend",               &darksend,               false,     false,      true },
@@ -251,7 +252,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getworkex",              &getworkex,              true,      false,      true },
     { "listaccounts",           &listaccounts,           false,     false,      true },
     { "settxfee",               &settxfee,               false,     false,      true },
-    { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,      true,       false },
     { "submitblock",            &submitblock,            false,     false,      false },
     { "setmininput",            &setmininput,            false,     false,      false },
     { "listsinceblock",         &listsinceblock,         false,     false,      true },
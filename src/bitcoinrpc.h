@@ -128,6 +128,21 @@ extern const CRPCTable tableRPC;
 extern void InitRPCMining();
 extern void ShutdownRPCMining();
 
+/** One of the RPC threads a getblocktemplate long poll may hold while it
+ *  waits; released when destroyed */
+class CLongPollSlot
+{
+private:
+    bool fTaken;
+
+public:
+    CLongPollSlot() : fTaken(false) { }
+    ~CLongPollSlot();
+
+    /** Take a slot, unless -rpcthreads - 1 are taken already. Returns true if this one holds a slot. */
+    bool Take();
+};
+
 extern int64 nWalletUnlockTime;
 extern int64 AmountFromValue(const json_spirit::Value& value);
 extern json_spirit::Value ValueFromAmount(int64 amount);
@@ -142,6 +157,7 @@ extern json_spirit::Value masternode(const json_spirit::Array& params, bool fHel
 
 extern json_spirit::Value getconnectioncount(const json_spirit::Array& params, bool fHelp); // in rpcnet.cpp
 extern json_spirit::Value getpeerinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getlockstats(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value addnode(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getaddednodeinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpprivkey(const json_spirit::Array& params, bool fHelp); // in rpcdump.cpp
@@ -13,6 +13,69 @@
 
 template<typename T> class CCheckQueueControl;
 
+/** Interface of a CCheckQueue to the worker pool it shares with other queues */
+class CCheckQueueBase
+{
+public:
+    virtual ~CCheckQueueBase() {}
+
+    // Whether there are checks waiting to be picked up. Called with the
+    // pool's mutex held.
+    virtual bool HasWork() const = 0;
+
+    // Help with the queued checks until there are none left to pick up
+    virtual void Work() = 0;
+};
+
+/** Worker threads shared by several check queues.
+  *
+  * The queues of a pool use its mutex and wake its workers when checks are
+  * added, so one set of threads serves all of them: a worker waits until any
+  * queue has work, helps with that queue until it is empty, and then looks
+  * for work again. Queues are served in the order they joined the pool.
+  */
+class CCheckQueuePool
+{
+private:
+    // Mutex to protect the inner state of the pool and of its queues
+    boost::mutex mutex;
+
+    // Worker threads block on this when no queue has work
+    boost::condition_variable condWorker;
+
+    // The queues served by this pool
+    std::vector<CCheckQueueBase*> vQueues;
+
+    // The number of workers that are waiting for work
+    int nIdle;
+
+public:
+    CCheckQueuePool() : nIdle(0) {}
+
+    // Worker thread
+    void Thread() {
+        while (true) {
+            CCheckQueueBase *pqueue = NULL;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (true) {
+                    for (unsigned int i = 0; i < vQueues.size() && pqueue == NULL; i++)
+                        if (vQueues[i]->HasWork())
+                            pqueue = vQueues[i];
+                    if (pqueue != NULL)
+                        break;
+                    nIdle++;
+                    condWorker.wait(lock); // wait
+                    nIdle--;
+                }
+            }
+            pqueue->Work();
+        }
+    }
+
+    template<typename T> friend class CCheckQueue;
+};
+
 /** Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -21,14 +84,24 @@ template<typename T> class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * The workers are either the queue's own threads, or those of a
+  * CCheckQueuePool it shares with other queues.
   */
-template<typename T> class CCheckQueue {
+template<typename T> class CCheckQueue : public CCheckQueueBase {
 private:
-    // Mutex to protect the inner state
-    boost::mutex mutex;
+    // The pool whose workers process this queue, or NULL if it has its own
+    CCheckQueuePool *ppool;
 
-    // Worker threads block on this when out of work
-    boost::condition_variable condWorker;
+    // Mutex to protect the inner state, unless the queue is in a pool
+    boost::mutex mutexOwn;
+
+    // Mutex to protect the inner state: mutexOwn or the pool's
+    boost::mutex &mutex;
+
+    // Worker threads block on this when out of work: the queue's own, or the pool's
+    boost::condition_variable condWorkerOwn;
+    boost::condition_variable &condWorker;
 
     // Master thread blocks on this when out of work
     boost::condition_variable condMaster;
@@ -80,6 +153,11 @@ private:
                 }
                 // logically, the do loop starts here
                 while (queue.empty()) {
+                    if (ppool != NULL && !fMaster) {
+                        // leave, so the pool can put us to work on another queue
+                        nTotal--;
+                        return fAllOk;
+                    }
                     if ((fMaster || fQuit) && nTodo == 0) {
                         nTotal--;
                         bool fRet = fAllOk;
@@ -98,7 +176,8 @@ private:
                 //   all workers finish approximately simultaneously.
                 // * Try to account for idle jobs which will instantly start helping.
                 // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
+                int nHelpers = nTotal + (ppool != NULL ? ppool->nIdle : nIdle) + 1;
+                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / nHelpers));
                 vChecks.resize(nNow);
                 for (unsigned int i = 0; i < nNow; i++) {
                      // We want the lock on the mutex to be as short as possible, so swap jobs from the global
@@ -118,12 +197,28 @@ private:
     }
 
 public:
-    // Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    // Create a new check queue, processed by the workers of ppoolIn if given,
+    // or else by the threads that call Thread()
+    CCheckQueue(unsigned int nBatchSizeIn, CCheckQueuePool *ppoolIn = NULL) :
+        ppool(ppoolIn), mutex(ppoolIn ? ppoolIn->mutex : mutexOwn), condWorker(ppoolIn ? ppoolIn->condWorker : condWorkerOwn),
+        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {
+        if (ppool != NULL) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            ppool->vQueues.push_back(this);
+        }
+    }
 
     // Worker thread
     void Thread() {
+        assert(ppool == NULL);
+        Loop();
+    }
+
+    bool HasWork() const {
+        return !queue.empty();
+    }
+
+    void Work() {
         Loop();
     }
 
@@ -147,6 +242,10 @@ public:
     }
 
     ~CCheckQueue() {
+        if (ppool != NULL) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            ppool->vQueues.erase(std::remove(ppool->vQueues.begin(), ppool->vQueues.end(), this), ppool->vQueues.end());
+        }
     }
 
     friend class CCheckQueueControl<T>;
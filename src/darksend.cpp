@@ -5,6 +5,7 @@
 #include "init.h"
 #include "masternode.h"
 #include "activemasternode.h"
+#include "checkqueue.h"
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -22,6 +23,8 @@ using namespace boost;
 CDarkSendPool darkSendPool;
 /** A helper object for signing messages from masternodes */
 CDarkSendSigner darkSendSigner;
+/** Signatures of received masternode messages, verified in batches */
+CDarkSendSignatureQueue darkSendSignatureQueue;
 /** All denominations used by darksend */
 std::vector<int64> darkSendDenominations;
 /** The current darksends in progress on the network */
@@ -98,17 +101,28 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
         vRecv >> nDenom >> txCollateral;
 
         std::string error = "";
-        int mn = GetMasternodeByVin(activeMasternode.vinMasternode);
-        if(mn == -1){
+        bool fListed = false;
+        int64 nLastDsq = 0;
+        int nMasternodes = 0;
+        {
+            READ_LOCK(darkSendMasterNodes.cs);
+            int mn = darkSendMasterNodes.Find(activeMasternode.vinMasternode);
+            if(mn >= 0) {
+                fListed = true;
+                nLastDsq = darkSendMasterNodes[mn].nLastDsq;
+                nMasternodes = darkSendMasterNodes.size();
+            }
+        }
+        if(!fListed){
             std::string strError = "Not in the masternode list";
             pfrom->PushMessage("dssu", darkSendPool.sessionID, darkSendPool.GetState(), darkSendPool.GetEntriesCount(), MASTERNODE_REJECTED, strError);
             return;            
         }
 
         if(darkSendPool.sessionUsers == 0) {
-            if(darkSendMasterNodes[mn].nLastDsq != 0 && 
-                darkSendMasterNodes[mn].nLastDsq + (int)darkSendMasterNodes.size()/5 > darkSendPool.nDsqCount){
-                //LogPrintf("dsa -- last dsq too recent, must wait. %s \n", darkSendMasterNodes[mn].addr.ToString().c_str());
+            if(nLastDsq != 0 && 
+                nLastDsq + nMasternodes/5 > darkSendPool.nDsqCount){
+                //LogPrintf("dsa -- last dsq too recent, must wait. %s \n", activeMasternode.vinMasternode.ToString().c_str());
                 std::string strError = "Last darksend was too recent";
                 pfrom->PushMessage("dssu", darkSendPool.sessionID, darkSendPool.GetState(), darkSendPool.GetEntriesCount(), MASTERNODE_REJECTED, strError);
                 return;
@@ -139,8 +153,10 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
 
         if(dsq.IsExpired()) return;
 
-        int mn = GetMasternodeByVin(dsq.vin);
-        if(mn == -1) return;
+        {
+            READ_LOCK(darkSendMasterNodes.cs);
+            if(darkSendMasterNodes.Find(dsq.vin) == -1) return;
+        }
 
 
         // if the queue is ready, submit if we can
@@ -152,22 +168,32 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
 
             if (fDebug)  LogPrintf("darksend queue is ready - %s\n", addr.ToString().c_str());
 
+            // dsq is dispatched without cs_main
+            LOCK(cs_main);
             darkSendPool.DoAutomaticDenominating(false, true);
         } else {
+            // the queue is shared with the handlers of other nodes' messages
+            LOCK(cs_main);
             BOOST_FOREACH(CDarksendQueue q, vecDarksendQueue){
                 if(q.vin == dsq.vin) return;
             }
             
-            if(fDebug) LogPrintf("dsq last %"PRI64d" last2 %"PRI64d" count %"PRI64d"\n", darkSendMasterNodes[mn].nLastDsq, darkSendMasterNodes[mn].nLastDsq + (int)darkSendMasterNodes.size()/5, darkSendPool.nDsqCount);
-            //don't allow a few nodes to dominate the queuing process
-            if(darkSendMasterNodes[mn].nLastDsq != 0 && 
-                darkSendMasterNodes[mn].nLastDsq + (int)darkSendMasterNodes.size()/5 > darkSendPool.nDsqCount){
-                LogPrintf("dsq -- masternode sending too many dsq messages. %s \n", darkSendMasterNodes[mn].addr.ToString().c_str());
-                return;
+            {
+                WRITE_LOCK(darkSendMasterNodes.cs);
+                int mn = darkSendMasterNodes.Find(dsq.vin);
+                if(mn == -1) return;
+
+                if(fDebug) LogPrintf("dsq last %"PRI64d" last2 %"PRI64d" count %"PRI64d"\n", darkSendMasterNodes[mn].nLastDsq, darkSendMasterNodes[mn].nLastDsq + (int)darkSendMasterNodes.size()/5, darkSendPool.nDsqCount);
+                //don't allow a few nodes to dominate the queuing process
+                if(darkSendMasterNodes[mn].nLastDsq != 0 && 
+                    darkSendMasterNodes[mn].nLastDsq + (int)darkSendMasterNodes.size()/5 > darkSendPool.nDsqCount){
+                    LogPrintf("dsq -- masternode sending too many dsq messages. %s \n", darkSendMasterNodes[mn].addr.ToString().c_str());
+                    return;
+                }
+                darkSendPool.nDsqCount++;
+                darkSendMasterNodes[mn].nLastDsq = darkSendPool.nDsqCount; 
+                darkSendMasterNodes[mn].allowFreeTx = true;
             }
-            darkSendPool.nDsqCount++;
-            darkSendMasterNodes[mn].nLastDsq = darkSendPool.nDsqCount; 
-            darkSendMasterNodes[mn].allowFreeTx = true;
 
             if(fDebug) LogPrintf("dsq - new darksend queue object - %s\n", addr.ToString().c_str());
             vecDarksendQueue.push_back(dsq);
@@ -351,57 +377,18 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
 
 int randomizeList (int i) { return std::rand()%i;}
 
-// Recursively determine the rounds of a given input (How deep is the darksend chain for a given input)
+// Determine the rounds of a given input (How deep is the darksend chain for a given input)
 int GetInputDarksendRounds(CTxIn in, int rounds)
 {
-    if(rounds >= 9) return rounds;
-
-    std::string padding = "";
-    padding.insert(0, ((rounds+1)*5)+3, ' ');
-
-    CWalletTx tx;
-    if(pwalletMain->GetTransaction(in.prevout.hash,tx)){
-        // bounds check
-        if(in.prevout.n >= tx.vout.size()) return -4;
-
-        if(tx.vout[in.prevout.n].nValue == DARKSEND_FEE) return -3;
-
-        if(rounds == 0){ //make sure the final output is non-denominate
-            bool found = false;
-            BOOST_FOREACH(int64 d, darkSendDenominations)
-                if(tx.vout[in.prevout.n].nValue == d) found = true;
-
-            if(!found) {
-                //LogPrintf(" - NOT DENOM\n");
-                return -2;
-            }
-        }
-        bool found = false;
-
-        BOOST_FOREACH(CTxOut out, tx.vout){
-            BOOST_FOREACH(int64 d, darkSendDenominations)
-                if(out.nValue == d)
-                    found = true;
-        }
-        
-        if(!found) {
-            //LogPrintf(" - NOT FOUND\n");
-            return rounds;
-        }
-
-        // find my vin and look that up
-        BOOST_FOREACH(CTxIn in2, tx.vin) {
-            if(pwalletMain->IsMine(in2)){
-                //LogPrintf("rounds :: %s %s %d NEXT\n", padding.c_str(), in.ToString().c_str(), rounds);  
-                int n = GetInputDarksendRounds(in2, rounds+1);
-                if(n != -3) return n;
-            }
-        }
-    } else {
-        //LogPrintf("rounds :: %s %s %d NOTFOUND\n", padding.c_str(), in.ToString().c_str(), rounds);
-    }
+    return pwalletMain->GetOutpointDarksendRounds(in.prevout, rounds);
+}
 
-    return rounds-1;
+bool IsDenominatedAmount(int64 nInputAmount)
+{
+    BOOST_FOREACH(int64 d, darkSendDenominations)
+        if(nInputAmount == d)
+            return true;
+    return false;
 }
 
 void CDarkSendPool::SetNull(bool clearEverything){
@@ -1530,30 +1517,41 @@ bool CDarkSendPool::DoAutomaticDenominating(bool fDryRun, bool ready)
         // otherwise, try one randomly
         if(sessionTries++ < 10){
             //pick a random masternode to use
-            int max_value = darkSendMasterNodes.size();
-            if(max_value <= 0) return false;
-            int i = (rand() % max_value);
+            CTxIn vinPicked;
+            CService addrPicked;
+            int64 nLastDsq;
+            int max_value;
+            {
+                READ_LOCK(darkSendMasterNodes.cs);
+                max_value = darkSendMasterNodes.size();
+                if(max_value <= 0) return false;
+                int i = (rand() % max_value);
+
+                vinPicked = darkSendMasterNodes[i].vin;
+                addrPicked = darkSendMasterNodes[i].addr;
+                nLastDsq = darkSendMasterNodes[i].nLastDsq;
+            }
 
             //don't reuse masternodes
             BOOST_FOREACH(CTxIn usedVin, vecMasternodesUsed) {
-                if(darkSendMasterNodes[i].vin == usedVin){
+                if(vinPicked == usedVin){
                     return DoAutomaticDenominating();
                 }
             }
 
-            if(darkSendMasterNodes[i].nLastDsq != 0 && 
-                darkSendMasterNodes[i].nLastDsq + (int)darkSendMasterNodes.size()/5 > darkSendPool.nDsqCount){
+            if(nLastDsq != 0 && 
+                nLastDsq + max_value/5 > darkSendPool.nDsqCount){
                 return DoAutomaticDenominating();
             }
 
             lastTimeChanged = GetTimeMillis();
-            LogPrintf("DoAutomaticDenominating -- attempt %d connection to masternode %s\n", sessionTries, darkSendMasterNodes[i].addr.ToString().c_str());
-            if(ConnectNode((CAddress)darkSendMasterNodes[i].addr, NULL, true)){
-                submittedToMasternode = darkSendMasterNodes[i].addr;
+            LogPrintf("DoAutomaticDenominating -- attempt %d connection to masternode %s\n", sessionTries, addrPicked.ToString().c_str());
+            if(ConnectNode((CAddress)addrPicked, NULL, true)){
+                submittedToMasternode = addrPicked;
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    if(darkSendMasterNodes[i].addr != pnode->addr) continue;
+                    if(addrPicked != pnode->addr) continue;
 
                     std::string strReason;
                     if(txCollateral == CTransaction()){
@@ -1563,7 +1561,7 @@ bool CDarkSendPool::DoAutomaticDenominating(bool fDryRun, bool ready)
                         }
                     }
 
-                    vecMasternodesUsed.push_back(darkSendMasterNodes[i].vin);
+                    vecMasternodesUsed.push_back(vinPicked);
                     sessionDenom = GetDenominationsByAmount(sessionTotalValue);
                     pnode->PushMessage("dsa", sessionDenom, txCollateral);
                     LogPrintf("DoAutomaticDenominating --- connected, sending dsa for %d - denom %d\n", sessionDenom, GetDenominationsByAmount(sessionTotalValue));
@@ -1890,13 +1888,17 @@ bool CDarkSendSigner::SetKey(std::string strSecret, std::string& errorMessage, C
     return true;
 }
 
-bool CDarkSendSigner::SignMessage(std::string strMessage, std::string& errorMessage, vector<unsigned char>& vchSig, CKey key)
+static uint256 GetSignedMessageHash(const std::string& strMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    return ss.GetHash();
+}
 
-    if (!key.SignCompact(ss.GetHash(), vchSig)) {
+bool CDarkSendSigner::SignMessage(std::string strMessage, std::string& errorMessage, vector<unsigned char>& vchSig, CKey key)
+{
+    if (!key.SignCompact(GetSignedMessageHash(strMessage), vchSig)) {
         errorMessage = "Sign failed";
         return false;
     }
@@ -1906,17 +1908,216 @@ bool CDarkSendSigner::SignMessage(std::string strMessage, std::string& errorMess
 
 bool CDarkSendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
 {
-    CHashWriter ss(SER_GETHASH, 0);
-    ss << strMessageMagic;
-    ss << strMessage;
+    uint256 hashMessage = GetSignedMessageHash(strMessage);
 
-    CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+    bool fRecovered;
+    CKeyID keyid;
+    if (!darkSendSignatureQueue.Lookup(hashMessage, vchSig, fRecovered, keyid)) {
+        CPubKey pubkey2;
+        fRecovered = pubkey2.RecoverCompact(hashMessage, vchSig);
+        keyid = pubkey2.GetID();
+    }
+
+    if (!fRecovered) {
         errorMessage = "Error recovering pubkey";
         return false;
     }
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    return (keyid == pubkey.GetID());
+}
+
+/** Closure recovering the key of one queued masternode message signature */
+class CSignedMessageCheck
+{
+private:
+    CSignedMessage *pmsg;
+
+public:
+    CSignedMessageCheck() : pmsg(NULL) {}
+    CSignedMessageCheck(CSignedMessage &msgIn) : pmsg(&msgIn) {}
+
+    // Always succeeds, so that CCheckQueue doesn't skip the checks after a
+    // bad signature; the result is left in the message
+    bool operator()() {
+        CPubKey pubkey;
+        pmsg->fRecovered = pubkey.RecoverCompact(pmsg->hashMessage, pmsg->vchSig);
+        if (pmsg->fRecovered)
+            pmsg->keyid = pubkey.GetID();
+        return true;
+    }
+
+    void swap(CSignedMessageCheck &check) {
+        std::swap(pmsg, check.pmsg);
+    }
+};
+
+// Driven by CDarkSendSignatureQueue::Verify(). CheckMessageSignatures only
+// calls that from message handler thread 0, but with several handler threads
+// nothing else keeps a second caller out, and a queue has a single master.
+static CCheckQueue<CSignedMessageCheck> sigcheckqueue(32, &GetCheckQueuePool());
+static CCriticalSection cs_sigcheckqueue;
+
+// Results of signatures seen twice (relayed by several peers, or queued
+// before their handler ran) are kept for this many signatures
+static const unsigned int MAX_SIGNATURE_RESULTS = 20000;
+
+static uint256 GetSignatureKey(const uint256& hashMessage, const std::vector<unsigned char>& vchSig)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << hashMessage << vchSig;
+    return ss.GetHash();
+}
+
+void CDarkSendSignatureQueue::Add(const std::string& strMessage, const std::vector<unsigned char>& vchSig)
+{
+    uint256 hashMessage = GetSignedMessageHash(strMessage);
+    uint256 hashKey = GetSignatureKey(hashMessage, vchSig);
+
+    LOCK(cs);
+    if (mapResults.count(hashKey) || !setPending.insert(hashKey).second)
+        return;
+    vPending.push_back(CSignedMessage(hashMessage, vchSig));
+    stats.nQueued++;
+}
+
+// The messages are built as their handlers build them in
+// ProcessMessageMasternode and ProcessMessageDarksend. A message built
+// differently is not wrong, it is just verified again by its handler.
+// Messages their handler drops before checking the signature are skipped
+// here too, so they don't cost a key recovery.
+void CDarkSendSignatureQueue::AddMessage(int nVersion, const std::string& strCommand, const CDataStream& vRecvIn)
+{
+    if (strCommand != "dsee" && strCommand != "dseep" && strCommand != "dsq" && strCommand != "mnw")
+        return;
+    if (strCommand != "mnw" && nVersion != darkSendPool.MIN_PEER_PROTO_VERSION)
+        return;
+    if ((strCommand == "dsee" || strCommand == "dseep") && IsInitialBlockDownload())
+        return;
+
+    // parse a copy, the handler reads the message again later
+    CDataStream vRecv(vRecvIn);
+    try {
+        if (strCommand == "dsee") {
+            CTxIn vin;
+            CService addr;
+            CPubKey pubkey;
+            CPubKey pubkey2;
+            vector<unsigned char> vchSig;
+            int64 sigTime;
+            vRecv >> vin >> addr >> vchSig >> sigTime >> pubkey >> pubkey2;
+
+            std::string vchPubKey(pubkey.begin(), pubkey.end());
+            std::string vchPubKey2(pubkey2.begin(), pubkey2.end());
+            Add(addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2, vchSig);
+        }
+        else if (strCommand == "dseep") {
+            CTxIn vin;
+            vector<unsigned char> vchSig;
+            int64 sigTime;
+            bool stop;
+            vRecv >> vin >> vchSig >> sigTime >> stop;
+            if (sigTime > GetAdjustedTime() + 60 * 60)
+                return;
+
+            std::string strAddr;
+            {
+                READ_LOCK(darkSendMasterNodes.cs);
+                int i = darkSendMasterNodes.Find(vin);
+                if (i < 0 || darkSendMasterNodes[i].lastDseep >= sigTime)
+                    return;
+                strAddr = darkSendMasterNodes[i].addr.ToString();
+            }
+            Add(strAddr + boost::lexical_cast<std::string>(sigTime) + boost::lexical_cast<std::string>(stop), vchSig);
+        }
+        else if (strCommand == "dsq") {
+            CDarksendQueue dsq;
+            vRecv >> dsq;
+            CService addr;
+            if (dsq.IsExpired() || !dsq.GetAddress(addr))
+                return;
+            Add(dsq.vin.ToString() + boost::lexical_cast<std::string>(dsq.nDenom) + boost::lexical_cast<std::string>(dsq.time) + boost::lexical_cast<std::string>(dsq.ready), dsq.vchSig);
+        }
+        else if (strCommand == "mnw") {
+            CMasternodePaymentWinner winner;
+            vRecv >> winner;
+            CBlockIndex* pindex = pindexBest;
+            if (pindex == NULL || winner.nBlockHeight < pindex->nHeight - 10 || winner.nBlockHeight > pindex->nHeight + 20)
+                return;
+            if (winner.vin.nSequence != std::numeric_limits<unsigned int>::max())
+                return;
+            Add(winner.vin.ToString().c_str() + boost::lexical_cast<std::string>(winner.nBlockHeight), winner.vchSig);
+        }
+    } catch (std::exception&) {
+        // malformed, its handler will say so
+    }
+}
+
+void CDarkSendSignatureQueue::Verify()
+{
+    std::vector<CSignedMessage> vBatch;
+    {
+        LOCK(cs);
+        vBatch.swap(vPending);
+        setPending.clear();
+    }
+    if (vBatch.empty())
+        return;
+
+    int64 nStart = GetTimeMicros();
+    std::vector<CSignedMessageCheck> vChecks;
+    vChecks.reserve(vBatch.size());
+    BOOST_FOREACH(CSignedMessage &msg, vBatch)
+        vChecks.push_back(CSignedMessageCheck(msg));
+    {
+        LOCK(cs_sigcheckqueue);
+        CCheckQueueControl<CSignedMessageCheck> control(&sigcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+    int64 nTime = GetTimeMicros() - nStart;
+
+    LOCK(cs);
+    BOOST_FOREACH(const CSignedMessage &msg, vBatch) {
+        uint256 hashKey = GetSignatureKey(msg.hashMessage, msg.vchSig);
+        if (!mapResults.insert(make_pair(hashKey, msg.fRecovered ? msg.keyid : CKeyID())).second)
+            continue;
+        vResultOrder.push_back(hashKey);
+    }
+    while (vResultOrder.size() > MAX_SIGNATURE_RESULTS) {
+        mapResults.erase(vResultOrder.front());
+        vResultOrder.pop_front();
+    }
+
+    stats.nBatches++;
+    stats.nLastDepth = vBatch.size();
+    stats.nMaxDepth = std::max(stats.nMaxDepth, stats.nLastDepth);
+    stats.nVerifyMicros += nTime;
+    stats.nMaxVerifyMicros = std::max(stats.nMaxVerifyMicros, nTime);
+    if (fBenchmark)
+        LogPrintf("- Verify %u masternode message signatures: %.2fms (%.3fms/sig)\n",
+                  (unsigned int)vBatch.size(), 0.001 * nTime, 0.001 * nTime / vBatch.size());
+}
+
+bool CDarkSendSignatureQueue::Lookup(const uint256& hashMessage, const std::vector<unsigned char>& vchSig, bool& fRecovered, CKeyID& keyid)
+{
+    uint256 hashKey = GetSignatureKey(hashMessage, vchSig);
+
+    LOCK(cs);
+    std::map<uint256, CKeyID>::const_iterator mi = mapResults.find(hashKey);
+    if (mi == mapResults.end()) {
+        stats.nMisses++;
+        return false;
+    }
+    stats.nHits++;
+    keyid = mi->second;
+    fRecovered = (keyid != CKeyID());
+    return true;
+}
+
+CSignatureQueueStats CDarkSendSignatureQueue::GetStats() const
+{
+    LOCK(cs);
+    return stats;
 }
 
 bool CDarksendQueue::Sign()
@@ -1962,18 +2163,17 @@ bool CDarksendQueue::Relay()
 
 bool CDarksendQueue::CheckSignature()
 {
-    BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-
-        if(mn.vin == vin) {
-            std::string strMessage = vin.ToString() + boost::lexical_cast<std::string>(nDenom) + boost::lexical_cast<std::string>(time) + boost::lexical_cast<std::string>(ready); 
+    READ_LOCK(darkSendMasterNodes.cs);
+    int i = darkSendMasterNodes.Find(vin);
+    if(i >= 0) {
+        std::string strMessage = vin.ToString() + boost::lexical_cast<std::string>(nDenom) + boost::lexical_cast<std::string>(time) + boost::lexical_cast<std::string>(ready); 
 
-            std::string errorMessage = "";
-            if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
-                return error("Got bad masternode address signature %s \n", vin.ToString().c_str());
-            }
-
-            return true;
+        std::string errorMessage = "";
+        if(!darkSendSigner.VerifyMessage(darkSendMasterNodes[i].pubkey2, vchSig, strMessage, errorMessage)){
+            return error("Got bad masternode address signature %s \n", vin.ToString().c_str());
         }
+
+        return true;
     }
 
     return false;
@@ -1986,24 +2186,20 @@ void ThreadCheckDarkSendPool()
     RenameThread("bitcoin-darksend");
 
     unsigned int c = 0;
+    CBlockIndex* pindexChecked = NULL;
     while (true)
     {
         MilliSleep(1000);
         //LogPrintf("ThreadCheckDarkSendPool::check timeout\n");
         darkSendPool.CheckTimeout();
         
-        if(c % 60 == 0){
-            vector<CMasterNode>::iterator it = darkSendMasterNodes.begin();
-            while(it != darkSendMasterNodes.end()){
-                (*it).Check();
-                if((*it).enabled == 4 || (*it).enabled == 3){
-                    LogPrintf("Removing inactive masternode %s\n", (*it).addr.ToString().c_str());
-                    it = darkSendMasterNodes.erase(it);
-                } else {
-                    ++it;
-                }
-            }
+        //check the masternode collaterals on every new block, and expire entries at least every minute
+        if(pindexBest != pindexChecked || c % 60 == 0){
+            pindexChecked = pindexBest;
+            CheckMasternodes();
+        }
 
+        if(c % 60 == 0){
             masternodePayments.CleanPaymentList();
         }
 
@@ -2033,18 +2229,29 @@ void ThreadCheckDarkSendPool()
 
 
         if(c % MASTERNODE_PING_SECONDS == 0){
+            // activeMasternode is guarded by cs_main
+            LOCK(cs_main);
             activeMasternode.RegisterAsMasterNode(false);
         }
 
         if(c % 60 == 0){
             //if we've used 1/5 of the masternode list, then clear the list.
-            if((int)vecMasternodesUsed.size() > (int)darkSendMasterNodes.size() / 5) 
+            int nMasternodes;
+            {
+                READ_LOCK(darkSendMasterNodes.cs);
+                nMasternodes = darkSendMasterNodes.size();
+            }
+            if((int)vecMasternodesUsed.size() > nMasternodes / 5) 
                 vecMasternodesUsed.clear();
 
         }
 
         //clear this every 3 hours
-        if(c % 60*60*3 == 0) vecMasternodeAskedFor.clear();
+        if(c % 60*60*3 == 0) {
+            // guarded by cs_main, like dseep's uses of it
+            LOCK(cs_main);
+            vecMasternodeAskedFor.clear();
+        }
 
         //auto denom every 2.5 minutes (liquidity provides try less often)
         if(c % 60*(nLiquidityProvider+1) == 0){
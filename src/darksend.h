@@ -16,6 +16,7 @@ class CDarkSendSigner;
 class CMasterNodeVote;
 class CBitcoinAddress;
 class CDarksendQueue;
+class CDarkSendSignatureQueue;
 
 #define POOL_MAX_TRANSACTIONS                  3 // wait for X transactions to merge and publish
 #define POOL_STATUS_UNKNOWN                    0 // waiting for update
@@ -35,6 +36,7 @@ class CDarksendQueue;
 
 extern CDarkSendPool darkSendPool;
 extern CDarkSendSigner darkSendSigner;
+extern CDarkSendSignatureQueue darkSendSignatureQueue;
 extern std::vector<int64> darkSendDenominations;
 extern std::vector<CDarksendQueue> vecDarksendQueue;
 extern std::string strMasterNodePrivKey;
@@ -48,6 +50,9 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
 // get the darksend chain depth for a given input
 int GetInputDarksendRounds(CTxIn in, int rounds=0);
 
+// is this amount one of the darksend denominations
+bool IsDenominatedAmount(int64 nInputAmount);
+
 
 // An input in the darksend pool
 class CDarkSendEntryVin
@@ -154,11 +159,11 @@ public:
 
     int GetAddress(CService &addr)
     {
-        BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-            if(mn.vin == vin){
-                addr = mn.addr;
-                return true;
-            }
+        READ_LOCK(darkSendMasterNodes.cs);
+        int i = darkSendMasterNodes.Find(vin);
+        if(i >= 0){
+            addr = darkSendMasterNodes[i].addr;
+            return true;
         }
         return false;
     }
@@ -187,6 +192,72 @@ public:
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
 };
 
+/** A signed message from a masternode, and the key its signature recovers to */
+struct CSignedMessage
+{
+    uint256 hashMessage;
+    std::vector<unsigned char> vchSig;
+    bool fRecovered;
+    CKeyID keyid;
+
+    CSignedMessage(const uint256& hashMessageIn, const std::vector<unsigned char>& vchSigIn) :
+        hashMessage(hashMessageIn), vchSig(vchSigIn), fRecovered(false) {}
+};
+
+struct CSignatureQueueStats
+{
+    uint64 nQueued;             // signatures taken from the receive queues
+    uint64 nBatches;
+    unsigned int nLastDepth;    // size of the last batch
+    unsigned int nMaxDepth;
+    int64 nVerifyMicros;        // time spent verifying batches
+    int64 nMaxVerifyMicros;
+    uint64 nHits;               // VerifyMessage calls answered from the results
+    uint64 nMisses;
+
+    CSignatureQueueStats() : nQueued(0), nBatches(0), nLastDepth(0), nMaxDepth(0),
+        nVerifyMicros(0), nMaxVerifyMicros(0), nHits(0), nMisses(0) {}
+};
+
+//
+// After a restart peers send us thousands of dsee announcements at once, and
+// each used to have its key recovered in turn on the message handler thread.
+// The message handler now hands the signatures of the dsee, dseep, dsq and
+// mnw messages waiting in the receive queues to this queue and verifies them
+// together on the worker pool it shares with block validation (see
+// GetCheckQueuePool). The messages are still processed one by one in their
+// order; VerifyMessage takes the recovered key from here instead of
+// recovering it again.
+//
+class CDarkSendSignatureQueue
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<CSignedMessage> vPending;
+    std::set<uint256> setPending;
+    // recovered keys by Hash(hashMessage, vchSig), oldest first in
+    // vResultOrder; a null key id if the signature recovers to nothing
+    std::map<uint256, CKeyID> mapResults;
+    std::deque<uint256> vResultOrder;
+    CSignatureQueueStats stats;
+
+    void Add(const std::string& strMessage, const std::vector<unsigned char>& vchSig);
+
+public:
+    /** Queue the signature of a received message, if it is one of ours and
+     *  its handler would check it. nVersion is the sending peer's version. */
+    void AddMessage(int nVersion, const std::string& strCommand, const CDataStream& vRecv);
+
+    /** Recover the keys of all queued signatures, on the validation worker pool */
+    void Verify();
+
+    /** Look up the key a signature was recovered to. Returns false if it
+     *  hasn't been verified here. */
+    bool Lookup(const uint256& hashMessage, const std::vector<unsigned char>& vchSig, bool& fRecovered, CKeyID& keyid);
+
+    CSignatureQueueStats GetStats() const;
+};
+
 class CDarksendSession
 {
 
@@ -35,6 +35,7 @@
 #include <limits.h>
 
 #include "sph_echo.h"
+#include "sph_aesni.h"
 
 #ifdef __cplusplus
 extern "C"{
@@ -711,6 +712,87 @@ echo_big_init(sph_echo_big_context *sc, unsigned out_len)
 	sc->C0 = sc->C1 = sc->C2 = sc->C3 = 0;
 }
 
+#if SPH_AESNI
+
+/*
+ * ECHO-512 compression with the AES-NI instructions. Each 128-bit word
+ * of the state is held in one register; the two AES rounds of a BIG.SubWords
+ * step map to one AESENC with the salt/counter key and one AESENC with
+ * a null key.
+ */
+static SPH_AESNI_TARGET void
+echo_big_compress_aesni(sph_echo_big_context *sc)
+{
+	__m128i W[16];
+	__m128i zero = _mm_setzero_si128();
+	sph_u64 klo, khi;
+	unsigned u, n;
+
+	for (u = 0; u < 8; u ++) {
+		W[u] = _mm_loadu_si128((const __m128i *)&sc->u.Vb[u][0]);
+		W[u + 8] = _mm_loadu_si128((const __m128i *)(sc->buf + 16 * u));
+	}
+	klo = (sph_u64)sc->C0 | ((sph_u64)sc->C1 << 32);
+	khi = (sph_u64)sc->C2 | ((sph_u64)sc->C3 << 32);
+	for (u = 0; u < 10; u ++) {
+		__m128i t;
+
+		for (n = 0; n < 16; n ++) {
+			__m128i K = _mm_set_epi64x((long long)khi, (long long)klo);
+
+			W[n] = _mm_aesenc_si128(_mm_aesenc_si128(W[n], K), zero);
+			if (++ klo == 0)
+				khi ++;
+		}
+
+		t = W[1];
+		W[1] = W[5];
+		W[5] = W[9];
+		W[9] = W[13];
+		W[13] = t;
+		t = W[2];
+		W[2] = W[10];
+		W[10] = t;
+		t = W[6];
+		W[6] = W[14];
+		W[14] = t;
+		t = W[15];
+		W[15] = W[11];
+		W[11] = W[7];
+		W[7] = W[3];
+		W[3] = t;
+
+		for (n = 0; n < 16; n += 4) {
+			__m128i a = W[n + 0];
+			__m128i b = W[n + 1];
+			__m128i c = W[n + 2];
+			__m128i d = W[n + 3];
+			__m128i ab = _mm_xor_si128(a, b);
+			__m128i bc = _mm_xor_si128(b, c);
+			__m128i cd = _mm_xor_si128(c, d);
+			__m128i abx = sph_aesni_mul2(ab);
+			__m128i bcx = sph_aesni_mul2(bc);
+			__m128i cdx = sph_aesni_mul2(cd);
+
+			W[n + 0] = _mm_xor_si128(abx, _mm_xor_si128(bc, d));
+			W[n + 1] = _mm_xor_si128(bcx, _mm_xor_si128(a, cd));
+			W[n + 2] = _mm_xor_si128(cdx, _mm_xor_si128(ab, d));
+			W[n + 3] = _mm_xor_si128(_mm_xor_si128(abx, bcx),
+				_mm_xor_si128(cdx, _mm_xor_si128(ab, c)));
+		}
+	}
+	for (u = 0; u < 8; u ++) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&sc->u.Vb[u][0]);
+
+		v = _mm_xor_si128(v,
+			_mm_loadu_si128((const __m128i *)(sc->buf + 16 * u)));
+		v = _mm_xor_si128(v, _mm_xor_si128(W[u], W[u + 8]));
+		_mm_storeu_si128((__m128i *)&sc->u.Vb[u][0], v);
+	}
+}
+
+#endif
+
 static void
 echo_small_compress(sph_echo_small_context *sc)
 {
@@ -724,6 +806,12 @@ echo_big_compress(sph_echo_big_context *sc)
 {
 	DECL_STATE_BIG
 
+#if SPH_AESNI
+	if (sph_aesni_available()) {
+		echo_big_compress_aesni(sc);
+		return;
+	}
+#endif
 	COMPRESS_BIG(sc);
 }
 
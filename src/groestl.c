@@ -34,6 +34,7 @@
 #include <string.h>
 
 #include "sph_groestl.h"
+#include "sph_aesni.h"
 
 #ifdef __cplusplus
 extern "C"{
@@ -2734,6 +2735,260 @@ static const sph_u32 T3dn[] = {
 
 #endif
 
+#if SPH_AESNI
+
+/*
+ * Groestl-512 permutations with the AES-NI instructions. The 8x16 state
+ * matrix is held as one register per row; SubBytes and ShiftBytes are
+ * done with a byte shuffle followed by AESENCLAST with a null key (the
+ * shuffle cancels the AES ShiftRows and applies the Groestl row
+ * rotation), MixBytes is computed with xtime doublings.
+ */
+
+/*
+ * Byte shuffle for a left rotation of a row by s positions, composed
+ * with the inverse of the AES ShiftRows.
+ */
+#define GROESTL_AESNI_SHUF(s)   _mm_and_si128(_mm_add_epi8( \
+		_mm_set_epi8(0x03, 0x06, 0x09, 0x0C, 0x0F, 0x02, 0x05, 0x08, \
+			0x0B, 0x0E, 0x01, 0x04, 0x07, 0x0A, 0x0D, 0x00), \
+		_mm_set1_epi8(s)), _mm_set1_epi8(0x0F))
+
+static SPH_AESNI_TARGET void
+groestl_aesni_transpose(__m128i x[8], const void *src)
+{
+	__m128i sh = _mm_set_epi8(15, 7, 14, 6, 13, 5, 12, 4,
+		11, 3, 10, 2, 9, 1, 8, 0);
+	__m128i a[8], b[8];
+	int i;
+
+	for (i = 0; i < 8; i ++)
+		a[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+			(const __m128i *)((const unsigned char *)src + 16 * i)), sh);
+	for (i = 0; i < 8; i += 2) {
+		b[i + 0] = _mm_unpacklo_epi16(a[i], a[i + 1]);
+		b[i + 1] = _mm_unpackhi_epi16(a[i], a[i + 1]);
+	}
+	a[0] = _mm_unpacklo_epi32(b[0], b[2]);
+	a[1] = _mm_unpackhi_epi32(b[0], b[2]);
+	a[2] = _mm_unpacklo_epi32(b[1], b[3]);
+	a[3] = _mm_unpackhi_epi32(b[1], b[3]);
+	a[4] = _mm_unpacklo_epi32(b[4], b[6]);
+	a[5] = _mm_unpackhi_epi32(b[4], b[6]);
+	a[6] = _mm_unpacklo_epi32(b[5], b[7]);
+	a[7] = _mm_unpackhi_epi32(b[5], b[7]);
+	for (i = 0; i < 4; i ++) {
+		x[2 * i + 0] = _mm_unpacklo_epi64(a[i], a[i + 4]);
+		x[2 * i + 1] = _mm_unpackhi_epi64(a[i], a[i + 4]);
+	}
+}
+
+static SPH_AESNI_TARGET void
+groestl_aesni_untranspose(void *dst, const __m128i x[8])
+{
+	__m128i a[8], b[8];
+	int i;
+
+	for (i = 0; i < 8; i += 2) {
+		a[i + 0] = _mm_unpacklo_epi8(x[i], x[i + 1]);
+		a[i + 1] = _mm_unpackhi_epi8(x[i], x[i + 1]);
+	}
+	b[0] = _mm_unpacklo_epi16(a[0], a[2]);
+	b[1] = _mm_unpackhi_epi16(a[0], a[2]);
+	b[2] = _mm_unpacklo_epi16(a[1], a[3]);
+	b[3] = _mm_unpackhi_epi16(a[1], a[3]);
+	b[4] = _mm_unpacklo_epi16(a[4], a[6]);
+	b[5] = _mm_unpackhi_epi16(a[4], a[6]);
+	b[6] = _mm_unpacklo_epi16(a[5], a[7]);
+	b[7] = _mm_unpackhi_epi16(a[5], a[7]);
+	for (i = 0; i < 4; i ++) {
+		_mm_storeu_si128((__m128i *)((unsigned char *)dst + 32 * i),
+			_mm_unpacklo_epi32(b[i], b[i + 4]));
+		_mm_storeu_si128((__m128i *)((unsigned char *)dst + 32 * i + 16),
+			_mm_unpackhi_epi32(b[i], b[i + 4]));
+	}
+}
+
+/*
+ * One output row of MixBytes: the circulant (2, 2, 3, 4, 5, 3, 5, 7) is
+ * evaluated as 2*(s2 + 2*s4) + s1, with t(i) = a(i) + a(i+1).
+ */
+#define GROESTL_AESNI_MIX(d, t0, a2, t3, t4, a5, t6, a7)   do { \
+		__m128i s1, s2, s4; \
+		s4 = _mm_xor_si128(t3, t6); \
+		s2 = _mm_xor_si128(_mm_xor_si128(t0, a2), _mm_xor_si128(a5, a7)); \
+		s1 = _mm_xor_si128(a2, _mm_xor_si128(t4, t6)); \
+		d = _mm_xor_si128(sph_aesni_mul2( \
+			_mm_xor_si128(s2, sph_aesni_mul2(s4))), s1); \
+	} while (0)
+
+/*
+ * SubBytes, ShiftBytes and MixBytes on the rows x0..x7; the round
+ * constant must already have been added. The shuffles sh0..sh7 and a
+ * null register 'zero' must be in scope.
+ */
+#define GROESTL_AESNI_ROUND   do { \
+		__m128i a0, a1, a2, a3, a4, a5, a6, a7; \
+		__m128i t0, t1, t2, t3, t4, t5, t6, t7; \
+		a0 = _mm_aesenclast_si128(_mm_shuffle_epi8(x0, sh0), zero); \
+		a1 = _mm_aesenclast_si128(_mm_shuffle_epi8(x1, sh1), zero); \
+		a2 = _mm_aesenclast_si128(_mm_shuffle_epi8(x2, sh2), zero); \
+		a3 = _mm_aesenclast_si128(_mm_shuffle_epi8(x3, sh3), zero); \
+		a4 = _mm_aesenclast_si128(_mm_shuffle_epi8(x4, sh4), zero); \
+		a5 = _mm_aesenclast_si128(_mm_shuffle_epi8(x5, sh5), zero); \
+		a6 = _mm_aesenclast_si128(_mm_shuffle_epi8(x6, sh6), zero); \
+		a7 = _mm_aesenclast_si128(_mm_shuffle_epi8(x7, sh7), zero); \
+		t0 = _mm_xor_si128(a0, a1); \
+		t1 = _mm_xor_si128(a1, a2); \
+		t2 = _mm_xor_si128(a2, a3); \
+		t3 = _mm_xor_si128(a3, a4); \
+		t4 = _mm_xor_si128(a4, a5); \
+		t5 = _mm_xor_si128(a5, a6); \
+		t6 = _mm_xor_si128(a6, a7); \
+		t7 = _mm_xor_si128(a7, a0); \
+		GROESTL_AESNI_MIX(x0, t0, a2, t3, t4, a5, t6, a7); \
+		GROESTL_AESNI_MIX(x1, t1, a3, t4, t5, a6, t7, a0); \
+		GROESTL_AESNI_MIX(x2, t2, a4, t5, t6, a7, t0, a1); \
+		GROESTL_AESNI_MIX(x3, t3, a5, t6, t7, a0, t1, a2); \
+		GROESTL_AESNI_MIX(x4, t4, a6, t7, t0, a1, t2, a3); \
+		GROESTL_AESNI_MIX(x5, t5, a7, t0, t1, a2, t3, a4); \
+		GROESTL_AESNI_MIX(x6, t6, a0, t1, t2, a3, t4, a5); \
+		GROESTL_AESNI_MIX(x7, t7, a1, t2, t3, a4, t5, a6); \
+	} while (0)
+
+#define GROESTL_AESNI_LOAD(x)   do { \
+		x0 = x[0]; \
+		x1 = x[1]; \
+		x2 = x[2]; \
+		x3 = x[3]; \
+		x4 = x[4]; \
+		x5 = x[5]; \
+		x6 = x[6]; \
+		x7 = x[7]; \
+	} while (0)
+
+#define GROESTL_AESNI_STORE(x)   do { \
+		x[0] = x0; \
+		x[1] = x1; \
+		x[2] = x2; \
+		x[3] = x3; \
+		x[4] = x4; \
+		x[5] = x5; \
+		x[6] = x6; \
+		x[7] = x7; \
+	} while (0)
+
+static SPH_AESNI_TARGET void
+groestl_aesni_perm_p(__m128i x[8])
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7;
+	__m128i sh0, sh1, sh2, sh3, sh4, sh5, sh6, sh7;
+	__m128i zero = _mm_setzero_si128();
+	__m128i col = _mm_set_epi8(
+		(char)0xF0, (char)0xE0, (char)0xD0, (char)0xC0,
+		(char)0xB0, (char)0xA0, (char)0x90, (char)0x80,
+		0x70, 0x60, 0x50, 0x40, 0x30, 0x20, 0x10, 0x00);
+	int r;
+
+	sh0 = GROESTL_AESNI_SHUF(0);
+	sh1 = GROESTL_AESNI_SHUF(1);
+	sh2 = GROESTL_AESNI_SHUF(2);
+	sh3 = GROESTL_AESNI_SHUF(3);
+	sh4 = GROESTL_AESNI_SHUF(4);
+	sh5 = GROESTL_AESNI_SHUF(5);
+	sh6 = GROESTL_AESNI_SHUF(6);
+	sh7 = GROESTL_AESNI_SHUF(11);
+	GROESTL_AESNI_LOAD(x);
+	for (r = 0; r < 14; r ++) {
+		x0 = _mm_xor_si128(x0, _mm_xor_si128(col, _mm_set1_epi8((char)r)));
+		GROESTL_AESNI_ROUND;
+	}
+	GROESTL_AESNI_STORE(x);
+}
+
+static SPH_AESNI_TARGET void
+groestl_aesni_perm_q(__m128i x[8])
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7;
+	__m128i sh0, sh1, sh2, sh3, sh4, sh5, sh6, sh7;
+	__m128i zero = _mm_setzero_si128();
+	__m128i ones = _mm_set1_epi8((char)0xFF);
+	__m128i col = _mm_set_epi8(
+		0x0F, 0x1F, 0x2F, 0x3F, 0x4F, 0x5F, 0x6F, 0x7F,
+		(char)0x8F, (char)0x9F, (char)0xAF, (char)0xBF,
+		(char)0xCF, (char)0xDF, (char)0xEF, (char)0xFF);
+	int r;
+
+	sh0 = GROESTL_AESNI_SHUF(1);
+	sh1 = GROESTL_AESNI_SHUF(3);
+	sh2 = GROESTL_AESNI_SHUF(5);
+	sh3 = GROESTL_AESNI_SHUF(11);
+	sh4 = GROESTL_AESNI_SHUF(0);
+	sh5 = GROESTL_AESNI_SHUF(2);
+	sh6 = GROESTL_AESNI_SHUF(4);
+	sh7 = GROESTL_AESNI_SHUF(6);
+	GROESTL_AESNI_LOAD(x);
+	for (r = 0; r < 14; r ++) {
+		x0 = _mm_xor_si128(x0, ones);
+		x1 = _mm_xor_si128(x1, ones);
+		x2 = _mm_xor_si128(x2, ones);
+		x3 = _mm_xor_si128(x3, ones);
+		x4 = _mm_xor_si128(x4, ones);
+		x5 = _mm_xor_si128(x5, ones);
+		x6 = _mm_xor_si128(x6, ones);
+		x7 = _mm_xor_si128(x7, _mm_xor_si128(col, _mm_set1_epi8((char)r)));
+		GROESTL_AESNI_ROUND;
+	}
+	GROESTL_AESNI_STORE(x);
+}
+
+/*
+ * Compression function; 'h' points to the 128-byte chaining value
+ * (in the same byte order as the input data).
+ */
+static SPH_AESNI_TARGET void
+groestl_big_compress_aesni(void *h, const unsigned char *buf)
+{
+	__m128i g[8], m[8], x[8];
+	int i;
+
+	groestl_aesni_transpose(x, h);
+	groestl_aesni_transpose(m, buf);
+	for (i = 0; i < 8; i ++)
+		g[i] = _mm_xor_si128(x[i], m[i]);
+	groestl_aesni_perm_p(g);
+	groestl_aesni_perm_q(m);
+	for (i = 0; i < 8; i ++)
+		x[i] = _mm_xor_si128(x[i], _mm_xor_si128(g[i], m[i]));
+	groestl_aesni_untranspose(h, x);
+}
+
+/*
+ * Output transformation: h ^= P(h).
+ */
+static SPH_AESNI_TARGET void
+groestl_big_final_aesni(void *h)
+{
+	__m128i g[8], x[8];
+	int i;
+
+	groestl_aesni_transpose(x, h);
+	for (i = 0; i < 8; i ++)
+		g[i] = x[i];
+	groestl_aesni_perm_p(g);
+	for (i = 0; i < 8; i ++)
+		x[i] = _mm_xor_si128(x[i], g[i]);
+	groestl_aesni_untranspose(h, x);
+}
+
+#undef GROESTL_AESNI_SHUF
+#undef GROESTL_AESNI_MIX
+#undef GROESTL_AESNI_ROUND
+#undef GROESTL_AESNI_LOAD
+#undef GROESTL_AESNI_STORE
+
+#endif
+
 static void
 groestl_small_init(sph_groestl_small_context *sc, unsigned out_size)
 {
@@ -2931,6 +3186,11 @@ groestl_big_core(sph_groestl_big_context *sc, const void *data, size_t len)
 		data = (const unsigned char *)data + clen;
 		len -= clen;
 		if (ptr == sizeof sc->buf) {
+#if SPH_AESNI
+			if (sph_aesni_available())
+				groestl_big_compress_aesni(H, buf);
+			else
+#endif
 			COMPRESS_BIG;
 #if SPH_64
 			sc->count ++;
@@ -2994,6 +3254,11 @@ groestl_big_close(sph_groestl_big_context *sc,
 #endif
 	groestl_big_core(sc, pad, pad_len);
 	READ_STATE_BIG(sc);
+#if SPH_AESNI
+	if (sph_aesni_available())
+		groestl_big_final_aesni(H);
+	else
+#endif
 	FINAL_BIG;
 #if SPH_GROESTL_64
 	for (u = 0; u < 8; u ++)
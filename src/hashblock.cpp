@@ -0,0 +1,571 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hashblock.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+#include <boost/thread/tss.hpp>
+
+//
+// Multi-buffer X11
+//
+// Hash9xN runs a group of equally sized inputs through the eleven X11 stages
+// in lockstep: every lane finishes a stage before any lane starts the next.
+// BLAKE-512 and Keccak-512 are computed with one input per 64-bit vector
+// element, so a group is a single pass through their rounds. The remaining
+// stages run the sph kernels lane by lane, which keeps each kernel's code and
+// tables hot for the whole group instead of cycling through all eleven per
+// input.
+//
+
+typedef uint64_t v64x4 __attribute__((vector_size(32)));
+typedef uint64_t v64x8 __attribute__((vector_size(64)));
+
+#define X11_MAX_LANES 8
+
+#define ROTR64V(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define ROTL64V(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline uint64_t ReadBE64(const unsigned char* p)
+{
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+static inline void WriteBE64(unsigned char* p, uint64_t x)
+{
+    for (int i = 7; i >= 0; i--, x >>= 8)
+        p[i] = x & 0xff;
+}
+
+static inline uint64_t ReadLE64(const unsigned char* p)
+{
+    return ((uint64_t)p[7] << 56) | ((uint64_t)p[6] << 48) | ((uint64_t)p[5] << 40) | ((uint64_t)p[4] << 32) |
+           ((uint64_t)p[3] << 24) | ((uint64_t)p[2] << 16) | ((uint64_t)p[1] << 8) | (uint64_t)p[0];
+}
+
+static inline void WriteLE64(unsigned char* p, uint64_t x)
+{
+    for (int i = 0; i < 8; i++, x >>= 8)
+        p[i] = x & 0xff;
+}
+
+// BLAKE-512 constants, see blake.c
+static const uint64_t blake512_IV[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+static const uint64_t blake512_CB[16] = {
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+    0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+    0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+    0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL
+};
+
+static const unsigned char blake512_sigma[10][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 }
+};
+
+// Keccak-f[1600] constants, see keccak.c
+static const uint64_t keccak_RC[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+    0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+    0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+static const unsigned char keccak_rotc[24] = {
+    1, 3, 6, 10, 15, 21, 28, 36, 45, 55, 2, 14, 27, 41, 56, 8, 25, 43, 62, 18, 39, 61, 20, 44
+};
+
+static const unsigned char keccak_piln[24] = {
+    10, 7, 11, 17, 18, 3, 5, 16, 8, 21, 24, 4, 15, 23, 19, 13, 12, 2, 20, 14, 22, 9, 6, 1
+};
+
+// Copy one 64-bit word per lane into a vector (vectors are never passed by
+// value so the kernels below can be inlined into differently targeted callers)
+#define LOADV(v, w) memcpy(&(v), (w), sizeof(v))
+#define STOREV(w, v) memcpy((w), &(v), sizeof(v))
+
+/** Set every lane of v to x */
+template<typename V, unsigned int N>
+static inline __attribute__((always_inline))
+void SplatV(V& v, uint64_t x)
+{
+    uint64_t c[N];
+    for (unsigned int l = 0; l < N; l++)
+        c[l] = x;
+    LOADV(v, c);
+}
+
+/** BLAKE-512 initial state for a single block message of nBits bits */
+template<typename V, unsigned int N>
+static inline __attribute__((always_inline))
+void Blake512Setup(V v[16], V CB[16], uint64_t nBits)
+{
+    for (int i = 0; i < 16; i++)
+        SplatV<V, N>(CB[i], blake512_CB[i]);
+    for (int i = 0; i < 8; i++)
+        SplatV<V, N>(v[i], blake512_IV[i]);
+    // Salt is zero, T0 is the message length in bits and T1 is zero
+    V T0;
+    SplatV<V, N>(T0, nBits);
+    v[8] = CB[0];
+    v[9] = CB[1];
+    v[10] = CB[2];
+    v[11] = CB[3];
+    v[12] = T0 ^ CB[4];
+    v[13] = T0 ^ CB[5];
+    v[14] = CB[6];
+    v[15] = CB[7];
+}
+
+#define BLAKE_G(a, b, c, d, i) do { \
+        const unsigned char* s = blake512_sigma[r % 10]; \
+        v[a] = v[a] + v[b] + (M[s[2*i]] ^ CB[s[2*i+1]]); \
+        v[d] = ROTR64V(v[d] ^ v[a], 32); \
+        v[c] = v[c] + v[d]; \
+        v[b] = ROTR64V(v[b] ^ v[c], 25); \
+        v[a] = v[a] + v[b] + (M[s[2*i+1]] ^ CB[s[2*i]]); \
+        v[d] = ROTR64V(v[d] ^ v[a], 16); \
+        v[c] = v[c] + v[d]; \
+        v[b] = ROTR64V(v[b] ^ v[c], 11); \
+    } while (0)
+
+/** Column step of BLAKE-512 round r; round 0 only reads message words 0..7 */
+template<typename V>
+static inline __attribute__((always_inline))
+void Blake512Columns(V v[16], const V M[16], const V CB[16], int r)
+{
+    BLAKE_G(0, 4,  8, 12, 0);
+    BLAKE_G(1, 5,  9, 13, 1);
+    BLAKE_G(2, 6, 10, 14, 2);
+    BLAKE_G(3, 7, 11, 15, 3);
+}
+
+/** Diagonal step of BLAKE-512 round r */
+template<typename V>
+static inline __attribute__((always_inline))
+void Blake512Diagonals(V v[16], const V M[16], const V CB[16], int r)
+{
+    BLAKE_G(0, 5, 10, 15, 4);
+    BLAKE_G(1, 6, 11, 12, 5);
+    BLAKE_G(2, 7,  8, 13, 6);
+    BLAKE_G(3, 4,  9, 14, 7);
+}
+
+#undef BLAKE_G
+
+/** Finish the 16 rounds (round 0 from its diagonal step if fColumnsDone) and
+ *  write the N digests */
+template<typename V, unsigned int N>
+static inline __attribute__((always_inline))
+void Blake512Finish(V v[16], const V M[16], const V CB[16], bool fColumnsDone, uint512* phash)
+{
+    for (int r = 0; r < 16; r++)
+    {
+        if (r > 0 || !fColumnsDone)
+            Blake512Columns<V>(v, M, CB, r);
+        Blake512Diagonals<V>(v, M, CB, r);
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t h[N];
+        V x = v[i] ^ v[i + 8];
+        STOREV(h, x);
+        for (unsigned int l = 0; l < N; l++)
+            WriteBE64(phash[l].begin() + 8 * i, h[l] ^ blake512_IV[i]);
+    }
+}
+
+/** BLAKE-512 of N inputs of nLen (<= 111) bytes, i.e. a single padded block */
+template<typename V, unsigned int N>
+static inline __attribute__((always_inline))
+void Blake512Lanes(const unsigned char* const* ppin, unsigned int nLen, uint512* phash)
+{
+    uint64_t w[16][N];
+    for (unsigned int l = 0; l < N; l++)
+    {
+        unsigned char buf[128];
+        memcpy(buf, ppin[l], nLen);
+        buf[nLen] = 0x80;
+        memset(buf + nLen + 1, 0, 111 - nLen);
+        buf[111] |= 1;
+        WriteBE64(buf + 112, 0);
+        WriteBE64(buf + 120, (uint64_t)nLen << 3);
+        for (int i = 0; i < 16; i++)
+            w[i][l] = ReadBE64(buf + 8 * i);
+    }
+
+    V M[16], CB[16], v[16];
+    for (int i = 0; i < 16; i++)
+        LOADV(M[i], w[i]);
+    Blake512Setup<V, N>(v, CB, (uint64_t)nLen << 3);
+    Blake512Finish<V, N>(v, M, CB, false, phash);
+}
+
+/** BLAKE-512 of N 80-byte block headers with consecutive nonces, starting
+ *  from the state left by the column step of round 0 (which reads only the
+ *  first 64 bytes). Bytes 64..75 come from pheader. */
+template<typename V, unsigned int N>
+static inline __attribute__((always_inline))
+void Blake512HeaderLanes(const uint64* pmidstate, const uint64* pmidwords, const unsigned char* pheader,
+                         unsigned int nNonce, uint512* phash)
+{
+    uint64_t w9[N];
+    for (unsigned int l = 0; l < N; l++)
+    {
+        unsigned char buf[8];
+        memcpy(buf, pheader + 72, 4);
+        unsigned int n = nNonce + l;
+        for (int i = 4; i < 8; i++, n >>= 8)
+            buf[i] = n & 0xff;
+        w9[l] = ReadBE64(buf);
+    }
+
+    V M[16], CB[16], v[16];
+    for (int i = 0; i < 16; i++)
+        SplatV<V, N>(CB[i], blake512_CB[i]);
+    for (int i = 0; i < 16; i++)
+        SplatV<V, N>(v[i], pmidstate[i]);
+    for (int i = 0; i < 8; i++)
+        SplatV<V, N>(M[i], pmidwords[i]);
+    SplatV<V, N>(M[8], ReadBE64(pheader + 64));
+    LOADV(M[9], w9);
+    // Padding of an 80-byte message: 0x80, zeros, a final 1 bit, length
+    SplatV<V, N>(M[10], 0x8000000000000000ULL);
+    SplatV<V, N>(M[11], 0);
+    SplatV<V, N>(M[12], 0);
+    SplatV<V, N>(M[13], 1);
+    SplatV<V, N>(M[14], 0);
+    SplatV<V, N>(M[15], 80 << 3);
+    Blake512Finish<V, N>(v, M, CB, true, phash);
+}
+
+/** Keccak-512 of N 64-byte inputs, in place */
+template<typename V, unsigned int N>
+static inline __attribute__((always_inline))
+void Keccak512Lanes(uint512* phash)
+{
+    uint64_t w[25][N];
+    memset(w, 0, sizeof(w));
+    for (unsigned int l = 0; l < N; l++)
+    {
+        for (int i = 0; i < 8; i++)
+            w[i][l] = ReadLE64(phash[l].begin() + 8 * i);
+        // 0x01 || 0x00... || 0x80 padding fills the ninth (last rate) word
+        w[8][l] = 0x8000000000000001ULL;
+    }
+
+    V A[25];
+    for (int i = 0; i < 25; i++)
+        LOADV(A[i], w[i]);
+
+    for (int r = 0; r < 24; r++)
+    {
+        V C[5], t;
+        for (int x = 0; x < 5; x++)
+            C[x] = A[x] ^ A[x + 5] ^ A[x + 10] ^ A[x + 15] ^ A[x + 20];
+        for (int x = 0; x < 5; x++)
+        {
+            t = C[(x + 4) % 5] ^ ROTL64V(C[(x + 1) % 5], 1);
+            for (int y = 0; y < 25; y += 5)
+                A[y + x] ^= t;
+        }
+
+        t = A[1];
+        for (int i = 0; i < 24; i++)
+        {
+            int j = keccak_piln[i];
+            V u = A[j];
+            A[j] = ROTL64V(t, keccak_rotc[i]);
+            t = u;
+        }
+
+        for (int y = 0; y < 25; y += 5)
+        {
+            for (int x = 0; x < 5; x++)
+                C[x] = A[y + x];
+            for (int x = 0; x < 5; x++)
+                A[y + x] = C[x] ^ (~C[(x + 1) % 5] & C[(x + 2) % 5]);
+        }
+
+        A[0] ^= keccak_RC[r];
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        STOREV(w[i], A[i]);
+        for (unsigned int l = 0; l < N; l++)
+            WriteLE64(phash[l].begin() + 8 * i, w[i][l]);
+    }
+}
+
+#undef LOADV
+#undef STOREV
+
+typedef void (*BlakeLanesFn)(const unsigned char* const*, unsigned int, uint512*);
+typedef void (*BlakeHeaderLanesFn)(const uint64*, const uint64*, const unsigned char*, unsigned int, uint512*);
+typedef void (*KeccakLanesFn)(uint512*);
+
+static void Blake512x4(const unsigned char* const* ppin, unsigned int nLen, uint512* phash)
+{
+    Blake512Lanes<v64x4, 4>(ppin, nLen, phash);
+}
+
+static void Blake512Headerx4(const uint64* pmidstate, const uint64* pmidwords, const unsigned char* pheader,
+                             unsigned int nNonce, uint512* phash)
+{
+    Blake512HeaderLanes<v64x4, 4>(pmidstate, pmidwords, pheader, nNonce, phash);
+}
+
+static void Keccak512x4(uint512* phash)
+{
+    Keccak512Lanes<v64x4, 4>(phash);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X11_CPU_DISPATCH
+
+__attribute__((target("avx2")))
+static void Blake512x4_AVX2(const unsigned char* const* ppin, unsigned int nLen, uint512* phash)
+{
+    Blake512Lanes<v64x4, 4>(ppin, nLen, phash);
+}
+
+__attribute__((target("avx2")))
+static void Blake512Headerx4_AVX2(const uint64* pmidstate, const uint64* pmidwords, const unsigned char* pheader,
+                                  unsigned int nNonce, uint512* phash)
+{
+    Blake512HeaderLanes<v64x4, 4>(pmidstate, pmidwords, pheader, nNonce, phash);
+}
+
+__attribute__((target("avx2")))
+static void Keccak512x4_AVX2(uint512* phash)
+{
+    Keccak512Lanes<v64x4, 4>(phash);
+}
+
+__attribute__((target("avx512f")))
+static void Blake512x8_AVX512(const unsigned char* const* ppin, unsigned int nLen, uint512* phash)
+{
+    Blake512Lanes<v64x8, 8>(ppin, nLen, phash);
+}
+
+__attribute__((target("avx512f")))
+static void Blake512Headerx8_AVX512(const uint64* pmidstate, const uint64* pmidwords, const unsigned char* pheader,
+                                    unsigned int nNonce, uint512* phash)
+{
+    Blake512HeaderLanes<v64x8, 8>(pmidstate, pmidwords, pheader, nNonce, phash);
+}
+
+__attribute__((target("avx512f")))
+static void Keccak512x8_AVX512(uint512* phash)
+{
+    Keccak512Lanes<v64x8, 8>(phash);
+}
+#endif
+
+/** The multi-buffer kernels picked for this CPU */
+struct CX11Engine
+{
+    unsigned int nLanes;
+    BlakeLanesFn pBlake;
+    BlakeHeaderLanesFn pBlakeHeader;
+    KeccakLanesFn pKeccak;
+
+    CX11Engine()
+    {
+        // SSE2 (or the target's native vector unit) with four lanes is the
+        // baseline; wider units are used when the CPU reports them.
+        nLanes = 4;
+        pBlake = Blake512x4;
+        pBlakeHeader = Blake512Headerx4;
+        pKeccak = Keccak512x4;
+#ifdef X11_CPU_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            nLanes = 8;
+            pBlake = Blake512x8_AVX512;
+            pBlakeHeader = Blake512Headerx8_AVX512;
+            pKeccak = Keccak512x8_AVX512;
+        }
+        else if (__builtin_cpu_supports("avx2"))
+        {
+            pBlake = Blake512x4_AVX2;
+            pBlakeHeader = Blake512Headerx4_AVX2;
+            pKeccak = Keccak512x4_AVX2;
+        }
+#endif
+    }
+};
+
+static const CX11Engine& GetX11Engine()
+{
+    static const CX11Engine engine;
+    return engine;
+}
+
+CHash9Contexts::CHash9Contexts()
+{
+    sph_blake512_init(&blake);
+    sph_bmw512_init(&bmw);
+    sph_groestl512_init(&groestl);
+    sph_jh512_init(&jh);
+    sph_keccak512_init(&keccak);
+    sph_skein512_init(&skein);
+    sph_luffa512_init(&luffa);
+    sph_cubehash512_init(&cubehash);
+    sph_shavite512_init(&shavite);
+    sph_simd512_init(&simd);
+    sph_echo512_init(&echo);
+    nHashes = 0;
+}
+
+CHash9Contexts& GetHash9Contexts()
+{
+    static boost::thread_specific_ptr<CHash9Contexts> contexts;
+    CHash9Contexts* pcontexts = contexts.get();
+    if (pcontexts == NULL)
+    {
+        pcontexts = new CHash9Contexts();
+        contexts.reset(pcontexts);
+    }
+    return *pcontexts;
+}
+
+/** Run one sph stage over every lane, hashing each 64-byte state in place */
+template<typename T>
+static void SphStage(T& ctx, void (*update)(void*, const void*, size_t), void (*close)(void*, void*),
+                     uint512* phash, unsigned int nLanes)
+{
+    for (unsigned int l = 0; l < nLanes; l++)
+    {
+        update(&ctx, phash[l].begin(), 64);
+        close(&ctx, phash[l].begin());
+    }
+}
+
+/** Run the ten stages after BLAKE over engine.nLanes states in place */
+static void Hash9GroupTail(const CX11Engine& engine, uint512* phash)
+{
+    const unsigned int nLanes = engine.nLanes;
+    CHash9Contexts& ctx = GetHash9Contexts();
+
+    SphStage(ctx.bmw, sph_bmw512, sph_bmw512_close, phash, nLanes);
+    SphStage(ctx.groestl, sph_groestl512, sph_groestl512_close, phash, nLanes);
+    SphStage(ctx.skein, sph_skein512, sph_skein512_close, phash, nLanes);
+    SphStage(ctx.jh, sph_jh512, sph_jh512_close, phash, nLanes);
+    engine.pKeccak(phash);
+    SphStage(ctx.luffa, sph_luffa512, sph_luffa512_close, phash, nLanes);
+    SphStage(ctx.cubehash, sph_cubehash512, sph_cubehash512_close, phash, nLanes);
+    SphStage(ctx.shavite, sph_shavite512, sph_shavite512_close, phash, nLanes);
+    SphStage(ctx.simd, sph_simd512, sph_simd512_close, phash, nLanes);
+    SphStage(ctx.echo, sph_echo512, sph_echo512_close, phash, nLanes);
+}
+
+/** Hash exactly engine.nLanes inputs */
+static void Hash9Group(const CX11Engine& engine, const unsigned char* const* ppin, unsigned int nLen, uint512* phash)
+{
+    if (nLen <= 111)
+        engine.pBlake(ppin, nLen, phash);
+    else
+    {
+        CHash9Contexts& ctx = GetHash9Contexts();
+        for (unsigned int l = 0; l < engine.nLanes; l++)
+        {
+            sph_blake512(&ctx.blake, ppin[l], nLen);
+            sph_blake512_close(&ctx.blake, phash[l].begin());
+        }
+    }
+    Hash9GroupTail(engine, phash);
+}
+
+unsigned int Hash9Lanes()
+{
+    return GetX11Engine().nLanes;
+}
+
+void Hash9xN(const unsigned char* const* ppinput, unsigned int nLen, uint256* phash, unsigned int nCount)
+{
+    if (nLen == 0)
+    {
+        // Hash9 feeds a dummy pointer for empty input; keep its exact path
+        static const unsigned char pblank[1] = {0};
+        for (unsigned int i = 0; i < nCount; i++)
+            phash[i] = Hash9(pblank, pblank);
+        return;
+    }
+
+    const CX11Engine& engine = GetX11Engine();
+    const unsigned int nLanes = engine.nLanes;
+    const unsigned char* ppin[X11_MAX_LANES];
+    uint512 hash[X11_MAX_LANES];
+    GetHash9Contexts().nHashes += nCount;
+
+    for (unsigned int nDone = 0; nDone < nCount; nDone += nLanes)
+    {
+        // A short final group repeats its last input in the unused lanes
+        unsigned int nGroup = std::min(nLanes, nCount - nDone);
+        for (unsigned int l = 0; l < nLanes; l++)
+            ppin[l] = ppinput[nDone + std::min(l, nGroup - 1)];
+
+        Hash9Group(engine, ppin, nLen, hash);
+
+        for (unsigned int l = 0; l < nGroup; l++)
+            phash[nDone + l] = hash[l].trim256();
+    }
+}
+
+CHash9Midstate::CHash9Midstate(const unsigned char* pheader)
+{
+    uint64_t v[16], CB[16], M[16];
+    memset(M, 0, sizeof(M));
+    for (int i = 0; i < 8; i++)
+        M[i] = ReadBE64(pheader + 8 * i);
+    Blake512Setup<uint64_t, 1>(v, CB, 80 << 3);
+    Blake512Columns<uint64_t>(v, M, CB, 0);
+
+    for (int i = 0; i < 16; i++)
+        vState[i] = v[i];
+    for (int i = 0; i < 8; i++)
+        vWords[i] = M[i];
+}
+
+void CHash9Midstate::Hashes(const unsigned char* pheader, unsigned int nNonce, uint256* phash, unsigned int nCount) const
+{
+    const CX11Engine& engine = GetX11Engine();
+    const unsigned int nLanes = engine.nLanes;
+    uint512 hash[X11_MAX_LANES];
+    GetHash9Contexts().nHashes += nCount;
+
+    for (unsigned int nDone = 0; nDone < nCount; nDone += nLanes)
+    {
+        // A short final group hashes a few nonces past the end and drops them
+        engine.pBlakeHeader(vState, vWords, pheader, nNonce + nDone, hash);
+        Hash9GroupTail(engine, hash);
+
+        unsigned int nGroup = std::min(nLanes, nCount - nDone);
+        for (unsigned int l = 0; l < nGroup; l++)
+            phash[nDone + l] = hash[l].trim256();
+    }
+}
@@ -18,117 +18,113 @@
 #include <string>
 #endif
 
-#ifdef GLOBALDEFINED
-#define GLOBAL
-#else
-#define GLOBAL extern
-#endif
-
-GLOBAL sph_blake512_context     z_blake;
-GLOBAL sph_bmw512_context       z_bmw;
-GLOBAL sph_groestl512_context   z_groestl;
-GLOBAL sph_jh512_context        z_jh;
-GLOBAL sph_keccak512_context    z_keccak;
-GLOBAL sph_skein512_context     z_skein;
-GLOBAL sph_luffa512_context     z_luffa;
-GLOBAL sph_cubehash512_context  z_cubehash;
-GLOBAL sph_shavite512_context   z_shavite;
-GLOBAL sph_simd512_context      z_simd;
-GLOBAL sph_echo512_context      z_echo;
-
-#define fillz() do { \
-    sph_blake512_init(&z_blake); \
-    sph_bmw512_init(&z_bmw); \
-    sph_groestl512_init(&z_groestl); \
-    sph_jh512_init(&z_jh); \
-    sph_keccak512_init(&z_keccak); \
-    sph_skein512_init(&z_skein); \
-    sph_luffa512_init(&z_luffa); \
-    sph_cubehash512_init(&z_cubehash); \
-    sph_shavite512_init(&z_shavite); \
-    sph_simd512_init(&z_simd); \
-    sph_echo512_init(&z_echo); \
-} while (0) 
-
-
-#define ZBLAKE (memcpy(&ctx_blake, &z_blake, sizeof(z_blake)))
-#define ZBMW (memcpy(&ctx_bmw, &z_bmw, sizeof(z_bmw)))
-#define ZGROESTL (memcpy(&ctx_groestl, &z_groestl, sizeof(z_groestl)))
-#define ZJH (memcpy(&ctx_jh, &z_jh, sizeof(z_jh)))
-#define ZKECCAK (memcpy(&ctx_keccak, &z_keccak, sizeof(z_keccak)))
-#define ZSKEIN (memcpy(&ctx_skein, &z_skein, sizeof(z_skein)))
+/** One initialised context for each X11 stage.
+ *  Every sph close function reinitialises its context, so a set that has
+ *  been initialised once is ready for the next hash as soon as the previous
+ *  one is finished; no init calls are needed on the hashing path. */
+struct CHash9Contexts
+{
+    sph_blake512_context     blake;
+    sph_bmw512_context       bmw;
+    sph_groestl512_context   groestl;
+    sph_jh512_context        jh;
+    sph_keccak512_context    keccak;
+    sph_skein512_context     skein;
+    sph_luffa512_context     luffa;
+    sph_cubehash512_context  cubehash;
+    sph_shavite512_context   shavite;
+    sph_simd512_context      simd;
+    sph_echo512_context      echo;
+
+    // X11 chains computed on this thread, for -benchmark accounting
+    uint64 nHashes;
+
+    CHash9Contexts();
+};
+
+/** The calling thread's own context set, created on first use */
+CHash9Contexts& GetHash9Contexts();
 
 template<typename T1>
 inline uint256 Hash9(const T1 pbegin, const T1 pend)
 
 {
-    sph_blake512_context     ctx_blake;
-    sph_bmw512_context       ctx_bmw;
-    sph_groestl512_context   ctx_groestl;
-    sph_jh512_context        ctx_jh;
-    sph_keccak512_context    ctx_keccak;
-    sph_skein512_context     ctx_skein;
-    sph_luffa512_context     ctx_luffa;
-    sph_cubehash512_context  ctx_cubehash;
-    sph_shavite512_context   ctx_shavite;
-    sph_simd512_context      ctx_simd;
-    sph_echo512_context      ctx_echo;
+    CHash9Contexts& ctx = GetHash9Contexts();
     static unsigned char pblank[1];
+    uint512 hash[11];
+    ctx.nHashes++;
 
-#ifndef QT_NO_DEBUG
-    //std::string strhash;
-    //strhash = "";
-#endif
-    
-    uint512 hash[17];
-
-    sph_blake512_init(&ctx_blake);
-    sph_blake512 (&ctx_blake, (pbegin == pend ? pblank : static_cast<const void*>(&pbegin[0])), (pend - pbegin) * sizeof(pbegin[0]));
-    sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[0]));
-    
-    sph_bmw512_init(&ctx_bmw);
-    sph_bmw512 (&ctx_bmw, static_cast<const void*>(&hash[0]), 64);
-    sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[1]));
-
-    sph_groestl512_init(&ctx_groestl);
-    sph_groestl512 (&ctx_groestl, static_cast<const void*>(&hash[1]), 64);
-    sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[2]));
-
-    sph_skein512_init(&ctx_skein);
-    sph_skein512 (&ctx_skein, static_cast<const void*>(&hash[2]), 64);
-    sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[3]));
-    
-    sph_jh512_init(&ctx_jh);
-    sph_jh512 (&ctx_jh, static_cast<const void*>(&hash[3]), 64);
-    sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[4]));
-    
-    sph_keccak512_init(&ctx_keccak);
-    sph_keccak512 (&ctx_keccak, static_cast<const void*>(&hash[4]), 64);
-    sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[5]));
-
-    sph_luffa512_init(&ctx_luffa);
-    sph_luffa512 (&ctx_luffa, static_cast<void*>(&hash[5]), 64);
-    sph_luffa512_close(&ctx_luffa, static_cast<void*>(&hash[6]));
-    
-    sph_cubehash512_init(&ctx_cubehash);
-    sph_cubehash512 (&ctx_cubehash, static_cast<const void*>(&hash[6]), 64);
-    sph_cubehash512_close(&ctx_cubehash, static_cast<void*>(&hash[7]));
-    
-    sph_shavite512_init(&ctx_shavite);
-    sph_shavite512(&ctx_shavite, static_cast<const void*>(&hash[7]), 64);
-    sph_shavite512_close(&ctx_shavite, static_cast<void*>(&hash[8]));
-        
-    sph_simd512_init(&ctx_simd);
-    sph_simd512 (&ctx_simd, static_cast<const void*>(&hash[8]), 64);
-    sph_simd512_close(&ctx_simd, static_cast<void*>(&hash[9]));
-
-    sph_echo512_init(&ctx_echo);
-    sph_echo512 (&ctx_echo, static_cast<const void*>(&hash[9]), 64);
-    sph_echo512_close(&ctx_echo, static_cast<void*>(&hash[10]));
+    sph_blake512(&ctx.blake, (pbegin == pend ? pblank : static_cast<const void*>(&pbegin[0])), (pend - pbegin) * sizeof(pbegin[0]));
+    sph_blake512_close(&ctx.blake, static_cast<void*>(&hash[0]));
+
+    sph_bmw512(&ctx.bmw, static_cast<const void*>(&hash[0]), 64);
+    sph_bmw512_close(&ctx.bmw, static_cast<void*>(&hash[1]));
+
+    sph_groestl512(&ctx.groestl, static_cast<const void*>(&hash[1]), 64);
+    sph_groestl512_close(&ctx.groestl, static_cast<void*>(&hash[2]));
+
+    sph_skein512(&ctx.skein, static_cast<const void*>(&hash[2]), 64);
+    sph_skein512_close(&ctx.skein, static_cast<void*>(&hash[3]));
+
+    sph_jh512(&ctx.jh, static_cast<const void*>(&hash[3]), 64);
+    sph_jh512_close(&ctx.jh, static_cast<void*>(&hash[4]));
+
+    sph_keccak512(&ctx.keccak, static_cast<const void*>(&hash[4]), 64);
+    sph_keccak512_close(&ctx.keccak, static_cast<void*>(&hash[5]));
+
+    sph_luffa512(&ctx.luffa, static_cast<void*>(&hash[5]), 64);
+    sph_luffa512_close(&ctx.luffa, static_cast<void*>(&hash[6]));
+
+    sph_cubehash512(&ctx.cubehash, static_cast<const void*>(&hash[6]), 64);
+    sph_cubehash512_close(&ctx.cubehash, static_cast<void*>(&hash[7]));
+
+    sph_shavite512(&ctx.shavite, static_cast<const void*>(&hash[7]), 64);
+    sph_shavite512_close(&ctx.shavite, static_cast<void*>(&hash[8]));
+
+    sph_simd512(&ctx.simd, static_cast<const void*>(&hash[8]), 64);
+    sph_simd512_close(&ctx.simd, static_cast<void*>(&hash[9]));
+
+    sph_echo512(&ctx.echo, static_cast<const void*>(&hash[9]), 64);
+    sph_echo512_close(&ctx.echo, static_cast<void*>(&hash[10]));
 
     return hash[10].trim256();
 }
 
+/** Number of X11 chains the calling thread has computed so far */
+inline uint64 GetHash9Count()
+{
+    return GetHash9Contexts().nHashes;
+}
+
+/** Number of inputs Hash9xN hashes side by side on this CPU (4 or 8) */
+unsigned int Hash9Lanes();
+
+/** Hash9 of nCount inputs of nLen bytes each, ppinput[i] -> phash[i].
+ *  Inputs are processed in lockstep groups of Hash9Lanes(); the results are
+ *  identical to calling Hash9 on each input. */
+void Hash9xN(const unsigned char* const* ppinput, unsigned int nLen, uint256* phash, unsigned int nCount);
+
+/** X11 midstate of an 80-byte block header.
+ *  BLAKE-512 sees the whole header as a single 128-byte block, so nothing can
+ *  be compressed ahead of time; what can be cached is the first round's
+ *  column step, which only reads the first 64 bytes (nVersion, hashPrevBlock
+ *  and most of hashMerkleRoot), together with those decoded message words.
+ *  The midstate stays valid while nTime, nBits and nNonce change. */
+class CHash9Midstate
+{
+private:
+    uint64 vState[16];
+    uint64 vWords[8];
+
+public:
+    /** pheader points to the 80 serialized header bytes; only the first 64 are read */
+    explicit CHash9Midstate(const unsigned char* pheader);
+
+    /** Hash9 of the header at pheader with nNonce, nNonce+1, ... nNonce+nCount-1
+     *  stored as its last four bytes; pheader's first 64 bytes must be the ones
+     *  the midstate was built from. */
+    void Hashes(const unsigned char* pheader, unsigned int nNonce, uint256* phash, unsigned int nCount) const;
+};
 
 
 
@@ -28,7 +28,6 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
 	if (strCommand == "txlreq")
 	{
 		printf("ProcessMessageInstantX::txlreq\n");
-        CDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
 
@@ -43,7 +42,7 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
 			
             printf("ProcessMessageInstantX::txlreq - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
-                tx.GetHash().ToString().c_str()
+                inv.hash.ToString().c_str()
             );
 
             return;
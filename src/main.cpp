@@ -19,6 +19,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_array.hpp>
 
 #include <algorithm>
 #include <boost/assign/list_of.hpp>
@@ -38,6 +39,12 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
+// Signalled by NotifyTemplateChange(), for getblocktemplate long polls.
+// nTemplateNotifies counts the calls, protected by csTemplateChange.
+static boost::mutex csTemplateChange;
+static boost::condition_variable cvTemplateChange;
+static unsigned int nTemplateNotifies = 0;
+
 map<uint256, CBlockIndex*> mapBlockIndex;
 uint256 hashGenesisBlock("0x00000ffd590b1485b3caadc19b22e6379c733355108f107a430458cdf3407ab6"); //mainnet
 
@@ -56,7 +63,7 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -191,7 +198,7 @@ bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return fal
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -202,48 +209,230 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+static uint64 CoinsMapSalt(int n)
+{
+    static const uint64 nSalt[2] = { GetRand(std::numeric_limits<uint64>::max()), GetRand(std::numeric_limits<uint64>::max()) };
+    return nSalt[n];
+}
 
-bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
+uint32_t CCoinsMap::Hash(const uint256 &txid) const
+{
+    uint64 h = CoinsMapSalt(0);
+    for (int i = 0; i < 4; i++) {
+        h = (h ^ txid.Get64(i)) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
     }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
-        return true;
+    h = (h ^ CoinsMapSalt(1)) * 0xBF58476D1CE4E5B9ULL;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+void CCoinsMap::Rehash(size_t nSlots)
+{
+    const Slot empty = { 0, nEmpty };
+    std::vector<Slot> vOld;
+    vOld.swap(vSlots);
+    vSlots.assign(nSlots, empty);
+    size_t nMask = nSlots - 1;
+    BOOST_FOREACH(const Slot &slot, vOld) {
+        if (slot.nIndex == nEmpty)
+            continue;
+        size_t i = slot.nHash & nMask;
+        while (vSlots[i].nIndex != nEmpty)
+            i = (i + 1) & nMask;
+        vSlots[i] = slot;
     }
-    return false;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
-        return it;
-    CCoins tmp;
-    if (!base->GetCoins(txid,tmp))
-        return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
-    return ret;
+CCoinsCacheEntry *CCoinsMap::Find(const uint256 &txid)
+{
+    if (nCount == 0)
+        return NULL;
+    uint32_t nHash = Hash(txid);
+    size_t nMask = vSlots.size() - 1;
+    for (size_t i = nHash & nMask; vSlots[i].nIndex != nEmpty; i = (i + 1) & nMask) {
+        if (vSlots[i].nHash == nHash && vEntries[vSlots[i].nIndex].txid == txid)
+            return &vEntries[vSlots[i].nIndex];
+    }
+    return NULL;
+}
+
+CCoinsCacheEntry *CCoinsMap::Insert(const uint256 &txid, bool &fNew)
+{
+    // keep the table at most 3/4 full, probe chains stay short
+    if ((nCount + 1) * 4 > vSlots.size() * 3)
+        Rehash(std::max(vSlots.size() * 2, (size_t)16));
+
+    uint32_t nHash = Hash(txid);
+    size_t nMask = vSlots.size() - 1;
+    size_t i = nHash & nMask;
+    for (; vSlots[i].nIndex != nEmpty; i = (i + 1) & nMask) {
+        if (vSlots[i].nHash == nHash && vEntries[vSlots[i].nIndex].txid == txid) {
+            fNew = false;
+            return &vEntries[vSlots[i].nIndex];
+        }
+    }
+
+    uint32_t nIndex;
+    if (vFree.empty()) {
+        nIndex = vEntries.size();
+        vEntries.push_back(CCoinsCacheEntry());
+    } else {
+        nIndex = vFree.back();
+        vFree.pop_back();
+    }
+    CCoinsCacheEntry &entry = vEntries[nIndex];
+    entry.txid = txid;
+    entry.flags = CCoinsCacheEntry::USED;
+    entry.nUsage = 0;
+    vSlots[i].nHash = nHash;
+    vSlots[i].nIndex = nIndex;
+    nCount++;
+    fNew = true;
+    return &entry;
+}
+
+void CCoinsMap::Erase(const uint256 &txid)
+{
+    if (nCount == 0)
+        return;
+    uint32_t nHash = Hash(txid);
+    size_t nMask = vSlots.size() - 1;
+    size_t i = nHash & nMask;
+    for (;; i = (i + 1) & nMask) {
+        if (vSlots[i].nIndex == nEmpty)
+            return;
+        if (vSlots[i].nHash == nHash && vEntries[vSlots[i].nIndex].txid == txid)
+            break;
+    }
+
+    CCoinsCacheEntry &entry = vEntries[vSlots[i].nIndex];
+    CCoins().swap(entry.coins);
+    entry.flags = 0;
+    vFree.push_back(vSlots[i].nIndex);
+    nCount--;
+
+    // Move the rest of the probe chain up over the hole, unless that would
+    // put a slot in front of its home slot. No tombstones are left behind.
+    for (size_t j = (i + 1) & nMask; vSlots[j].nIndex != nEmpty; j = (j + 1) & nMask) {
+        size_t k = vSlots[j].nHash & nMask;
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            vSlots[i] = vSlots[j];
+            i = j;
+        }
+    }
+    vSlots[i].nIndex = nEmpty;
+}
+
+void CCoinsMap::Clear()
+{
+    std::vector<Slot>().swap(vSlots);
+    std::deque<CCoinsCacheEntry>().swap(vEntries);
+    std::vector<uint32_t>().swap(vFree);
+    nCount = 0;
+}
+
+size_t CCoinsMap::DynamicMemoryUsage() const
+{
+    // the deque allocates its entries in blocks, which this ignores
+    return MallocUsage(vSlots.capacity() * sizeof(Slot)) +
+           vEntries.size() * sizeof(CCoinsCacheEntry) +
+           MallocUsage(vFree.capacity() * sizeof(uint32_t));
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy, bool fCacheMissesIn) : CCoinsViewBacked(baseIn), pindexTip(NULL), fCacheMisses(fCacheMissesIn), cachedCoinsUsage(0) { }
+
+// An entry for a txid the view below doesn't have (any more)
+static inline bool IsMissing(const CCoinsCacheEntry *pentry) {
+    return (pentry->flags & CCoinsCacheEntry::FRESH) && pentry->coins.IsPruned();
+}
+
+CCoinsCacheEntry *CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    bool fNew;
+    CCoinsCacheEntry *pentry = cacheCoins.Insert(txid, fNew);
+    if (fNew) {
+        if (base->GetCoins(txid, pentry->coins)) {
+            pentry->nUsage = pentry->coins.DynamicMemoryUsage();
+            cachedCoinsUsage += pentry->nUsage;
+        } else {
+            // keep the miss, anything created under this txid is new to the base
+            pentry->coins = CCoins();
+            pentry->flags |= CCoinsCacheEntry::FRESH;
+        }
+    }
+    return pentry;
+}
+
+CCoinsCacheEntry *CCoinsViewCache::LookupCoins(const uint256 &txid) {
+    if (fCacheMisses)
+        return FetchCoins(txid);
+    CCoinsCacheEntry *pentry = cacheCoins.Find(txid);
+    if (pentry != NULL)
+        return pentry;
+    CCoins coins;
+    if (!base->GetCoins(txid, coins))
+        return NULL;
+    CacheCoins(txid, true, coins);
+    return cacheCoins.Find(txid);
+}
+
+bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
+    const CCoinsCacheEntry *pentry = LookupCoins(txid);
+    if (pentry == NULL || IsMissing(pentry))
+        return false;
+    coins = pentry->coins;
+    return true;
 }
 
 CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
-    assert(it != cacheCoins.end());
-    return it->second;
+    CCoinsCacheEntry *pentry = FetchCoins(txid);
+    pentry->flags |= CCoinsCacheEntry::DIRTY;
+    if (!(pentry->flags & CCoinsCacheEntry::RECOUNT)) {
+        pentry->flags |= CCoinsCacheEntry::RECOUNT;
+        vRecount.push_back(pentry);
+    }
+    return pentry->coins;
+}
+
+const CCoins &CCoinsViewCache::AccessCoins(const uint256 &txid) {
+    return FetchCoins(txid)->coins;
+}
+
+bool CCoinsViewCache::HaveCoinsInCache(const uint256 &txid) {
+    return cacheCoins.Find(txid) != NULL;
+}
+
+void CCoinsViewCache::CacheCoins(const uint256 &txid, bool fFound, CCoins &coins) {
+    if (!fFound && !fCacheMisses)
+        return;
+    bool fNew;
+    CCoinsCacheEntry *pentry = cacheCoins.Insert(txid, fNew);
+    if (!fNew)
+        return;
+    if (fFound) {
+        pentry->coins.swap(coins);
+        pentry->nUsage = pentry->coins.DynamicMemoryUsage();
+        cachedCoinsUsage += pentry->nUsage;
+    } else
+        pentry->flags |= CCoinsCacheEntry::FRESH;
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    bool fNew;
+    CCoinsCacheEntry *pentry = cacheCoins.Insert(txid, fNew);
+    pentry->coins = coins;
+    pentry->flags |= CCoinsCacheEntry::DIRTY;
+    size_t nUsage = pentry->coins.DynamicMemoryUsage();
+    cachedCoinsUsage += nUsage - pentry->nUsage;
+    pentry->nUsage = nUsage;
     return true;
 }
 
 bool CCoinsViewCache::HaveCoins(const uint256 &txid) {
-    return FetchCoins(txid) != cacheCoins.end();
+    const CCoinsCacheEntry *pentry = LookupCoins(txid);
+    return pentry != NULL && !IsMissing(pentry);
 }
 
 CBlockIndex *CCoinsViewCache::GetBestBlock() {
@@ -257,22 +446,63 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    Recount();
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        if (!(it->flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        bool fPruned = it->coins.IsPruned();
+        CCoinsCacheEntry *pentry = cacheCoins.Find(it->txid);
+        if (pentry == NULL) {
+            // FRESH below means neither this cache nor its base has the coins
+            if (fPruned && (it->flags & CCoinsCacheEntry::FRESH))
+                continue;
+            bool fNew;
+            pentry = cacheCoins.Insert(it->txid, fNew);
+            pentry->flags |= it->flags & CCoinsCacheEntry::FRESH;
+        } else if (fPruned && (pentry->flags & CCoinsCacheEntry::FRESH)) {
+            // created and spent before reaching the base
+            cachedCoinsUsage -= pentry->nUsage;
+            cacheCoins.Erase(it->txid);
+            continue;
+        }
+        pentry->flags |= CCoinsCacheEntry::DIRTY;
+        pentry->coins.swap(it->coins);
+        size_t nUsage = pentry->coins.DynamicMemoryUsage();
+        cachedCoinsUsage += nUsage - pentry->nUsage;
+        pentry->nUsage = nUsage;
+    }
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
+    Recount();
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
-        cacheCoins.clear();
+    if (fOk) {
+        cacheCoins.Clear();
+        cachedCoinsUsage = 0;
+    }
     return fOk;
 }
 
 unsigned int CCoinsViewCache::GetCacheSize() {
-    return cacheCoins.size();
+    return cacheCoins.Size();
+}
+
+size_t CCoinsViewCache::DynamicMemoryUsage() {
+    Recount();
+    return cacheCoins.DynamicMemoryUsage() + cachedCoinsUsage;
+}
+
+void CCoinsViewCache::Recount() {
+    BOOST_FOREACH(CCoinsCacheEntry *pentry, vRecount) {
+        size_t nUsage = pentry->coins.DynamicMemoryUsage();
+        cachedCoinsUsage += nUsage - pentry->nUsage;
+        pentry->nUsage = nUsage;
+        pentry->flags &= ~CCoinsCacheEntry::RECOUNT;
+    }
+    vRecount.clear();
 }
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -680,9 +910,65 @@ bool CTxMemPool::getTransactionFees(CTransaction& tx, int64& nFees)
     return true;
 }
 
+CCheckQueuePool& GetCheckQueuePool()
+{
+    // Constructed on first use, as queues in other files join it during
+    // their static initialization
+    static CCheckQueuePool pool;
+    return pool;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, &GetCheckQueuePool());
+// Held by whoever drives scriptcheckqueue: ConnectBlock(), or a loose
+// transaction check that found the workers idle.
+static CCriticalSection cs_scriptcheckqueue;
+
+// Script checks for a loose transaction. The inputs are verified on the
+// script check threads when they are idle, inline otherwise.
+static bool CheckLooseInputs(CValidationState &state, const CTransaction &tx, CCoinsViewCache &view, unsigned int flags)
+{
+    if (nScriptCheckThreads == 0 || tx.vin.size() < 2)
+        return tx.CheckInputs(state, view, true, flags);
+
+    TRY_LOCK(cs_scriptcheckqueue, lockQueue);
+    if (!lockQueue)
+        return tx.CheckInputs(state, view, true, flags);
+
+    // Each check says whether it failed only on non-canonical encodings,
+    // which must not trigger DoS protection
+    boost::scoped_array<bool> pfNonCanonical(new bool[tx.vin.size()]);
+    std::fill(pfNonCanonical.get(), pfNonCanonical.get() + tx.vin.size(), false);
+    bool fOk;
+    {
+        std::vector<CScriptCheck> vChecks;
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        if (!tx.CheckInputs(state, view, true, flags, &vChecks))
+            return false;
+        for (unsigned int i = 0; i < vChecks.size(); i++)
+            vChecks[i].SetNonCanonicalResult(&pfNonCanonical[i]);
+        control.Add(vChecks);
+        fOk = control.Wait();
+    }
+    if (fOk)
+        return true;
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        if (pfNonCanonical[i])
+            return state.Invalid();
+    return state.DoS(100, false);
+}
+
 bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree,
                         bool* pfMissingInputs, bool ignoreFees)
 {
+    // The checks run in stages: the context free checks without locks, the
+    // input lookup under cs_main and cs, then the policy checks and the
+    // script checks without either, and finally the insert, which takes both
+    // again and repeats the conflict and input checks, as a block or another
+    // transaction may have spent the inputs in between. Callers that hold
+    // cs_main keep it over all of this, so the network handler calls this
+    // without it.
+    int64 nTimeStart = GetTimeMicros();
+
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -703,49 +989,37 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         return error("CTxMemPool::accept() : nonstandard transaction (%s)",
                      strNonStd.c_str());
 
+    int64 nTimeContextFree = GetTimeMicros();
+
     // is it already in the memory pool?
     uint256 hash = tx.GetHash();
     {
         LOCK(cs);
         if (mapTx.count(hash))
             return false;
-    }
 
-    // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
-    {
-        COutPoint outpoint = tx.vin[i].prevout;
-        if (mapNextTx.count(outpoint))
+        // Check for conflicts with in-memory transactions
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
-            // Disable replacement feature for now
-            return false;
-
-            // Allow replacing with a newer version of the same transaction
-            if (i != 0)
-                return false;
-            ptxOld = mapNextTx[outpoint].ptx;
-            if (ptxOld->IsFinal())
-                return false;
-            if (!tx.IsNewerThan(*ptxOld))
-                return false;
-            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            COutPoint outpoint = tx.vin[i].prevout;
+            if (mapNextTx.count(outpoint))
             {
-                COutPoint outpoint = tx.vin[i].prevout;
-                if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
-                    return false;
+                // Replacement of in-memory transactions is disabled for now
+                return false;
             }
-            break;
         }
     }
 
+    int64 nTimeInputs = GetTimeMicros();
+    int64 nTimePolicy = nTimeInputs;
+    int64 nTimeScripts = nTimeInputs;
     if (fCheckInputs)
     {
         CCoinsView dummy;
         CCoinsViewCache view(dummy);
 
         {
-        LOCK(cs);
+        LOCK2(cs_main, cs);
         CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
         view.SetBackend(viewMemPool);
 
@@ -774,6 +1048,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
         view.SetBackend(dummy);
         }
+        nTimeInputs = GetTimeMicros();
 
         // Check for non-standard pay-to-script-hash in inputs
         if (!tx.AreInputsStandard(view) && !fTestNet)
@@ -817,30 +1092,47 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
                 dFreeCount += nSize;
             }
         }
+        nTimePolicy = GetTimeMicros();
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
+        if (!CheckLooseInputs(state, tx, view, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
         }
+        nTimeScripts = GetTimeMicros();
     }
 
-    // Store transaction in memory
+    // Store transaction in memory, unless a conflicting one got in or the
+    // inputs were spent while the scripts were being checked. The scripts
+    // only depend on the outputs spent, which can't change, so checking
+    // that they are still there is enough.
+    LOCK(cs_main);
     {
         LOCK(cs);
-        if (ptxOld)
+        if (mapTx.count(hash))
+            return false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (mapNextTx.count(txin.prevout))
+                return false;
+        if (fCheckInputs)
         {
-            LogPrintf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
-            remove(*ptxOld);
+            CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+            CCoinsViewCache view(viewMemPool);
+            if (!tx.HaveInputs(view))
+                return state.Invalid(error("CTxMemPool::accept() : inputs spent while checking %s", hash.ToString().c_str()));
         }
         addUnchecked(hash, tx);
     }
+    int64 nTimeInsert = GetTimeMicros();
+
+    if (fBenchmark)
+        LogPrintf("- Accept %s: checks %.2fms, inputs %.2fms, policy %.2fms, scripts %.2fms (%u inputs), insert %.2fms\n",
+                  hash.ToString().substr(0,10).c_str(),
+                  0.001 * (nTimeContextFree - nTimeStart), 0.001 * (nTimeInputs - nTimeContextFree),
+                  0.001 * (nTimePolicy - nTimeInputs), 0.001 * (nTimeScripts - nTimePolicy),
+                  (unsigned int)tx.vin.size(), 0.001 * (nTimeInsert - nTimeScripts));
 
-    ///// are we sure this is ok when loading transactions or restoring block txes
-    // If updated, erase old tx from wallet
-    if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
     SyncWithWallets(hash, tx, NULL, true);
 
     return true;
@@ -1024,7 +1316,9 @@ bool CTxMemPool::acceptable(CValidationState &state, CTransaction &tx, bool fChe
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.CheckInputs(state, view, fScriptChecks, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
+        bool fInputsOk = fScriptChecks ? CheckLooseInputs(state, tx, view, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC)
+                                       : tx.CheckInputs(state, view, false, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC);
+        if (!fInputsOk)
         {
             return error("CTxMemPool::acceptable() : ConnectInputs failed %s", hash.ToString().c_str());
         }
@@ -1078,7 +1372,7 @@ int GetInputAge(CTxIn& vin)
 
     if(!view.HaveCoins(vin.prevout.hash)) return -1;
 
-    const CCoins &coins = view.GetCoins(vin.prevout.hash);
+    const CCoins &coins = view.AccessCoins(vin.prevout.hash);
 
     return (pindexBest->nHeight+1) - coins.nHeight;
 }
@@ -1088,9 +1382,16 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        LOCK(cs);
+        std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
+            UnindexEntry(hash, mi->second);
+        CTxMemPoolEntry& entry = mapTx[hash];
+        entry = CTxMemPoolEntry(tx);
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&entry.tx, i);
+        UpdateEntry(hash);
+        UpdateSpenders(hash);
         nTransactionsUpdated++;
     }
     return true;
@@ -1110,11 +1411,16 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                     remove(*it->second.ptx, true);
             }
         }
-        if (mapTx.count(hash))
+        std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
         {
+            UnindexEntry(hash, mi->second);
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            mapTx.erase(mi);
+            // Spenders left behind now take those inputs from the chain
+            // (the usual case: tx was just mined) or miss them.
+            UpdateSpenders(hash);
             nTransactionsUpdated++;
         }
     }
@@ -1141,6 +1447,8 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setByFeeRate.clear();
+    setByPriority.clear();
     ++nTransactionsUpdated;
 }
 
@@ -1150,10 +1458,107 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
+void CTxMemPool::SetPriorityHeight(int nHeight)
+{
+    LOCK(cs);
+    if (nHeight == nPriorityHeight)
+        return;
+    nPriorityHeight = nHeight;
+    setByPriority.clear();
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        if ((*mi).second.IsMineable())
+            setByPriority.insert(make_pair((*mi).second.GetPriority(nPriorityHeight), (*mi).first));
+}
+
+void CTxMemPool::IndexEntry(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    if (!entry.IsMineable())
+        return;
+    setByFeeRate.insert(make_pair(entry.GetFeePerKb(), hash));
+    setByPriority.insert(make_pair(entry.GetPriority(nPriorityHeight), hash));
+}
+
+void CTxMemPool::UnindexEntry(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    if (!entry.IsMineable())
+        return;
+    setByFeeRate.erase(make_pair(entry.GetFeePerKb(), hash));
+    setByPriority.erase(make_pair(entry.GetPriority(nPriorityHeight), hash));
+}
+
+// Recompute fee, priority and pool parents of a pool entry from the chain
+// and the pool, and move it in the indexes. Caller holds cs.
+void CTxMemPool::UpdateEntry(const uint256& hash)
+{
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+    if (mi == mapTx.end())
+        return;
+    CTxMemPoolEntry& entry = (*mi).second;
+    const CTransaction& tx = entry.tx;
+    UnindexEntry(hash, entry);
+
+    entry.nFee = 0;
+    entry.nValueInChain = 0;
+    entry.dPriority = 0;
+    entry.nHeight = pindexBest ? pindexBest->nHeight : 0;
+    entry.fMissingInputs = false;
+    entry.setParents.clear();
+
+    if (!tx.IsCoinBase())
+    {
+        int64 nValueIn = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            // Has to wait for the pool transaction it spends
+            map<uint256, CTxMemPoolEntry>::const_iterator mp = mapTx.find(txin.prevout.hash);
+            if (mp != mapTx.end())
+            {
+                if (txin.prevout.n >= (*mp).second.tx.vout.size())
+                {
+                    entry.fMissingInputs = true;
+                    break;
+                }
+                nValueIn += (*mp).second.tx.vout[txin.prevout.n].nValue;
+                entry.setParents.insert(txin.prevout.hash);
+                continue;
+            }
+
+            CCoins coins;
+            if (!pcoinsTip || !pcoinsTip->GetCoins(txin.prevout.hash, coins) || !coins.IsAvailable(txin.prevout.n))
+            {
+                entry.fMissingInputs = true;
+                break;
+            }
+            int64 nValue = coins.vout[txin.prevout.n].nValue;
+            nValueIn += nValue;
+            entry.nValueInChain += nValue;
+            entry.dPriority += (double)nValue * (entry.nHeight - coins.nHeight + 1);
+        }
+        entry.dPriority /= entry.nTxSize;
+        entry.nFee = nValueIn - tx.GetValueOut();
+    }
+
+    IndexEntry(hash, entry);
+}
+
+// Update the pool transactions spending outputs of hash, after hash
+// entered or left the pool. Caller holds cs.
+void CTxMemPool::UpdateSpenders(const uint256& hash)
+{
+    set<uint256> setSpenders;
+    map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+    while (it != mapNextTx.end() && it->first.hash == hash) {
+        setSpenders.insert(it->second.ptx->GetHash());
+        it++;
+    }
+    BOOST_FOREACH(const uint256& hashSpender, setSpenders)
+        UpdateEntry(hashSpender);
+}
+
 
 int CMerkleTx::IsTransactionLocked() const
 {
@@ -1232,7 +1637,8 @@ bool CMerkleTx::IsAcceptable(bool fCheckInputs, bool fLimitFree)
 bool CWalletTx::AcceptWalletTransaction(bool fCheckInputs)
 {
     {
-        LOCK(mempool.cs);
+        // accept takes cs_main before mempool.cs
+        LOCK2(cs_main, mempool.cs);
         // Add previous supporting transactions first
         BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
         {
@@ -1349,6 +1755,60 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
     return true;
 }
 
+// Blocks are stored serialized as they are sent, so they can be read
+// straight into the message; only the size and the header are checked
+static CSharedMessage ReadRawBlockMessage(const CBlockIndex* pindex)
+{
+    // The block is preceded by the message start and its size. The message
+    // start is not checked, blocks written before the switch have the old one
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    if (pos.nPos < 8)
+        return CSharedMessage();
+    pos.nPos -= 8;
+    CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return CSharedMessage();
+
+    CSerializeData vchMessage;
+    try {
+        unsigned char pchDiskMessageStart[4];
+        unsigned int nSize;
+        filein >> FLATDATA(pchDiskMessageStart) >> nSize;
+        if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+            return CSharedMessage();
+        vchMessage.resize(CMessageHeader::HEADER_SIZE + nSize);
+        filein.read(&vchMessage[CMessageHeader::HEADER_SIZE], nSize);
+    }
+    catch (std::exception &e) {
+        return CSharedMessage();
+    }
+
+    CBlockHeader header;
+    CDataStream ssHeader(&vchMessage[CMessageHeader::HEADER_SIZE], &vchMessage[CMessageHeader::HEADER_SIZE] + 80, SER_DISK, CLIENT_VERSION);
+    ssHeader >> header;
+    if (header.GetHash() != pindex->GetBlockHash())
+        return CSharedMessage();
+
+    return MakeSharedMessage("block", vchMessage);
+}
+
+CSharedMessage ReadBlockMessage(const CBlockIndex* pindex)
+{
+    CSharedMessage msg = ReadRawBlockMessage(pindex);
+    if (msg)
+        return msg;
+
+    // Unexpected framing, go through the block
+    LogPrintf("ReadBlockMessage() : bad framing for block %s, reading it whole\n", pindex->GetBlockHash().ToString().c_str());
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+        return CSharedMessage();
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(block.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION));
+    ss << block;
+    return MakeSharedMessage("block", ss);
+}
+
 uint256 static GetOrphanRoot(const CBlockHeader* pblock)
 {
     // Work back to the first block in the orphan chain
@@ -1799,13 +2259,27 @@ void CBlockHeader::UpdateTime(const CBlockIndex* pindexPrev)
 }
 
 uint256 CBlockHeader::GetHash() const
-{   
+{
     return Hash9(BEGIN(nVersion), END(nNonce));
 }
 
+void CBlockHeader::GetHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashRet)
+{
+    vHashRet.resize(vHeaders.size());
+    if (vHeaders.empty())
+        return;
+
+    std::vector<const unsigned char*> vpHeader;
+    vpHeader.reserve(vHeaders.size());
+    BOOST_FOREACH(const CBlockHeader& header, vHeaders)
+        vpHeader.push_back((const unsigned char*)BEGIN(header.nVersion));
+
+    Hash9xN(&vpHeader[0], END(vHeaders[0].nNonce) - BEGIN(vHeaders[0].nVersion), &vHashRet[0], vHeaders.size());
+}
+
 const CTxOut &CTransaction::GetOutputFor(const CTxIn& input, CCoinsViewCache& view)
 {
-    const CCoins &coins = view.GetCoins(input.prevout.hash);
+    const CCoins &coins = view.AccessCoins(input.prevout.hash);
     assert(coins.IsAvailable(input.prevout.n));
     return coins.vout[input.prevout.n];
 }
@@ -1866,7 +2340,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
         // then check whether the actual outputs are available
         for (unsigned int i = 0; i < vin.size(); i++) {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
             if (!coins.IsAvailable(prevout.n))
                 return false;
         }
@@ -1876,8 +2350,11 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType)) {
+        if (pfNonCanonical && (nFlags & SCRIPT_VERIFY_STRICTENC))
+            *pfNonCanonical = VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags & ~SCRIPT_VERIFY_STRICTENC, nHashType);
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
+    }
     return true;
 }
 
@@ -1906,7 +2383,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
             // If prev is coinbase, check that it's matured
             if (coins.IsCoinBase()) {
@@ -1942,7 +2419,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         if (fScriptChecks) {
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
                 // Verify signature
                 CScriptCheck check(coins, *this, i, flags, 0);
@@ -2081,11 +2558,136 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
-    scriptcheckqueue.Thread();
+    GetCheckQueuePool().Thread();
+}
+
+/** A lookup in the coin database, as done by the prefetch stage of ConnectBlock */
+struct CCoinsLookup
+{
+    uint256 txid;
+    bool fFound;
+    CCoins coins;
+
+    CCoinsLookup(const uint256 &txidIn) : txid(txidIn), fFound(false) { }
+};
+
+/** Closure running one CCoinsLookup on a prefetch thread */
+class CCoinsPrefetch
+{
+private:
+    CCoinsView *pview;
+    CCoinsLookup *plookup;
+
+public:
+    CCoinsPrefetch() : pview(NULL), plookup(NULL) { }
+    CCoinsPrefetch(CCoinsView &viewIn, CCoinsLookup &lookupIn) : pview(&viewIn), plookup(&lookupIn) { }
+
+    bool operator()() {
+        plookup->fFound = pview->GetCoins(plookup->txid, plookup->coins);
+        return true;
+    }
+
+    void swap(CCoinsPrefetch &check) {
+        std::swap(pview, check.pview);
+        std::swap(plookup, check.plookup);
+    }
+};
+
+// Only used from ConnectBlock, so with cs_main held
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(8, &GetCheckQueuePool());
+
+/** Closure representing the context-free checks of one transaction of a block */
+class CTxCheck
+{
+private:
+    const CTransaction *ptx;
+    uint256 *phash;
+    unsigned int *pnSigOps;
+    CValidationState *pstate;
+
+public:
+    CTxCheck() : ptx(NULL), phash(NULL), pnSigOps(NULL), pstate(NULL) { }
+    CTxCheck(const CTransaction &txIn, uint256 &hashOut, unsigned int &nSigOpsOut, CValidationState &stateOut) :
+        ptx(&txIn), phash(&hashOut), pnSigOps(&nSigOpsOut), pstate(&stateOut) { }
+
+    bool operator()() {
+        if (!ptx->CheckTransaction(*pstate))
+            return false;
+        *phash = ptx->GetHash();
+        *pnSigOps = ptx->GetLegacySigOpCount();
+        return true;
+    }
+
+    void swap(CTxCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(phash, check.phash);
+        std::swap(pnSigOps, check.pnSigOps);
+        std::swap(pstate, check.pstate);
+    }
+};
+
+static CCheckQueue<CTxCheck> txcheckqueue(16, &GetCheckQueuePool());
+
+// Blocks are checked from several threads (mining, RPC), but only one can
+// use txcheckqueue at a time; the others check their transactions inline.
+static CCriticalSection cs_txcheckqueue;
+
+// Read the coins a block creates or spends into pcoinsTip (misses into the
+// block's view) before it is connected, with the database lookups spread over the script check threads.
+// Otherwise every cache miss in the connect loop waits for its own read.
+// The coin database is the only view that is read concurrently here.
+static void PrefetchBlockCoins(const CBlock &block, CCoinsViewCache &view)
+{
+    if (nScriptCheckThreads == 0 || pcoinsTip == NULL)
+        return;
+
+    int64 nStart = GetTimeMicros();
+    std::set<uint256> setTxid;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        // looked up for BIP30
+        setTxid.insert(block.GetTxHash(i));
+        const CTransaction &tx = block.vtx[i];
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn &txin, tx.vin)
+            setTxid.insert(txin.prevout.hash);
+    }
+
+    std::vector<CCoinsLookup> vLookup;
+    vLookup.reserve(setTxid.size());
+    BOOST_FOREACH(const uint256 &txid, setTxid)
+        if (!view.HaveCoinsInCache(txid) && !pcoinsTip->HaveCoinsInCache(txid))
+            vLookup.push_back(CCoinsLookup(txid));
+
+    if (!vLookup.empty()) {
+        std::vector<CCoinsPrefetch> vPrefetch;
+        vPrefetch.reserve(vLookup.size());
+        BOOST_FOREACH(CCoinsLookup &lookup, vLookup)
+            vPrefetch.push_back(CCoinsPrefetch(pcoinsTip->GetBackend(), lookup));
+        CCheckQueueControl<CCoinsPrefetch> control(&prefetchqueue);
+        control.Add(vPrefetch);
+        control.Wait();
+    }
+
+    unsigned int nFound = 0;
+    BOOST_FOREACH(CCoinsLookup &lookup, vLookup) {
+        if (lookup.fFound)
+            nFound++;
+        // misses only matter to this block, so they stay in its view
+        if (lookup.fFound)
+            pcoinsTip->CacheCoins(lookup.txid, true, lookup.coins);
+        else
+            view.CacheCoins(lookup.txid, false, lookup.coins);
+    }
+
+    int64 nTime = GetTimeMicros() - nStart;
+    unsigned int nCached = setTxid.size() - vLookup.size();
+    if (fBenchmark)
+        LogPrintf("- Prefetch %u txids: %u cached (%.1f%%), %u read (%u found): %.2fms\n",
+                  (unsigned int)setTxid.size(), nCached, 100.0 * nCached / setTxid.size(),
+                  (unsigned int)vLookup.size(), nFound, 0.001 * nTime);
 }
 
 bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
@@ -2100,12 +2702,14 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
-    if (GetHash() == hashGenesisBlock) {
+    if (pindex->GetBlockHash() == hashGenesisBlock) {
         view.SetBestBlock(pindex);
         pindexGenesisBlock = pindex;
         return true;
     }
 
+    PrefetchBlockCoins(*this, view);
+
     bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
@@ -2124,7 +2728,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fEnforceBIP30) {
         for (unsigned int i=0; i<vtx.size(); i++) {
             uint256 hash = GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+            if (view.HaveCoins(hash) && !view.AccessCoins(hash).IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
         }
     }
@@ -2138,6 +2742,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
     CBlockUndo blockundo;
 
+    LOCK(cs_scriptcheckqueue);
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64 nStart = GetTimeMicros();
@@ -2328,7 +2933,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    if (!fIsInitialDownload || pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -2384,6 +2989,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    NotifyTemplateChange();
     LogPrintf("SetBestChain: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0), (unsigned long)pindexNew->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str(),
@@ -2419,10 +3025,9 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 }
 
 
-bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
+bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos, const uint256 &hash)
 {
     // Check for duplicate
-    uint256 hash = GetHash();
     if (mapBlockIndex.count(hash))
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
@@ -2651,15 +3256,47 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
         if (vtx[i].IsCoinBase())
             return state.DoS(100, error("CheckBlock() : more than one coinbase"));
 
-    // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-        if (!tx.CheckTransaction(state))
-            return error("CheckBlock() : CheckTransaction failed");
+    // Check transactions, hash them and count their sigops. Large blocks
+    // have this done on the transaction check threads.
+    vMerkleTree.assign(vtx.size(), 0);
+    std::vector<unsigned int> vSigOps(vtx.size(), 0);
+    std::vector<CValidationState> vState(vtx.size());
+
+    bool fTxOk = true;
+    bool fChecked = false;
+    {
+        TRY_LOCK(cs_txcheckqueue, lockQueue);
+        if (lockQueue && nScriptCheckThreads && vtx.size() >= 16) {
+            std::vector<CTxCheck> vChecks;
+            vChecks.reserve(vtx.size());
+            for (unsigned int i = 0; i < vtx.size(); i++)
+                vChecks.push_back(CTxCheck(vtx[i], vMerkleTree[i], vSigOps[i], vState[i]));
+            CCheckQueueControl<CTxCheck> control(&txcheckqueue);
+            control.Add(vChecks);
+            fTxOk = fChecked = control.Wait();
+        }
+    }
+    if (!fChecked) {
+        // The queue stops at whichever failure its threads hit first, so
+        // after a failure the checks are run again in order: the state (and
+        // DoS score) is always that of the first bad transaction.
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            vState[i] = CValidationState();
+            if (!(fTxOk = CTxCheck(vtx[i], vMerkleTree[i], vSigOps[i], vState[i])())) {
+                state = vState[i];
+                break;
+            }
+        }
+    }
+    if (!fTxOk) {
+        vMerkleTree.clear();
+        return error("CheckBlock() : CheckTransaction failed");
+    }
 
     // Build the merkle tree already. We need it anyway later, and it makes the
     // block cache the transaction hashes, which means they don't need to be
     // recalculated many times during this block's validation.
-    BuildMerkleTree();
+    uint256 hashMerkleRootBuilt = BuildMerkleTreeBranches();
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
@@ -2671,24 +3308,21 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
         return state.DoS(100, error("CheckBlock() : duplicate transaction"), true);
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        nSigOps += tx.GetLegacySigOpCount();
-    }
+    BOOST_FOREACH(unsigned int nTxSigOps, vSigOps)
+        nSigOps += nTxSigOps;
     if (nSigOps > MAX_BLOCK_SIGOPS)
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    if (fCheckMerkleRoot && hashMerkleRoot != hashMerkleRootBuilt)
         return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
     return true;
 }
 
-bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
+bool CBlock::AcceptBlock(CValidationState &state, const uint256 &hash, CDiskBlockPos *dbp)
 {
     // Check for duplicate
-    uint256 hash = GetHash();
     if (mapBlockIndex.count(hash))
         return state.Invalid(error("AcceptBlock() : block already in mapBlockIndex"));
 
@@ -2784,7 +3418,7 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         if (dbp == NULL)
             if (!WriteToDisk(blockPos))
                 return state.Abort(_("Failed to write block"));
-        if (!AddToBlockIndex(state, blockPos))
+        if (!AddToBlockIndex(state, blockPos, hash))
             return error("AcceptBlock() : AddToBlockIndex failed");
     } catch(std::runtime_error &e) {
         return state.Abort(_("System error: ") + e.what());
@@ -2865,7 +3499,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     }
 
     // Store to disk
-    if (!pblock->AcceptBlock(state, dbp))
+    if (!pblock->AcceptBlock(state, hash, dbp))
         return error("ProcessBlock() : AcceptBlock FAILED");
 
     // Recursively process any orphan blocks that depended on this one
@@ -2881,9 +3515,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             CBlock* pblockOrphan = (*mi).second;
             // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan resolution (that is, feeding people an invalid block based on LegitBlockX in order to get anyone relaying LegitBlockX banned)
             CValidationState stateDummy;
-            if (pblockOrphan->AcceptBlock(stateDummy))
-                vWorkQueue.push_back(pblockOrphan->GetHash());
-            mapOrphanBlocks.erase(pblockOrphan->GetHash());
+            uint256 hashOrphan = pblockOrphan->GetHash();
+            if (pblockOrphan->AcceptBlock(stateDummy, hashOrphan))
+                vWorkQueue.push_back(hashOrphan);
+            mapOrphanBlocks.erase(hashOrphan);
             delete pblockOrphan;
         }
         mapOrphanBlocksByPrev.erase(hashPrev);
@@ -2943,17 +3578,21 @@ uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::ve
     if (height == 0) {
         // hash at height 0 is the txids themself
         return vTxid[pos];
-    } else {
-        // calculate left hash
-        uint256 left = CalcHash(height-1, pos*2, vTxid), right;
-        // calculate right hash if not beyong the end of the array - copy left hash otherwise1
-        if (pos*2+1 < CalcTreeWidth(height-1))
-            right = CalcHash(height-1, pos*2+1, vTxid);
-        else
-            right = left;
-        // combine subhashes
-        return Hash(BEGIN(left), END(left), BEGIN(right), END(right));
     }
+    // calculate the subtree one level at a time, hashing all pairs of a level in
+    // one batch; past the end of the array, the last hash of a level is paired
+    // with itself
+    unsigned int nBegin = pos << height;
+    unsigned int nEnd = std::min((pos + 1) << height, nTransactions);
+    std::vector<uint256> vLevel(vTxid.begin() + nBegin, vTxid.begin() + nEnd), vNext;
+    for (int h = 0; h < height; h++) {
+        if (vLevel.size() & 1)
+            vLevel.push_back(vLevel.back());
+        vNext.resize(vLevel.size() / 2);
+        SHA256D64(vNext[0].begin(), vLevel[0].begin(), vNext.size());
+        vLevel.swap(vNext);
+    }
+    return vLevel[0];
 }
 
 void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) {
@@ -3245,7 +3884,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage() <= nCoinCacheUsage) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -3372,7 +4011,7 @@ bool InitBlockIndex() {
                 return error("LoadBlockIndex() : FindBlockPos failed");
             if (!block.WriteToDisk(blockPos))
                 return error("LoadBlockIndex() : writing genesis block to disk failed");
-            if (!block.AddToBlockIndex(state, blockPos))
+            if (!block.AddToBlockIndex(state, blockPos, hash))
                 return error("LoadBlockIndex() : genesis block not accepted");
             if (!WriteSyncCheckpoint(hashGenesisBlock))
                 return error("LoadBlockIndex() : failed to init sync checkpoint");
@@ -3643,6 +4282,19 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+// Salts of the deterministic choices of addr relay peers and of trickled
+// transactions; set once before the message handler threads start
+static uint256 hashAddrRelaySalt;
+static uint256 hashTrickleSalt;
+
+void InitRelaySalts()
+{
+    hashAddrRelaySalt = GetRandHash();
+    hashTrickleSalt = GetRandHash();
+}
+
+// Blocks this close to the tip are kept in the relay cache when served
+static const int MAX_CACHED_BLOCK_DEPTH = 6;
 
 void static ProcessGetData(CNode* pfrom)
 {
@@ -3689,13 +4341,30 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        // New blocks are asked for by most nodes at about
+                        // the same time, they share one message
+                        CSharedMessage msg = relayCache.Find(inv);
+                        if (!msg)
+                        {
+                            // Send block from disk
+                            msg = ReadBlockMessage((*mi).second);
+                            // Old blocks are asked for by one syncing node at
+                            // a time, they would only push out what is relayed
+                            if (msg && (*mi).second->nHeight > nBestHeight - MAX_CACHED_BLOCK_DEPTH)
+                                relayCache.Add(inv, msg);
+                        }
+                        if (msg)
+                            pfrom->PushMessage(msg);
+                        else
+                            vNotFound.push_back(inv);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from disk
+                        CBlock block;
+                        block.ReadFromDisk((*mi).second);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3733,13 +4402,10 @@ void static ProcessGetData(CNode* pfrom)
             {
                 // Send stream from relay memory
                 bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
+                CSharedMessage msg = relayCache.Find(inv);
+                if (msg) {
+                    pfrom->PushMessage(msg);
+                    pushed = true;
                 }
                 if (!pushed && inv.type == MSG_TX) {
                     LOCK(mempool.cs);
@@ -3748,6 +4414,8 @@ void static ProcessGetData(CNode* pfrom)
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
                         ss << tx;
+                        // not cached, so a peer asking for the whole mempool
+                        // can't push the transactions we relayed out of the cache
                         pfrom->PushMessage("tx", ss);
                         pushed = true;
                     }
@@ -3965,11 +4633,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
                     uint64 hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
+                    uint256 hashRand = hashAddrRelaySalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     multimap<uint256, CNode*> mapMix;
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -4148,7 +4813,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
         CTransaction tx;
 
         //masternode signed transaction
@@ -4163,34 +4827,38 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             //these allow masternodes to publish a limited amount of free transactions
             vRecv >> tx >> vin >> vchSig >> sigTime;
 
-            BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-                if(mn.vin == vin) {
-                    if(!mn.allowFreeTx){
-                        //multiple peers can send us a valid masternode transaction
-                        if(fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString().c_str());
-                        return true;
-                    }
+            WRITE_LOCK(darkSendMasterNodes.cs);
+            int i = darkSendMasterNodes.Find(vin);
+            if(i >= 0) {
+                CMasterNode& mn = darkSendMasterNodes[i];
+                if(!mn.allowFreeTx){
+                    //multiple peers can send us a valid masternode transaction
+                    if(fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString().c_str());
+                    return true;
+                }
 
-                    std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime); 
+                std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime); 
 
-                    std::string errorMessage = "";
-                    if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
-                        LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString().c_str());
-                        //pfrom->Misbehaving(20);
-                        return false;
-                    }
+                std::string errorMessage = "";
+                if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
+                    LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString().c_str());
+                    //pfrom->Misbehaving(20);
+                    return false;
+                }
 
-                    LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString().c_str());
+                LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString().c_str());
 
-                    allowFree = true;
-                    mn.allowFreeTx = false;
-                }
+                allowFree = true;
+                mn.allowFreeTx = false;
             }
         }
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // tx and dstx are dispatched without cs_main, so that the script
+        // checks in AcceptToMemoryPool run without it; the orphan pool and
+        // mapAlreadyAskedFor are still guarded by cs_main
         bool fMissingInputs = false;
         CValidationState state;
         if (tx.AcceptToMemoryPool(state, true, true, &fMissingInputs, allowFree))
@@ -4198,37 +4866,47 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if(strCommand == "tx") RelayTransaction(tx, inv.hash);
             else if(strCommand == "dstx") RelayDarkSendTransaction(tx, vin, vchSig, sigTime);
 
-            mapAlreadyAskedFor.erase(inv);
+            {
+                LOCK(cs_main);
+                mapAlreadyAskedFor.erase(inv);
+            }
             vWorkQueue.push_back(inv.hash);
             vEraseQueue.push_back(inv.hash);
 
             LogPrintf("AcceptToMemoryPool: %s %s : accepted %s (poolsz %"PRIszu")\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
-                tx.GetHash().ToString().c_str(),
+                inv.hash.ToString().c_str(),
                 mempool.mapTx.size());
 
             // Recursively process any orphan transactions that depended on this one
             for (unsigned int i = 0; i < vWorkQueue.size(); i++)
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
+                // copied out, to be checked without cs_main
+                vector<CTransaction> vOrphans;
+                {
+                    LOCK(cs_main);
+                    const set<uint256>& setOrphans = mapOrphanTransactionsByPrev[vWorkQueue[i]];
+                    for (set<uint256>::const_iterator mi = setOrphans.begin(); mi != setOrphans.end(); ++mi)
+                        vOrphans.push_back(mapOrphanTransactions[*mi]);
+                }
+                BOOST_FOREACH(CTransaction& orphanTx, vOrphans)
                 {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash];
+                    uint256 orphanHash = orphanTx.GetHash();
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
                     // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
                     // anyone relaying LegitTxX banned)
                     CValidationState stateDummy;
 
-                    if (tx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
+                    if (orphanTx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
                     {
                         LogPrintf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
                         RelayTransaction(orphanTx, orphanHash);
 
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
+                        {
+                            LOCK(cs_main);
+                            mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
+                        }
                         vWorkQueue.push_back(orphanHash);
                         vEraseQueue.push_back(orphanHash);
                     }
@@ -4241,11 +4919,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 }
             }
 
+            LOCK(cs_main);
             BOOST_FOREACH(uint256 hash, vEraseQueue)
                 EraseOrphanTx(hash);
         }
         else if (fMissingInputs)
         {
+            LOCK(cs_main);
             AddOrphanTx(tx);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
@@ -4256,7 +4936,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
         {
-            LogPrintf("%s from %s %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
+            LogPrintf("%s from %s %s was not accepted into the memory pool\n", inv.hash.ToString().c_str(),
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
             if (nDoS > 0)
                 pfrom->Misbehaving(nDoS);
@@ -4266,18 +4946,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
+        uint64 nHashesStart = GetHash9Count();
         CBlock block;
         vRecv >> block;
 
-        LogPrintf("received block %s peer=%d\n", block.GetHash().ToString().c_str(), pfrom->id);
+        CInv inv(MSG_BLOCK, block.GetHash());
+        LogPrintf("received block %s peer=%d\n", inv.hash.ToString().c_str(), pfrom->id);
         // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
 
         CValidationState state;
         if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
             mapAlreadyAskedFor.erase(inv);
+        if (fBenchmark)
+            LogPrintf("- X11: %"PRI64u" hashes for block %s\n", GetHash9Count() - nHashesStart, inv.hash.ToString().c_str());
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
             if (nDoS > 0)
@@ -4286,7 +4969,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addr);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4460,6 +5146,80 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Messages whose handlers touch neither the block chain and coins nor the
+// wallets run without cs_main, so that a slow block or masternode check
+// doesn't hold them up; their handlers lock what they use themselves. dsee
+// and dsq verify their signatures first and only then take cs_main; tx and
+// dstx take it in CTxMemPool::accept for the input lookup and the insert, but
+// not for the script checks in between. With
+// several message handler threads they also run alongside the messages of
+// other nodes, so anything they share with those has to be locked too.
+// Commands not listed here are processed with cs_main held. "checkpoint"
+// must stay off the list: ProcessSyncCheckpoint reads the block index and
+// may switch the best chain.
+bool MessageNeedsChainLock(const string& strCommand)
+{
+    static const char* const ppszNoChainLock[] = {
+        "verack", "misbehave", "addr", "getaddr", "ping", "mempool",
+        "filterload", "filteradd", "filterclear", "dsee", "dseep", "dsq",
+        "tx", "dstx"
+    };
+    for (unsigned int i = 0; i < sizeof(ppszNoChainLock)/sizeof(ppszNoChainLock[0]); i++)
+        if (strCommand == ppszNoChainLock[i])
+            return false;
+    return true;
+}
+
+static CCriticalSection cs_mapMessageLockStats;
+static map<string, CMessageLockStats> mapMessageLockStats;
+
+static void RecordMessageLockStats(const string& strCommand, bool fChainLock, int64 nWaitMicros, int64 nHoldMicros)
+{
+    LOCK(cs_mapMessageLockStats);
+    // Peers choose the command names; don't let them grow the map
+    map<string, CMessageLockStats>::iterator mi = mapMessageLockStats.find(strCommand);
+    if (mi == mapMessageLockStats.end())
+        mi = mapMessageLockStats.insert(make_pair(mapMessageLockStats.size() < 64 ? strCommand : string("other"), CMessageLockStats())).first;
+    CMessageLockStats& stats = mi->second;
+    stats.fChainLock = fChainLock;
+    stats.nCount++;
+    stats.nWaitMicros += nWaitMicros;
+    stats.nHoldMicros += nHoldMicros;
+    stats.nMaxHoldMicros = std::max(stats.nMaxHoldMicros, nHoldMicros);
+}
+
+void GetMessageLockStats(map<string, CMessageLockStats>& mapStats)
+{
+    LOCK(cs_mapMessageLockStats);
+    mapStats = mapMessageLockStats;
+}
+
+void CheckMessageSignatures(const std::vector<CNode*>& vNodes)
+{
+    if (nScriptCheckThreads == 0)
+        return;
+
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->fDisconnect)
+            continue;
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv)
+            continue;
+        BOOST_FOREACH(CNetMessage& msg, pnode->vRecvMsg)
+        {
+            if (!msg.complete())
+                break;
+            if (msg.fSigQueued)
+                continue;
+            msg.fSigQueued = true;
+            darkSendSignatureQueue.AddMessage(pnode->nVersion, msg.hdr.GetCommand(), msg.vRecv);
+        }
+    }
+
+    darkSendSignatureQueue.Verify();
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -4480,7 +5240,10 @@ bool ProcessMessages(CNode* pfrom)
     GetMessageStart(pchMessageStart);
 
     if (!pfrom->vRecvGetData.empty())
+    {
+        LOCK(cs_main);
         ProcessGetData(pfrom);
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -4541,10 +5304,23 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            bool fChainLock = MessageNeedsChainLock(strCommand);
+            int64 nTimeStart = GetTimeMicros();
+            int64 nTimeLocked = nTimeStart;
+            int64 nTimeDone;
+            if (fChainLock)
             {
                 LOCK(cs_main);
+                nTimeLocked = GetTimeMicros();
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
+                nTimeDone = GetTimeMicros();
             }
+            else
+            {
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+                nTimeDone = GetTimeMicros();
+            }
+            RecordMessageLockStats(strCommand, fChainLock, nTimeLocked - nTimeStart, nTimeDone - nTimeLocked);
             boost::this_thread::interruption_point();
         }
         catch (std::ios_base::failure& e)
@@ -4581,7 +5357,15 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
+    {
+        pfrom->nRecvQueued -= it - pfrom->vRecvMsg.begin();
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
+
+    // The socket handler stopped reading at the flood limit, and has to
+    // be told that there may be room again
+    if (pfrom->fRecvThrottled)
+        WakeupSocketHandler();
 
     return fOk;
 }
@@ -4634,7 +5418,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_addr);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -4653,6 +5440,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_addr);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -4693,10 +5481,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
                     // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
+                    uint256 hashRand = inv.hash ^ hashTrickleSalt;
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     bool fTrickleWait = ((hashRand & 3) != 0);
 
@@ -4799,52 +5584,25 @@ static const unsigned int pSHA256InitState[8] =
 
 void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 {
-    SHA256_CTX ctx;
+    uint32_t state[8];
     unsigned char data[64];
 
-    SHA256_Init(&ctx);
-
     for (int i = 0; i < 16; i++)
         ((uint32_t*)data)[i] = ByteReverse(((uint32_t*)pinput)[i]);
 
     for (int i = 0; i < 8; i++)
-        ctx.h[i] = ((uint32_t*)pinit)[i];
+        state[i] = ((uint32_t*)pinit)[i];
 
-    SHA256_Update(&ctx, data, sizeof(data));
+    SHA256Compress(state, data);
     for (int i = 0; i < 8; i++)
-        ((uint32_t*)pstate)[i] = ctx.h[i];
+        ((uint32_t*)pstate)[i] = state[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-
-    void print() const
-    {
-        LogPrintf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            LogPrintf("   setDependsOn %s\n", hash.ToString().c_str());
-    }
-};
-
-
 uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -4898,6 +5656,17 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         }
     }
     
+    // Fallback payee in case no winner was voted for this block. Picked
+    // before taking mempool.cs, which is ordered after the masternode list.
+    CScript payeeCurrent;
+    if(bMasterNodePayment) {
+        int nWinner = GetCurrentMasterNode(1);
+        READ_LOCK(darkSendMasterNodes.cs);
+        int winningNode = darkSendMasterNodes.FindById(nWinner);
+        if(winningNode >= 0)
+            payeeCurrent.SetDestination(darkSendMasterNodes[winningNode].pubkey.GetID());
+    }
+
     int64 nFees = 0;
     {
         LOCK2(cs_main, mempool.cs);
@@ -4909,9 +5678,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             //spork
             if(!masternodePayments.GetBlockPayee(pindexPrev->nHeight+1, pblock->payee)){
                 //no masternode detected
-                int winningNode = GetCurrentMasterNode(1);
-                if(winningNode >= 0){
-                    pblock->payee.SetDestination(darkSendMasterNodes[winningNode].pubkey.GetID());
+                if(!payeeCurrent.empty()){
+                    pblock->payee = payeeCurrent;
                 } else { 
                     LogPrintf("CreateNewBlock: Failed to detect masternode to pay\n");
                     hasPayment = false;
@@ -4957,82 +5725,14 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 
         // Collect memory pool transactions into the block
         {
-            // Priority order to process transactions
-            list<COrphan> vOrphan; // list memory doesn't move
-            map<uint256, vector<COrphan*> > mapDependers;
+            // The pool keeps its transactions indexed by priority and by fee
+            // rate, so walk the index for the current sort order from the
+            // top. A transaction spending outputs of other pool transactions
+            // is held back until those are all in the block, and then
+            // competes with the index from vecReady.
             bool fPrintPriority = GetBoolArg("-printpriority");
-
-            // This vector will be sorted into a priority queue:
-            vector<TxPriority> vecPriority;
-            vecPriority.reserve(mempool.mapTx.size());
-            for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-            {
-                CTransaction& tx = (*mi).second;
-                if (tx.IsCoinBase() || !tx.IsFinal())
-                    continue;
-
-                COrphan* porphan = NULL;
-                double dPriority = 0;
-                int64 nTotalIn = 0;
-                bool fMissingInputs = false;
-                BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                {
-                    // Read prev transaction
-                    if (!view.HaveCoins(txin.prevout.hash))
-                    {
-                        // This should never happen; all transactions in the memory
-                        // pool should connect to either transactions in the chain
-                        // or other transactions in the memory pool.
-                        if (!mempool.mapTx.count(txin.prevout.hash))
-                        {
-                            LogPrintf("ERROR: mempool transaction missing input %s\n", txin.prevout.hash.ToString().c_str());
-                            if (!fTestNet && fDebug) assert("mempool transaction missing input" == 0);
-                            fMissingInputs = true;
-                            if (porphan)
-                                vOrphan.pop_back();
-                            break;
-                        }
-
-                        // Has to wait for dependencies
-                        if (!porphan)
-                        {
-                            // Use list for automatic deletion
-                            vOrphan.push_back(COrphan(&tx));
-                            porphan = &vOrphan.back();
-                        }
-                        mapDependers[txin.prevout.hash].push_back(porphan);
-                        porphan->setDependsOn.insert(txin.prevout.hash);
-                        nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                        continue;
-                    }
-                    const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                    int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                    nTotalIn += nValueIn;
-
-                    int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                    dPriority += (double)nValueIn * nConf;
-                }
-                if (fMissingInputs) continue;
-
-                // Priority is sum(valuein * age) / txsize
-                unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-                dPriority /= nTxSize;
-
-                // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-                // client code rounds up the size to the nearest 1K. That's good, because it gives an
-                // incentive to create smaller transactions.
-                double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-                if (porphan)
-                {
-                    porphan->dPriority = dPriority;
-                    porphan->dFeePerKb = dFeePerKb;
-                }
-                else
-                    vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-            }
+            int nHeight = pindexPrev->nHeight;
+            mempool.SetPriorityHeight(nHeight);
 
             // Collect transactions into block
             uint64 nBlockSize = 1000;
@@ -5041,23 +5741,66 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             bool fSortedByFee = (nBlockPrioritySize <= 0);
 
             TxPriorityCompare comparer(fSortedByFee);
-            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            const set<pair<double, uint256> >* psetIndex = fSortedByFee ? &mempool.setByFeeRate : &mempool.setByPriority;
+            set<pair<double, uint256> >::const_reverse_iterator itIndex = psetIndex->rbegin();
 
-            // Create coinbase tx
-            CTransaction txMerged;
+            set<uint256> setDone;       // taken off the index or vecReady
+            set<uint256> setInBlock;
+            vector<TxPriority> vecReady; // heap of released dependers
+            map<uint256, vector<uint256> > mapDependers;
+            map<uint256, int> mapWaitingFor;
 
-            while (!vecPriority.empty())
+            while (true)
             {
-                // Take highest priority transaction off the priority queue:
-                double dPriority = vecPriority.front().get<0>();
-                double dFeePerKb = vecPriority.front().get<1>();
-                CTransaction& tx = *(vecPriority.front().get<2>());
+                while (itIndex != psetIndex->rend() && setDone.count(itIndex->second))
+                    ++itIndex;
+                if (itIndex == psetIndex->rend() && vecReady.empty())
+                    break;
 
-                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                vecPriority.pop_back();
+                // Take the better of the index head and the top of vecReady
+                TxPriority next;
+                if (itIndex != psetIndex->rend())
+                {
+                    const CTxMemPoolEntry& entry = mempool.mapTx[itIndex->second];
+                    next = TxPriority(entry.GetPriority(nHeight), entry.GetFeePerKb(), &entry);
+                }
+                if (itIndex == psetIndex->rend() || (!vecReady.empty() && comparer(next, vecReady.front())))
+                {
+                    next = vecReady.front();
+                    std::pop_heap(vecReady.begin(), vecReady.end(), comparer);
+                    vecReady.pop_back();
+                }
+                else
+                    ++itIndex;
+
+                double dPriority = next.get<0>();
+                double dFeePerKb = next.get<1>();
+                const CTxMemPoolEntry& entry = *next.get<2>();
+                const CTransaction& tx = entry.tx;
+                uint256 hash = tx.GetHash();
+                if (!setDone.insert(hash).second)
+                    continue;
+
+                // Has to wait for dependencies
+                int nWaitingFor = 0;
+                BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+                {
+                    if (setInBlock.count(hashParent))
+                        continue;
+                    mapDependers[hashParent].push_back(hash);
+                    nWaitingFor++;
+                }
+                if (nWaitingFor > 0)
+                {
+                    mapWaitingFor[hash] = nWaitingFor;
+                    continue;
+                }
+
+                if (!tx.IsFinal())
+                    continue;
 
                 // Size limits
-                unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+                unsigned int nTxSize = entry.nTxSize;
                 if (nBlockSize + nTxSize >= nBlockMaxSize)
                     continue;
 
@@ -5066,9 +5809,14 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                     continue;
 
-                // Skip free transactions if we're past the minimum block size:
+                // Skip free transactions if we're past the minimum block size;
+                // everything after this one pays less, so stop there.
                 if (fSortedByFee && (dFeePerKb < CTransaction::nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+                {
+                    if (nBlockSize >= nBlockMinSize)
+                        break;
                     continue;
+                }
 
                 // Prioritize by fee once past the priority size or we run out of high-priority
                 // transactions:
@@ -5077,7 +5825,9 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 {
                     fSortedByFee = true;
                     comparer = TxPriorityCompare(fSortedByFee);
-                    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                    std::make_heap(vecReady.begin(), vecReady.end(), comparer);
+                    psetIndex = &mempool.setByFeeRate;
+                    itIndex = psetIndex->rbegin();
                 }
 
                 if (!tx.HaveInputs(view))
@@ -5094,11 +5844,11 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                     continue;
 
                 CTxUndo txundo;
-                uint256 hash = tx.GetHash();
                 tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
 
                 // Added
                 pblock->vtx.push_back(tx);
+                setInBlock.insert(hash);
 
                 //* END MERGE *//
                 pblocktemplate->vTxFees.push_back(nTxFees);
@@ -5111,22 +5861,21 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 if (fPrintPriority)
                 {
                     LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                           dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
+                           dPriority, dFeePerKb, hash.ToString().c_str());
                 }
 
-                // Add transactions that depend on this one to the priority queue
-                if (mapDependers.count(hash))
+                // Release transactions that were waiting for this one
+                map<uint256, vector<uint256> >::iterator mi = mapDependers.find(hash);
+                if (mi != mapDependers.end())
                 {
-                    BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                    BOOST_FOREACH(const uint256& hashDepender, mi->second)
                     {
-                        if (!porphan->setDependsOn.empty())
+                        if (--mapWaitingFor[hashDepender] == 0)
                         {
-                            porphan->setDependsOn.erase(hash);
-                            if (porphan->setDependsOn.empty())
-                            {
-                                vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                            }
+                            const CTxMemPoolEntry& depender = mempool.mapTx[hashDepender];
+                            setDone.erase(hashDepender);
+                            vecReady.push_back(TxPriority(depender.GetPriority(nHeight), depender.GetFeePerKb(), &depender));
+                            std::push_heap(vecReady.begin(), vecReady.end(), comparer);
                         }
                     }
                 }
@@ -5172,6 +5921,37 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 }
 
 
+void NotifyTemplateChange()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csTemplateChange);
+        nTemplateNotifies++;
+    }
+    cvTemplateChange.notify_all();
+}
+
+unsigned int GetTemplateNotifyCount()
+{
+    boost::unique_lock<boost::mutex> lock(csTemplateChange);
+    return nTemplateNotifies;
+}
+
+// The best chain is protected by cs_main, which callers of
+// NotifyTemplateChange() may hold, so it can't be read here. Every new tip
+// is followed by a notification; the waiter watches the count of those
+// instead.
+void WaitForTemplateChange(unsigned int nNotifyCountSeen, int64 nTimeLimit)
+{
+    boost::unique_lock<boost::mutex> lock(csTemplateChange);
+    while (nTemplateNotifies == nNotifyCountSeen && !ShutdownRequested())
+    {
+        int64 nWait = nTimeLimit - GetTime();
+        if (nWait <= 0)
+            break;
+        cvTemplateChange.timed_wait(lock, boost::posix_time::seconds(nWait));
+    }
+}
+
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey)
 {
     CPubKey pubkey;
@@ -5322,6 +6102,11 @@ void static DarkCoinMiner(CWallet *pwallet)
 
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
+        // Only nTime and nNonce change while scanning this block, so the
+        // X11 midstate of the first 64 header bytes is computed once
+        const unsigned char* pheader = (const unsigned char*)BEGIN(pblock->nVersion);
+        CHash9Midstate x11midstate(pheader);
+
         unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
         unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
         //unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
@@ -5336,20 +6121,30 @@ void static DarkCoinMiner(CWallet *pwallet)
         {
             unsigned int nHashesDone = 0;
 
-            uint256 thash;
+            // Scan Hash9Lanes() nonces per pass through the multi-buffer engine
+            std::vector<uint256> vHash(Hash9Lanes());
+            bool fFound = false;
             loop
             {
-                thash = pblock->GetHash();
-                if (thash <= hashTarget)
+                x11midstate.Hashes(pheader, pblock->nNonce, &vHash[0], vHash.size());
+
+                for (unsigned int i = 0; i < vHash.size(); i++)
                 {
-                    // Found a solution
-                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwallet, reservekey);
-                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                    break;
+                    if (vHash[i] <= hashTarget)
+                    {
+                        // Found a solution
+                        pblock->nNonce += i;
+                        SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                        CheckWork(pblock, *pwallet, reservekey);
+                        SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                        fFound = true;
+                        break;
+                    }
                 }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
+                if (fFound)
+                    break;
+                pblock->nNonce += vHash.size();
+                nHashesDone += vHash.size();
                 if ((pblock->nNonce & 0xFF) == 0)
                     break;
             }
@@ -5385,6 +6180,11 @@ void static DarkCoinMiner(CWallet *pwallet)
 
             // Check for stop or if block needs to be rebuilt
             boost::this_thread::interruption_point();
+            // After a solution the nonce is off the Hash9Lanes() boundary the
+            // scan loop stops at, and CheckWork may have rejected it with the
+            // same tip; start again from a fresh block
+            if (fFound)
+                break;
             if (vNodes.empty())
                 break;
             if (pblock->nNonce >= 0xffff0000)
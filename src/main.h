@@ -15,6 +15,7 @@
 #include "base58.h"
 
 #include <list>
+#include <deque>
 #include <algorithm>
 #include <boost/lexical_cast.hpp>
 
@@ -105,7 +106,7 @@ extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern int nAskedForBlocks;    // Nodes sent a getblocks 0
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern CWallet pmainWallet;
 extern std::map<uint256, CBlock*> mapOrphanBlocks;
 
@@ -127,6 +128,7 @@ class CCoinsView;
 class CCoinsViewCache;
 class CScriptCheck;
 class CValidationState;
+class CCheckQueuePool;
 
 struct CBlockTemplate;
 
@@ -144,6 +146,9 @@ bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+/** Read a block from disk as a "block" message, without deserializing it
+ *  unless its framing is unexpected. Empty if it can't be read. */
+CSharedMessage ReadBlockMessage(const CBlockIndex* pindex);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
@@ -160,9 +165,31 @@ void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Verify the signatures of the masternode messages received from the given nodes together */
+void CheckMessageSignatures(const std::vector<CNode*>& vNodes);
+/** Time spent processing one kind of protocol message */
+struct CMessageLockStats
+{
+    bool fChainLock;        // processed with cs_main held
+    uint64 nCount;
+    int64 nWaitMicros;      // waiting for cs_main
+    int64 nHoldMicros;      // processing
+    int64 nMaxHoldMicros;
+
+    CMessageLockStats() : fChainLock(false), nCount(0), nWaitMicros(0), nHoldMicros(0), nMaxHoldMicros(0) {}
+};
+/** Whether a protocol message command is processed with cs_main held */
+bool MessageNeedsChainLock(const std::string& strCommand);
+/** Get the processing statistics of each protocol message command */
+void GetMessageLockStats(std::map<std::string, CMessageLockStats>& mapStats);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
-/** Run an instance of the script checking thread */
+/** Pick the random salts of addr and transaction relay, before the message handlers start */
+void InitRelaySalts();
+/** Get the worker pool shared by the script, transaction, coin prefetch and
+ *  message signature check queues */
+CCheckQueuePool& GetCheckQueuePool();
+/** Run an instance of the script checking thread, which serves all queues of the pool */
 void ThreadScriptCheck();
 //** Get age of an input */
 int GetInputAge(CTxIn& vin);
@@ -173,6 +200,13 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
+/** Wake the threads in WaitForTemplateChange(); call after the best chain changed, or at shutdown */
+void NotifyTemplateChange();
+/** Get the number of NotifyTemplateChange() calls so far */
+unsigned int GetTemplateNotifyCount();
+/** Block until NotifyTemplateChange() is called after the caller got nNotifyCountSeen from
+ *  GetTemplateNotifyCount(), or until shutdown or nTimeLimit (unix time) */
+void WaitForTemplateChange(unsigned int nNotifyCountSeen, int64 nTimeLimit);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Do mining precalculation */
@@ -705,6 +739,17 @@ public:
  *              * 8c988f1a4a4de2161e0f50aac7f17e7f9555caa4: address uint160
  *  - height = 120891
  */
+/** Memory taken by a heap allocation of nAlloc bytes, including the allocator's
+ *  overhead (one size word, rounded up to 16 bytes as glibc does) */
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
 class CCoins
 {
 public:
@@ -742,6 +787,14 @@ public:
         std::swap(to.nVersion, nVersion);
     }
 
+    // heap memory used by the outputs and their scripts, in bytes
+    size_t DynamicMemoryUsage() const {
+        size_t nUsage = MallocUsage(vout.capacity() * sizeof(CTxOut));
+        BOOST_FOREACH(const CTxOut &out, vout)
+            nUsage += MallocUsage(out.scriptPubKey.capacity());
+        return nUsage;
+    }
+
     // equality test
     friend bool operator==(const CCoins &a, const CCoins &b) {
          return a.fCoinBase == b.fCoinBase &&
@@ -913,21 +966,27 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    bool *pfNonCanonical;
 
 public:
-    CScriptCheck() {}
+    CScriptCheck() : pfNonCanonical(NULL) {}
     CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pfNonCanonical(NULL) { }
 
     bool operator()() const;
 
+    // On a failure under SCRIPT_VERIFY_STRICTENC, set *pfNonCanonicalIn to
+    // whether the script passes without it. Only written by the check itself.
+    void SetNonCanonicalResult(bool *pfNonCanonicalIn) { pfNonCanonical = pfNonCanonicalIn; }
+
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
         std::swap(ptxTo, check.ptxTo);
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        std::swap(pfNonCanonical, check.pfNonCanonical);
     }
 };
 
@@ -1206,8 +1265,13 @@ public:
         return (nBits == 0);
     }
 
+    // X11 of the header, computed on every call; callers that need it more
+    // than once keep it
     uint256 GetHash() const;
 
+    // Hash a batch of headers with the multi-buffer X11 engine
+    static void GetHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashRet);
+
     int64 GetBlockTime() const
     {
         return (int64)nTime;
@@ -1273,15 +1337,24 @@ public:
         vMerkleTree.clear();
         BOOST_FOREACH(const CTransaction& tx, vtx)
             vMerkleTree.push_back(tx.GetHash());
+        return BuildMerkleTreeBranches();
+    }
+
+    // Build the rest of the merkle tree on top of the transaction hashes,
+    // which must be the only entries of vMerkleTree
+    uint256 BuildMerkleTreeBranches() const
+    {
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
+            // The pairs of a level lie next to each other, so they are hashed
+            // in one batch; an odd last entry is paired with itself.
+            int nPairs = nSize / 2;
+            vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+            SHA256D64(vMerkleTree[j+nSize].begin(), vMerkleTree[j].begin(), nPairs);
+            if (nSize & 1)
+                vMerkleTree[j+nSize+nPairs] = Hash(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                                   BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
             j += nSize;
         }
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
@@ -1413,15 +1486,16 @@ public:
     // Read a block from disk
     bool ReadFromDisk(const CBlockIndex* pindex);
 
-    // Add this block to the block index, and if necessary, switch the active block chain to this
-    bool AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos);
+    // Add this block to the block index, and if necessary, switch the active block chain to this.
+    // hash is GetHash(), which the callers already have
+    bool AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos, const uint256 &hash);
 
     // Context-independent validity checks
     bool CheckBlock(CValidationState &state, bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckVotes=true) const;
 
     // Store block on disk
-    // if dbp is provided, the file is known to already reside on disk
-    bool AcceptBlock(CValidationState &state, CDiskBlockPos *dbp = NULL);
+    // if dbp is provided, the file is known to already reside on disk; hash is GetHash()
+    bool AcceptBlock(CValidationState &state, const uint256 &hash, CDiskBlockPos *dbp = NULL);
 
     
     bool MasterNodePaymentsOn() const
@@ -1779,7 +1853,7 @@ public:
         READWRITE(nNonce);
     )
 
-    uint256 GetBlockHash() const
+    CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
         block.nVersion        = nVersion;
@@ -1788,7 +1862,12 @@ public:
         block.nTime           = nTime;
         block.nBits           = nBits;
         block.nNonce          = nNonce;
-        return block.GetHash();
+        return block;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        return GetBlockHeader().GetHash();
     }
 
 
@@ -2000,13 +2079,82 @@ public:
 
 
 
+/** A transaction in the memory pool, together with what block template
+ * assembly needs to know about it: fee, size and the confirmed inputs its
+ * priority grows with. Filled in when the transaction enters the pool and
+ * again whenever one of the pool transactions it spends comes or goes.
+ */
+class CTxMemPoolEntry
+{
+public:
+    CTransaction tx;
+    int64 nFee;                     // value in minus value out
+    unsigned int nTxSize;           // serialized size
+    int64 nValueInChain;            // value of the inputs confirmed in the chain
+    double dPriority;               // priority at nHeight
+    int nHeight;                    // best height when dPriority was computed
+    bool fMissingInputs;            // an input is neither in the chain nor in the pool
+    std::set<uint256> setParents;   // pool transactions this one spends
+
+    CTxMemPoolEntry()
+    {
+        nFee = 0;
+        nTxSize = 0;
+        nValueInChain = 0;
+        dPriority = 0;
+        nHeight = 0;
+        fMissingInputs = false;
+    }
+
+    explicit CTxMemPoolEntry(const CTransaction& txIn) : tx(txIn)
+    {
+        nFee = 0;
+        nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        nValueInChain = 0;
+        dPriority = 0;
+        nHeight = 0;
+        fMissingInputs = false;
+    }
+
+    // Priority is sum(valuein * age) / txsize; every confirmed input ages by
+    // one block per block, inputs from the pool count for nothing.
+    double GetPriority(int nAtHeight) const
+    {
+        return dPriority + (double)nValueInChain * (nAtHeight - nHeight) / nTxSize;
+    }
+
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions.
+    double GetFeePerKb() const
+    {
+        return double(nFee) / (double(nTxSize) / 1000.0);
+    }
+
+    // Whether block template assembly can consider it at all
+    bool IsMineable() const
+    {
+        return !fMissingInputs && !tx.IsCoinBase();
+    }
+};
+
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+    // Indexes of the mineable entries of mapTx by fee rate and by priority,
+    // kept up to date on add and remove. Priority grows with the height, so
+    // the priority keys are for nPriorityHeight and are recomputed once per
+    // height by SetPriorityHeight().
+    std::set<std::pair<double, uint256> > setByFeeRate;
+    std::set<std::pair<double, uint256> > setByPriority;
+    int nPriorityHeight;
+
+    CTxMemPool() : nPriorityHeight(0) {}
+
     bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool ignoreFees=false);
     bool acceptable(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool fScriptChecks=true);
     bool acceptableInputs(CValidationState &state, CTransaction &tx, bool fLimitFree);
@@ -2017,6 +2165,7 @@ public:
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     bool getTransactionFees(CTransaction& tx, int64& nFees);
+    void SetPriorityHeight(int nHeight);
 
     unsigned long size()
     {
@@ -2031,8 +2180,14 @@ public:
 
     CTransaction& lookup(uint256 hash)
     {
-        return mapTx[hash];
+        return mapTx[hash].tx;
     }
+
+private:
+    void IndexEntry(const uint256& hash, const CTxMemPoolEntry& entry);
+    void UnindexEntry(const uint256& hash, const CTxMemPoolEntry& entry);
+    void UpdateEntry(const uint256& hash);
+    void UpdateSpenders(const uint256& hash);
 };
 
 extern CTxMemPool mempool;
@@ -2050,6 +2205,88 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+/** An entry of a coins cache: the coins of one txid, and how they relate
+ *  to the view below the cache */
+struct CCoinsCacheEntry
+{
+    enum
+    {
+        DIRTY   = (1 << 0), // differs from the view below, must be written back
+        FRESH   = (1 << 1), // the view below has no unspent version; once pruned it needn't be written at all
+        USED    = (1 << 2), // the entry is in use (CCoinsMap)
+        RECOUNT = (1 << 3), // handed out for modification, memory usage is to be recounted
+    };
+
+    uint256 txid;
+    CCoins coins;
+    unsigned char flags;
+    size_t nUsage; // coins.DynamicMemoryUsage() when last counted
+
+    CCoinsCacheEntry() : flags(0), nUsage(0) { }
+};
+
+/** Hash table of coins cache entries by txid. Open addressing with linear
+ *  probing over a flat array of slots, each holding 32 bits of the hash and
+ *  the index of the entry; the entries themselves live in a deque, so
+ *  references to them stay valid while the table grows. Hashes are salted,
+ *  so peers can't line txids up on one probe chain.
+ */
+class CCoinsMap
+{
+private:
+    struct Slot
+    {
+        uint32_t nHash;
+        uint32_t nIndex;
+    };
+    static const uint32_t nEmpty = 0xffffffff;
+
+    std::vector<Slot> vSlots; // size is zero or a power of two
+    std::deque<CCoinsCacheEntry> vEntries;
+    std::vector<uint32_t> vFree; // unused indexes in vEntries
+    size_t nCount;
+
+    uint32_t Hash(const uint256 &txid) const;
+    void Rehash(size_t nSlots);
+
+public:
+    class iterator
+    {
+    private:
+        std::deque<CCoinsCacheEntry>::iterator it, itEnd;
+        void Skip() {
+            while (it != itEnd && !(it->flags & CCoinsCacheEntry::USED))
+                ++it;
+        }
+    public:
+        iterator(std::deque<CCoinsCacheEntry>::iterator itIn, std::deque<CCoinsCacheEntry>::iterator itEndIn) : it(itIn), itEnd(itEndIn) { Skip(); }
+        CCoinsCacheEntry &operator*() const { return *it; }
+        CCoinsCacheEntry *operator->() const { return &*it; }
+        iterator &operator++() { ++it; Skip(); return *this; }
+        bool operator==(const iterator &other) const { return it == other.it; }
+        bool operator!=(const iterator &other) const { return it != other.it; }
+    };
+
+    CCoinsMap() : nCount(0) { }
+
+    // Return the entry for txid, or NULL
+    CCoinsCacheEntry *Find(const uint256 &txid);
+
+    // Return the entry for txid, adding an empty one (fNew set) if there is none
+    CCoinsCacheEntry *Insert(const uint256 &txid, bool &fNew);
+
+    // Remove the entry for txid. Iterators stay valid.
+    void Erase(const uint256 &txid);
+
+    void Clear();
+    size_t Size() const { return nCount; }
+    iterator begin() { return iterator(vEntries.begin(), vEntries.end()); }
+    iterator end() { return iterator(vEntries.end(), vEntries.end()); }
+
+    // Memory used by the table and its entries, not counting the heap memory of the coins
+    size_t DynamicMemoryUsage() const;
+};
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2070,8 +2307,9 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock). Only the
+    // DIRTY entries of mapCoins are written; their coins may be taken over.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -2094,19 +2332,34 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    CCoinsView &GetBackend() { return *base; }
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
-/** CCoinsView that adds a memory cache for transactions to another CCoinsView */
+/** CCoinsView that adds a memory cache for transactions to another CCoinsView.
+ *  Lookups that miss the view below are cached as well, as FRESH pruned
+ *  entries, so a transaction created later in this cache is known to be new
+ *  and is dropped rather than written back if it is spent before a flush.
+ *  A long-lived cache over the database doesn't keep misses (fCacheMisses),
+ *  as anyone can make it look up txids that don't exist; FRESH still comes
+ *  up from the caches on top of it.
+ */
 class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+    bool fCacheMisses;
+
+    // heap memory used by the cached coins, up to the entries in vRecount
+    size_t cachedCoinsUsage;
+
+    // entries handed out by reference for modification since the last count
+    std::vector<CCoinsCacheEntry*> vRecount;
 
 public:
-    CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
+    CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false, bool fCacheMissesIn = true);
 
     // Standard CCoinsView methods
     bool GetCoins(const uint256 &txid, CCoins &coins);
@@ -2114,13 +2367,24 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
+    // copying. The entry is marked to be written back, so use AccessCoins to read.
     CCoins &GetCoins(const uint256 &txid);
 
+    // Return a reference to a CCoins, for reading only. Check HaveCoins first.
+    const CCoins &AccessCoins(const uint256 &txid);
+
+    // Check whether txid is cached, without looking it up in the base
+    bool HaveCoinsInCache(const uint256 &txid);
+
+    // Cache the result of a lookup of txid in the base done elsewhere, unless
+    // txid is cached already or it is a miss this cache doesn't keep. The
+    // coins may be taken over.
+    void CacheCoins(const uint256 &txid, bool fFound, CCoins &coins);
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     bool Flush();
@@ -2128,8 +2392,14 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the memory used by the cache, in bytes
+    size_t DynamicMemoryUsage();
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsCacheEntry *FetchCoins(const uint256 &txid);
+    // FetchCoins for reading: NULL on a miss that isn't kept
+    CCoinsCacheEntry *LookupCoins(const uint256 &txid);
+    void Recount();
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
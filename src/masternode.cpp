@@ -7,7 +7,7 @@
 
 
 /** The list of active masternodes */
-std::vector<CMasterNode> darkSendMasterNodes;
+CMasternodeList darkSendMasterNodes;
 /** Object for who's going to get paid on which blocks */
 CMasternodePayments masternodePayments;
 /** Which masternodes we're asked other clients for */
@@ -15,6 +15,86 @@ std::vector<CTxIn> vecMasternodeAskedFor;
 // keep track of masternode votes I've seen
 map<uint256, int> mapSeenMasternodeVotes;
 
+int CMasternodeList::Find(const CTxIn& vin) const
+{
+    int i = Find(vin.prevout);
+    if (i >= 0 && vMasternodes[i].vin != vin)
+        return -1;
+    return i;
+}
+
+int CMasternodeList::Find(const COutPoint& outpoint) const
+{
+    boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher>::const_iterator mi = mapByOutPoint.find(outpoint);
+    return mi == mapByOutPoint.end() ? -1 : mi->second;
+}
+
+int CMasternodeList::Find(const CService& addr) const
+{
+    boost::unordered_map<CService, int, CMasternodeServiceHasher>::const_iterator mi = mapByAddr.find(addr);
+    return mi == mapByAddr.end() ? -1 : mi->second;
+}
+
+int CMasternodeList::FindById(int nId) const
+{
+    boost::unordered_map<int, int>::const_iterator mi = mapById.find(nId);
+    return mi == mapById.end() ? -1 : mi->second;
+}
+
+bool CMasternodeList::Add(const CMasterNode& mn)
+{
+    if (mapByOutPoint.count(mn.vin.prevout))
+        return false;
+
+    int i = vMasternodes.size();
+    vMasternodes.push_back(mn);
+    vMasternodes[i].nId = nNextId++;
+    mapByOutPoint.insert(make_pair(mn.vin.prevout, i));
+    mapByAddr.insert(make_pair(mn.addr, i));
+    mapById.insert(make_pair(vMasternodes[i].nId, i));
+    nGeneration++;
+    return true;
+}
+
+CMasternodeList::iterator CMasternodeList::Remove(iterator it)
+{
+    // Removals are rare (expired or spent entries), so keep the arrival
+    // order and rebuild the indexes rather than swapping entries around
+    int i = it - vMasternodes.begin();
+    vMasternodes.erase(it);
+    Reindex();
+    nGeneration++;
+    return vMasternodes.begin() + i;
+}
+
+void CMasternodeList::Clear()
+{
+    vMasternodes.clear();
+    mapByOutPoint.clear();
+    mapByAddr.clear();
+    mapById.clear();
+    nGeneration++;
+}
+
+void CMasternodeList::Reindex()
+{
+    mapByOutPoint.clear();
+    mapByAddr.clear();
+    mapById.clear();
+    for (unsigned int i = 0; i < vMasternodes.size(); i++)
+    {
+        mapByOutPoint.insert(make_pair(vMasternodes[i].vin.prevout, (int)i));
+        mapByAddr.insert(make_pair(vMasternodes[i].addr, (int)i));
+        mapById.insert(make_pair(vMasternodes[i].nId, (int)i));
+    }
+}
+
+std::vector<CMasterNode> CMasternodeList::GetAll() const
+{
+    READ_LOCK(cs);
+    return vMasternodes;
+}
+
 // manage the masternode connections
 void ProcessMasternodeConnections(){
     LOCK(cs_vNodes);
@@ -87,10 +167,15 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
 
         //LogPrintf("Searching existing masternodes : %s - %s\n", addr.ToString().c_str(),  vin.ToString().c_str());
 
-        BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-            //LogPrintf(" -- %s\n", mn.vin.ToString().c_str());
+        bool fKnown = false;
+        bool fUpdated = false;
+        {
+            WRITE_LOCK(darkSendMasterNodes.cs);
+            int i = darkSendMasterNodes.Find(vin.prevout);
+            if(i >= 0) {
+                fKnown = true;
+                CMasterNode& mn = darkSendMasterNodes[i];
 
-            if(mn.vin.prevout == vin.prevout) {
                 //count == -1 when it's a new entry
                 // e.g. We don't want the entry relayed/time updated when we're syncing the list
                 if(count == -1 && !mn.UpdatedWithin(MASTERNODE_MIN_SECONDS)){
@@ -101,19 +186,31 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
                         mn.pubkey2 = pubkey2;
                         mn.now = sigTime;
                         mn.sig = vchSig;
-
-                        if(pubkey2 == activeMasternode.pubkeyMasterNode2){
-                            activeMasternode.EnableHotColdMasterNode(vin, sigTime, addr);
-                        }
-
-                        RelayDarkSendElectionEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated);
+                        fUpdated = true;
                     }
                 }
+            }
+        }
 
-                return;
+        if(fKnown) {
+            if(fUpdated) {
+                if(pubkey2 == activeMasternode.pubkeyMasterNode2){
+                    // activeMasternode is guarded by cs_main, and dsee is
+                    // dispatched without it, on any handler thread
+                    LOCK(cs_main);
+                    activeMasternode.EnableHotColdMasterNode(vin, sigTime, addr);
+                }
+
+                RelayDarkSendElectionEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated);
             }
+
+            return;
         }
 
+        // dsee is dispatched without cs_main; checking the collateral of a
+        // new entry needs it
+        LOCK(cs_main);
+
         if(!darkSendSigner.IsVinAssociatedWithPubkey(vin, pubkey)) {
             LogPrintf("dsee - Got mismatched pubkey and vin\n");
             pfrom->Misbehaving(100);
@@ -140,7 +237,11 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
 
             CMasterNode mn(addr, vin, pubkey, vchSig, sigTime, pubkey2);
             mn.UpdateLastSeen(lastUpdated);
-            darkSendMasterNodes.push_back(mn);
+            {
+                WRITE_LOCK(darkSendMasterNodes.cs);
+                // another peer may have announced it meanwhile
+                if(!darkSendMasterNodes.Add(mn)) return;
+            }
 
             if(pubkey2 == activeMasternode.pubkeyMasterNode2){
                 activeMasternode.EnableHotColdMasterNode(vin, sigTime, addr);
@@ -188,39 +289,69 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
 
         //LogPrintf("Searching existing masternodes : %s - %s\n", addr.ToString().c_str(),  vin.ToString().c_str());
 
-        BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-            if(mn.vin == vin) {
-                if(mn.lastDseep < sigTime){ //take this only if it's newer
-                    mn.lastDseep = sigTime;
+        // the signature is checked without holding the list
+        bool fKnown = false;
+        bool fNewer = false;
+        CPubKey pubkey2;
+        CService addr;
+        {
+            READ_LOCK(darkSendMasterNodes.cs);
+            int i = darkSendMasterNodes.Find(vin);
+            if(i >= 0) {
+                fKnown = true;
+                const CMasterNode& mn = darkSendMasterNodes[i];
+                fNewer = (mn.lastDseep < sigTime); //take this only if it's newer
+                pubkey2 = mn.pubkey2;
+                addr = mn.addr;
+            }
+        }
 
-                    std::string strMessage = mn.addr.ToString() + boost::lexical_cast<std::string>(sigTime) + boost::lexical_cast<std::string>(stop);
+        bool fRelay = false;
+        if(fNewer) {
+            std::string strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + boost::lexical_cast<std::string>(stop);
 
-                    std::string errorMessage = "";
-                    if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
-                        LogPrintf("dseep - Got bad masternode address signature %s \n", vin.ToString().c_str());
-                        //pfrom->Misbehaving(20);
-                        return;
-                    }
+            std::string errorMessage = "";
+            if(!darkSendSigner.VerifyMessage(pubkey2, vchSig, strMessage, errorMessage)){
+                LogPrintf("dseep - Got bad masternode address signature %s \n", vin.ToString().c_str());
+                //pfrom->Misbehaving(20);
+                return;
+            }
 
-                    if(stop) {
-                        if(mn.IsEnabled()){
-                            mn.Disable();
-                            mn.Check();
-                            RelayDarkSendElectionEntryPing(vin, vchSig, sigTime, stop);
-                        }
-                    } else if(!mn.UpdatedWithin(MASTERNODE_MIN_SECONDS)){
-                        mn.UpdateLastSeen();
-                        RelayDarkSendElectionEntryPing(vin, vchSig, sigTime, stop);
+            WRITE_LOCK(darkSendMasterNodes.cs);
+            int i = darkSendMasterNodes.Find(vin);
+            // the entry may have changed meanwhile
+            if(i >= 0 && darkSendMasterNodes[i].lastDseep < sigTime &&
+               darkSendMasterNodes[i].pubkey2 == pubkey2 && darkSendMasterNodes[i].addr == addr) {
+                CMasterNode& mn = darkSendMasterNodes[i];
+                mn.lastDseep = sigTime;
+
+                if(stop) {
+                    if(mn.IsEnabled()){
+                        mn.Disable();
+                        mn.Check();
+                        darkSendMasterNodes.SetChanged();
+                        fRelay = true;
                     }
+                } else if(!mn.UpdatedWithin(MASTERNODE_MIN_SECONDS)){
+                    mn.UpdateLastSeen();
+                    fRelay = true;
                 }
-                return;
             }
         }
 
+        if(fKnown) {
+            if(fRelay)
+                RelayDarkSendElectionEntryPing(vin, vchSig, sigTime, stop);
+            return;
+        }
+
         // ask for the dsee info once from the node that sent dseep
 
         LogPrintf("dseep - Couldn't find masternode entry %s\n", vin.ToString().c_str());
 
+        // dseep is dispatched without cs_main; it guards the list of
+        // entries asked for against other nodes' dseep
+        LOCK(cs_main);
         BOOST_FOREACH(CTxIn vinAsked, vecMasternodeAskedFor)
             if (vinAsked == vin) return;
 
@@ -247,10 +378,11 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
             pfrom->FulfilledRequest("dseg");
         } //else, asking for a specific node which is ok
 
-        int count = darkSendMasterNodes.size()-1;
+        std::vector<CMasterNode> vMasternodes = darkSendMasterNodes.GetAll();
+        int count = vMasternodes.size()-1;
         int i = 0;
 
-        BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
+        BOOST_FOREACH(CMasterNode mn, vMasternodes) {
             LogPrintf("dseg - Sending master node entry - %s \n", mn.addr.ToString().c_str());
 
             if(mn.addr.IsRFC1918()) continue; //local network
@@ -317,126 +449,147 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
     }
 }
 
-struct CompareValueOnly
+int GetMasternodeByVin(CTxIn& vin)
 {
-    bool operator()(const pair<int64, CTxIn>& t1,
-                    const pair<int64, CTxIn>& t2) const
+    READ_LOCK(darkSendMasterNodes.cs);
+    int i = darkSendMasterNodes.Find(vin);
+    return i == -1 ? -1 : darkSendMasterNodes[i].nId;
+}
+
+//
+// Scores of the enabled masternodes for one (block height, mod), computed
+// once and shared by the winner and rank queries. A table is rebuilt when
+// the best block changes, when the registry gains or loses entries or is
+// marked changed, and after MASTERNODE_SCORE_CACHE_SECONDS, which bounds how
+// long an entry that expired or came back by itself goes unnoticed.
+//
+class CMasternodeScores
+{
+public:
+    uint256 hashBest;
+    unsigned int nGeneration;
+    int64 nTimeComputed;
+
+    // (score, position) of the enabled entries, best first; ties keep list order
+    std::vector<pair<unsigned int, int> > vScores;
+    // rank (1 based) of every position, -1 for disabled entries
+    std::vector<int> vRank;
+
+    CMasternodeScores()
     {
-        return t1.first < t2.first;
+        nGeneration = 0;
+        nTimeComputed = 0;
     }
-};
 
-struct CompareValueOnly2
-{
-    bool operator()(const pair<int64, int>& t1,
-                    const pair<int64, int>& t2) const
+    bool IsCurrent(const uint256& hashBestIn, unsigned int nGenerationIn) const
     {
-        return t1.first < t2.first;
+        return hashBest == hashBestIn && nGeneration == nGenerationIn &&
+               GetTime() - nTimeComputed < MASTERNODE_SCORE_CACHE_SECONDS;
     }
 };
 
-
-int GetMasternodeByVin(CTxIn& vin)
+struct CompareScoreDescending
 {
-    int i = 0;
-
-    BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-        if (mn.vin == vin) return i;
-        i++;
+    bool operator()(const pair<unsigned int, int>& t1,
+                    const pair<unsigned int, int>& t2) const
+    {
+        return t1.first > t2.first;
     }
+};
 
-    return -1;
-}
+static CCriticalSection cs_mapMasternodeScores;
+static std::map<pair<int64, int>, CMasternodeScores> mapMasternodeScores;
 
-int GetCurrentMasterNode(int mod, int64 nBlockHeight)
+// Caller holds darkSendMasterNodes.cs and cs_mapMasternodeScores
+static const CMasternodeScores& GetMasternodeScores(int mod, int64 nBlockHeight)
 {
-    int i = 0;
-    unsigned int score = 0;
-    int winner = -1;
+    uint256 hashBest = pindexBest ? pindexBest->GetBlockHash() : 0;
+    unsigned int nGeneration = darkSendMasterNodes.GetGeneration();
+
+    CMasternodeScores& scores = mapMasternodeScores[make_pair(nBlockHeight, mod)];
+    if(scores.IsCurrent(hashBest, nGeneration))
+        return scores;
+
+    // tables for older tips won't be asked for again
+    std::map<pair<int64, int>, CMasternodeScores>::iterator it = mapMasternodeScores.begin();
+    while(it != mapMasternodeScores.end()) {
+        if(it->second.hashBest != hashBest && &it->second != &scores)
+            mapMasternodeScores.erase(it++);
+        else
+            ++it;
+    }
 
-    // scan for winner
-    BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-        mn.Check();
-        if(!mn.IsEnabled()) {
-            i++;
-            continue;
+    scores.hashBest = hashBest;
+    scores.nGeneration = nGeneration;
+    scores.nTimeComputed = GetTime();
+    scores.vScores.clear();
+    scores.vRank.assign(darkSendMasterNodes.size(), -1);
+
+    // the block hash part of the score is the same for every masternode
+    uint256 hashScore = 0;
+    bool fScore = false;
+    if(pindexBest != NULL) {
+        uint256 n1 = 0;
+        if(darkSendPool.GetLastValidBlockHash(n1, mod, nBlockHeight)) {
+            hashScore = Hash9(BEGIN(n1), END(n1));
+            fScore = true;
         }
+    }
 
-        // calculate the score for each masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
+    for(unsigned int i = 0; i < darkSendMasterNodes.size(); i++) {
+        const CMasterNode& mn = darkSendMasterNodes[i];
+        if(mn.GetCheckedState() != 1) continue;
+
+        uint256 n = fScore ? mn.CalculateScore(hashScore) : 0;
         unsigned int n2 = 0;
         memcpy(&n2, &n, sizeof(n2));
 
-        // determine the winner
-        if(n2 > score){
-            score = n2;
-            winner = i;
-        }
-        i++;
+        scores.vScores.push_back(make_pair(n2, (int)i));
     }
 
-    return winner;
-}
+    stable_sort(scores.vScores.begin(), scores.vScores.end(), CompareScoreDescending());
 
-int GetMasternodeByRank(int findRank, int64 nBlockHeight)
-{
-    int i = 0;
+    for(unsigned int r = 0; r < scores.vScores.size(); r++)
+        scores.vRank[scores.vScores[r].second] = r + 1;
 
-    std::vector<pair<unsigned int, int> > vecMasternodeScores;
+    return scores;
+}
 
-    i = 0;
-    BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-        mn.Check();
-        if(!mn.IsEnabled()) {
-            i++;
-            continue;
-        }
+int GetCurrentMasterNode(int mod, int64 nBlockHeight)
+{
+    READ_LOCK(darkSendMasterNodes.cs);
+    LOCK(cs_mapMasternodeScores);
+    const CMasternodeScores& scores = GetMasternodeScores(mod, nBlockHeight);
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    // the highest non-zero score wins
+    if(scores.vScores.empty() || scores.vScores[0].first == 0)
+        return -1;
 
-        vecMasternodeScores.push_back(make_pair(n2, i));
-        i++;
-    }
+    return darkSendMasterNodes[scores.vScores[0].second].nId;
+}
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly2());
+int GetMasternodeByRank(int findRank, int64 nBlockHeight)
+{
+    READ_LOCK(darkSendMasterNodes.cs);
+    LOCK(cs_mapMasternodeScores);
+    const CMasternodeScores& scores = GetMasternodeScores(1, nBlockHeight);
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, int)& s, vecMasternodeScores){
-        rank++;
-        if(rank == findRank) return s.second;
-    }
+    if(findRank < 1 || findRank > (int)scores.vScores.size())
+        return -1;
 
-    return -1;
+    return darkSendMasterNodes[scores.vScores[findRank - 1].second].nId;
 }
 
 int GetMasternodeRank(CTxIn& vin, int64 nBlockHeight)
 {
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
-
-    BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-        mn.Check();
-        if(!mn.IsEnabled()) {
-            continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    READ_LOCK(darkSendMasterNodes.cs);
+    int i = darkSendMasterNodes.Find(vin);
+    if(i == -1) return -1;
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
-
-    unsigned int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(s.second == vin) return rank;
-    }
+    LOCK(cs_mapMasternodeScores);
+    const CMasternodeScores& scores = GetMasternodeScores(1, nBlockHeight);
 
-    return -1;
+    return scores.vRank[i];
 }
 
 //
@@ -451,7 +604,11 @@ uint256 CMasterNode::CalculateScore(int mod, int64 nBlockHeight)
     uint256 n1 = 0;
     if(!darkSendPool.GetLastValidBlockHash(n1, mod, nBlockHeight)) return 0;
 
-    uint256 n2 = Hash9(BEGIN(n1), END(n1));
+    return CalculateScore(Hash9(BEGIN(n1), END(n1)));
+}
+
+uint256 CMasterNode::CalculateScore(const uint256& n2) const
+{
     uint256 n3 = vin.prevout.hash > n2 ? (vin.prevout.hash - n2) : (n2 - vin.prevout.hash);
 
     /*
@@ -463,35 +620,88 @@ uint256 CMasterNode::CalculateScore(int mod, int64 nBlockHeight)
 }
 
 void CMasterNode::Check()
+{
+    enabled = GetCheckedState();
+}
+
+int CMasterNode::GetCheckedState() const
 {
     //once spent, stop doing the checks
-    if(enabled==3) return;
+    if(enabled==3) return 3;
 
+    if(!UpdatedWithin(MASTERNODE_REMOVAL_SECONDS))
+        return 4;
 
-    if(!UpdatedWithin(MASTERNODE_REMOVAL_SECONDS)){
-        enabled = 4;
-        return;
-    }
+    if(!UpdatedWithin(MASTERNODE_EXPIRATION_SECONDS))
+        return 2;
+
+    // the collateral is re-validated by CheckMasternodes() once per block,
+    // which sets enabled to 3 when it's gone
+    return 1; // OK
+}
+
+// Would the dsee dummy transaction still be able to spend this collateral?
+// Caller holds cs_main and mempool.cs.
+static bool IsCollateralAvailable(const COutPoint& outpoint)
+{
+    // spent by a transaction in the memory pool
+    if(mempool.mapNextTx.count(outpoint)) return false;
+
+    CCoins coins;
+    if(!pcoinsTip->GetCoins(outpoint.hash, coins) || !coins.IsAvailable(outpoint.n))
+        return false;
 
-    if(!UpdatedWithin(MASTERNODE_EXPIRATION_SECONDS)){
-        enabled = 2;
-        return;
+    int64 nValueRequired = 999.99*COIN;
+    if(coins.vout[outpoint.n].nValue < nValueRequired) return false;
+
+    int nSpendHeight = pindexBest->nHeight + 1;
+    if(coins.IsCoinBase() && nSpendHeight - coins.nHeight < COINBASE_MATURITY) return false;
+
+    return true;
+}
+
+void CheckMasternodes()
+{
+    if(pindexBest == NULL) return;
+
+    std::vector<COutPoint> vCollateral;
+    {
+        READ_LOCK(darkSendMasterNodes.cs);
+        BOOST_FOREACH(const CMasterNode& mn, darkSendMasterNodes)
+            if(!mn.unitTest && mn.enabled != 3)
+                vCollateral.push_back(mn.vin.prevout);
     }
 
-    if(!unitTest){
-        CValidationState state;
-        CTransaction tx = CTransaction();
-        CTxOut vout = CTxOut(999.99*COIN, darkSendPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
+    // one pass over the chain state for the whole list
+    std::set<COutPoint> setSpent;
+    {
+        LOCK2(cs_main, mempool.cs);
+        BOOST_FOREACH(const COutPoint& outpoint, vCollateral)
+            if(!IsCollateralAvailable(outpoint))
+                setSpent.insert(outpoint);
+    }
 
-        if(!tx.AcceptableInputs(state, true)) {
-            enabled = 3;
-            return;
+    WRITE_LOCK(darkSendMasterNodes.cs);
+    bool fChanged = false;
+    CMasternodeList::iterator it = darkSendMasterNodes.begin();
+    while(it != darkSendMasterNodes.end()){
+        int nPrevious = (*it).enabled;
+        if(setSpent.count((*it).vin.prevout))
+            (*it).enabled = 3;
+        else
+            (*it).Check();
+
+        if((*it).enabled == 4 || (*it).enabled == 3){
+            LogPrintf("Removing inactive masternode %s\n", (*it).addr.ToString().c_str());
+            it = darkSendMasterNodes.Remove(it);
+            continue;
         }
+
+        if((*it).enabled != nPrevious) fChanged = true;
+        ++it;
     }
 
-    enabled = 1; // OK
+    if(fChanged) darkSendMasterNodes.SetChanged();
 }
 
 bool CMasternodePayments::CheckSignature(CMasternodePaymentWinner& winner)
@@ -553,12 +763,19 @@ bool CMasternodePayments::GetBlockPayee(int nBlockHeight, CScript& payee)
 {
     BOOST_FOREACH(CMasternodePaymentWinner& winner, vWinning){
         if(winner.nBlockHeight == nBlockHeight) {
+            std::map<uint256, CScript>::iterator it = mapCollateralPayee.find(winner.vin.prevout.hash);
+            if(it != mapCollateralPayee.end()){
+                payee = it->second;
+                return true;
+            }
 
             CTransaction tx;
             uint256 hash;
             if(GetTransaction(winner.vin.prevout.hash, tx, hash, true)){
                 BOOST_FOREACH(CTxOut out, tx.vout){
                     if(out.nValue == 1000*COIN){
+                        if(mapCollateralPayee.size() > 1000) mapCollateralPayee.clear();
+                        mapCollateralPayee[winner.vin.prevout.hash] = out.scriptPubKey;
                         payee = out.scriptPubKey;
                         return true;
                     }
@@ -651,20 +868,23 @@ bool CMasternodePayments::ProcessBlock(int nBlockHeight)
     uint256 blockHash = 0;
     if(!darkSendPool.GetBlockHash(blockHash, nBlockHeight-576)) return false;
 
-    BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-        mn.Check();
+    {
+        WRITE_LOCK(darkSendMasterNodes.cs);
+        BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
+            mn.Check();
 
-        if(!mn.IsEnabled()) {
-            continue;
-        }
+            if(!mn.IsEnabled()) {
+                continue;
+            }
 
-        if(LastPayment(mn) < darkSendMasterNodes.size()*.9) continue;
+            if(LastPayment(mn) < darkSendMasterNodes.size()*.9) continue;
 
-        uint64 score = CalculateScore(blockHash, mn.vin);
-        if(score > winner.score){
-            winner.score = score;
-            winner.nBlockHeight = nBlockHeight;
-            winner.vin = mn.vin;
+            uint64 score = CalculateScore(blockHash, mn.vin);
+            if(score > winner.score){
+                winner.score = score;
+                winner.nBlockHeight = nBlockHeight;
+                winner.vin = mn.vin;
+            }
         }
     }
 
@@ -17,7 +17,10 @@
 #include "base58.h"
 #include "main.h"
 
+#include <boost/unordered_map.hpp>
+
 class CMasterNode;
+class CMasternodeList;
 class CMasternodePayments;
 
 #define MASTERNODE_NOT_PROCESSED               0 // initial state
@@ -35,10 +38,11 @@ class CMasternodePayments;
 #define MASTERNODE_PING_SECONDS                (5*60)
 #define MASTERNODE_EXPIRATION_SECONDS          (65*60)
 #define MASTERNODE_REMOVAL_SECONDS             (70*60)
+#define MASTERNODE_SCORE_CACHE_SECONDS         60
 
 using namespace std;
 
-extern std::vector<CMasterNode> darkSendMasterNodes;
+extern CMasternodeList darkSendMasterNodes;
 extern CMasternodePayments masternodePayments;
 extern std::vector<CTxIn> vecMasternodeAskedFor;
 extern map<uint256, int> mapSeenMasternodeVotes;
@@ -47,6 +51,17 @@ extern map<uint256, int> mapSeenMasternodeVotes;
 // manage the masternode connections
 void ProcessMasternodeConnections();
 
+// Re-validate all masternode collaterals in one batch, refresh their status
+// and remove the spent and expired ones
+void CheckMasternodes();
+
+// The lookup and ranking functions take darkSendMasterNodes.cs (shared)
+// themselves, so the caller must not hold it. They return entry ids
+// (CMasterNode::nId), or -1: an id stays valid after the lock is released and
+// other entries are removed; turn it into a position with
+// darkSendMasterNodes.FindById() under the lock. Winners and ranks come from a
+// score table that is cached per (block height, mod), see CMasternodeScores.
+
 // Get the current winner for this block
 int GetCurrentMasterNode(int mod=1, int64 nBlockHeight=0);
 
@@ -63,6 +78,8 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
 class CMasterNode
 {
 public:
+    // handle given out by CMasternodeList::Add, -1 until then
+    int nId;
     CService addr;
     CTxIn vin;
     int64 lastTimeSeen;
@@ -82,6 +99,7 @@ public:
 
     CMasterNode(CService newAddr, CTxIn newVin, CPubKey newPubkey, std::vector<unsigned char> newSig, int64 newNow, CPubKey newPubkey2)
     {
+        nId = -1;
         addr = newAddr;
         vin = newVin;
         pubkey = newPubkey;
@@ -99,6 +117,8 @@ public:
     }
 
     uint256 CalculateScore(int mod=1, int64 nBlockHeight=0);
+    // Score against n2, the Hash9 of the election block's hash
+    uint256 CalculateScore(const uint256& n2) const;
 
     void UpdateLastSeen(int64 override=0)
     {
@@ -110,8 +130,10 @@ public:
     }
 
     void Check();
+    // The enabled state Check() would set, without setting it
+    int GetCheckedState() const;
 
-    bool UpdatedWithin(int seconds)
+    bool UpdatedWithin(int seconds) const
     {
         //LogPrintf("UpdatedWithin %"PRI64u", %"PRI64u" --  %d \n", GetTimeMicros() , lastTimeSeen, (GetTimeMicros() - lastTimeSeen) < seconds);
 
@@ -141,6 +163,88 @@ public:
     }
 };
 
+/** Hash functions for the registry indexes */
+struct CMasternodeOutPointHasher
+{
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        // txids are already uniformly distributed
+        return (size_t)(outpoint.hash.Get64() ^ outpoint.n);
+    }
+};
+
+struct CMasternodeServiceHasher
+{
+    size_t operator()(const CService& addr) const
+    {
+        return (size_t)(addr.GetHash() ^ addr.GetPort());
+    }
+};
+
+//
+// The registry of known masternodes.
+//
+// Entries are kept in arrival order in a vector, so the list can be walked
+// like before; two hash indexes, by collateral outpoint and by service
+// address, make lookups O(1). Positions move when an entry is removed, so
+// they are only good while cs is held; every entry also gets an id from Add
+// that never changes and is never reused, for handles kept across
+// releases of cs (FindById). cs is a reader/writer lock: hold it
+// shared to look up or walk the list, exclusively to add, remove or modify
+// entries. It is not recursive. Lock order is cs_main, then cs, then
+// mempool.cs or cs_vNodes.
+//
+class CMasternodeList
+{
+private:
+    std::vector<CMasterNode> vMasternodes;
+    boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher> mapByOutPoint;
+    boost::unordered_map<CService, int, CMasternodeServiceHasher> mapByAddr;
+    boost::unordered_map<int, int> mapById;
+    unsigned int nGeneration;
+    int nNextId;
+
+    void Reindex();
+
+public:
+    typedef std::vector<CMasterNode>::iterator iterator;
+    typedef std::vector<CMasterNode>::const_iterator const_iterator;
+
+    mutable CSharedCriticalSection cs;
+
+    CMasternodeList() : nGeneration(0), nNextId(0) {}
+
+    iterator begin() { return vMasternodes.begin(); }
+    iterator end() { return vMasternodes.end(); }
+    const_iterator begin() const { return vMasternodes.begin(); }
+    const_iterator end() const { return vMasternodes.end(); }
+    unsigned int size() const { return vMasternodes.size(); }
+    bool empty() const { return vMasternodes.empty(); }
+    CMasterNode& operator[](int i) { return vMasternodes[i]; }
+    const CMasterNode& operator[](int i) const { return vMasternodes[i]; }
+
+    // Position of the entry with this collateral input, or -1
+    int Find(const CTxIn& vin) const;
+    int Find(const COutPoint& outpoint) const;
+    // Position of the first entry announced for this address, or -1
+    int Find(const CService& addr) const;
+    // Position of the entry with this id, or -1 if it was removed
+    int FindById(int nId) const;
+
+    // Append an entry and give it the next id; false if its collateral is already registered
+    bool Add(const CMasterNode& mn);
+    // Remove an entry, returning the position after it
+    iterator Remove(iterator it);
+    void Clear();
+
+    // Bumped whenever entries are added or removed, or by SetChanged()
+    // after a change to an entry that affects the elections
+    unsigned int GetGeneration() const { return nGeneration; }
+    void SetChanged() { nGeneration++; }
+
+    // Copy of every entry; takes cs itself
+    std::vector<CMasterNode> GetAll() const;
+};
 
 // for storing the winning payments
 class CMasternodePaymentWinner
@@ -181,6 +285,8 @@ class CMasternodePayments
 {
 private:
     std::vector<CMasternodePaymentWinner> vWinning;
+    // Payee script of each winner's collateral transaction, by txid
+    std::map<uint256, CScript> mapCollateralPayee;
     int nSyncedFromPeer;
     std::string strMasterPrivKey;
     std::string strTestPubKey;
@@ -211,7 +317,8 @@ public:
     void CleanPaymentList();
     int LastPayment(CMasterNode& mn);
 
-    //slow
+    // The collateral transaction is read from disk once per winner, then
+    // its payee comes from mapCollateralPayee
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
 };
 
@@ -11,6 +11,7 @@
 #include "addrman.h"
 #include "ui_interface.h"
 #include "script.h"
+#include "socketevents.h"
 
 #ifdef WIN32
 #include <string.h>
@@ -31,6 +32,13 @@ using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
 
+// Bytes of relayed and served messages kept, and for how many seconds
+static const size_t RELAY_CACHE_SIZE = 32 * 1000 * 1000;
+static const int64 RELAY_CACHE_LIFETIME = 15 * 60;
+
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 4;
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 
 
@@ -57,9 +65,7 @@ int nMaxConnections = 125;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+CRelayCache relayCache(RELAY_CACHE_SIZE, RELAY_CACHE_LIFETIME);
 limitedmap<CInv, int64> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -75,6 +81,27 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
+static CSocketEvents *psocketEvents = NULL;
+static int nMessageHandlerThreads = 1;
+
+int GetMessageHandler(const CNode* pnode, int nThreads)
+{
+    return pnode->id % nThreads;
+}
+
+static int GetMessageHandler(const CNode* pnode)
+{
+    return GetMessageHandler(pnode, nMessageHandlerThreads);
+}
+
+bool CanHelpWithMessages(CNode* pnode, int nThread, int nThreads)
+{
+    if (pnode->fDisconnect || GetMessageHandler(pnode, nThreads) == nThread)
+        return false;
+    // busy means its messages are being received or handled already
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    return lockRecv && pnode->nRecvQueued > 0;
+}
 
 void AddOneShot(string strDest)
 {
@@ -511,6 +538,8 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaste
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        // to have its socket watched
+        WakeupSocketHandler();
 
         pnode->nTimeConnected = GetTime();
         if(darkSendMaster) pnode->fDarkSendMaster = true;
@@ -528,14 +557,18 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrintf("disconnecting node %s\n", addrName.c_str());
+        if (fSocketRegistered && psocketEvents)
+            psocketEvents->Remove(hSocket);
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
     TRY_LOCK(cs_vRecvMsg, lockRecv);
-    if (lockRecv)
+    if (lockRecv) {
         vRecvMsg.clear();
+        nRecvQueued = 0;
+    }
 
     // if this was the sync node, we'll need a new one
     if (this == pnodeSync)
@@ -630,7 +663,13 @@ void CNode::copyStats(CNodeStats &stats)
     X(nSendBytes);
     X(nRecvBytes);
     X(nBlocksRequested);
+    {
+        // cs_vRecvMsg is taken before cs_vNodes elsewhere, so don't wait for it
+        TRY_LOCK(cs_vRecvMsg, lockRecv);
+        stats.nRecvQueued = lockRecv ? nRecvQueued : -1;
+    }
     stats.fSyncNode = (this == pnodeSync);
+    stats.nMessageHandler = GetMessageHandler(this);
 }
 #undef X
 
@@ -656,6 +695,9 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         if (handled < 0)
                 return false;
 
+        if (msg.complete())
+            nRecvQueued++;
+
         pch += handled;
         nBytes -= handled;
     }
@@ -700,7 +742,9 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // nothing to copy if it was received in place
+    if (pch != &vRecv[nDataPos])
+        memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -717,10 +761,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -759,319 +803,421 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+void WakeupSocketHandler()
 {
-    unsigned int nPrevNodeCount = 0;
-    loop
-    {
-        //
-        // Disconnect nodes
-        //
-        {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-            {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
-
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
-
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
-            }
+    if (psocketEvents)
+        psocketEvents->Wakeup();
+}
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
-            {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
-                {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
-                        {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
-                    }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
-                }
-            }
-        }
-        if (vNodes.size() != nPrevNodeCount)
-        {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
-        }
+// Every node is looked at this often: disconnects, timeouts, new sockets.
+// Sockets are otherwise only serviced when they have events.
+static const int64 SOCKET_HOUSEKEEPING_MILLIS = 50;
+// Bytes read from one socket before the others get their turn
+static const int MAX_RECV_PER_TURN = 0x40000;
+// Payloads with at least this much left are received in place
+static const unsigned int MIN_RECV_IN_PLACE = 0x4000;
+
+// With select() only the directions we can act on are watched:
+// * If there is data to send, select() for sending data. As this only
+//   happens when optimistic write failed, we choose to first drain the
+//   write buffer in this case before receiving more. This avoids
+//   needlessly queueing received data, if the remote peer is not themselves
+//   receiving data. This means properly utilizing TCP flow control signalling.
+// * Otherwise, if there is no (complete) message in the receive buffer,
+//   or there is space left in the buffer, select() for receiving data.
+// * (if neither of the above applies, there is certainly one message
+//   in the receiver buffer ready to be processed).
+// Together, that means that at least one of the following is always possible,
+// so we don't deadlock:
+// * We send some data.
+// * We wait for data to be received (and disconnect after timeout).
+// * We process a message in the buffer (message handler thread).
+// Edge triggered events are always watched for both; ServiceSocket keeps
+// the same order.
+static void UpdateSocketInterest(CNode* pnode)
+{
+    if (psocketEvents->IsEdgeTriggered() || pnode->hSocket == INVALID_SOCKET)
+        return;
 
+    bool fSend = false;
+    bool fRecv = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        fSend = lockSend && !pnode->vSendMsg.empty();
+    }
+    if (!fSend)
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        fRecv = lockRecv && (
+            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+            pnode->GetTotalRecvSize() <= ReceiveFloodSize());
+    }
+    psocketEvents->SetInterest(pnode->hSocket, fRecv, fSend);
+}
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+// Send and receive what the socket of the node is ready for. Returns whether
+// it has more to do after the other sockets had their turn.
+static bool ServiceSocket(CNode* pnode, bool& fProgress)
+{
+    //
+    // Send
+    //
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+    bool fSendQueued;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend)
+            return true;
+        if (pnode->fSendReady && !pnode->vSendMsg.empty())
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
+            uint64 nSendBytes = pnode->nSendBytes;
+            SocketSendData(pnode);
+            if (pnode->nSendBytes != nSendBytes)
+                fProgress = true;
+            // stopped early, the socket is full until the next event
+            if (!pnode->vSendMsg.empty())
+                pnode->fSendReady = false;
         }
+        fSendQueued = !pnode->vSendMsg.empty();
+    }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
+    //
+    // Receive
+    //
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+    if (pnode->fRecvReady && !fSendQueued)
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv)
+            return true;
+        int nTurn = 0;
+        while (true)
         {
-            if (have_fds)
+            if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+                pnode->GetTotalRecvSize() > ReceiveFloodSize())
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                // the message handler wakes us up when it took some
+                pnode->fRecvThrottled = true;
+                break;
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
-
-
-        //
-        // Accept new connections
-        //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
+            pnode->fRecvThrottled = false;
+            if (nTurn >= MAX_RECV_PER_TURN)
+                return true;
 
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
+            // typical socket buffer is 8K-64K
+            char pchBuf[0x10000];
+            char* pch = pchBuf;
+            unsigned int nSize = sizeof(pchBuf);
 
+            // The rest of a large payload is read straight into its
+            // message, small ones come several to a read
+            unsigned int nDataSize;
+            char* pchData = pnode->GetRecvDataBuffer(nDataSize);
+            if (pchData && nDataSize >= MIN_RECV_IN_PLACE)
             {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
+                pch = pchData;
+                nSize = std::min(nDataSize, nSize);
             }
 
-            LogPrintf("maxconnections check %d\n", nMaxConnections - MAX_OUTBOUND_CONNECTIONS);
-            
-            if (hSocket == INVALID_SOCKET)
+            int nBytes = recv(pnode->hSocket, pch, nSize, MSG_DONTWAIT);
+            if (nBytes > 0)
             {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
+                if (!pnode->ReceiveMsgBytes(pch, nBytes))
+                    pnode->CloseSocketDisconnect();
+                pnode->nLastRecv = GetTime();
+                pnode->nRecvBytes += nBytes;
+                nTurn += nBytes;
+                fProgress = true;
+                if (pnode->hSocket == INVALID_SOCKET)
+                    return false;
             }
-            else if (CNode::IsBanned(addr))
+            else if (nBytes == 0)
             {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
+                // socket closed gracefully
+                if (!pnode->fDisconnect)
+                    LogPrintf("socket closed\n");
+                pnode->CloseSocketDisconnect();
+                return false;
             }
             else
             {
-                LogPrintf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                 {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
+                    if (!pnode->fDisconnect)
+                        LogPrintf("socket recv error %d\n", nErr);
+                    pnode->CloseSocketDisconnect();
+                    return false;
                 }
+                // read empty until the next event
+                if (nErr != WSAEINTR)
+                    pnode->fRecvReady = false;
+                break;
             }
         }
+    }
 
+    UpdateSocketInterest(pnode);
+    return false;
+}
 
-        //
-        // Service each socket
-        //
-        vector<CNode*> vNodesCopy;
+// Accept one connection waiting on the listening socket. Returns false when
+// there are none left.
+static bool AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %d\n", nErr);
+        return false;
+    }
+
+    LogPrintf("maxconnections check %d\n", nMaxConnections - MAX_OUTBOUND_CONNECTIONS);
+
+    if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        LogPrintf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+            vNodes.push_back(pnode);
         }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    }
+    return true;
+}
+
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64 nLastHousekeeping = 0;
+    bool fWakeup = true;
+    bool fProgress = false;
+    bool fListen = false;
+    // Nodes whose sockets have events we haven't fully acted on. Only this
+    // thread deletes nodes, and it takes them out of here first.
+    set<CNode*> setNodesReady;
+    vector<CSocketEvent> vEvents;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (!psocketEvents->Add(hListenSocket, NULL))
+            LogPrintf("socket events: cannot watch listening socket, error %d\n", WSAGetLastError());
+
+    loop
+    {
+        int64 nNow = GetTimeMillis();
+        if (fWakeup || nNow - nLastHousekeeping >= SOCKET_HOUSEKEEPING_MILLIS)
         {
-            boost::this_thread::interruption_point();
+            nLastHousekeeping = nNow;
+            // Edge triggered, a listening socket isn't reported again if
+            // accepting stopped at an error (out of descriptors)
+            fListen = true;
 
             //
-            // Receive
+            // Disconnect nodes
             //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                LOCK(cs_vNodes);
+                // Disconnect unused nodes
+                vector<CNode*> vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 {
+                    if (pnode->fDisconnect ||
+                        (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
                     {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrintf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
+                        // remove from vNodes
+                        vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                        // release outbound grant (if any)
+                        pnode->grantOutbound.Release();
+
+                        // close socket and cleanup
+                        pnode->CloseSocketDisconnect();
+                        pnode->Cleanup();
+
+                        // hold in disconnected pool until all refs are released
+                        if (pnode->fNetworkNode || pnode->fInbound)
+                            pnode->Release();
+                        vNodesDisconnected.push_back(pnode);
+                    }
+                }
+
+                // Delete disconnected nodes
+                list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+                BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+                {
+                    // wait until threads are done using it
+                    if (pnode->GetRefCount() <= 0)
+                    {
+                        bool fDelete = false;
                         {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            TRY_LOCK(pnode->cs_vSend, lockSend);
+                            if (lockSend)
                             {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
+                                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                                if (lockRecv)
+                                {
+                                    TRY_LOCK(pnode->cs_inventory, lockInv);
+                                    if (lockInv)
+                                        fDelete = true;
+                                }
                             }
                         }
+                        if (fDelete)
+                        {
+                            vNodesDisconnected.remove(pnode);
+                            setNodesReady.erase(pnode);
+                            delete pnode;
+                        }
                     }
                 }
             }
-
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (vNodes.size() != nPrevNodeCount)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
+                nPrevNodeCount = vNodes.size();
+                uiInterface.NotifyNumConnectionsChanged(vNodes.size());
             }
 
             //
-            // Inactivity checking
+            // Watch new sockets, check for inactivity
             //
-            if (pnode->vSendMsg.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
+            int64 nTime = GetTime();
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrintf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    LogPrintf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    LogPrintf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    if (!pnode->fSocketRegistered)
+                    {
+                        if (!psocketEvents->Add(pnode->hSocket, pnode))
+                        {
+                            LogPrintf("socket events: cannot watch socket of %s, error %d\n", pnode->addrName.c_str(), WSAGetLastError());
+                            pnode->fDisconnect = true;
+                            continue;
+                        }
+                        pnode->fSocketRegistered = true;
+                    }
+
+                    // Sockets that were ready, but that we held off from
+                    // reading or whose send queue only just got data
+                    if (pnode->fRecvReady || (pnode->fSendReady && !pnode->vSendMsg.empty()))
+                        setNodesReady.insert(pnode);
+                    UpdateSocketInterest(pnode);
+
+                    //
+                    // Inactivity checking
+                    //
+                    if (pnode->vSendMsg.empty())
+                        pnode->nLastSendEmpty = nTime;
+                    if (nTime - pnode->nTimeConnected > 60)
+                    {
+                        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+                        {
+                            LogPrintf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+                            pnode->fDisconnect = true;
+                        }
+                        else if (nTime - pnode->nLastSend > 90*60 && nTime - pnode->nLastSendEmpty > 90*60)
+                        {
+                            LogPrintf("socket not sending\n");
+                            pnode->fDisconnect = true;
+                        }
+                        else if (nTime - pnode->nLastRecv > 90*60)
+                        {
+                            LogPrintf("socket inactivity timeout\n");
+                            pnode->fDisconnect = true;
+                        }
+                    }
                 }
             }
         }
+
+        //
+        // Wait for sockets to become ready
+        //
+        int nTimeout = std::max((int)(nLastHousekeeping + SOCKET_HOUSEKEEPING_MILLIS - GetTimeMillis()), 0);
+        if (!setNodesReady.empty())
+            nTimeout = fProgress ? 0 : std::min(nTimeout, 10);
+        if (!psocketEvents->Wait(nTimeout, vEvents, fWakeup))
+            LogPrintf("socket events error %d\n", WSAGetLastError());
+        boost::this_thread::interruption_point();
+
+        BOOST_FOREACH(const CSocketEvent& event, vEvents)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            if (event.pdata == NULL)
+            {
+                fListen = true;
+                continue;
+            }
+            CNode* pnode = (CNode*)event.pdata;
+            if (event.fRecv || event.fError)
+                pnode->fRecvReady = true;
+            if (event.fSend)
+                pnode->fSendReady = true;
+            setNodesReady.insert(pnode);
         }
 
-        MilliSleep(10);
+        //
+        // Accept new connections
+        //
+        if (fListen)
+        {
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                while (hListenSocket != INVALID_SOCKET && AcceptConnection(hListenSocket))
+                    fWakeup = true;
+            fListen = false;
+        }
+
+        //
+        // Service each ready socket
+        //
+        fProgress = false;
+        for (set<CNode*>::iterator it = setNodesReady.begin(); it != setNodesReady.end(); )
+        {
+            boost::this_thread::interruption_point();
+            if (ServiceSocket(*it, fProgress))
+                ++it;
+            else
+                setNodesReady.erase(it++);
+        }
     }
 }
 
@@ -1545,7 +1691,45 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
-void ThreadMessageHandler()
+// Processes the next message of a node and, if fSend, sends what is due to
+// it. Returns whether it has more messages that can be processed now.
+// requires LOCK(pnode->cs_messageHandler)
+static bool HandleNodeMessages(CNode* pnode, bool fSend, bool fSendTrickle)
+{
+    bool fMore = false;
+
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+        {
+            if (!ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+
+            if (pnode->nSendSize < SendBufferSize())
+            {
+                if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                {
+                    fMore = true;
+                }
+            }
+        }
+    }
+    boost::this_thread::interruption_point();
+
+    // Send messages
+    if (fSend)
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            SendMessages(pnode, fSendTrickle);
+    }
+    boost::this_thread::interruption_point();
+
+    return fMore;
+}
+
+void ThreadMessageHandler(int nThread)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
@@ -1563,47 +1747,49 @@ void ThreadMessageHandler()
             }
         }
 
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
-
-        // Poll the connected nodes for messages
+        // Chosen among all nodes, so that each is trickled to as often as
+        // with a single thread
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
         bool fSleep = true;
 
+        if (nThread == 0)
+        {
+            if (!fHaveSyncNode)
+                StartSync(vNodesCopy);
+
+            // Masternode messages are processed one per node and loop, but
+            // their signatures are checked for all waiting messages at once
+            CheckMessageSignatures(vNodesCopy);
+        }
+
+        // Poll the nodes pinned to this thread
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            if (pnode->fDisconnect)
+            if (pnode->fDisconnect || GetMessageHandler(pnode) != nThread)
                 continue;
 
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
-            }
-            boost::this_thread::interruption_point();
+            LOCK(pnode->cs_messageHandler);
+            if (HandleNodeMessages(pnode, true, pnode == pnodeTrickle))
+                fSleep = false;
+        }
 
-            // Send messages
+        // With nothing to do for its own nodes, help out with the messages
+        // waiting for other threads, which may be stuck on a slow one
+        if (fSleep && nMessageHandlerThreads > 1)
+        {
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                if (!CanHelpWithMessages(pnode, nThread, nMessageHandlerThreads))
+                    continue;
+
+                // the thread holding it handles the node's messages in order
+                TRY_LOCK(pnode->cs_messageHandler, lockHandler);
+                if (lockHandler && HandleNodeMessages(pnode, false, false))
+                    fSleep = false;
             }
-            boost::this_thread::interruption_point();
         }
 
         {
@@ -1788,6 +1974,11 @@ void StartNode(boost::thread_group& threadGroup)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+    if (psocketEvents == NULL) {
+        psocketEvents = new CSocketEvents();
+        LogPrintf("Using %s to wait for sockets\n", psocketEvents->GetName());
+    }
+
     Discover();
 
     //
@@ -1814,7 +2005,11 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    nMessageHandlerThreads = GetArg("-msghandthreads", DEFAULT_MESSAGE_HANDLER_THREADS);
+    nMessageHandlerThreads = std::max(std::min(nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS), 1);
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1861,6 +2056,8 @@ public:
         vNodesDisconnected.clear();
         delete semOutbound;
         semOutbound = NULL;
+        delete psocketEvents;
+        psocketEvents = NULL;
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;
 
@@ -1873,6 +2070,93 @@ public:
 instance_of_cnetcleanup;
 
 
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CSerializeData vchMessage(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    if (!ssPayload.empty())
+        memcpy(&vchMessage[CMessageHeader::HEADER_SIZE], &ssPayload[0], ssPayload.size());
+    return MakeSharedMessage(pszCommand, vchMessage);
+}
+
+CSharedMessage MakeSharedMessage(const char* pszCommand, CSerializeData& vchMessage)
+{
+    assert(vchMessage.size() >= CMessageHeader::HEADER_SIZE);
+    CMessageHeader hdr(pszCommand, vchMessage.size() - CMessageHeader::HEADER_SIZE);
+    uint256 hash = Hash(vchMessage.begin() + CMessageHeader::HEADER_SIZE, vchMessage.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    assert(ss.size() == CMessageHeader::HEADER_SIZE);
+    memcpy(&vchMessage[0], &ss[0], CMessageHeader::HEADER_SIZE);
+
+    CSerializeData* pdata = new CSerializeData();
+    pdata->swap(vchMessage);
+    return CSharedMessage(pdata);
+}
+
+CRelayCache::CRelayCache(size_t nMaxSizeIn, int64 nLifetimeIn) : nMaxSize(nMaxSizeIn), nLifetime(nLifetimeIn), nSize(0)
+{
+}
+
+// requires LOCK(cs)
+void CRelayCache::Expire()
+{
+    int64 nNow = GetTime();
+    while (!vExpiration.empty() && (vExpiration.front().first < nNow || nSize > nMaxSize))
+    {
+        map<CInv, CSharedMessage>::iterator mi = mapMessages.find(vExpiration.front().second);
+        nSize -= mi->second->size();
+        mapMessages.erase(mi);
+        vExpiration.pop_front();
+    }
+}
+
+void CRelayCache::Add(const CInv& inv, const CSharedMessage& msg)
+{
+    LOCK(cs);
+    if (!mapMessages.insert(make_pair(inv, msg)).second)
+        return;
+    nSize += msg->size();
+    vExpiration.push_back(make_pair(GetTime() + nLifetime, inv));
+    Expire();
+}
+
+CSharedMessage CRelayCache::Find(const CInv& inv)
+{
+    LOCK(cs);
+    Expire();
+    map<CInv, CSharedMessage>::const_iterator mi = mapMessages.find(inv);
+    if (mi == mapMessages.end())
+        return CSharedMessage();
+    return mi->second;
+}
+
+size_t CRelayCache::GetCount() const
+{
+    LOCK(cs);
+    return mapMessages.size();
+}
+
+size_t CRelayCache::GetSize() const
+{
+    LOCK(cs);
+    return nSize;
+}
+
+// Queues a message built once to every node, or to those that relay
+// transactions
+static void RelayToNodes(const CSharedMessage& msg, bool fRelayTxesOnly)
+{
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (fRelayTxesOnly && !pnode->fRelayTxes)
+            continue;
+        pnode->PushMessage(msg);
+    }
+}
+
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
@@ -1884,19 +2168,10 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
+    // Save original serialized message so newer versions are preserved
+    relayCache.Add(inv, MakeSharedMessage("tx", ss));
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
@@ -1915,27 +2190,17 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
 
 void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash)
 {
-    CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
-
     //broadcast the new lock
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
-    {
-        if(!pnode->fRelayTxes)
-            continue;
-
-        pnode->PushMessage("txlreq", tx, pindexBest->nHeight-10);
-    }
-
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx << (pindexBest->nHeight-10);
+    RelayToNodes(MakeSharedMessage("txlreq", ss), true);
 }
 
 void RelayDarkSendFinalTransaction(const int sessionID, const CTransaction& txNew)
 {
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
-    {
-        pnode->PushMessage("dsf", sessionID, txNew);
-    }
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sessionID << txNew;
+    RelayToNodes(MakeSharedMessage("dsf", ss), false);
 }
 
 void RelayDarkSendIn(const std::vector<CTxIn>& in, const int64& nAmount, const CTransaction& txCollateral, const std::vector<CTxOut>& out)
@@ -1952,48 +2217,34 @@ void RelayDarkSendIn(const std::vector<CTxIn>& in, const int64& nAmount, const C
 
 void RelayDarkSendStatus(const int sessionID, const int newState, const int newEntriesCount, const int newAccepted, const std::string error)
 {
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
-    {
-        pnode->PushMessage("dssu", sessionID, newState, newEntriesCount, newAccepted, error);
-    }
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sessionID << newState << newEntriesCount << newAccepted << error;
+    RelayToNodes(MakeSharedMessage("dssu", ss), false);
 }
 
 void RelayDarkSendElectionEntry(const CTxIn vin, const CService addr, const std::vector<unsigned char> vchSig, const int64 nNow, const CPubKey pubkey, const CPubKey pubkey2, const int count, const int current, const int64 lastUpdated)
 {
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
-    {
-        if(!pnode->fRelayTxes) continue;
-
-        pnode->PushMessage("dsee", vin, addr, vchSig, nNow, pubkey, pubkey2, count, current, lastUpdated);
-    }
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vin << addr << vchSig << nNow << pubkey << pubkey2 << count << current << lastUpdated;
+    RelayToNodes(MakeSharedMessage("dsee", ss), true);
 }
 
 void RelayDarkSendElectionEntryPing(const CTxIn vin, const std::vector<unsigned char> vchSig, const int64 nNow, const bool stop)
 {
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
-    {
-        if(!pnode->fRelayTxes) continue;
-        
-        pnode->PushMessage("dseep", vin, vchSig, nNow, stop);
-    }
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vin << vchSig << nNow << stop;
+    RelayToNodes(MakeSharedMessage("dseep", ss), true);
 }
 
 void RelayDarkSendCompletedTransaction(const int sessionID, const bool error, const std::string errorMessage)
 {
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
-    {
-        pnode->PushMessage("dsc", sessionID, error, errorMessage);
-    }
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sessionID << error << errorMessage;
+    RelayToNodes(MakeSharedMessage("dsc", ss), false);
 }
 
 void RelayDarkSendTransaction(const CTransaction txNew, const CTxIn vin, const std::vector<unsigned char> vchSig, const int64 sigTime){
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes) {
-        if(!pnode->fRelayTxes) continue;
-        pnode->PushMessage("dstx", txNew, vin, vchSig, sigTime);
-    }
-}
\ No newline at end of file
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << txNew << vin << vchSig << sigTime;
+    RelayToNodes(MakeSharedMessage("dstx", ss), true);
+}
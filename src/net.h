@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -45,7 +46,14 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
+/** The one of nThreads message handler threads a node is pinned to */
+int GetMessageHandler(const CNode* pnode, int nThreads);
+/** Whether handler thread nThread of nThreads may help with the messages
+ *  waiting for a node pinned to another, which must still take its cs_messageHandler */
+bool CanHelpWithMessages(CNode* pnode, int nThread, int nThreads);
 void SocketSendData(CNode *pnode);
+/** Have the socket handler thread look at all nodes again, for sends it isn't waiting for */
+void WakeupSocketHandler();
 
 typedef int NodeId;
 
@@ -82,9 +90,6 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
@@ -94,6 +99,47 @@ extern NodeId nLastNodeId;
 extern CCriticalSection cs_nLastNodeId;
 
 
+/** A complete message, header and checksum included, as queued for sending.
+ *  A message for many nodes is built once and queued to all of them. */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload);
+/** Frames a payload that follows HEADER_SIZE bytes of room in vchMessage,
+ *  taking the buffer over */
+CSharedMessage MakeSharedMessage(const char* pszCommand, CSerializeData& vchMessage);
+
+/** The messages for objects we relay and serve, by inv, so that sending
+ *  one to many nodes costs a single serialization. Entries are dropped
+ *  nLifetime seconds after they were added, or earlier, oldest first, once
+ *  the messages take more than nMaxSize bytes. */
+class CRelayCache
+{
+private:
+    mutable CCriticalSection cs;
+    std::map<CInv, CSharedMessage> mapMessages;
+    std::deque<std::pair<int64, CInv> > vExpiration;
+    size_t nMaxSize;
+    int64 nLifetime;
+    size_t nSize;
+
+    void Expire();
+
+public:
+    CRelayCache(size_t nMaxSizeIn, int64 nLifetimeIn);
+
+    /** An inv keeps the first message added for it, so that the original
+     *  serialization of a relayed object is preserved */
+    void Add(const CInv& inv, const CSharedMessage& msg);
+    /** The message for an inv, or NULL */
+    CSharedMessage Find(const CInv& inv);
+
+    size_t GetCount() const;
+    size_t GetSize() const;
+};
+
+extern CRelayCache relayCache;
+
+
 class CNodeStats
 {
 public:
@@ -111,6 +157,8 @@ public:
     uint64 nRecvBytes;
     uint64 nBlocksRequested;
     bool fSyncNode;
+    int nRecvQueued;        // -1 if the node's messages were busy
+    int nMessageHandler;
 };
 
 
@@ -127,11 +175,14 @@ public:
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
+    bool fSigQueued;                // signature handed to darkSendSignatureQueue
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        fSigQueued = false;
     }
 
     bool complete() const
@@ -147,6 +198,14 @@ public:
         vRecv.SetVersion(nVersionIn);
     }
 
+    // The part of the payload not received yet. Data received to it in
+    // place is not copied again by readData.
+    char* GetDataBuffer(unsigned int& nBytes)
+    {
+        nBytes = hdr.nMessageSize - nDataPos;
+        return &vRecv[nDataPos];
+    }
+
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
 };
@@ -166,7 +225,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64 nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -174,6 +233,19 @@ public:
     CCriticalSection cs_vRecvMsg;
     uint64 nRecvBytes;
     int nRecvVersion;
+    int nRecvQueued;        // complete messages in vRecvMsg, not processed yet
+
+    // Held by the message handler thread working on this node, either the
+    // one it is pinned to or one that took its messages while idle, so its
+    // messages are still processed one after the other
+    CCriticalSection cs_messageHandler;
+
+    // Socket readiness, for the socket handler thread. Sockets are only
+    // reported again once they were read or written until they would block.
+    bool fSocketRegistered;
+    bool fRecvReady;
+    bool fSendReady;
+    bool fRecvThrottled;    // not read further, the receive buffer is full
 
     int64 nLastSend;
     int64 nLastRecv;
@@ -226,6 +298,7 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_addr;
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown;
@@ -241,6 +314,11 @@ public:
         nServices = 0;
         hSocket = hSocketIn;
         nRecvVersion = INIT_PROTO_VERSION;
+        nRecvQueued = 0;
+        fSocketRegistered = false;
+        fRecvReady = false;
+        fSendReady = false;
+        fRecvThrottled = false;
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
@@ -320,6 +398,16 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // Where the rest of the payload of the message being received can be
+    // read to, or NULL between messages
+    char* GetRecvDataBuffer(unsigned int& nBytes)
+    {
+        if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+            return NULL;
+        return vRecvMsg.back().GetDataBuffer(nBytes);
+    }
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -343,6 +431,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addr);
         setAddrKnown.insert(addr);
     }
 
@@ -351,6 +440,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addr);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -449,15 +539,35 @@ public:
 
         LogPrint("net2", "(%d bytes)\n", nSize);
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        CSerializeData* pdata = new CSerializeData();
+        ssSend.GetAndClear(*pdata);
+        QueueMessage(CSharedMessage(pdata));
+
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    // requires LOCK(cs_vSend)
+    void QueueMessage(const CSharedMessage& msg)
+    {
+        vSendMsg.push_back(msg);
+        nSendSize += msg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
+        {
             SocketSendData(this);
+            // the rest goes out when the socket handler sees room
+            if (!vSendMsg.empty())
+                WakeupSocketHandler();
+        }
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    // Queue a message that was built for several nodes
+    void PushMessage(const CSharedMessage& msg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net2", "sending (peer=%d): shared message (%"PRIszu" bytes)\n", id, msg->size());
+        QueueMessage(msg);
     }
 
     void PushVersion();
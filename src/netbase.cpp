@@ -10,6 +10,7 @@
 
 #ifndef WIN32
 #include <sys/fcntl.h>
+#include <poll.h>
 #endif
 
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
@@ -350,6 +351,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINVAL)
         {
+#ifdef WIN32
             struct timeval timeout;
             timeout.tv_sec  = nTimeout / 1000;
             timeout.tv_usec = (nTimeout % 1000) * 1000;
@@ -358,6 +360,13 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
             FD_ZERO(&fdset);
             FD_SET(hSocket, &fdset);
             int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+#else
+            // the descriptor may be beyond FD_SETSIZE with many connections
+            struct pollfd pollfdSocket;
+            pollfdSocket.fd = hSocket;
+            pollfdSocket.events = POLLOUT;
+            int nRet = poll(&pollfdSocket, 1, nTimeout);
+#endif
             if (nRet == 0)
             {
                 LogPrintf("connection timeout\n");
@@ -366,7 +375,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
             }
             if (nRet == SOCKET_ERROR)
             {
-                LogPrintf("select() for connection failed: %i\n",WSAGetLastError());
+                LogPrintf("waiting for connection failed: %i\n",WSAGetLastError());
                 closesocket(hSocket);
                 return false;
             }
@@ -383,7 +392,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
             }
             if (nRet != 0)
             {
-                LogPrintf("connect() failed after select(): %s\n",strerror(nRet));
+                LogPrintf("connect() failed after waiting: %s\n",strerror(nRet));
                 closesocket(hSocket);
                 return false;
             }
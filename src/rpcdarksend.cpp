@@ -74,9 +74,16 @@ Value getpoolinfo(const Array& params, bool fHelp)
             "getpoolinfo\n"
             "Returns an object containing anonymous pool-related information.");
 
+    int nWinner = GetCurrentMasterNode();
+    int nCurrent;
+    {
+        READ_LOCK(darkSendMasterNodes.cs);
+        nCurrent = darkSendMasterNodes.FindById(nWinner);
+    }
+
     Object obj;
     obj.push_back(Pair("connected_to_masternode",        activeMasternode.masterNodeAddr));
-    obj.push_back(Pair("current_masternode",        GetCurrentMasterNode()));
+    obj.push_back(Pair("current_masternode",        nCurrent));
     obj.push_back(Pair("state",        darkSendPool.GetState()));
     obj.push_back(Pair("entries",      darkSendPool.GetEntriesCount()));
     obj.push_back(Pair("entries_accepted",      darkSendPool.GetCountEntriesAccepted()));
@@ -91,9 +98,10 @@ Value masternode(const Array& params, bool fHelp)
 
     if (fHelp  ||
         (strCommand != "start" && strCommand != "start-many" && strCommand != "stop" && strCommand != "list" && strCommand != "count"  && strCommand != "enforce"
-            && strCommand != "debug" && strCommand != "current" && strCommand != "winners" && strCommand != "genkey" && strCommand != "connect"))
+            && strCommand != "debug" && strCommand != "current" && strCommand != "winners" && strCommand != "genkey" && strCommand != "connect"
+            && strCommand != "sigqueue"))
         throw runtime_error(
-            "masternode <start|start-many|stop|list|count|debug|current|winners|genkey|enforce> passphrase\n");
+            "masternode <start|start-many|stop|list|count|debug|current|winners|genkey|enforce|sigqueue> passphrase\n");
 
     if (strCommand == "stop")
     {
@@ -137,8 +145,9 @@ Value masternode(const Array& params, bool fHelp)
                 "list supports 'active', 'vin', 'pubkey', 'lastseen', 'activeseconds', 'rank'\n");
         }
 
+        // a copy, as the rank lookups take the list's lock themselves
         Object obj;
-        BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
+        BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes.GetAll()) {
             mn.Check();   
 
             if(strCommand == "active"){
@@ -163,7 +172,24 @@ Value masternode(const Array& params, bool fHelp)
         }
         return obj;
     }
-    if (strCommand == "count") return (int)darkSendMasterNodes.size();
+    if (strCommand == "count") {
+        READ_LOCK(darkSendMasterNodes.cs);
+        return (int)darkSendMasterNodes.size();
+    }
+
+    if (strCommand == "sigqueue") {
+        CSignatureQueueStats stats = darkSendSignatureQueue.GetStats();
+        Object obj;
+        obj.push_back(Pair("queued", (boost::int64_t)stats.nQueued));
+        obj.push_back(Pair("batches", (boost::int64_t)stats.nBatches));
+        obj.push_back(Pair("lastdepth", (int)stats.nLastDepth));
+        obj.push_back(Pair("maxdepth", (int)stats.nMaxDepth));
+        obj.push_back(Pair("verifyms", 0.001 * stats.nVerifyMicros));
+        obj.push_back(Pair("maxverifyms", 0.001 * stats.nMaxVerifyMicros));
+        obj.push_back(Pair("hits", (boost::int64_t)stats.nHits));
+        obj.push_back(Pair("misses", (boost::int64_t)stats.nMisses));
+        return obj;
+    }
 
     if (strCommand == "start")
     {
@@ -256,7 +282,9 @@ Value masternode(const Array& params, bool fHelp)
 
     if (strCommand == "current")
     {
-        int winner = GetCurrentMasterNode(1);
+        int nWinner = GetCurrentMasterNode(1);
+        READ_LOCK(darkSendMasterNodes.cs);
+        int winner = darkSendMasterNodes.FindById(nWinner);
         if(winner >= 0) {
             return darkSendMasterNodes[winner].addr.ToString().c_str();
         }
@@ -63,6 +63,9 @@ Value importprivkey(const Array& params, bool fHelp)
 
         if (!pwalletMain->AddKeyPubKey(key, pubkey))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+        // an imported key can make more darksend inputs ours; keys from the
+        // key pool are new, so generating them doesn't
+        pwalletMain->ClearDarksendRounds();
 
         if (fRescan) {
             pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
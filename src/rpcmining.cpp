@@ -411,6 +411,126 @@ Value getwork(const Array& params, bool fHelp)
 }
 
 
+// getblocktemplate keeps a single template. It is rebuilt when the tip
+// changes, or when the memory pool changed and the template is more than
+// 5 seconds old. nTemplateChanges only counts the rebuilds that changed the
+// transactions or the payee; long polls wait on it. The JSON list of
+// transactions is made along with the template, reusing the serialized
+// data of the transactions the previous template had. All of this state is
+// protected by cs_main.
+static CBlockTemplate* pblocktemplateCached = NULL;
+static CBlockIndex* pindexPrevCached = NULL;
+static unsigned int nTransactionsUpdatedCached = 0;
+static int64 nTimeCached = 0;
+static unsigned int nTemplateChanges = 0;
+static Array arrCachedTransactions;
+static map<uint256, string> mapCachedTxData;
+
+// A long poll holds its RPC thread while it waits, so they may only use
+// -rpcthreads - 1 of them, keeping one free for other calls
+static CCriticalSection cs_nLongPolls;
+static int nLongPolls = 0;
+
+bool CLongPollSlot::Take()
+{
+    if (fTaken)
+        return true;
+    LOCK(cs_nLongPolls);
+    if (nLongPolls >= GetArg("-rpcthreads", 4) - 1)
+        return false;
+    nLongPolls++;
+    fTaken = true;
+    return true;
+}
+
+CLongPollSlot::~CLongPollSlot()
+{
+    if (fTaken) {
+        LOCK(cs_nLongPolls);
+        nLongPolls--;
+    }
+}
+
+static void UpdateBlockTemplate()
+{
+    if (pblocktemplateCached && pindexPrevCached == pindexBest &&
+        (nTransactionsUpdated == nTransactionsUpdatedCached || GetTime() - nTimeCached <= 5))
+        return;
+
+    // Store the pindexBest used before CreateNewBlock, to avoid races
+    unsigned int nTransactionsUpdatedNew = nTransactionsUpdated;
+    CBlockIndex* pindexPrevNew = pindexBest;
+
+    CScript scriptDummy = CScript() << OP_TRUE;
+    CBlockTemplate* pblocktemplate = CreateNewBlock(scriptDummy);
+    if (!pblocktemplate)
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+    const CBlock& block = pblocktemplate->block;
+
+    vector<uint256> vHashes;
+    vHashes.reserve(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vHashes.push_back(tx.GetHash());
+
+    bool fChanged = (pblocktemplateCached == NULL || pindexPrevNew != pindexPrevCached ||
+                     block.payee != pblocktemplateCached->block.payee ||
+                     block.vtx.size() != pblocktemplateCached->block.vtx.size());
+    for (unsigned int i = 1; !fChanged && i < block.vtx.size(); i++)
+        fChanged = (vHashes[i] != pblocktemplateCached->block.vtx[i].GetHash());
+
+    Array transactions;
+    map<uint256, int64_t> setTxIndex;
+    map<uint256, string> mapTxData;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        const CTransaction& tx = block.vtx[i];
+        const uint256& txHash = vHashes[i];
+        setTxIndex[txHash] = i;
+
+        if (tx.IsCoinBase())
+            continue;
+
+        Object entry;
+
+        string& strData = mapTxData[txHash];
+        map<uint256, string>::iterator mi = mapCachedTxData.find(txHash);
+        if (mi != mapCachedTxData.end())
+            strData.swap(mi->second);
+        else
+        {
+            CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+            ssTx << tx;
+            strData = HexStr(ssTx.begin(), ssTx.end());
+        }
+        entry.push_back(Pair("data", strData));
+
+        entry.push_back(Pair("hash", txHash.GetHex()));
+
+        Array deps;
+        BOOST_FOREACH (const CTxIn &in, tx.vin)
+        {
+            if (setTxIndex.count(in.prevout.hash))
+                deps.push_back(setTxIndex[in.prevout.hash]);
+        }
+        entry.push_back(Pair("depends", deps));
+
+        entry.push_back(Pair("fee", pblocktemplate->vTxFees[i]));
+        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[i]));
+
+        transactions.push_back(entry);
+    }
+
+    delete pblocktemplateCached;
+    pblocktemplateCached = pblocktemplate;
+    pindexPrevCached = pindexPrevNew;
+    nTransactionsUpdatedCached = nTransactionsUpdatedNew;
+    nTimeCached = GetTime();
+    if (fChanged)
+        nTemplateChanges++;
+    arrCachedTransactions.swap(transactions);
+    mapCachedTxData.swap(mapTxData);
+}
+
 Value getblocktemplate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -436,12 +556,16 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"votes\" : show vote candidates for this block\n"
             "  \"masternode_payments\" : if masternode payments are active\n"
             "  \"masternode_payments_enforcing\" : if masternode payments are being actively enforced by the network\n"
+            "  \"longpollid\" : pass it back as \"longpollid\" to wait until there is a newer template;\n"
+            "                 each waiting call holds one of the -rpcthreads, and one is kept for other calls\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
+        lpval = find_value(oparam, "longpollid");
         const Value& modeval = find_value(oparam, "mode");
         if (modeval.type() == str_type)
             strMode = modeval.get_str();
@@ -462,76 +586,53 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "DarkCoin is downloading blocks...");
 
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64 nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    if (lpval.type() == str_type)
     {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
+        // Long polling: wait until the template the client named by its
+        // longpollid is out of date. cs_main is only held while checking.
+        const std::string& lpstr = lpval.get_str();
+        if (lpstr.size() < 64)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+        uint256 hashWatchedChain;
+        hashWatchedChain.SetHex(lpstr.substr(0, 64));
+        unsigned int nChangesWatched = atoi64(lpstr.substr(64));
+        CLongPollSlot slot;
+        // Only a new tip wakes the wait. Pool changes are looked for after
+        // a minute, and then every 10 seconds.
+        int64 nTimeCheckPool = GetTime() + 60;
+        while (true)
         {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
+            // taken before the check, so a new tip after it wakes the wait
+            unsigned int nNotifyCount = GetTemplateNotifyCount();
+            int64 nTimeLimit = nTimeCheckPool;
+            {
+                LOCK(cs_main);
+                UpdateBlockTemplate();
+                if (pindexPrevCached->GetBlockHash() != hashWatchedChain || nTemplateChanges != nChangesWatched)
+                    break;
+                // Pool changes are only picked up once the template is 5 seconds old
+                if (nTransactionsUpdated != nTransactionsUpdatedCached)
+                    nTimeLimit = std::min(nTimeLimit, nTimeCached + 6);
+            }
+            if (!slot.Take())
+                throw JSONRPCError(RPC_MISC_ERROR, "Too many long polls waiting, raise -rpcthreads");
+            WaitForTemplateChange(nNotifyCount, nTimeLimit);
+            if (GetTime() >= nTimeCheckPool)
+                nTimeCheckPool = GetTime() + 10;
+            if (ShutdownRequested())
+                throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
         }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
     }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+
+    LOCK(cs_main);
+    UpdateBlockTemplate();
+    CBlockIndex* pindexPrev = pindexPrevCached;
+    CBlock* pblock = &pblocktemplateCached->block; // pointer for convenience
 
     // Update nTime
     pblock->UpdateTime(pindexPrev);
     pblock->nNonce = 0;
 
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
-    {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
-
-        if (tx.IsCoinBase())
-            continue;
-
-        Object entry;
-
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
-
-        entry.push_back(Pair("hash", txHash.GetHex()));
-
-        Array deps;
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
-        {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
-        }
-        entry.push_back(Pair("depends", deps));
-
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
-
-        transactions.push_back(entry);
-    }
-
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
@@ -550,9 +651,10 @@ Value getblocktemplate(const Array& params, bool fHelp)
     Object result;
     result.push_back(Pair("version", pblock->nVersion));
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
-    result.push_back(Pair("transactions", transactions));
+    result.push_back(Pair("transactions", arrCachedTransactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].GetValueOut()));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + strprintf("%u", nTemplateChanges)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
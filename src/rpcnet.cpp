@@ -2,6 +2,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "main.h"
 #include "net.h"
 #include "bitcoinrpc.h"
 #include "alert.h"
@@ -65,6 +66,9 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("inbound", stats.fInbound));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        obj.push_back(Pair("msghandler", stats.nMessageHandler));
+        if (stats.nRecvQueued >= 0)
+            obj.push_back(Pair("msgqueue", stats.nRecvQueued));
         if (stats.fSyncNode)
             obj.push_back(Pair("syncnode", true));
 
@@ -74,6 +78,34 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getlockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getlockstats\n"
+            "Returns, per protocol message command, how often it was processed, whether\n"
+            "that happens with cs_main held, the time spent waiting for cs_main and the\n"
+            "time spent processing, in milliseconds.");
+
+    map<string, CMessageLockStats> mapStats;
+    GetMessageLockStats(mapStats);
+
+    Object ret;
+    for (map<string, CMessageLockStats>::const_iterator mi = mapStats.begin(); mi != mapStats.end(); ++mi)
+    {
+        const CMessageLockStats& stats = mi->second;
+        Object obj;
+        obj.push_back(Pair("count", (boost::int64_t)stats.nCount));
+        obj.push_back(Pair("cs_main", stats.fChainLock));
+        obj.push_back(Pair("waitms", 0.001 * stats.nWaitMicros));
+        obj.push_back(Pair("holdms", 0.001 * stats.nHoldMicros));
+        obj.push_back(Pair("maxholdms", 0.001 * stats.nMaxHoldMicros));
+        ret.push_back(Pair(mi->first, obj));
+    }
+
+    return ret;
+}
+
 Value addnode(const Array& params, bool fHelp)
 {
     string strCommand;
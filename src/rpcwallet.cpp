@@ -805,6 +805,8 @@ Value addmultisigaddress(const Array& params, bool fHelp)
     CScript inner = _createmultisig(params);
     CScriptID innerID = inner.GetID();
     pwalletMain->AddCScript(inner);
+    // an imported script can make more darksend inputs ours
+    pwalletMain->ClearDarksendRounds();
 
     pwalletMain->SetAddressBookName(innerID, strAccount);
     return CBitcoinAddress(innerID).ToString();
@@ -0,0 +1,1235 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "secp256k1.h"
+
+#include <string.h>
+
+namespace {
+
+//
+// 64x64 bit multiplication, and a 192 bit accumulator for the column sums of
+// multi-limb products
+//
+
+inline void Mul64(uint64_t a, uint64_t b, uint64_t& lo, uint64_t& hi)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 t = (unsigned __int128)a * b;
+    lo = (uint64_t)t;
+    hi = (uint64_t)(t >> 64);
+#else
+    uint64_t al = (uint32_t)a, ah = a >> 32, bl = (uint32_t)b, bh = b >> 32;
+    uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+    uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+    lo = (mid << 32) | (uint32_t)ll;
+    hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+struct CAcc
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 c01;
+    uint64_t c2;
+
+    CAcc() : c01(0), c2(0) { }
+
+    void MulAdd(uint64_t a, uint64_t b)
+    {
+        unsigned __int128 t = (unsigned __int128)a * b;
+        c01 += t;
+        c2 += (c01 < t);
+    }
+
+    void Add(uint64_t a)
+    {
+        c01 += a;
+        c2 += (c01 < a);
+    }
+
+    uint64_t Low() const { return (uint64_t)c01; }
+
+    // Take the low 64 bits out
+    uint64_t Extract()
+    {
+        uint64_t r = (uint64_t)c01;
+        c01 = (c01 >> 64) | ((unsigned __int128)c2 << 64);
+        c2 = 0;
+        return r;
+    }
+#else
+    uint64_t c0, c1, c2;
+
+    CAcc() : c0(0), c1(0), c2(0) { }
+
+    void MulAdd(uint64_t a, uint64_t b)
+    {
+        uint64_t lo, hi;
+        Mul64(a, b, lo, hi);
+        c0 += lo;
+        hi += (c0 < lo);
+        c1 += hi;
+        c2 += (c1 < hi);
+    }
+
+    void Add(uint64_t a)
+    {
+        c0 += a;
+        uint64_t k = (c0 < a);
+        c1 += k;
+        c2 += (c1 < k);
+    }
+
+    uint64_t Low() const { return c0; }
+
+    // Take the low 64 bits out
+    uint64_t Extract()
+    {
+        uint64_t r = c0;
+        c0 = c1;
+        c1 = c2;
+        c2 = 0;
+        return r;
+    }
+#endif
+};
+
+// 512 bit product of two 256 bit numbers
+inline void Mul256(uint64_t t[8], const uint64_t a[4], const uint64_t b[4])
+{
+    CAcc c;
+    for (int k = 0; k < 7; k++) {
+        for (int i = (k > 3 ? k - 3 : 0); i <= (k < 3 ? k : 3); i++)
+            c.MulAdd(a[i], b[k - i]);
+        t[k] = c.Extract();
+    }
+    t[7] = c.Extract();
+}
+
+inline void Read256(uint64_t r[4], const unsigned char* b)
+{
+    for (int i = 0; i < 4; i++) {
+        const unsigned char* p = b + 24 - 8 * i;
+        r[i] = ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+               ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+    }
+}
+
+inline void Write256(unsigned char* b, const uint64_t a[4])
+{
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 8; j++)
+            b[31 - 8 * i - j] = a[i] >> (8 * j);
+}
+
+// Variable time comparison, for public values only
+inline bool Less256(const uint64_t a[4], const uint64_t b[4])
+{
+    for (int i = 3; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] < b[i];
+    return false;
+}
+
+inline void Cleanse(void* p, size_t n)
+{
+    volatile unsigned char* v = (volatile unsigned char*)p;
+    while (n--)
+        *v++ = 0;
+}
+
+//
+// Field elements mod p = 2^256 - 0x1000003D1, always fully reduced
+//
+
+struct CFe
+{
+    uint64_t n[4];
+};
+
+const uint64_t FE_C = 0x1000003D1ULL;
+const uint64_t FE_P[4] = {0xFFFFFFFEFFFFFC2FULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL};
+const CFe FE_BETA = {{0xC1396C28719501EEULL, 0x9CF0497512F58995ULL, 0x6E64479EAC3434E9ULL, 0x7AE96A2B657C0710ULL}};
+
+inline void FeSetInt(CFe& r, uint64_t a)
+{
+    r.n[0] = a;
+    r.n[1] = r.n[2] = r.n[3] = 0;
+}
+
+inline bool FeIsZero(const CFe& a) { return (a.n[0] | a.n[1] | a.n[2] | a.n[3]) == 0; }
+inline bool FeIsOdd(const CFe& a) { return a.n[0] & 1; }
+inline bool FeEqual(const CFe& a, const CFe& b) { return ((a.n[0] ^ b.n[0]) | (a.n[1] ^ b.n[1]) | (a.n[2] ^ b.n[2]) | (a.n[3] ^ b.n[3])) == 0; }
+
+bool FeSetB32(CFe& r, const unsigned char* b)
+{
+    Read256(r.n, b);
+    return Less256(r.n, FE_P);
+}
+
+inline void FeGetB32(unsigned char* b, const CFe& a) { Write256(b, a.n); }
+
+// r = mask ? a : r
+inline void FeCMov(CFe& r, const CFe& a, uint64_t mask)
+{
+    for (int i = 0; i < 4; i++)
+        r.n[i] = (a.n[i] & mask) | (r.n[i] & ~mask);
+}
+
+// Subtract p from top*2^256 + r if that is at least p. The value must be
+// below 2p.
+inline void FeFinal(CFe& r, uint64_t top)
+{
+    CFe t;
+    uint64_t carry = FE_C;
+    for (int i = 0; i < 4; i++) {
+        t.n[i] = r.n[i] + carry;
+        carry = (t.n[i] < carry);
+    }
+    // r + 0x1000003D1 carries out exactly when r >= p
+    FeCMov(r, t, 0 - (carry | top));
+}
+
+inline void FeAdd(CFe& r, const CFe& a, const CFe& b)
+{
+    uint64_t carry = 0;
+    for (int i = 0; i < 4; i++) {
+        uint64_t t = a.n[i] + carry;
+        uint64_t c1 = (t < carry);
+        r.n[i] = t + b.n[i];
+        carry = c1 | (r.n[i] < t);
+    }
+    FeFinal(r, carry);
+}
+
+inline void FeSub(CFe& r, const CFe& a, const CFe& b)
+{
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; i++) {
+        uint64_t d = a.n[i] - b.n[i];
+        uint64_t b1 = (a.n[i] < b.n[i]);
+        uint64_t b2 = (d < borrow);
+        r.n[i] = d - borrow;
+        borrow = b1 | b2;
+    }
+    // On a borrow add p, which modulo 2^256 is subtracting 0x1000003D1
+    uint64_t sub = FE_C & (0 - borrow);
+    borrow = (r.n[0] < sub);
+    r.n[0] -= sub;
+    for (int i = 1; i < 4; i++) {
+        uint64_t b1 = (r.n[i] < borrow);
+        r.n[i] -= borrow;
+        borrow = b1;
+    }
+}
+
+inline void FeNegate(CFe& r, const CFe& a)
+{
+    CFe zero;
+    FeSetInt(zero, 0);
+    FeSub(r, zero, a);
+}
+
+void FeMul(CFe& r, const CFe& a, const CFe& b)
+{
+    uint64_t t[8];
+    Mul256(t, a.n, b.n);
+
+    // 2^256 = 0x1000003D1 (mod p): fold the top half in, twice
+    uint64_t u[5];
+    CAcc c;
+    for (int i = 0; i < 4; i++) {
+        c.Add(t[i]);
+        c.MulAdd(t[4 + i], FE_C);
+        u[i] = c.Extract();
+    }
+    u[4] = c.Extract();
+
+    CAcc d;
+    d.Add(u[0]);
+    d.MulAdd(u[4], FE_C);
+    r.n[0] = d.Extract();
+    for (int i = 1; i < 4; i++) {
+        d.Add(u[i]);
+        r.n[i] = d.Extract();
+    }
+
+    // a last carry leaves r small, so adding it back in can't carry again
+    CAcc e;
+    e.Add(r.n[0]);
+    e.Add(FE_C & (0 - d.Low()));
+    r.n[0] = e.Extract();
+    for (int i = 1; i < 4; i++) {
+        e.Add(r.n[i]);
+        r.n[i] = e.Extract();
+    }
+    FeFinal(r, 0);
+}
+
+inline void FeSqr(CFe& r, const CFe& a) { FeMul(r, a, a); }
+
+inline void FeSqrN(CFe& r, const CFe& a, int n)
+{
+    r = a;
+    while (n--)
+        FeSqr(r, r);
+}
+
+// The addition chain shared by inversion and square roots: a^(2^223 - 1),
+// a^(2^22 - 1) and a^3
+void FePowChain(CFe& x223, CFe& x22, CFe& x2, const CFe& a)
+{
+    CFe x3, x6, x9, x11, x44, x88, x176, x220;
+    FeSqr(x2, a);
+    FeMul(x2, x2, a);
+    FeSqr(x3, x2);
+    FeMul(x3, x3, a);
+    FeSqrN(x6, x3, 3);
+    FeMul(x6, x6, x3);
+    FeSqrN(x9, x6, 3);
+    FeMul(x9, x9, x3);
+    FeSqrN(x11, x9, 2);
+    FeMul(x11, x11, x2);
+    FeSqrN(x22, x11, 11);
+    FeMul(x22, x22, x11);
+    FeSqrN(x44, x22, 22);
+    FeMul(x44, x44, x22);
+    FeSqrN(x88, x44, 44);
+    FeMul(x88, x88, x44);
+    FeSqrN(x176, x88, 88);
+    FeMul(x176, x176, x88);
+    FeSqrN(x220, x176, 44);
+    FeMul(x220, x220, x44);
+    FeSqrN(x223, x220, 3);
+    FeMul(x223, x223, x3);
+}
+
+// r = a^(p-2) = 1/a, in constant time
+void FeInv(CFe& r, const CFe& a)
+{
+    CFe x223, x22, x2, t;
+    FePowChain(x223, x22, x2, a);
+    FeSqrN(t, x223, 23);
+    FeMul(t, t, x22);
+    FeSqrN(t, t, 5);
+    FeMul(t, t, a);
+    FeSqrN(t, t, 3);
+    FeMul(t, t, x2);
+    FeSqrN(t, t, 2);
+    FeMul(r, t, a);
+}
+
+// r = a^((p+1)/4), a square root of a if there is one
+bool FeSqrt(CFe& r, const CFe& a)
+{
+    CFe x223, x22, x2, t;
+    FePowChain(x223, x22, x2, a);
+    FeSqrN(t, x223, 23);
+    FeMul(t, t, x22);
+    FeSqrN(t, t, 6);
+    FeMul(t, t, x2);
+    FeSqrN(r, t, 2);
+    FeSqr(t, r);
+    return FeEqual(t, a);
+}
+
+//
+// Scalars mod the group order n
+//
+
+struct CScalar
+{
+    uint64_t d[4];
+};
+
+const uint64_t N_0 = 0xBFD25E8CD0364141ULL;
+const uint64_t N_1 = 0xBAAEDCE6AF48A03BULL;
+const uint64_t N_2 = 0xFFFFFFFFFFFFFFFEULL;
+const uint64_t N_3 = 0xFFFFFFFFFFFFFFFFULL;
+
+// 2^256 - n
+const uint64_t NC_0 = 0x402DA1732FC9BEBFULL;
+const uint64_t NC_1 = 0x4551231950B75FC4ULL;
+
+// n / 2
+const uint64_t NH[4] = {0xDFE92F46681B20A0ULL, 0x5D576E7357A4501DULL, 0xFFFFFFFFFFFFFFFFULL, 0x7FFFFFFFFFFFFFFFULL};
+
+// p - n: x coordinates below it have a second candidate, x + n
+const uint64_t PMN[4] = {0x402DA1722FC9BAEEULL, 0x4551231950B75FC4ULL, 1, 0};
+
+const CScalar SC_LAMBDA = {{0xDF02967C1B23BD72ULL, 0x122E22EA20816678ULL, 0xA5261C028812645AULL, 0x5363AD4CC05C30E0ULL}};
+
+inline bool ScalarIsZero(const CScalar& a) { return (a.d[0] | a.d[1] | a.d[2] | a.d[3]) == 0; }
+inline bool ScalarEqual(const CScalar& a, const CScalar& b) { return ((a.d[0] ^ b.d[0]) | (a.d[1] ^ b.d[1]) | (a.d[2] ^ b.d[2]) | (a.d[3] ^ b.d[3])) == 0; }
+
+// Whether a >= n, in constant time
+inline uint64_t ScalarCheckOverflow(const CScalar& a)
+{
+    uint64_t yes = 0, no = 0;
+    no |= (a.d[3] < N_3);
+    no |= (a.d[2] < N_2);
+    yes |= (a.d[2] > N_2) & ~no;
+    no |= (a.d[1] < N_1);
+    yes |= (a.d[1] > N_1) & ~no;
+    yes |= (a.d[0] >= N_0) & ~no;
+    return yes & 1;
+}
+
+// Subtract n from overflow*2^256 + r if overflow is set
+inline void ScalarReduce(CScalar& r, uint64_t overflow)
+{
+    uint64_t mask = 0 - overflow;
+    CAcc c;
+    c.Add(r.d[0]);
+    c.Add(NC_0 & mask);
+    r.d[0] = c.Extract();
+    c.Add(r.d[1]);
+    c.Add(NC_1 & mask);
+    r.d[1] = c.Extract();
+    c.Add(r.d[2]);
+    c.Add(overflow);
+    r.d[2] = c.Extract();
+    c.Add(r.d[3]);
+    r.d[3] = c.Extract();
+}
+
+inline void ScalarSetB32(CScalar& r, const unsigned char* b, bool& fOverflow)
+{
+    Read256(r.d, b);
+    uint64_t overflow = ScalarCheckOverflow(r);
+    ScalarReduce(r, overflow);
+    fOverflow = overflow;
+}
+
+inline void ScalarGetB32(unsigned char* b, const CScalar& a) { Write256(b, a.d); }
+
+void ScalarAdd(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    CAcc c;
+    for (int i = 0; i < 4; i++) {
+        c.Add(a.d[i]);
+        c.Add(b.d[i]);
+        r.d[i] = c.Extract();
+    }
+    ScalarReduce(r, c.Low() | ScalarCheckOverflow(r));
+}
+
+void ScalarNegate(CScalar& r, const CScalar& a)
+{
+    const uint64_t N[4] = {N_0, N_1, N_2, N_3};
+    uint64_t mask = 0 - (uint64_t)!ScalarIsZero(a);
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; i++) {
+        uint64_t d = N[i] - a.d[i];
+        uint64_t b1 = (N[i] < a.d[i]);
+        uint64_t b2 = (d < borrow);
+        r.d[i] = (d - borrow) & mask;
+        borrow = b1 | b2;
+    }
+}
+
+// r[0..nr) = a[0..4) + b[0..nb) * (2^256 - n)
+void ScalarFold(uint64_t* r, int nr, const uint64_t* a, const uint64_t* b, int nb)
+{
+    CAcc c;
+    for (int k = 0; k < nr; k++) {
+        if (k < 4)
+            c.Add(a[k]);
+        for (int i = 0; i < nb && i <= k; i++) {
+            if (k - i == 0)
+                c.MulAdd(b[i], NC_0);
+            else if (k - i == 1)
+                c.MulAdd(b[i], NC_1);
+            else if (k - i == 2)
+                c.Add(b[i]);
+        }
+        r[k] = c.Extract();
+    }
+}
+
+void ScalarMul(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    uint64_t l[8], m[7], p[5], q[5];
+    Mul256(l, a.d, b.d);
+    // 2^256 = 2^256 - n (mod n), which is 129 bits: 512 -> 385 -> 258 -> 256 bits
+    ScalarFold(m, 7, l, l + 4, 4);
+    ScalarFold(p, 5, m, m + 4, 3);
+    ScalarFold(q, 5, p, p + 4, 1);
+    for (int i = 0; i < 4; i++)
+        r.d[i] = q[i];
+    ScalarReduce(r, q[4] | ScalarCheckOverflow(r));
+}
+
+// r = a^(n-2) = 1/a, four exponent bits at a time. The exponent is public,
+// so this is constant time.
+void ScalarInverse(CScalar& r, const CScalar& a)
+{
+    const uint64_t E[4] = {N_0 - 2, N_1, N_2, N_3};
+    CScalar pow[16];
+    pow[1] = a;
+    for (int i = 2; i < 16; i++)
+        ScalarMul(pow[i], pow[i - 1], a);
+    CScalar x = pow[E[3] >> 60];
+    for (int i = 62; i >= 0; i--) {
+        for (int j = 0; j < 4; j++)
+            ScalarMul(x, x, x);
+        int nibble = (E[i / 16] >> ((i % 16) * 4)) & 15;
+        if (nibble)
+            ScalarMul(x, x, pow[nibble]);
+    }
+    r = x;
+    Cleanse(pow, sizeof(pow));
+}
+
+inline bool ScalarIsHigh(const CScalar& a) { return Less256(NH, a.d); }
+
+// r = round(a * b / 2^384)
+void ScalarMulShift384(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    uint64_t l[8];
+    Mul256(l, a.d, b.d);
+    CAcc c;
+    c.Add(l[6]);
+    c.Add(l[5] >> 63);
+    r.d[0] = c.Extract();
+    c.Add(l[7]);
+    r.d[1] = c.Extract();
+    r.d[2] = r.d[3] = 0;
+}
+
+// Split k into r1 + r2 * lambda, both r1 and r2 (or their negations) below
+// 2^128. lambda is a cube root of 1 mod n: lambda * (x, y) = (beta * x, y).
+void ScalarSplitLambda(CScalar& r1, CScalar& r2, const CScalar& k)
+{
+    static const CScalar minus_b1 = {{0x6F547FA90ABFE4C3ULL, 0xE4437ED6010E8828ULL, 0, 0}};
+    static const CScalar minus_b2 = {{0xD765CDA83DB1562CULL, 0x8A280AC50774346DULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL}};
+    static const CScalar g1 = {{0xE893209A45DBB031ULL, 0x3DAA8A1471E8CA7FULL, 0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL}};
+    static const CScalar g2 = {{0x1571B4AE8AC47F71ULL, 0x221208AC9DF506C6ULL, 0x6F547FA90ABFE4C4ULL, 0xE4437ED6010E8828ULL}};
+    CScalar c1, c2;
+    ScalarMulShift384(c1, k, g1);
+    ScalarMulShift384(c2, k, g2);
+    ScalarMul(c1, c1, minus_b1);
+    ScalarMul(c2, c2, minus_b2);
+    ScalarAdd(r2, c1, c2);
+    ScalarMul(r1, r2, SC_LAMBDA);
+    ScalarNegate(r1, r1);
+    ScalarAdd(r1, r1, k);
+}
+
+//
+// Points, affine (CGe) and in Jacobian coordinates (CGej): x = X/Z^2, y = Y/Z^3
+//
+
+struct CGe
+{
+    CFe x, y;
+    bool fInfinity;
+};
+
+struct CGej
+{
+    CFe x, y, z;
+    bool fInfinity;
+};
+
+const CGe GE_G = {
+    {{0x59F2815B16F81798ULL, 0x029BFCDB2DCE28D9ULL, 0x55A06295CE870B07ULL, 0x79BE667EF9DCBBACULL}},
+    {{0x9C47D08FFB10D4B8ULL, 0xFD17B448A6855419ULL, 0x5DA4FBFC0E1108A8ULL, 0x483ADA7726A3C465ULL}},
+    false
+};
+
+// y^2 = x^3 + 7
+bool GeIsValid(const CGe& a)
+{
+    if (a.fInfinity)
+        return false;
+    CFe y2, x3, seven;
+    FeSqr(y2, a.y);
+    FeSqr(x3, a.x);
+    FeMul(x3, x3, a.x);
+    FeSetInt(seven, 7);
+    FeAdd(x3, x3, seven);
+    return FeEqual(y2, x3);
+}
+
+// The point with this x coordinate and y of the given parity
+bool GeSetXO(CGe& r, const CFe& x, bool fOdd)
+{
+    CFe x3, seven;
+    FeSqr(x3, x);
+    FeMul(x3, x3, x);
+    FeSetInt(seven, 7);
+    FeAdd(x3, x3, seven);
+    if (!FeSqrt(r.y, x3))
+        return false;
+    r.x = x;
+    r.fInfinity = false;
+    if (FeIsOdd(r.y) != fOdd)
+        FeNegate(r.y, r.y);
+    return true;
+}
+
+inline void GejSetGe(CGej& r, const CGe& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FeSetInt(r.z, 1);
+    r.fInfinity = a.fInfinity;
+}
+
+void GeSetGej(CGe& r, const CGej& a)
+{
+    r.fInfinity = a.fInfinity;
+    if (a.fInfinity)
+        return;
+    CFe zi, zi2, zi3;
+    FeInv(zi, a.z);
+    FeSqr(zi2, zi);
+    FeMul(zi3, zi2, zi);
+    FeMul(r.x, a.x, zi2);
+    FeMul(r.y, a.y, zi3);
+}
+
+// Convert n points at once, with a single inversion. None may be infinity.
+void GeSetAllGej(CGe* r, const CGej* a, size_t n)
+{
+    CFe* prod = new CFe[n];
+    prod[0] = a[0].z;
+    for (size_t i = 1; i < n; i++)
+        FeMul(prod[i], prod[i - 1], a[i].z);
+    CFe inv;
+    FeInv(inv, prod[n - 1]);
+    for (size_t i = n; i-- > 0; ) {
+        CFe zi, zi2, zi3;
+        if (i > 0) {
+            FeMul(zi, inv, prod[i - 1]);
+            FeMul(inv, inv, a[i].z);
+        } else {
+            zi = inv;
+        }
+        FeSqr(zi2, zi);
+        FeMul(zi3, zi2, zi);
+        FeMul(r[i].x, a[i].x, zi2);
+        FeMul(r[i].y, a[i].y, zi3);
+        r[i].fInfinity = false;
+    }
+    delete[] prod;
+}
+
+void GejDouble(CGej& r, const CGej& a)
+{
+    if (a.fInfinity) {
+        r.fInfinity = true;
+        return;
+    }
+    // dbl-2009-l; there are no points with y = 0 on the curve
+    CFe A, B, C, D, E, F, t, x3, y3, z3;
+    FeSqr(A, a.x);
+    FeSqr(B, a.y);
+    FeSqr(C, B);
+    FeAdd(t, a.x, B);
+    FeSqr(t, t);
+    FeSub(t, t, A);
+    FeSub(t, t, C);
+    FeAdd(D, t, t);
+    FeAdd(E, A, A);
+    FeAdd(E, E, A);
+    FeSqr(F, E);
+    FeMul(z3, a.y, a.z);
+    FeAdd(z3, z3, z3);
+    FeAdd(t, D, D);
+    FeSub(x3, F, t);
+    FeSub(t, D, x3);
+    FeMul(y3, E, t);
+    FeAdd(C, C, C);
+    FeAdd(C, C, C);
+    FeAdd(C, C, C);
+    FeSub(y3, y3, C);
+    r.x = x3;
+    r.y = y3;
+    r.z = z3;
+    r.fInfinity = false;
+}
+
+// r = a + b given U1 = X1*Z2^2, S1 = Y1*Z2^3, U2, S2 likewise, and Z1*Z2
+void GejAddFinish(CGej& r, const CGej& a, const CFe& u1, const CFe& u2, const CFe& s1, const CFe& s2, const CFe& z1z2)
+{
+    CFe h, rr, h2, h3, u1h2, t, x3, y3, z3;
+    FeSub(h, u2, u1);
+    FeSub(rr, s2, s1);
+    if (FeIsZero(h)) {
+        if (FeIsZero(rr))
+            GejDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FeSqr(h2, h);
+    FeMul(h3, h2, h);
+    FeMul(u1h2, u1, h2);
+    FeSqr(x3, rr);
+    FeSub(x3, x3, h3);
+    FeSub(x3, x3, u1h2);
+    FeSub(x3, x3, u1h2);
+    FeSub(t, u1h2, x3);
+    FeMul(y3, rr, t);
+    FeMul(t, s1, h3);
+    FeSub(y3, y3, t);
+    FeMul(z3, z1z2, h);
+    r.x = x3;
+    r.y = y3;
+    r.z = z3;
+    r.fInfinity = false;
+}
+
+void GejAdd(CGej& r, const CGej& a, const CGej& b)
+{
+    if (a.fInfinity) {
+        r = b;
+        return;
+    }
+    if (b.fInfinity) {
+        r = a;
+        return;
+    }
+    CFe z1z1, z2z2, u1, u2, s1, s2, z1z2;
+    FeSqr(z1z1, a.z);
+    FeSqr(z2z2, b.z);
+    FeMul(u1, a.x, z2z2);
+    FeMul(u2, b.x, z1z1);
+    FeMul(s1, a.y, b.z);
+    FeMul(s1, s1, z2z2);
+    FeMul(s2, b.y, a.z);
+    FeMul(s2, s2, z1z1);
+    FeMul(z1z2, a.z, b.z);
+    GejAddFinish(r, a, u1, u2, s1, s2, z1z2);
+}
+
+void GejAddGe(CGej& r, const CGej& a, const CGe& b)
+{
+    if (a.fInfinity) {
+        GejSetGe(r, b);
+        return;
+    }
+    if (b.fInfinity) {
+        r = a;
+        return;
+    }
+    CFe z1z1, u2, s2;
+    FeSqr(z1z1, a.z);
+    FeMul(u2, b.x, z1z1);
+    FeMul(s2, b.y, a.z);
+    FeMul(s2, s2, z1z1);
+    GejAddFinish(r, a, a.x, u2, a.y, s2, a.z);
+}
+
+//
+// Precomputed tables
+//
+
+// Odd multiples of G (and of lambda*G) up to 2047G, for wNAF with 12 bit windows
+const int WINDOW_G = 12;
+const int TABLE_G = 1 << (WINDOW_G - 2);
+
+// Odd multiples of the other point up to 15Q, computed on each call
+const int WINDOW_A = 5;
+const int TABLE_A = 1 << (WINDOW_A - 2);
+
+CGe preG[TABLE_G];
+CGe preGLambda[TABLE_G];
+
+// For secret scalars: preGen[i][j] = j*16^i*G + 2^i*U (the last row compensates
+// the U terms, which make sure no entry is infinity and no addition doubles)
+CGe preGen[64][16];
+
+struct CSecp256k1Init
+{
+    CSecp256k1Init()
+    {
+        CGej g, g2;
+        GejSetGe(g, GE_G);
+        GejDouble(g2, g);
+
+        CGej* pj = new CGej[64 * 16];
+        pj[0] = g;
+        for (int i = 1; i < TABLE_G; i++)
+            GejAdd(pj[i], pj[i - 1], g2);
+        GeSetAllGej(preG, pj, TABLE_G);
+        for (int i = 0; i < TABLE_G; i++) {
+            FeMul(preGLambda[i].x, preG[i].x, FE_BETA);
+            preGLambda[i].y = preG[i].y;
+            preGLambda[i].fInfinity = false;
+        }
+
+        // U is the first point with an x coordinate of the form 2^255 + i
+        CFe x;
+        FeSetInt(x, 0);
+        x.n[3] = 1ULL << 63;
+        CGe u;
+        while (!GeSetXO(u, x, false))
+            x.n[0]++;
+
+        CGej base = g, ui, row;
+        GejSetGe(ui, u);
+        for (int i = 0; i < 64; i++) {
+            if (i < 63) {
+                row = ui;
+            } else {
+                // U - 2^63 U = -(2^0 + ... + 2^62) U
+                CGej neg = ui;
+                FeNegate(neg.y, neg.y);
+                GejAddGe(row, neg, u);
+            }
+            for (int j = 0; j < 16; j++) {
+                pj[i * 16 + j] = row;
+                GejAdd(row, row, base);
+            }
+            for (int k = 0; k < 4; k++)
+                GejDouble(base, base);
+            GejDouble(ui, ui);
+        }
+        GeSetAllGej(&preGen[0][0], pj, 64 * 16);
+        delete[] pj;
+    }
+} instance_of_csecp256k1init;
+
+// k*G without branches or memory accesses that depend on k
+void ECMultGen(CGej& r, const CScalar& k)
+{
+    CGe add;
+    add.fInfinity = false;
+    for (int i = 0; i < 64; i++) {
+        uint64_t bits = (k.d[i / 16] >> ((i % 16) * 4)) & 15;
+        for (uint64_t j = 0; j < 16; j++) {
+            uint64_t mask = 0 - (uint64_t)(j == bits);
+            FeCMov(add.x, preGen[i][j].x, mask);
+            FeCMov(add.y, preGen[i][j].y, mask);
+        }
+        if (i == 0)
+            GejSetGe(r, add);
+        else
+            GejAddGe(r, r, add);
+    }
+    Cleanse(&add, sizeof(add));
+}
+
+// Width-w NAF of a scalar of at most 128 bits, or the negation of one. Every
+// digit is zero or odd and below 2^(w-1) in magnitude. Returns the number of
+// digits.
+int ScalarWnaf(int wnaf[130], const CScalar& s, int w)
+{
+    CScalar a = s;
+    int sign = 1;
+    if (a.d[3] >> 63) {
+        ScalarNegate(a, a);
+        sign = -1;
+    }
+    uint64_t v[3] = {a.d[0], a.d[1], a.d[2]};
+    int nLen = 0;
+    for (int i = 0; i < 130; i++) {
+        int digit = 0;
+        if (v[0] & 1) {
+            digit = v[0] & ((1 << w) - 1);
+            if (digit >= (1 << (w - 1)))
+                digit -= (1 << w);
+            // v -= digit, leaving v even
+            if (digit > 0) {
+                v[0] -= digit;
+            } else {
+                v[0] -= digit;
+                if (v[0] < (uint64_t)-digit && ++v[1] == 0)
+                    v[2]++;
+            }
+            nLen = i + 1;
+        }
+        wnaf[i] = sign * digit;
+        v[0] = (v[0] >> 1) | (v[1] << 63);
+        v[1] = (v[1] >> 1) | (v[2] << 63);
+        v[2] >>= 1;
+    }
+    return nLen;
+}
+
+inline void TableGet(CGej& r, const CGej* pre, int n)
+{
+    r = pre[(n < 0 ? -n : n) / 2];
+    if (n < 0)
+        FeNegate(r.y, r.y);
+}
+
+inline void TableGet(CGe& r, const CGe* pre, int n)
+{
+    r = pre[(n < 0 ? -n : n) / 2];
+    if (n < 0)
+        FeNegate(r.y, r.y);
+}
+
+// r = na*A + ng*G, in variable time: for public values only
+void ECMult(CGej& r, const CGe& a, const CScalar& na, const CScalar& ng)
+{
+    CScalar na1, na2, ng1, ng2;
+    ScalarSplitLambda(na1, na2, na);
+    ScalarSplitLambda(ng1, ng2, ng);
+
+    // odd multiples of A, and of lambda*A = (beta*x, y)
+    CGej preA[TABLE_A], preALambda[TABLE_A], a2;
+    GejSetGe(preA[0], a);
+    GejDouble(a2, preA[0]);
+    for (int i = 1; i < TABLE_A; i++)
+        GejAdd(preA[i], preA[i - 1], a2);
+    for (int i = 0; i < TABLE_A; i++) {
+        preALambda[i] = preA[i];
+        FeMul(preALambda[i].x, preA[i].x, FE_BETA);
+    }
+
+    int wa1[130], wa2[130], wg1[130], wg2[130];
+    int la1 = ScalarWnaf(wa1, na1, WINDOW_A);
+    int la2 = ScalarWnaf(wa2, na2, WINDOW_A);
+    int lg1 = ScalarWnaf(wg1, ng1, WINDOW_G);
+    int lg2 = ScalarWnaf(wg2, ng2, WINDOW_G);
+    int nBits = la1;
+    if (la2 > nBits) nBits = la2;
+    if (lg1 > nBits) nBits = lg1;
+    if (lg2 > nBits) nBits = lg2;
+
+    r.fInfinity = true;
+    CGej tj;
+    CGe t;
+    for (int i = nBits - 1; i >= 0; i--) {
+        GejDouble(r, r);
+        if (i < la1 && wa1[i]) {
+            TableGet(tj, preA, wa1[i]);
+            GejAdd(r, r, tj);
+        }
+        if (i < la2 && wa2[i]) {
+            TableGet(tj, preALambda, wa2[i]);
+            GejAdd(r, r, tj);
+        }
+        if (i < lg1 && wg1[i]) {
+            TableGet(t, preG, wg1[i]);
+            GejAddGe(r, r, t);
+        }
+        if (i < lg2 && wg2[i]) {
+            TableGet(t, preGLambda, wg2[i]);
+            GejAddGe(r, r, t);
+        }
+    }
+}
+
+//
+// Encodings
+//
+
+bool PubKeyParse(CGe& r, const unsigned char* pubkey, size_t pubkeylen)
+{
+    if (pubkeylen == 33 && (pubkey[0] == 0x02 || pubkey[0] == 0x03)) {
+        CFe x;
+        if (!FeSetB32(x, pubkey + 1))
+            return false;
+        return GeSetXO(r, x, pubkey[0] == 0x03);
+    }
+    if (pubkeylen == 65 && (pubkey[0] == 0x04 || pubkey[0] == 0x06 || pubkey[0] == 0x07)) {
+        if (!FeSetB32(r.x, pubkey + 1) || !FeSetB32(r.y, pubkey + 33))
+            return false;
+        if (pubkey[0] != 0x04 && FeIsOdd(r.y) != (pubkey[0] == 0x07))
+            return false;
+        r.fInfinity = false;
+        return GeIsValid(r);
+    }
+    return false;
+}
+
+void PubKeySerialize(unsigned char pubkey[65], size_t& pubkeylen, const CGe& a, bool fCompressed)
+{
+    FeGetB32(pubkey + 1, a.x);
+    if (fCompressed) {
+        pubkey[0] = FeIsOdd(a.y) ? 0x03 : 0x02;
+        pubkeylen = 33;
+    } else {
+        pubkey[0] = 0x04;
+        FeGetB32(pubkey + 33, a.y);
+        pubkeylen = 65;
+    }
+}
+
+// Read one BER length, short or long form; false if it runs past the end or
+// is indefinite
+bool ReadBERLength(const unsigned char* sig, size_t siglen, size_t& pos, size_t& len)
+{
+    if (pos == siglen)
+        return false;
+    len = sig[pos++];
+    if (!(len & 0x80))
+        return true;
+    size_t nLenBytes = len & 0x7f;
+    if (nLenBytes == 0 || nLenBytes > siglen - pos)
+        return false;
+    len = 0;
+    while (nLenBytes > 0) {
+        // longer than any signature buffer
+        if (len >> (8 * sizeof(size_t) - 8))
+            return false;
+        len = (len << 8) | sig[pos++];
+        nLenBytes--;
+    }
+    return true;
+}
+
+// Read one integer of a signature sequence ending at end, as a scalar.
+// Leading zeroes are skipped. Negative numbers, and numbers that do not fit,
+// leave zero, which never verifies.
+bool ParseBERInteger(CScalar& r, const unsigned char* sig, size_t end, size_t& pos)
+{
+    if (pos == end || sig[pos++] != 0x02)
+        return false;
+    size_t len;
+    if (!ReadBERLength(sig, end, pos, len) || len > end - pos)
+        return false;
+    const unsigned char* p = sig + pos;
+    pos += len;
+
+    memset(&r, 0, sizeof(r));
+    if (len > 0 && (p[0] & 0x80))
+        return true;
+    while (len > 0 && p[0] == 0) {
+        p++;
+        len--;
+    }
+    if (len > 32)
+        return true;
+    unsigned char tmp[32];
+    memset(tmp, 0, sizeof(tmp));
+    memcpy(tmp + 32 - len, p, len);
+    bool fOverflow;
+    ScalarSetB32(r, tmp, fOverflow);
+    if (fOverflow)
+        memset(&r, 0, sizeof(r));
+    return true;
+}
+
+// Parse a signature the way OpenSSL before 1.0.1k did, which is what the
+// block chain was validated with: long form and indefinite sequence lengths,
+// padded integers and bytes after the sequence are taken. The sequence has to
+// hold exactly R and S, and negative integers never verify, as in every
+// OpenSSL version.
+bool SigParseDERLax(CScalar& r, CScalar& s, const unsigned char* sig, size_t siglen)
+{
+    size_t pos = 0, len;
+    if (siglen < 2 || sig[pos++] != 0x30)
+        return false;
+    if (sig[pos] == 0x80) {
+        // indefinite: R and S, then an end-of-contents marker
+        pos++;
+        if (!ParseBERInteger(r, sig, siglen, pos) || !ParseBERInteger(s, sig, siglen, pos))
+            return false;
+        return siglen - pos >= 2 && sig[pos] == 0 && sig[pos + 1] == 0;
+    }
+    if (!ReadBERLength(sig, siglen, pos, len) || len > siglen - pos)
+        return false;
+    size_t end = pos + len;
+    if (!ParseBERInteger(r, sig, end, pos) || !ParseBERInteger(s, sig, end, pos))
+        return false;
+    return pos == end;
+}
+
+size_t SerializeDERInteger(unsigned char* out, const CScalar& a)
+{
+    unsigned char b[33];
+    b[0] = 0;
+    ScalarGetB32(b + 1, a);
+    // minimal encoding, positive
+    size_t nStart = 0;
+    while (nStart < 32 && b[nStart] == 0 && b[nStart + 1] < 0x80)
+        nStart++;
+    size_t len = 33 - nStart;
+    out[0] = 0x02;
+    out[1] = len;
+    memcpy(out + 2, b + nStart, len);
+    return len + 2;
+}
+
+// ECDSA signature with the nonce k; recid gets the parity of R's y, and
+// whether its x was reduced mod n
+bool SignRaw(CScalar& r, CScalar& s, int& recid, const unsigned char hash[32], const unsigned char seckey[32], const unsigned char nonce[32])
+{
+    CScalar sec, k, m, t;
+    bool fOverflow;
+    ScalarSetB32(sec, seckey, fOverflow);
+    bool fOk = !fOverflow && !ScalarIsZero(sec);
+    ScalarSetB32(k, nonce, fOverflow);
+    fOk = fOk && !fOverflow && !ScalarIsZero(k);
+    if (fOk) {
+        ScalarSetB32(m, hash, fOverflow);
+
+        CGej rj;
+        CGe ra;
+        ECMultGen(rj, k);
+        GeSetGej(ra, rj);
+        unsigned char b[32];
+        FeGetB32(b, ra.x);
+        ScalarSetB32(r, b, fOverflow);
+        recid = (fOverflow ? 2 : 0) | (FeIsOdd(ra.y) ? 1 : 0);
+
+        // s = (m + r * sec) / k
+        ScalarMul(t, r, sec);
+        ScalarAdd(t, t, m);
+        ScalarInverse(k, k);
+        ScalarMul(s, k, t);
+        fOk = !ScalarIsZero(r) && !ScalarIsZero(s);
+        if (ScalarIsHigh(s)) {
+            ScalarNegate(s, s);
+            recid ^= 1;
+        }
+        Cleanse(&rj, sizeof(rj));
+        Cleanse(&ra, sizeof(ra));
+    }
+    Cleanse(&sec, sizeof(sec));
+    Cleanse(&k, sizeof(k));
+    Cleanse(&t, sizeof(t));
+    return fOk;
+}
+
+} // namespace
+
+bool ECDSAVerify(const unsigned char hash[32], const unsigned char* sig, size_t siglen,
+                 const unsigned char* pubkey, size_t pubkeylen)
+{
+    CGe q;
+    if (!PubKeyParse(q, pubkey, pubkeylen))
+        return false;
+    CScalar r, s;
+    if (!SigParseDERLax(r, s, sig, siglen))
+        return false;
+    if (ScalarIsZero(r) || ScalarIsZero(s))
+        return false;
+
+    // R = (m/s)*G + (r/s)*Q must have r as its x coordinate mod n
+    CScalar m, sn, u1, u2;
+    bool fOverflow;
+    ScalarSetB32(m, hash, fOverflow);
+    ScalarInverse(sn, s);
+    ScalarMul(u1, m, sn);
+    ScalarMul(u2, r, sn);
+    CGej rj;
+    ECMult(rj, q, u2, u1);
+    if (rj.fInfinity)
+        return false;
+    CGe ra;
+    GeSetGej(ra, rj);
+    unsigned char b[32];
+    FeGetB32(b, ra.x);
+    CScalar xr;
+    ScalarSetB32(xr, b, fOverflow);
+    return ScalarEqual(xr, r);
+}
+
+bool ECDSASign(const unsigned char hash[32], const unsigned char seckey[32], const unsigned char nonce[32],
+               unsigned char* sig, size_t& siglen)
+{
+    CScalar r, s;
+    int recid;
+    if (!SignRaw(r, s, recid, hash, seckey, nonce))
+        return false;
+    unsigned char tmp[72];
+    size_t len = SerializeDERInteger(tmp, r);
+    len += SerializeDERInteger(tmp + len, s);
+    sig[0] = 0x30;
+    sig[1] = len;
+    memcpy(sig + 2, tmp, len);
+    siglen = len + 2;
+    return true;
+}
+
+bool ECDSASignCompact(const unsigned char hash[32], const unsigned char seckey[32], const unsigned char nonce[32],
+                      unsigned char sig[64], int& recid)
+{
+    CScalar r, s;
+    if (!SignRaw(r, s, recid, hash, seckey, nonce))
+        return false;
+    ScalarGetB32(sig, r);
+    ScalarGetB32(sig + 32, s);
+    return true;
+}
+
+bool ECDSARecoverCompact(const unsigned char hash[32], const unsigned char sig[64], int recid,
+                         bool fCompressed, unsigned char pubkey[65], size_t& pubkeylen)
+{
+    if (recid < 0 || recid > 3)
+        return false;
+    CScalar r, s;
+    bool fOverflowR, fOverflowS;
+    ScalarSetB32(r, sig, fOverflowR);
+    ScalarSetB32(s, sig + 32, fOverflowS);
+    if (fOverflowR || fOverflowS || ScalarIsZero(r) || ScalarIsZero(s))
+        return false;
+
+    // R's x coordinate is r, or r + n
+    CFe x;
+    memcpy(x.n, r.d, sizeof(x.n));
+    if (recid & 2) {
+        if (!Less256(r.d, PMN))
+            return false;
+        const CScalar n = {{N_0, N_1, N_2, N_3}};
+        CAcc c;
+        for (int i = 0; i < 4; i++) {
+            c.Add(r.d[i]);
+            c.Add(n.d[i]);
+            x.n[i] = c.Extract();
+        }
+    }
+    CGe ra;
+    if (!GeSetXO(ra, x, recid & 1))
+        return false;
+
+    // Q = (s/r)*R - (m/r)*G
+    CScalar m, rn, u1, u2;
+    bool fOverflow;
+    ScalarSetB32(m, hash, fOverflow);
+    ScalarInverse(rn, r);
+    ScalarMul(u1, m, rn);
+    ScalarNegate(u1, u1);
+    ScalarMul(u2, s, rn);
+    CGej qj;
+    ECMult(qj, ra, u2, u1);
+    if (qj.fInfinity)
+        return false;
+    CGe q;
+    GeSetGej(q, qj);
+    PubKeySerialize(pubkey, pubkeylen, q, fCompressed);
+    return true;
+}
+
+bool ECPubKeyCreate(const unsigned char seckey[32], bool fCompressed, unsigned char pubkey[65], size_t& pubkeylen)
+{
+    CScalar sec;
+    bool fOverflow;
+    ScalarSetB32(sec, seckey, fOverflow);
+    bool fOk = !fOverflow && !ScalarIsZero(sec);
+    if (fOk) {
+        CGej pj;
+        CGe p;
+        ECMultGen(pj, sec);
+        GeSetGej(p, pj);
+        PubKeySerialize(pubkey, pubkeylen, p, fCompressed);
+    }
+    Cleanse(&sec, sizeof(sec));
+    return fOk;
+}
+
+bool ECPubKeyIsValid(const unsigned char* pubkey, size_t pubkeylen)
+{
+    CGe q;
+    return PubKeyParse(q, pubkey, pubkeylen);
+}
+
+bool ECPubKeyDecompress(const unsigned char* pubkey, size_t pubkeylen, unsigned char out[65])
+{
+    CGe q;
+    if (!PubKeyParse(q, pubkey, pubkeylen))
+        return false;
+    size_t len;
+    PubKeySerialize(out, len, q, false);
+    return true;
+}
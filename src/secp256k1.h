@@ -0,0 +1,56 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+//
+// ECDSA over secp256k1, without OpenSSL.
+//
+// Verification and public key recovery compute u1*G + u2*Q with wNAF over
+// odd multiples of the points, splitting both scalars in halves of 128 bits
+// with the curve's endomorphism. Multiples of G come from tables built once
+// at startup. Secret scalars are only ever multiplied with G, through a
+// table that is read with constant-time lookups. Nothing allocates.
+//
+// Hashes are the 32 bytes given to OpenSSL before, most significant first.
+// Public keys are in the SEC encodings: 33 bytes (02/03) or 65 bytes (04,
+// and the hybrid 06/07 OpenSSL also takes).
+//
+
+/** Check a DER encoded signature. Like OpenSSL's ECDSA_verify before
+ *  1.0.1k, BER lengths, padded integers and trailing bytes are taken,
+ *  as blocks may hold such signatures; negative integers are not. Loose
+ *  transactions are held to canonical signatures by SCRIPT_VERIFY_STRICTENC.
+ *  Signatures with a high S value are valid. */
+bool ECDSAVerify(const unsigned char hash[32], const unsigned char* sig, size_t siglen,
+                 const unsigned char* pubkey, size_t pubkeylen);
+
+/** Sign with the given random nonce, writing a DER signature of at most 72
+ *  bytes with a low S value. Fails if the nonce is not usable; try again with
+ *  another one. */
+bool ECDSASign(const unsigned char hash[32], const unsigned char seckey[32], const unsigned char nonce[32],
+               unsigned char* sig, size_t& siglen);
+
+/** Sign as ECDSASign, writing r and s as 32 bytes each and the recovery id of
+ *  the public key (0-3). */
+bool ECDSASignCompact(const unsigned char hash[32], const unsigned char seckey[32], const unsigned char nonce[32],
+                      unsigned char sig[64], int& recid);
+
+/** Compute the public key from a compact signature and its recovery id */
+bool ECDSARecoverCompact(const unsigned char hash[32], const unsigned char sig[64], int recid,
+                         bool fCompressed, unsigned char pubkey[65], size_t& pubkeylen);
+
+/** Compute the public key of a secret key */
+bool ECPubKeyCreate(const unsigned char seckey[32], bool fCompressed, unsigned char pubkey[65], size_t& pubkeylen);
+
+/** Check that a public key is well formed and its point is on the curve */
+bool ECPubKeyIsValid(const unsigned char* pubkey, size_t pubkeylen);
+
+/** Re-encode a public key uncompressed (65 bytes) */
+bool ECPubKeyDecompress(const unsigned char* pubkey, size_t pubkeylen, unsigned char out[65]);
+
+#endif
@@ -0,0 +1,628 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sha256.h"
+
+#include <string.h>
+
+//
+// SHA-256
+//
+// The portable compression function below is used unless the CPU offers
+// something better. On x86 targets built with a GCC compatible compiler,
+// there are versions written with intrinsics, compiled for their instruction
+// set through target attributes and picked at startup from CPUID:
+//  - the SHA extensions (SHA-NI), for one message or two at a time;
+//  - AVX2 and SSE4.1, computing the double SHA-256 of 8 or 4 independent
+//    64 byte inputs, one per 32-bit vector element.
+// Define SHA256_NO_SIMD to compile the portable code only.
+//
+
+#if !defined SHA256_NO_SIMD && defined __GNUC__ \
+    && (defined __x86_64__ || defined __i386__) \
+    && (__GNUC__ >= 5 || defined __clang__)
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#else
+#define SHA256_X86 0
+#endif
+
+namespace {
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+const uint32_t pInit[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+// Padding block following a 64 byte message
+const unsigned char pPad64[64] = {
+    0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00,
+};
+
+inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+inline void WriteBE64(unsigned char* p, uint64_t x)
+{
+    WriteBE32(p, x >> 32);
+    WriteBE32(p + 4, (uint32_t)x);
+}
+
+// Second block of a double SHA-256: the first digest, padded
+inline void FormatDigestBlock(unsigned char* block, const uint32_t* s)
+{
+    for (int i = 0; i < 8; i++)
+        WriteBE32(block + 4 * i, s[i]);
+    memset(block + 32, 0, 32);
+    block[32] = 0x80;
+    block[62] = 0x01;
+}
+
+inline uint32_t Ch(uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); }
+inline uint32_t Maj(uint32_t x, uint32_t y, uint32_t z) { return (x & y) | (z & (x | y)); }
+inline uint32_t Sigma0(uint32_t x) { return (x >> 2 | x << 30) ^ (x >> 13 | x << 19) ^ (x >> 22 | x << 10); }
+inline uint32_t Sigma1(uint32_t x) { return (x >> 6 | x << 26) ^ (x >> 11 | x << 21) ^ (x >> 25 | x << 7); }
+inline uint32_t sigma0(uint32_t x) { return (x >> 7 | x << 25) ^ (x >> 18 | x << 14) ^ (x >> 3); }
+inline uint32_t sigma1(uint32_t x) { return (x >> 17 | x << 15) ^ (x >> 19 | x << 13) ^ (x >> 10); }
+
+void TransformScalar(uint32_t* s, const unsigned char* chunk, size_t nBlocks)
+{
+    while (nBlocks--) {
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++)
+            w[i] = ReadBE32(chunk + 4 * i);
+
+        uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; i++) {
+            // w[i & 15] holds w[i - 16] until it is replaced by w[i]
+            if (i >= 16)
+                w[i & 15] += sigma1(w[(i + 14) & 15]) + w[(i + 9) & 15] + sigma0(w[(i + 1) & 15]);
+            uint32_t t1 = h + Sigma1(e) + Ch(e, f, g) + K[i] + w[i & 15];
+            uint32_t t2 = Sigma0(a) + Maj(a, b, c);
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        s[0] += a;
+        s[1] += b;
+        s[2] += c;
+        s[3] += d;
+        s[4] += e;
+        s[5] += f;
+        s[6] += g;
+        s[7] += h;
+        chunk += 64;
+    }
+}
+
+typedef void (*TransformFn)(uint32_t* s, const unsigned char* chunk, size_t nBlocks);
+
+// Best compression function for this CPU (set at startup)
+TransformFn Transform = TransformScalar;
+
+// Double SHA-256 of one 64 byte input
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    uint32_t s[8];
+    unsigned char block[64];
+    memcpy(s, pInit, sizeof(s));
+    Transform(s, in, 1);
+    Transform(s, pPad64, 1);
+    FormatDigestBlock(block, s);
+    memcpy(s, pInit, sizeof(s));
+    Transform(s, block, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
+#if SHA256_X86
+
+#define SHA256_SHANI_TARGET __attribute__((target("sha,sse4.1")))
+#define SHA256_AVX2_TARGET __attribute__((target("avx2")))
+#define SHA256_SSE41_TARGET __attribute__((target("sse4.1")))
+
+bool fSHANI = false;
+bool fAVX2 = false;
+bool fSSE41 = false;
+
+//
+// SHA-NI. The state is kept as ABEF and CDGH, the order the instructions
+// use. Each QuadRound runs four rounds, the message schedule is computed four
+// words at a time with sha256msg1 / sha256msg2.
+//
+namespace shani {
+
+inline SHA256_SHANI_TARGET __m128i Load(const unsigned char* p)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), mask);
+}
+
+inline SHA256_SHANI_TARGET void Shuffle(__m128i& s0, __m128i& s1)
+{
+    const __m128i t1 = _mm_shuffle_epi32(s0, 0xB1);
+    const __m128i t2 = _mm_shuffle_epi32(s1, 0x1B);
+    s0 = _mm_alignr_epi8(t1, t2, 0x08);
+    s1 = _mm_blend_epi16(t2, t1, 0xF0);
+}
+
+inline SHA256_SHANI_TARGET void Unshuffle(__m128i& s0, __m128i& s1)
+{
+    const __m128i t1 = _mm_shuffle_epi32(s0, 0x1B);
+    const __m128i t2 = _mm_shuffle_epi32(s1, 0xB1);
+    s0 = _mm_blend_epi16(t1, t2, 0xF0);
+    s1 = _mm_alignr_epi8(t2, t1, 0x08);
+}
+
+inline SHA256_SHANI_TARGET void QuadRound(__m128i& s0, __m128i& s1, __m128i m, int i)
+{
+    const __m128i msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i*)(K + i)));
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0E));
+}
+
+// Start the next message words from m0 (the oldest) and m1
+inline SHA256_SHANI_TARGET void ShiftMessageA(__m128i& m0, __m128i m1)
+{
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+}
+
+// Complete the next message words m2 from m0 and m1
+inline SHA256_SHANI_TARGET void ShiftMessageC(__m128i m0, __m128i m1, __m128i& m2)
+{
+    m2 = _mm_sha256msg2_epu32(_mm_add_epi32(m2, _mm_alignr_epi8(m1, m0, 4)), m1);
+}
+
+inline SHA256_SHANI_TARGET void ShiftMessageB(__m128i& m0, __m128i m1, __m128i& m2)
+{
+    ShiftMessageC(m0, m1, m2);
+    ShiftMessageA(m0, m1);
+}
+
+// The 64 rounds on one block, from state s0/s1
+inline SHA256_SHANI_TARGET void Rounds(__m128i& s0, __m128i& s1, const unsigned char* chunk)
+{
+    const __m128i so0 = s0, so1 = s1;
+    __m128i m0 = Load(chunk), m1 = Load(chunk + 16), m2 = Load(chunk + 32), m3 = Load(chunk + 48);
+
+    QuadRound(s0, s1, m0, 0);
+    QuadRound(s0, s1, m1, 4);
+    ShiftMessageA(m0, m1);
+    QuadRound(s0, s1, m2, 8);
+    ShiftMessageA(m1, m2);
+    QuadRound(s0, s1, m3, 12);
+    ShiftMessageB(m2, m3, m0);
+    for (int i = 16; i < 48; i += 16) {
+        QuadRound(s0, s1, m0, i);
+        ShiftMessageB(m3, m0, m1);
+        QuadRound(s0, s1, m1, i + 4);
+        ShiftMessageB(m0, m1, m2);
+        QuadRound(s0, s1, m2, i + 8);
+        ShiftMessageB(m1, m2, m3);
+        QuadRound(s0, s1, m3, i + 12);
+        ShiftMessageB(m2, m3, m0);
+    }
+    QuadRound(s0, s1, m0, 48);
+    ShiftMessageB(m3, m0, m1);
+    QuadRound(s0, s1, m1, 52);
+    ShiftMessageC(m0, m1, m2);
+    QuadRound(s0, s1, m2, 56);
+    ShiftMessageC(m1, m2, m3);
+    QuadRound(s0, s1, m3, 60);
+
+    s0 = _mm_add_epi32(s0, so0);
+    s1 = _mm_add_epi32(s1, so1);
+}
+
+SHA256_SHANI_TARGET void Transform(uint32_t* s, const unsigned char* chunk, size_t nBlocks)
+{
+    __m128i s0 = _mm_loadu_si128((const __m128i*)s), s1 = _mm_loadu_si128((const __m128i*)(s + 4));
+    Shuffle(s0, s1);
+    while (nBlocks--) {
+        Rounds(s0, s1, chunk);
+        chunk += 64;
+    }
+    Unshuffle(s0, s1);
+    _mm_storeu_si128((__m128i*)s, s0);
+    _mm_storeu_si128((__m128i*)(s + 4), s1);
+}
+
+// One block for each of two messages. Both chains of rounds are independent,
+// so the CPU overlaps them.
+SHA256_SHANI_TARGET void Transform2(uint32_t* sa, uint32_t* sb, const unsigned char* chunka, const unsigned char* chunkb)
+{
+    __m128i sa0 = _mm_loadu_si128((const __m128i*)sa), sa1 = _mm_loadu_si128((const __m128i*)(sa + 4));
+    __m128i sb0 = _mm_loadu_si128((const __m128i*)sb), sb1 = _mm_loadu_si128((const __m128i*)(sb + 4));
+    Shuffle(sa0, sa1);
+    Shuffle(sb0, sb1);
+    Rounds(sa0, sa1, chunka);
+    Rounds(sb0, sb1, chunkb);
+    Unshuffle(sa0, sa1);
+    Unshuffle(sb0, sb1);
+    _mm_storeu_si128((__m128i*)sa, sa0);
+    _mm_storeu_si128((__m128i*)(sa + 4), sa1);
+    _mm_storeu_si128((__m128i*)sb, sb0);
+    _mm_storeu_si128((__m128i*)(sb + 4), sb1);
+}
+
+void TransformD64x2(unsigned char* out, const unsigned char* in)
+{
+    uint32_t sa[8], sb[8];
+    unsigned char blocka[64], blockb[64];
+    memcpy(sa, pInit, sizeof(sa));
+    memcpy(sb, pInit, sizeof(sb));
+    Transform2(sa, sb, in, in + 64);
+    Transform2(sa, sb, pPad64, pPad64);
+    FormatDigestBlock(blocka, sa);
+    FormatDigestBlock(blockb, sb);
+    memcpy(sa, pInit, sizeof(sa));
+    memcpy(sb, pInit, sizeof(sb));
+    Transform2(sa, sb, blocka, blockb);
+    for (int i = 0; i < 8; i++) {
+        WriteBE32(out + 4 * i, sa[i]);
+        WriteBE32(out + 32 + 4 * i, sb[i]);
+    }
+}
+
+} // namespace shani
+
+//
+// 8-way AVX2: lane j of every vector belongs to input j.
+//
+namespace avx2 {
+
+inline SHA256_AVX2_TARGET __m256i Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+inline SHA256_AVX2_TARGET __m256i Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+inline SHA256_AVX2_TARGET __m256i Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
+inline SHA256_AVX2_TARGET __m256i And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
+inline SHA256_AVX2_TARGET __m256i Rot(__m256i x, int n) { return Or(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+inline SHA256_AVX2_TARGET __m256i Set(uint32_t x) { return _mm256_set1_epi32(x); }
+
+inline SHA256_AVX2_TARGET __m256i Ch(__m256i x, __m256i y, __m256i z) { return Xor(z, And(x, Xor(y, z))); }
+inline SHA256_AVX2_TARGET __m256i Maj(__m256i x, __m256i y, __m256i z) { return Or(And(x, y), And(z, Or(x, y))); }
+inline SHA256_AVX2_TARGET __m256i Sigma0(__m256i x) { return Xor(Xor(Rot(x, 2), Rot(x, 13)), Rot(x, 22)); }
+inline SHA256_AVX2_TARGET __m256i Sigma1(__m256i x) { return Xor(Xor(Rot(x, 6), Rot(x, 11)), Rot(x, 25)); }
+inline SHA256_AVX2_TARGET __m256i sigma0(__m256i x) { return Xor(Xor(Rot(x, 7), Rot(x, 18)), _mm256_srli_epi32(x, 3)); }
+inline SHA256_AVX2_TARGET __m256i sigma1(__m256i x) { return Xor(Xor(Rot(x, 17), Rot(x, 19)), _mm256_srli_epi32(x, 10)); }
+
+inline SHA256_AVX2_TARGET void Round(__m256i a, __m256i b, __m256i c, __m256i& d, __m256i e, __m256i f, __m256i g, __m256i& h, __m256i kw)
+{
+    __m256i t1 = Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), kw));
+    __m256i t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+// K[i] plus message word i, computing the word from the previous 16 when i >= 16
+inline SHA256_AVX2_TARGET __m256i KW(__m256i* w, int i)
+{
+    if (i >= 16)
+        w[i & 15] = Add(Add(sigma1(w[(i + 14) & 15]), w[(i + 9) & 15]), Add(sigma0(w[(i + 1) & 15]), w[i & 15]));
+    return Add(Set(K[i]), w[i & 15]);
+}
+
+SHA256_AVX2_TARGET void Compress(__m256i* s, __m256i* w)
+{
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i += 8) {
+        Round(a, b, c, d, e, f, g, h, KW(w, i));
+        Round(h, a, b, c, d, e, f, g, KW(w, i + 1));
+        Round(g, h, a, b, c, d, e, f, KW(w, i + 2));
+        Round(f, g, h, a, b, c, d, e, KW(w, i + 3));
+        Round(e, f, g, h, a, b, c, d, KW(w, i + 4));
+        Round(d, e, f, g, h, a, b, c, KW(w, i + 5));
+        Round(c, d, e, f, g, h, a, b, KW(w, i + 6));
+        Round(b, c, d, e, f, g, h, a, KW(w, i + 7));
+    }
+    s[0] = Add(s[0], a);
+    s[1] = Add(s[1], b);
+    s[2] = Add(s[2], c);
+    s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e);
+    s[5] = Add(s[5], f);
+    s[6] = Add(s[6], g);
+    s[7] = Add(s[7], h);
+}
+
+SHA256_AVX2_TARGET void TransformD64x8(unsigned char* out, const unsigned char* in)
+{
+    __m256i s[8], w[16];
+    for (int i = 0; i < 8; i++)
+        s[i] = Set(pInit[i]);
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm256_set_epi32(ReadBE32(in + 448 + 4 * i), ReadBE32(in + 384 + 4 * i),
+                                ReadBE32(in + 320 + 4 * i), ReadBE32(in + 256 + 4 * i),
+                                ReadBE32(in + 192 + 4 * i), ReadBE32(in + 128 + 4 * i),
+                                ReadBE32(in + 64 + 4 * i), ReadBE32(in + 4 * i));
+    Compress(s, w);
+
+    // padding block
+    w[0] = Set(0x80000000);
+    for (int i = 1; i < 15; i++)
+        w[i] = Set(0);
+    w[15] = Set(512);
+    Compress(s, w);
+
+    // second hash, of the padded 32 byte digests
+    for (int i = 0; i < 8; i++) {
+        w[i] = s[i];
+        s[i] = Set(pInit[i]);
+    }
+    w[8] = Set(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = Set(0);
+    w[15] = Set(256);
+    Compress(s, w);
+
+    uint32_t lanes[8];
+    for (int i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i*)lanes, s[i]);
+        for (int j = 0; j < 8; j++)
+            WriteBE32(out + 32 * j + 4 * i, lanes[j]);
+    }
+}
+
+} // namespace avx2
+
+//
+// 4-way SSE4.1, the same as the AVX2 code on 128-bit vectors.
+//
+namespace sse41 {
+
+inline SHA256_SSE41_TARGET __m128i Add(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
+inline SHA256_SSE41_TARGET __m128i Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+inline SHA256_SSE41_TARGET __m128i Or(__m128i x, __m128i y) { return _mm_or_si128(x, y); }
+inline SHA256_SSE41_TARGET __m128i And(__m128i x, __m128i y) { return _mm_and_si128(x, y); }
+inline SHA256_SSE41_TARGET __m128i Rot(__m128i x, int n) { return Or(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+inline SHA256_SSE41_TARGET __m128i Set(uint32_t x) { return _mm_set1_epi32(x); }
+
+inline SHA256_SSE41_TARGET __m128i Ch(__m128i x, __m128i y, __m128i z) { return Xor(z, And(x, Xor(y, z))); }
+inline SHA256_SSE41_TARGET __m128i Maj(__m128i x, __m128i y, __m128i z) { return Or(And(x, y), And(z, Or(x, y))); }
+inline SHA256_SSE41_TARGET __m128i Sigma0(__m128i x) { return Xor(Xor(Rot(x, 2), Rot(x, 13)), Rot(x, 22)); }
+inline SHA256_SSE41_TARGET __m128i Sigma1(__m128i x) { return Xor(Xor(Rot(x, 6), Rot(x, 11)), Rot(x, 25)); }
+inline SHA256_SSE41_TARGET __m128i sigma0(__m128i x) { return Xor(Xor(Rot(x, 7), Rot(x, 18)), _mm_srli_epi32(x, 3)); }
+inline SHA256_SSE41_TARGET __m128i sigma1(__m128i x) { return Xor(Xor(Rot(x, 17), Rot(x, 19)), _mm_srli_epi32(x, 10)); }
+
+inline SHA256_SSE41_TARGET void Round(__m128i a, __m128i b, __m128i c, __m128i& d, __m128i e, __m128i f, __m128i g, __m128i& h, __m128i kw)
+{
+    __m128i t1 = Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), kw));
+    __m128i t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+inline SHA256_SSE41_TARGET __m128i KW(__m128i* w, int i)
+{
+    if (i >= 16)
+        w[i & 15] = Add(Add(sigma1(w[(i + 14) & 15]), w[(i + 9) & 15]), Add(sigma0(w[(i + 1) & 15]), w[i & 15]));
+    return Add(Set(K[i]), w[i & 15]);
+}
+
+SHA256_SSE41_TARGET void Compress(__m128i* s, __m128i* w)
+{
+    __m128i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i += 8) {
+        Round(a, b, c, d, e, f, g, h, KW(w, i));
+        Round(h, a, b, c, d, e, f, g, KW(w, i + 1));
+        Round(g, h, a, b, c, d, e, f, KW(w, i + 2));
+        Round(f, g, h, a, b, c, d, e, KW(w, i + 3));
+        Round(e, f, g, h, a, b, c, d, KW(w, i + 4));
+        Round(d, e, f, g, h, a, b, c, KW(w, i + 5));
+        Round(c, d, e, f, g, h, a, b, KW(w, i + 6));
+        Round(b, c, d, e, f, g, h, a, KW(w, i + 7));
+    }
+    s[0] = Add(s[0], a);
+    s[1] = Add(s[1], b);
+    s[2] = Add(s[2], c);
+    s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e);
+    s[5] = Add(s[5], f);
+    s[6] = Add(s[6], g);
+    s[7] = Add(s[7], h);
+}
+
+SHA256_SSE41_TARGET void TransformD64x4(unsigned char* out, const unsigned char* in)
+{
+    __m128i s[8], w[16];
+    for (int i = 0; i < 8; i++)
+        s[i] = Set(pInit[i]);
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm_set_epi32(ReadBE32(in + 192 + 4 * i), ReadBE32(in + 128 + 4 * i),
+                             ReadBE32(in + 64 + 4 * i), ReadBE32(in + 4 * i));
+    Compress(s, w);
+
+    w[0] = Set(0x80000000);
+    for (int i = 1; i < 15; i++)
+        w[i] = Set(0);
+    w[15] = Set(512);
+    Compress(s, w);
+
+    for (int i = 0; i < 8; i++) {
+        w[i] = s[i];
+        s[i] = Set(pInit[i]);
+    }
+    w[8] = Set(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = Set(0);
+    w[15] = Set(256);
+    Compress(s, w);
+
+    uint32_t lanes[4];
+    for (int i = 0; i < 8; i++) {
+        _mm_storeu_si128((__m128i*)lanes, s[i]);
+        for (int j = 0; j < 4; j++)
+            WriteBE32(out + 32 * j + 4 * i, lanes[j]);
+    }
+}
+
+} // namespace sse41
+
+// Whether the OS saves the AVX registers on context switches
+bool AVXEnabledByOS()
+{
+    uint32_t a, d;
+    __asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
+
+#endif // SHA256_X86
+
+std::string strImplementation = "scalar";
+
+// Pick the implementations once, before main() runs
+struct CSHA256Init
+{
+    CSHA256Init()
+    {
+#if SHA256_X86
+        uint32_t eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return;
+        fSSE41 = (ecx >> 19) & 1;
+        bool fAVX = ((ecx >> 27) & 1) && ((ecx >> 28) & 1) && AVXEnabledByOS();
+        if (__get_cpuid_max(0, NULL) >= 7) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            fAVX2 = fAVX && ((ebx >> 5) & 1);
+            fSHANI = fSSE41 && ((ebx >> 29) & 1);
+        }
+
+        if (fSHANI) {
+            Transform = shani::Transform;
+            strImplementation = "shani(1way,2way)";
+        } else {
+            if (fAVX2)
+                strImplementation += ",avx2(8way)";
+            if (fSSE41)
+                strImplementation += ",sse41(4way)";
+        }
+#endif
+    }
+} instance_of_csha256init;
+
+} // namespace
+
+CSHA256::CSHA256() : bytes(0)
+{
+    memcpy(s, pInit, sizeof(s));
+}
+
+CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
+{
+    const unsigned char* end = data + len;
+    size_t bufsize = bytes % 64;
+    if (bufsize && bufsize + len >= 64) {
+        // fill the buffer and process it
+        memcpy(buf + bufsize, data, 64 - bufsize);
+        bytes += 64 - bufsize;
+        data += 64 - bufsize;
+        Transform(s, buf, 1);
+        bufsize = 0;
+    }
+    if (end - data >= 64) {
+        // process whole blocks straight from the input
+        size_t nBlocks = (end - data) / 64;
+        Transform(s, data, nBlocks);
+        data += 64 * nBlocks;
+        bytes += 64 * nBlocks;
+    }
+    if (end > data) {
+        // keep the rest
+        memcpy(buf + bufsize, data, end - data);
+        bytes += end - data;
+    }
+    return *this;
+}
+
+void CSHA256::Finalize(unsigned char hash[OUTPUT_SIZE])
+{
+    static const unsigned char pad[64] = {0x80};
+    unsigned char sizedesc[8];
+    WriteBE64(sizedesc, bytes << 3);
+    Write(pad, 1 + ((119 - (bytes % 64)) % 64));
+    Write(sizedesc, 8);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(hash + 4 * i, s[i]);
+}
+
+CSHA256& CSHA256::Reset()
+{
+    bytes = 0;
+    memcpy(s, pInit, sizeof(s));
+    return *this;
+}
+
+void SHA256Compress(uint32_t s[8], const unsigned char block[64])
+{
+    Transform(s, block, 1);
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t nBlocks)
+{
+#if SHA256_X86
+    if (fSHANI) {
+        while (nBlocks >= 2) {
+            shani::TransformD64x2(out, in);
+            out += 64;
+            in += 128;
+            nBlocks -= 2;
+        }
+    }
+    if (fAVX2) {
+        while (nBlocks >= 8) {
+            avx2::TransformD64x8(out, in);
+            out += 256;
+            in += 512;
+            nBlocks -= 8;
+        }
+    }
+    if (fSSE41) {
+        while (nBlocks >= 4) {
+            sse41::TransformD64x4(out, in);
+            out += 128;
+            in += 256;
+            nBlocks -= 4;
+        }
+    }
+#endif
+    while (nBlocks) {
+        TransformD64(out, in);
+        out += 32;
+        in += 64;
+        nBlocks--;
+    }
+}
+
+std::string SHA256Implementation()
+{
+    return strImplementation;
+}
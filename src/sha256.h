@@ -0,0 +1,43 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SHA256_H
+#define BITCOIN_SHA256_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+/** A hasher class for SHA-256. The compression function is picked once for
+ *  the CPU at startup: the x86 SHA extensions where present, portable code
+ *  otherwise. */
+class CSHA256
+{
+private:
+    uint32_t s[8];
+    unsigned char buf[64];
+    uint64_t bytes;
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    CSHA256();
+    CSHA256& Write(const unsigned char* data, size_t len);
+    void Finalize(unsigned char hash[OUTPUT_SIZE]);
+    CSHA256& Reset();
+};
+
+/** Run the SHA-256 compression function on one 64 byte block, starting from
+ *  (and updating) the eight state words in s. */
+void SHA256Compress(uint32_t s[8], const unsigned char block[64]);
+
+/** Double SHA-256 of nBlocks inputs of 64 bytes each, such as the pairs of
+ *  child hashes of a merkle tree level, written to out at 32 bytes each.
+ *  Several inputs are hashed at once with 2-way SHA-NI, 8-way AVX2 or 4-way
+ *  SSE4.1 code, whichever the CPU supports first. out must not overlap in. */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t nBlocks);
+
+/** Describe the SHA-256 implementations in use, for the debug log */
+std::string SHA256Implementation();
+
+#endif
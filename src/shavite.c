@@ -34,6 +34,7 @@
 #include <string.h>
 
 #include "sph_shavite.h"
+#include "sph_aesni.h"
 
 #ifdef __cplusplus
 extern "C"{
@@ -720,6 +721,105 @@ c256(sph_shavite_small_context *sc, const void *msg)
 
 #endif
 
+#if SPH_AESNI
+
+/*
+ * SHAvite-3-512 compression with the AES-NI instructions. The message
+ * expansion is computed on 128-bit words: rk[u] holds the 32-bit words
+ * 4*u to 4*u+3 of the round key sequence used by the generic code.
+ */
+static SPH_AESNI_TARGET void
+c512_aesni(sph_shavite_big_context *sc, const void *msg)
+{
+	__m128i rk[112];
+	const sph_u32 *rk32 = (const sph_u32 *)rk;
+	__m128i zero = _mm_setzero_si128();
+	__m128i p0, p1, p2, p3;
+	size_t u;
+	int r, s;
+
+	for (u = 0; u < 8; u ++)
+		rk[u] = _mm_loadu_si128(
+			(const __m128i *)((const unsigned char *)msg + (u << 4)));
+	u = 8;
+	for (;;) {
+		for (s = 0; s < 8; s ++) {
+			__m128i x;
+
+			x = _mm_shuffle_epi32(rk[u - 8], 0x39);
+			x = _mm_aesenc_si128(x, zero);
+			rk[u] = _mm_xor_si128(x, rk[u - 1]);
+			switch (u) {
+			case 8:
+				rk[u] = _mm_xor_si128(rk[u], _mm_set_epi32(
+					(int)~sc->count3, (int)sc->count2,
+					(int)sc->count1, (int)sc->count0));
+				break;
+			case 41:
+				rk[u] = _mm_xor_si128(rk[u], _mm_set_epi32(
+					(int)~sc->count0, (int)sc->count1,
+					(int)sc->count2, (int)sc->count3));
+				break;
+			case 79:
+				rk[u] = _mm_xor_si128(rk[u], _mm_set_epi32(
+					(int)~sc->count1, (int)sc->count0,
+					(int)sc->count3, (int)sc->count2));
+				break;
+			case 110:
+				rk[u] = _mm_xor_si128(rk[u], _mm_set_epi32(
+					(int)~sc->count2, (int)sc->count3,
+					(int)sc->count0, (int)sc->count1));
+				break;
+			}
+			u ++;
+		}
+		if (u == 112)
+			break;
+		for (s = 0; s < 8; s ++) {
+			rk[u] = _mm_xor_si128(rk[u - 8],
+				_mm_loadu_si128((const __m128i *)&rk32[4 * u - 7]));
+			u ++;
+		}
+	}
+
+	p0 = _mm_loadu_si128((const __m128i *)&sc->h[0x0]);
+	p1 = _mm_loadu_si128((const __m128i *)&sc->h[0x4]);
+	p2 = _mm_loadu_si128((const __m128i *)&sc->h[0x8]);
+	p3 = _mm_loadu_si128((const __m128i *)&sc->h[0xC]);
+	u = 0;
+	for (r = 0; r < 14; r ++) {
+		__m128i x, t;
+
+		x = _mm_xor_si128(p1, rk[u]);
+		x = _mm_aesenc_si128(x, rk[u + 1]);
+		x = _mm_aesenc_si128(x, rk[u + 2]);
+		x = _mm_aesenc_si128(x, rk[u + 3]);
+		p0 = _mm_xor_si128(p0, _mm_aesenc_si128(x, zero));
+		x = _mm_xor_si128(p3, rk[u + 4]);
+		x = _mm_aesenc_si128(x, rk[u + 5]);
+		x = _mm_aesenc_si128(x, rk[u + 6]);
+		x = _mm_aesenc_si128(x, rk[u + 7]);
+		p2 = _mm_xor_si128(p2, _mm_aesenc_si128(x, zero));
+		u += 8;
+
+		t = p3;
+		p3 = p2;
+		p2 = p1;
+		p1 = p0;
+		p0 = t;
+	}
+	_mm_storeu_si128((__m128i *)&sc->h[0x0], _mm_xor_si128(
+		_mm_loadu_si128((const __m128i *)&sc->h[0x0]), p0));
+	_mm_storeu_si128((__m128i *)&sc->h[0x4], _mm_xor_si128(
+		_mm_loadu_si128((const __m128i *)&sc->h[0x4]), p1));
+	_mm_storeu_si128((__m128i *)&sc->h[0x8], _mm_xor_si128(
+		_mm_loadu_si128((const __m128i *)&sc->h[0x8]), p2));
+	_mm_storeu_si128((__m128i *)&sc->h[0xC], _mm_xor_si128(
+		_mm_loadu_si128((const __m128i *)&sc->h[0xC]), p3));
+}
+
+#endif
+
 #if SPH_SMALL_FOOTPRINT_SHAVITE
 
 /*
@@ -734,6 +834,12 @@ c512(sph_shavite_big_context *sc, const void *msg)
 	size_t u;
 	int r, s;
 
+#if SPH_AESNI
+	if (sph_aesni_available()) {
+		c512_aesni(sc, msg);
+		return;
+	}
+#endif
 #if SPH_LITTLE_ENDIAN
 	memcpy(rk, msg, 128);
 #else
@@ -908,6 +1014,13 @@ c512(sph_shavite_big_context *sc, const void *msg)
 	sph_u32 rk18, rk19, rk1A, rk1B, rk1C, rk1D, rk1E, rk1F;
 	int r;
 
+#if SPH_AESNI
+	if (sph_aesni_available()) {
+		c512_aesni(sc, msg);
+		return;
+	}
+#endif
+
 	p0 = sc->h[0x0];
 	p1 = sc->h[0x1];
 	p2 = sc->h[0x2];
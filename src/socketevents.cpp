@@ -0,0 +1,222 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include <boost/thread/thread.hpp>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// epoll_wait returns at most this many events per call; the rest stay
+// queued for the next one
+static const int MAX_EPOLL_EVENTS = 256;
+
+CSocketEvents::CSocketEvents(bool fTryEpoll) : fEpoll(false), fdEpoll(-1), fdWakeup(-1)
+{
+#ifdef __linux__
+    if (!fTryEpoll)
+        return;
+    fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+    fdWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fdEpoll >= 0 && fdWakeup >= 0) {
+        // level triggered, it is read empty on every wakeup
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &fdWakeup;
+        fEpoll = (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, fdWakeup, &event) == 0);
+    }
+    if (!fEpoll) {
+        if (fdEpoll >= 0)
+            close(fdEpoll);
+        if (fdWakeup >= 0)
+            close(fdWakeup);
+        fdEpoll = fdWakeup = -1;
+    }
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifdef __linux__
+    if (fEpoll) {
+        close(fdEpoll);
+        close(fdWakeup);
+    }
+#endif
+}
+
+bool CSocketEvents::HaveEpoll()
+{
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool CSocketEvents::Add(SOCKET hSocket, void* pdata)
+{
+#ifdef __linux__
+    if (fEpoll) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = pdata;
+        return epoll_ctl(fdEpoll, EPOLL_CTL_ADD, hSocket, &event) == 0;
+    }
+#endif
+
+    boost::mutex::scoped_lock lock(mutex);
+#ifdef WIN32
+    // a Windows fd_set is an array of FD_SETSIZE sockets
+    if (mapSockets.size() >= FD_SETSIZE)
+        return false;
+#else
+    // elsewhere it is a bitmap indexed by descriptor
+    if (hSocket >= FD_SETSIZE)
+        return false;
+#endif
+    CInterest interest;
+    interest.pdata = pdata;
+    interest.fRecv = true;
+    interest.fSend = false;
+    mapSockets[hSocket] = interest;
+    return true;
+}
+
+void CSocketEvents::Remove(SOCKET hSocket)
+{
+#ifdef __linux__
+    if (fEpoll) {
+        // kernels before 2.6.9 want an event even though it is ignored
+        struct epoll_event event;
+        epoll_ctl(fdEpoll, EPOLL_CTL_DEL, hSocket, &event);
+        return;
+    }
+#endif
+
+    boost::mutex::scoped_lock lock(mutex);
+    mapSockets.erase(hSocket);
+}
+
+void CSocketEvents::SetInterest(SOCKET hSocket, bool fRecv, bool fSend)
+{
+    if (fEpoll)
+        return;
+
+    boost::mutex::scoped_lock lock(mutex);
+    map<SOCKET, CInterest>::iterator mi = mapSockets.find(hSocket);
+    if (mi != mapSockets.end()) {
+        mi->second.fRecv = fRecv;
+        mi->second.fSend = fSend;
+    }
+}
+
+bool CSocketEvents::Wait(int nTimeoutMillis, vector<CSocketEvent>& vEvents, bool& fWakeup)
+{
+    vEvents.clear();
+    fWakeup = false;
+    if (!fEpoll)
+        return WaitSelect(nTimeoutMillis, vEvents);
+
+#ifdef __linux__
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(fdEpoll, events, MAX_EPOLL_EVENTS, nTimeoutMillis);
+    if (nEvents < 0)
+        return errno == EINTR;
+
+    vEvents.reserve(nEvents);
+    for (int i = 0; i < nEvents; i++) {
+        if (events[i].data.ptr == &fdWakeup) {
+            uint64_t nCount;
+            if (read(fdWakeup, &nCount, sizeof(nCount)) < 0) {
+                // already read empty
+            }
+            fWakeup = true;
+            continue;
+        }
+        CSocketEvent event;
+        event.pdata = events[i].data.ptr;
+        event.fRecv = (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) != 0;
+        event.fSend = (events[i].events & EPOLLOUT) != 0;
+        event.fError = (events[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+        vEvents.push_back(event);
+    }
+#endif
+    return true;
+}
+
+bool CSocketEvents::WaitSelect(int nTimeoutMillis, vector<CSocketEvent>& vEvents)
+{
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        for (map<SOCKET, CInterest>::const_iterator mi = mapSockets.begin(); mi != mapSockets.end(); ++mi) {
+            if (mi->second.fRecv)
+                FD_SET(mi->first, &fdsetRecv);
+            if (mi->second.fSend)
+                FD_SET(mi->first, &fdsetSend);
+            FD_SET(mi->first, &fdsetError);
+            hSocketMax = max(hSocketMax, mi->first);
+            have_fds = true;
+        }
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeoutMillis / 1000;
+    timeout.tv_usec = (nTimeoutMillis % 1000) * 1000;
+
+    // Windows fails select() without sockets
+    if (!have_fds) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(nTimeoutMillis));
+        return true;
+    }
+
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    bool fOk = (nSelect != SOCKET_ERROR);
+    if (!fOk) {
+        // try reading every socket, to drop the broken ones
+        for (unsigned int i = 0; i <= hSocketMax; i++)
+            FD_SET(i, &fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        boost::this_thread::sleep(boost::posix_time::milliseconds(nTimeoutMillis));
+    }
+
+    boost::mutex::scoped_lock lock(mutex);
+    for (map<SOCKET, CInterest>::const_iterator mi = mapSockets.begin(); mi != mapSockets.end(); ++mi) {
+        CSocketEvent event;
+        event.pdata = mi->second.pdata;
+        event.fRecv = FD_ISSET(mi->first, &fdsetRecv);
+        event.fSend = FD_ISSET(mi->first, &fdsetSend);
+        event.fError = FD_ISSET(mi->first, &fdsetError);
+        if (event.fRecv || event.fSend || event.fError)
+            vEvents.push_back(event);
+    }
+    return fOk;
+}
+
+void CSocketEvents::Wakeup()
+{
+#ifdef __linux__
+    if (fEpoll) {
+        uint64_t nOne = 1;
+        if (write(fdWakeup, &nOne, sizeof(nOne)) < 0) {
+            // the counter is full, Wait will wake up anyway
+        }
+    }
+#endif
+}
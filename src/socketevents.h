@@ -0,0 +1,80 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#include "compat.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+/** Readiness of one watched socket, as returned by CSocketEvents::Wait */
+struct CSocketEvent
+{
+    void* pdata;        // as given to CSocketEvents::Add
+    bool fRecv;         // data to read, or the peer closed
+    bool fSend;         // room to write
+    bool fError;
+};
+
+/** Waits for sockets to become ready, for the socket handler thread.
+ *
+ * On Linux this is epoll in edge triggered mode: every socket is registered
+ * once for both directions, and an event means the socket became ready
+ * since it was last drained. Whoever gets an event has to read or write
+ * until the call would block before another one comes; SetInterest is not
+ * needed. Wakeup interrupts Wait through an eventfd.
+ *
+ * Elsewhere, or if epoll can't be set up, select() stands in: events are
+ * level triggered, only the directions asked for with SetInterest are
+ * watched, sockets are limited to FD_SETSIZE and Wakeup does nothing.
+ *
+ * Wait is only called from one thread. Add, SetInterest and Remove may be
+ * called from any thread, but a socket must be removed before it is closed.
+ */
+class CSocketEvents
+{
+private:
+    bool fEpoll;
+    int fdEpoll;
+    int fdWakeup;
+
+    // select() fallback
+    struct CInterest
+    {
+        void* pdata;
+        bool fRecv;
+        bool fSend;
+    };
+    boost::mutex mutex;
+    std::map<SOCKET, CInterest> mapSockets;
+
+    bool WaitSelect(int nTimeoutMillis, std::vector<CSocketEvent>& vEvents);
+
+public:
+    CSocketEvents(bool fTryEpoll = true);
+    ~CSocketEvents();
+
+    /** Whether epoll is built in; select() watches at most FD_SETSIZE sockets */
+    static bool HaveEpoll();
+
+    bool IsEdgeTriggered() const { return fEpoll; }
+    const char* GetName() const { return fEpoll ? "epoll" : "select"; }
+
+    /** Start watching a socket, initially for reading only. Fails if the
+     *  backend can't watch it (select beyond FD_SETSIZE). */
+    bool Add(SOCKET hSocket, void* pdata);
+    void Remove(SOCKET hSocket);
+    /** Which directions to watch; ignored in edge triggered mode */
+    void SetInterest(SOCKET hSocket, bool fRecv, bool fSend);
+
+    /** Wait up to nTimeoutMillis for events. fWakeup tells whether Wakeup was
+     *  called since the last Wait. Returns false on errors. */
+    bool Wait(int nTimeoutMillis, std::vector<CSocketEvent>& vEvents, bool& fWakeup);
+    void Wakeup();
+};
+
+#endif
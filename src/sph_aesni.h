@@ -0,0 +1,60 @@
+/**
+ * AES-NI support for the AES based hash functions (ECHO, SHAvite-3 and
+ * Groestl). On x86 targets built with a GCC compatible compiler, those
+ * implementations carry a second version of their compression function
+ * written with the AES-NI and SSSE3 intrinsics. The CPU is probed once at
+ * program startup (by the compiler runtime) and the AES-NI version is used
+ * whenever it is available; otherwise the table based code runs as before.
+ * Both versions produce identical output.
+ *
+ * Define SPH_NO_AESNI to compile the table based code only.
+ *
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ *
+ * @file     sph_aesni.h
+ */
+
+#ifndef SPH_AESNI_H__
+#define SPH_AESNI_H__
+
+/*
+ * This header must be included outside of any 'extern "C"' block, since
+ * the intrinsics headers pull in C++ declarations when compiled as C++.
+ */
+
+#if !defined SPH_NO_AESNI && defined __GNUC__ \
+	&& (defined __x86_64__ || defined __i386__) \
+	&& (__GNUC__ >= 5 || defined __clang__)
+
+#define SPH_AESNI   1
+
+#include <immintrin.h>
+
+#define SPH_AESNI_TARGET   __attribute__((target("aes,ssse3")))
+
+/*
+ * Non-zero if the CPU executing this code implements AES-NI. The
+ * feature bits are read by the compiler runtime at startup, so this
+ * is a plain memory test.
+ */
+#define sph_aesni_available()   __builtin_cpu_supports("aes")
+
+/*
+ * Multiplication by 2 in GF(2^8) (AES polynomial) of every byte.
+ */
+static inline SPH_AESNI_TARGET __m128i
+sph_aesni_mul2(__m128i x)
+{
+	return _mm_xor_si128(_mm_add_epi8(x, x),
+		_mm_and_si128(_mm_cmplt_epi8(x, _mm_setzero_si128()),
+		_mm_set1_epi8(0x1B)));
+}
+
+#else
+
+#define SPH_AESNI   0
+
+#endif
+
+#endif
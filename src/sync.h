@@ -7,6 +7,7 @@
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include "threadsafety.h"
@@ -40,6 +41,10 @@ typedef AnnotatedMixin<boost::recursive_mutex> CCriticalSection;
 /** Wrapped boost mutex: supports waiting but not recursive locking */
 typedef AnnotatedMixin<boost::mutex> CWaitableCriticalSection;
 
+/** Reader/writer lock: many shared holders or a single exclusive one.
+ *  Not recursive, and not tracked by DEBUG_LOCKORDER. */
+typedef boost::shared_mutex CSharedCriticalSection;
+
 #ifdef DEBUG_LOCKORDER
 void EnterCritical(const char* pszName, const char* pszFile, int nLine, void* cs, bool fTry = false);
 void LeaveCritical();
@@ -109,6 +114,9 @@ typedef CMutexLock<CCriticalSection> CCriticalBlock;
 #define LOCK2(cs1,cs2) CCriticalBlock criticalblock1(cs1, #cs1, __FILE__, __LINE__),criticalblock2(cs2, #cs2, __FILE__, __LINE__)
 #define TRY_LOCK(cs,name) CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true)
 
+#define READ_LOCK(cs) boost::shared_lock<CSharedCriticalSection> readblock(cs)
+#define WRITE_LOCK(cs) boost::unique_lock<CSharedCriticalSection> writeblock(cs)
+
 #define ENTER_CRITICAL_SECTION(cs) \
     { \
         EnterCritical(#cs, __FILE__, __LINE__, (void*)(&cs)); \
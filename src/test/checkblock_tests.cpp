@@ -9,6 +9,7 @@
 #include <boost/foreach.hpp>
 
 #include "main.h"
+#include "hashblock.h"
 #include "wallet.h"
 #include "net.h"
 #include "util.h"
@@ -63,4 +64,95 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(header_hash_count)
+{
+    CBlock block;
+    block.nTime = 1390095618;
+    block.nBits = 0x1e0ffff0;
+    block.nNonce = 28917698;
+    block.hashMerkleRoot = uint256("0xe0028eb9648db56b1ac77cf090b99048a8007e2bb64b68f092c03c7f56a662c7");
+
+    uint64 nStart = GetHash9Count();
+    uint256 hash = block.GetHash();
+    BOOST_CHECK(hash == Hash9(BEGIN(block.nVersion), END(block.nNonce)));
+    BOOST_CHECK(block.GetBlockHeader().GetHash() == hash);
+    // Every X11 run on this thread is counted
+    BOOST_CHECK_EQUAL(GetHash9Count() - nStart, 3U);
+
+    block.nNonce++;
+    BOOST_CHECK(block.GetHash() != hash);
+}
+
+static CBlock MakeTestBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nTime = 1390095618;
+    block.nBits = 0x1e0ffff0;
+
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = 50 * COIN;
+    block.vtx.push_back(txCoinbase);
+
+    for (unsigned int i = 1; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(i), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = COIN;
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+// Run CheckBlock on the transaction check threads, or without them
+static bool CheckTestBlock(CBlock& block, bool fParallel, int& nDoS)
+{
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    int nThreads = nScriptCheckThreads;
+    if (!fParallel)
+        nScriptCheckThreads = 0;
+    CValidationState state;
+    bool fValid = block.CheckBlock(state, false, true);
+    nScriptCheckThreads = nThreads;
+    nDoS = 0;
+    state.IsInvalid(nDoS);
+    return fValid;
+}
+
+BOOST_AUTO_TEST_CASE(parallel_transaction_checks)
+{
+    BOOST_REQUIRE(nScriptCheckThreads > 1);
+    int nDoS = 0;
+
+    CBlock block = MakeTestBlock(20);
+    BOOST_CHECK(CheckTestBlock(block, false, nDoS));
+    BOOST_CHECK(CheckTestBlock(block, true, nDoS));
+
+    // one transaction with duplicate inputs
+    CBlock blockDup = MakeTestBlock(20);
+    blockDup.vtx[10].vin.push_back(blockDup.vtx[10].vin[0]);
+    BOOST_CHECK(!CheckTestBlock(blockDup, false, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    BOOST_CHECK(!CheckTestBlock(blockDup, true, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+
+    // two bad transactions with different scores: whatever the threads hit
+    // first, the first one in the block is reported, as by the serial checks
+    CBlock blockBad = MakeTestBlock(40);
+    blockBad.vtx[5].vout.clear();
+    blockBad.vtx[35].vin.push_back(blockBad.vtx[35].vin[0]);
+    BOOST_CHECK(!CheckTestBlock(blockBad, false, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 10);
+    for (int i = 0; i < 20; i++)
+    {
+        BOOST_CHECK(!CheckTestBlock(blockBad, true, nDoS));
+        BOOST_CHECK_EQUAL(nDoS, 10);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
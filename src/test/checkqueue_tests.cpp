@@ -0,0 +1,81 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/foreach.hpp>
+
+#include "checkqueue.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+/** Check that counts its runs, and fails if asked to */
+class CCountingCheck
+{
+private:
+    boost::mutex *pmutex;
+    int *pnRuns;
+    bool fOk;
+
+public:
+    CCountingCheck() : pmutex(NULL), pnRuns(NULL), fOk(true) { }
+    CCountingCheck(boost::mutex &mutexIn, int &nRunsIn, bool fOkIn) : pmutex(&mutexIn), pnRuns(&nRunsIn), fOk(fOkIn) { }
+
+    bool operator()() {
+        boost::unique_lock<boost::mutex> lock(*pmutex);
+        (*pnRuns)++;
+        return fOk;
+    }
+
+    void swap(CCountingCheck &check) {
+        std::swap(pmutex, check.pmutex);
+        std::swap(pnRuns, check.pnRuns);
+        std::swap(fOk, check.fOk);
+    }
+};
+
+static void RunChecks(CCheckQueue<CCountingCheck> *pqueue, int nChecks, int nFailAt, bool *pfResult)
+{
+    boost::mutex mutex;
+    int nRuns = 0;
+    CCheckQueueControl<CCountingCheck> control(pqueue);
+    for (int i = 0; i < nChecks; i++) {
+        vector<CCountingCheck> vChecks;
+        vChecks.push_back(CCountingCheck(mutex, nRuns, i != nFailAt));
+        control.Add(vChecks);
+    }
+    *pfResult = control.Wait();
+    if (nFailAt < 0)
+        BOOST_CHECK_EQUAL(nRuns, nChecks);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_pool)
+{
+    CCheckQueuePool pool;
+    CCheckQueue<CCountingCheck> queue1(4, &pool);
+    CCheckQueue<CCountingCheck> queue2(16, &pool);
+
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueuePool::Thread, &pool));
+
+    for (int n = 0; n < 20; n++) {
+        // both queues driven at once, by their own masters
+        bool fResult1 = false, fResult2 = false;
+        boost::thread master1(boost::bind(&RunChecks, &queue1, 1000, -1, &fResult1));
+        boost::thread master2(boost::bind(&RunChecks, &queue2, 1000, n * 50, &fResult2));
+        master1.join();
+        master2.join();
+        BOOST_CHECK(fResult1);
+        BOOST_CHECK(!fResult2);
+    }
+
+    // the queues are reusable after a failure
+    bool fResult = false;
+    RunChecks(&queue2, 100, -1, &fResult);
+    BOOST_CHECK(fResult);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
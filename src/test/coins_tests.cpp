@@ -0,0 +1,233 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+// Coin database stand-in, which keeps what BatchWrite would commit
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    map<uint256, CCoins> mapCoins;
+    unsigned int nWrites;
+
+    CCoinsViewTest() : nWrites(0) { }
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) {
+        map<uint256, CCoins>::iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256 &txid) {
+        return mapCoins.count(txid) > 0;
+    }
+
+    bool BatchWrite(CCoinsMap &mapWrite, CBlockIndex *pindex) {
+        for (CCoinsMap::iterator it = mapWrite.begin(); it != mapWrite.end(); ++it) {
+            if (!(it->flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            if ((it->flags & CCoinsCacheEntry::FRESH) && it->coins.IsPruned())
+                continue;
+            if (it->coins.IsPruned())
+                mapCoins.erase(it->txid);
+            else
+                mapCoins[it->txid] = it->coins;
+            nWrites++;
+        }
+        return true;
+    }
+};
+
+static CCoins MakeCoins(int nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(uint256(nValue), 0);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    tx.vout[0].nValue = nValue;
+    return CCoins(tx, 1);
+}
+
+static void SpendAll(CCoins &coins)
+{
+    for (unsigned int i = 0; i < coins.vout.size(); i++)
+        coins.vout[i].SetNull();
+    coins.Cleanup();
+}
+
+BOOST_AUTO_TEST_CASE(coins_map_random)
+{
+    CCoinsMap mapCoins;
+    map<uint256, int> mapExpected;
+    bool fNew;
+
+    for (int i = 0; i < 20000; i++) {
+        uint256 txid(GetRand(2000));
+        if (GetRand(3) == 0) {
+            mapCoins.Erase(txid);
+            mapExpected.erase(txid);
+        } else {
+            CCoinsCacheEntry *pentry = mapCoins.Insert(txid, fNew);
+            BOOST_CHECK(fNew == (mapExpected.count(txid) == 0));
+            BOOST_CHECK(pentry->txid == txid);
+            pentry->coins.nHeight = i;
+            mapExpected[txid] = i;
+        }
+    }
+
+    BOOST_CHECK(mapCoins.Size() == mapExpected.size());
+    for (int i = 0; i < 2000; i++) {
+        CCoinsCacheEntry *pentry = mapCoins.Find(uint256(i));
+        map<uint256, int>::iterator it = mapExpected.find(uint256(i));
+        BOOST_CHECK((pentry != NULL) == (it != mapExpected.end()));
+        if (pentry != NULL && it != mapExpected.end())
+            BOOST_CHECK(pentry->coins.nHeight == it->second);
+    }
+
+    size_t nSeen = 0;
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
+        nSeen++;
+    BOOST_CHECK(nSeen == mapExpected.size());
+
+    mapCoins.Clear();
+    BOOST_CHECK(mapCoins.Size() == 0);
+    BOOST_CHECK(mapCoins.Find(uint256(1)) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_flags)
+{
+    CCoinsViewTest base;
+    base.mapCoins[uint256(1)] = MakeCoins(1);
+    base.mapCoins[uint256(2)] = MakeCoins(2);
+
+    CCoinsViewCache cache(base);
+
+    // Reading doesn't make an entry dirty
+    BOOST_CHECK(cache.HaveCoins(uint256(1)));
+    BOOST_CHECK(cache.AccessCoins(uint256(1)).vout[0].nValue == 1);
+
+    // Spending does
+    SpendAll(cache.GetCoins(uint256(2)));
+
+    // Misses are cached, and coins created and spent on top of one never reach the base
+    BOOST_CHECK(!cache.HaveCoins(uint256(3)));
+    cache.SetCoins(uint256(3), MakeCoins(3));
+    BOOST_CHECK(cache.HaveCoins(uint256(3)));
+    SpendAll(cache.GetCoins(uint256(3)));
+    BOOST_CHECK(!cache.HaveCoins(uint256(3)));
+
+    cache.SetCoins(uint256(4), MakeCoins(4));
+
+    size_t nUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 0);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(cache.DynamicMemoryUsage() == 0);
+
+    BOOST_CHECK(base.nWrites == 2);
+    BOOST_CHECK(base.mapCoins.count(uint256(1)));
+    BOOST_CHECK(!base.mapCoins.count(uint256(2)));
+    BOOST_CHECK(!base.mapCoins.count(uint256(3)));
+    BOOST_CHECK(base.mapCoins.count(uint256(4)));
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_layers)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache parent(base);
+
+    {
+        CCoinsViewCache child(parent, true);
+        BOOST_CHECK(!child.HaveCoins(uint256(5)));
+        child.SetCoins(uint256(5), MakeCoins(5));
+        BOOST_CHECK(child.Flush());
+    }
+    BOOST_CHECK(parent.HaveCoins(uint256(5)));
+    BOOST_CHECK(parent.GetCacheSize() > 0);
+
+    {
+        CCoinsViewCache child(parent, true);
+        SpendAll(child.GetCoins(uint256(5)));
+        BOOST_CHECK(child.Flush());
+    }
+    BOOST_CHECK(!parent.HaveCoins(uint256(5)));
+
+    BOOST_CHECK(parent.Flush());
+    BOOST_CHECK(base.nWrites == 0);
+    BOOST_CHECK(base.mapCoins.empty());
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_warm)
+{
+    CCoinsViewTest base;
+    base.mapCoins[uint256(6)] = MakeCoins(6);
+    CCoinsViewCache cache(base);
+
+    // Lookups done elsewhere fill the cache as if it had done them itself
+    CCoins coins;
+    BOOST_CHECK(base.GetCoins(uint256(6), coins));
+    cache.CacheCoins(uint256(6), true, coins);
+    BOOST_CHECK(cache.HaveCoinsInCache(uint256(6)));
+    BOOST_CHECK(cache.AccessCoins(uint256(6)).vout[0].nValue == 6);
+
+    CCoins missing;
+    cache.CacheCoins(uint256(7), false, missing);
+    BOOST_CHECK(cache.HaveCoinsInCache(uint256(7)));
+    BOOST_CHECK(!cache.HaveCoins(uint256(7)));
+
+    // but never replace what is cached already
+    CCoins other = MakeCoins(8);
+    cache.CacheCoins(uint256(6), true, other);
+    BOOST_CHECK(cache.AccessCoins(uint256(6)).vout[0].nValue == 6);
+
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(base.nWrites == 0);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_no_misses)
+{
+    CCoinsViewTest base;
+    base.mapCoins[uint256(9)] = MakeCoins(9);
+    CCoinsViewCache parent(base, false, false);
+
+    // Looking up txids that don't exist doesn't grow a cache that doesn't keep misses
+    {
+        CCoinsViewCache child(parent, true);
+        for (int i = 100; i < 200; i++)
+            BOOST_CHECK(!child.HaveCoins(uint256(i)));
+        CCoins coins;
+        BOOST_CHECK(!child.GetCoins(uint256(200), coins));
+    }
+    CCoins missing;
+    parent.CacheCoins(uint256(201), false, missing);
+    BOOST_CHECK(!parent.HaveCoins(uint256(202)));
+    BOOST_CHECK(parent.GetCacheSize() == 0);
+    BOOST_CHECK(parent.DynamicMemoryUsage() == 0);
+
+    // Hits are still cached
+    BOOST_CHECK(parent.HaveCoins(uint256(9)));
+    BOOST_CHECK(parent.GetCacheSize() == 1);
+
+    // and coins created above it are still known to be new
+    {
+        CCoinsViewCache child(parent, true);
+        BOOST_CHECK(!child.HaveCoins(uint256(10)));
+        child.SetCoins(uint256(10), MakeCoins(10));
+        BOOST_CHECK(child.Flush());
+    }
+    {
+        CCoinsViewCache child(parent, true);
+        SpendAll(child.GetCoins(uint256(10)));
+        BOOST_CHECK(child.Flush());
+    }
+    BOOST_CHECK(!parent.HaveCoins(uint256(10)));
+    BOOST_CHECK(parent.Flush());
+    BOOST_CHECK(base.nWrites == 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
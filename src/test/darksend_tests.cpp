@@ -1,5 +1,6 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include "base58.h"
@@ -8,6 +9,7 @@
 #include "core.h"
 #include "darksend.h"
 #include "masternode.h"
+#include "wallet.h"
 
 using namespace std;
 
@@ -34,7 +36,7 @@ BOOST_AUTO_TEST_CASE(darksend_payment_amount)
 BOOST_AUTO_TEST_CASE(darksend_payments)
 {
     darkSendPool.unitTest = true;
-    darkSendMasterNodes.clear();
+    darkSendMasterNodes.Clear();
 
     CService addr;
     std::vector<unsigned char> vchSig;
@@ -49,11 +51,11 @@ BOOST_AUTO_TEST_CASE(darksend_payments)
     CTxIn t3 = CTxIn(n3, 0);
 
     CMasterNode mn1(addr, t1, CPubKey(), vchSig, 0, CPubKey());
-    darkSendMasterNodes.push_back(mn1);
+    darkSendMasterNodes.Add(mn1);
     CMasterNode mn2(addr, t2, CPubKey(), vchSig, 0, CPubKey());
-    darkSendMasterNodes.push_back(mn2);
+    darkSendMasterNodes.Add(mn2);
     CMasterNode mn3(addr, t3, CPubKey(), vchSig, 0, CPubKey());
-    darkSendMasterNodes.push_back(mn3);
+    darkSendMasterNodes.Add(mn3);
 
     CMasternodePaymentWinner w1; w1.nBlockHeight = 100000; w1.vin = t1;
     CMasternodePaymentWinner w2; w2.nBlockHeight = 100000; w2.vin = t2;
@@ -94,6 +96,66 @@ BOOST_AUTO_TEST_CASE(darksend_sign)
     BOOST_CHECK(dss.VerifyMessage(pubkey, vchSig, "hello2", errorMessage) == false);
 }
 
+BOOST_AUTO_TEST_CASE(darksend_signature_queue)
+{
+    std::string errorMessage = "";
+    CKey key;
+    CPubKey pubkey;
+    CDarkSendSigner dss;
+    dss.SetKey("XDPugk3QgxVpQ4BubgzKaXhQudtaBnjuos9w6ZTojYx68EipNnt7", errorMessage, key, pubkey);
+
+    uint256 n1; n1.SetHex("5c4573335c56fd5c9e1851bb5c0616de96d35a41b4d2971094f2380e84be8d32");
+    CMasternodePaymentWinner winner;
+    winner.nBlockHeight = pindexBest->nHeight + 1;
+    winner.vin = CTxIn(n1, 0);
+    std::string strMessage = winner.vin.ToString().c_str() + boost::lexical_cast<std::string>(winner.nBlockHeight);
+    BOOST_CHECK(dss.SignMessage(strMessage, errorMessage, winner.vchSig, key));
+
+    // the same signature over another height recovers to another key
+    CMasternodePaymentWinner winnerBad(winner);
+    winnerBad.nBlockHeight++;
+    std::string strMessageBad = winnerBad.vin.ToString().c_str() + boost::lexical_cast<std::string>(winnerBad.nBlockHeight);
+
+    CSignatureQueueStats statsBefore = darkSendSignatureQueue.GetStats();
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << winner;
+    darkSendSignatureQueue.AddMessage(PROTOCOL_VERSION, "mnw", ss);
+    darkSendSignatureQueue.AddMessage(PROTOCOL_VERSION, "mnw", ss);
+    CDataStream ssBad(SER_NETWORK, PROTOCOL_VERSION);
+    ssBad << winnerBad;
+    darkSendSignatureQueue.AddMessage(PROTOCOL_VERSION, "mnw", ssBad);
+    // truncated, ignored
+    darkSendSignatureQueue.AddMessage(PROTOCOL_VERSION, "mnw", CDataStream(ss.begin(), ss.begin() + 10, SER_NETWORK, PROTOCOL_VERSION));
+    darkSendSignatureQueue.Verify();
+
+    CSignatureQueueStats stats = darkSendSignatureQueue.GetStats();
+    BOOST_CHECK_EQUAL(stats.nQueued - statsBefore.nQueued, 2U);
+    BOOST_CHECK_EQUAL(stats.nLastDepth, 2U);
+
+    BOOST_CHECK(dss.VerifyMessage(pubkey, winner.vchSig, strMessage, errorMessage));
+    BOOST_CHECK(!dss.VerifyMessage(pubkey, winnerBad.vchSig, strMessageBad, errorMessage));
+    stats = darkSendSignatureQueue.GetStats();
+    BOOST_CHECK_EQUAL(stats.nHits - statsBefore.nHits, 2U);
+
+    // verified already, not queued again
+    darkSendSignatureQueue.AddMessage(PROTOCOL_VERSION, "mnw", ss);
+    BOOST_CHECK_EQUAL(darkSendSignatureQueue.GetStats().nQueued - statsBefore.nQueued, 2U);
+
+    // dropped by the handler before its signature is checked, not queued
+    CMasternodePaymentWinner winnerFar(winner);
+    winnerFar.nBlockHeight = pindexBest->nHeight + 100;
+    CDataStream ssFar(SER_NETWORK, PROTOCOL_VERSION);
+    ssFar << winnerFar;
+    darkSendSignatureQueue.AddMessage(PROTOCOL_VERSION, "mnw", ssFar);
+    CDarksendQueue dsq;
+    dsq.vin = winner.vin;
+    dsq.time = GetTime();
+    CDataStream ssDsq(SER_NETWORK, PROTOCOL_VERSION);
+    ssDsq << dsq;
+    darkSendSignatureQueue.AddMessage(darkSendPool.MIN_PEER_PROTO_VERSION, "dsq", ssDsq); // unknown masternode
+    BOOST_CHECK_EQUAL(darkSendSignatureQueue.GetStats().nQueued - statsBefore.nQueued, 2U);
+}
+
 BOOST_AUTO_TEST_CASE(darksend_vote)
 {
     CPubKey key;
@@ -289,7 +351,7 @@ BOOST_AUTO_TEST_CASE(darksend_session)
 
 BOOST_AUTO_TEST_CASE(darksend_masternode_search_by_vin)
 {
-    darkSendMasterNodes.clear();
+    darkSendMasterNodes.Clear();
 
     uint256 n1 = 10000;
     uint256 n2 = 10001;
@@ -302,14 +364,183 @@ BOOST_AUTO_TEST_CASE(darksend_masternode_search_by_vin)
 
     //setup a couple fake masternodes
     CMasterNode mn1(addr, testVin1, CPubKey(), vchSig, 0, CPubKey());
-    darkSendMasterNodes.push_back(mn1);
+    darkSendMasterNodes.Add(mn1);
 
     CMasterNode mn2(addr, testVin2, CPubKey(), vchSig, 0, CPubKey());
-    darkSendMasterNodes.push_back(mn2);
+    darkSendMasterNodes.Add(mn2);
 
     BOOST_CHECK(GetMasternodeByVin(testVinNotFound) == -1);
-    BOOST_CHECK(GetMasternodeByVin(testVin1) == 0);
-    BOOST_CHECK(GetMasternodeByVin(testVin2) == 1);
+    BOOST_CHECK(GetMasternodeByVin(testVin1) == darkSendMasterNodes[darkSendMasterNodes.Find(testVin1)].nId);
+    BOOST_CHECK(GetMasternodeByVin(testVin2) == darkSendMasterNodes[darkSendMasterNodes.Find(testVin2)].nId);
+    BOOST_CHECK(GetMasternodeByVin(testVin1) != GetMasternodeByVin(testVin2));
+}
+
+BOOST_AUTO_TEST_CASE(darksend_masternode_list_index)
+{
+    darkSendMasterNodes.Clear();
+
+    CService addr1("1.2.3.4:9999");
+    CService addr2("1.2.3.5:9999");
+    CService addr3("1.2.3.6:9999");
+    CTxIn vin1 = CTxIn(10000, 0);
+    CTxIn vin2 = CTxIn(10000, 1);
+    CTxIn vin3 = CTxIn(10002, 0);
+    std::vector<unsigned char> vchSig;
+
+    BOOST_CHECK(darkSendMasterNodes.Add(CMasterNode(addr1, vin1, CPubKey(), vchSig, 0, CPubKey())));
+    BOOST_CHECK(darkSendMasterNodes.Add(CMasterNode(addr2, vin2, CPubKey(), vchSig, 0, CPubKey())));
+    BOOST_CHECK(darkSendMasterNodes.Add(CMasterNode(addr3, vin3, CPubKey(), vchSig, 0, CPubKey())));
+    // the collateral can only be registered once
+    BOOST_CHECK(!darkSendMasterNodes.Add(CMasterNode(addr3, vin1, CPubKey(), vchSig, 0, CPubKey())));
+    BOOST_CHECK(darkSendMasterNodes.size() == 3);
+
+    BOOST_CHECK(darkSendMasterNodes.Find(vin2.prevout) == 1);
+    BOOST_CHECK(darkSendMasterNodes.Find(addr3) == 2);
+    BOOST_CHECK(darkSendMasterNodes.Find(CService("1.2.3.7:9999")) == -1);
+    // an input with the same outpoint but a different signature is not a match
+    CTxIn vin1Signed = vin1;
+    vin1Signed.scriptSig << OP_TRUE;
+    BOOST_CHECK(darkSendMasterNodes.Find(vin1Signed.prevout) == 0);
+    BOOST_CHECK(darkSendMasterNodes.Find(vin1Signed) == -1);
+
+    int nId1 = darkSendMasterNodes[0].nId;
+    int nId3 = darkSendMasterNodes[2].nId;
+    BOOST_CHECK(darkSendMasterNodes.FindById(nId3) == 2);
+
+    // removing an entry keeps the order of the others and their indexes
+    CMasternodeList::iterator it = darkSendMasterNodes.Remove(darkSendMasterNodes.begin());
+    BOOST_CHECK(it == darkSendMasterNodes.begin());
+    BOOST_CHECK(darkSendMasterNodes.size() == 2);
+    BOOST_CHECK(darkSendMasterNodes.Find(vin1) == -1);
+    BOOST_CHECK(darkSendMasterNodes.Find(addr1) == -1);
+    BOOST_CHECK(darkSendMasterNodes.Find(vin2) == 0);
+    BOOST_CHECK(darkSendMasterNodes.Find(addr3) == 1);
+    BOOST_CHECK(darkSendMasterNodes[1].vin == vin3);
+    // ids survive the removal, positions don't
+    BOOST_CHECK(darkSendMasterNodes.FindById(nId3) == 1);
+    BOOST_CHECK(darkSendMasterNodes.FindById(nId1) == -1);
+
+    // ids are not reused, even after the list was cleared
+    darkSendMasterNodes.Clear();
+    BOOST_CHECK(darkSendMasterNodes.Find(vin2) == -1);
+    BOOST_CHECK(darkSendMasterNodes.Add(CMasterNode(addr1, vin1, CPubKey(), vchSig, 0, CPubKey())));
+    BOOST_CHECK(darkSendMasterNodes[0].nId > nId3);
+    BOOST_CHECK(darkSendMasterNodes.FindById(nId1) == -1);
+    darkSendMasterNodes.Clear();
+}
+
+BOOST_AUTO_TEST_CASE(darksend_rounds_cache)
+{
+    if(!IsDenominatedAmount((10 * COIN)+1))
+        darkSendDenominations.push_back( (10 * COIN)+1 );
+
+    CScript scriptMine;
+    scriptMine.SetDestination(pwalletMain->GenerateNewKey().GetID());
+
+    // tx1: someone else's coins into one of our denominated outputs
+    CWalletTx tx1;
+    tx1.vin.push_back(CTxIn(uint256(40000), 0));
+    tx1.vout.push_back(CTxOut((10 * COIN)+1, scriptMine));
+
+    // tx2: mixes tx1's output into another denominated output
+    CWalletTx tx2;
+    tx2.vin.push_back(CTxIn(tx1.GetHash(), 0));
+    tx2.vout.push_back(CTxOut((10 * COIN)+1, scriptMine));
+
+    COutPoint out1(tx1.GetHash(), 0);
+    COutPoint out2(tx2.GetHash(), 0);
+
+    // tx2 arrives first: its input isn't known to be ours
+    pwalletMain->AddToWallet(tx2);
+    BOOST_CHECK(pwalletMain->GetOutpointDarksendRounds(out2) == -1);
+    BOOST_CHECK(pwalletMain->GetOutpointDarksendRounds(out2) == -1);
+
+    // the parent turning up flushes what was computed without it
+    pwalletMain->AddToWallet(tx1);
+    BOOST_CHECK(pwalletMain->GetOutpointDarksendRounds(out1) == -1);
+    BOOST_CHECK(pwalletMain->GetOutpointDarksendRounds(out2) == 0);
+    BOOST_CHECK(GetInputDarksendRounds(CTxIn(out2)) == 0);
+
+    // non-denominated and out of range outputs
+    BOOST_CHECK(pwalletMain->GetOutpointDarksendRounds(COutPoint(tx2.GetHash(), 1)) == -4);
+    BOOST_CHECK(pwalletMain->GetOutpointDarksendRounds(COutPoint(uint256(40000), 0)) == -1);
+
+    pwalletMain->mapWallet.erase(tx1.GetHash());
+    pwalletMain->mapWallet.erase(tx2.GetHash());
+    pwalletMain->ClearDarksendRounds();
+}
+
+BOOST_AUTO_TEST_CASE(darksend_masternode_check)
+{
+    CService addr;
+    std::vector<unsigned char> vchSig;
+    CMasterNode mn(addr, CTxIn(30000, 0), CPubKey(), vchSig, 0, CPubKey());
+
+    // Check() only looks at the times; the collateral is CheckMasternodes()' job
+    mn.UpdateLastSeen();
+    mn.Check();
+    BOOST_CHECK(mn.IsEnabled());
+
+    mn.UpdateLastSeen(GetAdjustedTime() - MASTERNODE_EXPIRATION_SECONDS);
+    mn.Check();
+    BOOST_CHECK(mn.enabled == 2);
+
+    mn.UpdateLastSeen(GetAdjustedTime() - MASTERNODE_REMOVAL_SECONDS);
+    mn.Check();
+    BOOST_CHECK(mn.enabled == 4);
+
+    // a spent collateral stays spent
+    mn.enabled = 3;
+    mn.UpdateLastSeen();
+    mn.Check();
+    BOOST_CHECK(mn.enabled == 3);
+}
+
+BOOST_AUTO_TEST_CASE(darksend_masternode_ranks)
+{
+    darkSendMasterNodes.Clear();
+
+    CService addr;
+    std::vector<unsigned char> vchSig;
+    CTxIn vin1 = CTxIn(20000, 0);
+    CTxIn vin2 = CTxIn(20001, 0);
+
+    CMasterNode mn1(addr, vin1, CPubKey(), vchSig, 0, CPubKey());
+    mn1.unitTest = true;
+    mn1.UpdateLastSeen();
+    CMasterNode mn2(addr, vin2, CPubKey(), vchSig, 0, CPubKey());
+    mn2.unitTest = true;
+    mn2.UpdateLastSeen();
+
+    darkSendMasterNodes.Add(mn1);
+    int nId1 = GetMasternodeByVin(vin1);
+    BOOST_CHECK(GetMasternodeRank(vin1) == 1);
+    BOOST_CHECK(GetMasternodeRank(vin2) == -1);
+    BOOST_CHECK(GetMasternodeByRank(1) == nId1);
+    BOOST_CHECK(GetMasternodeByRank(2) == -1);
+
+    // adding an entry invalidates the cached table; equal scores keep list order
+    darkSendMasterNodes.Add(mn2);
+    int nId2 = GetMasternodeByVin(vin2);
+    BOOST_CHECK(GetMasternodeRank(vin2) == 2);
+    BOOST_CHECK(GetMasternodeByRank(2) == nId2);
+
+    // without a chain every score is zero and nobody wins
+    BOOST_CHECK(GetCurrentMasterNode() == -1);
+
+    // disabled entries drop out of the ranking once the change is flagged
+    darkSendMasterNodes[0].Disable();
+    darkSendMasterNodes.SetChanged();
+    BOOST_CHECK(GetMasternodeRank(vin1) == -1);
+    BOOST_CHECK(GetMasternodeRank(vin2) == 1);
+    BOOST_CHECK(GetMasternodeByRank(1) == nId2);
+
+    // the winner's id still finds it after the entries before it are gone
+    darkSendMasterNodes.Remove(darkSendMasterNodes.begin());
+    BOOST_CHECK(darkSendMasterNodes.FindById(nId2) == 0);
+    BOOST_CHECK(GetMasternodeByRank(1) == nId2);
+
+    darkSendMasterNodes.Clear();
 }
 
 BOOST_AUTO_TEST_CASE(darksend_add_entry)
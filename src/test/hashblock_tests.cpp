@@ -0,0 +1,189 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hashblock.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(hashblock_tests)
+
+BOOST_AUTO_TEST_CASE(hash9xn_matches_hash9)
+{
+    // Cover header sized and masternode score sized inputs, the single block
+    // BLAKE limit and multi-block input, and partial final lane groups
+    static const unsigned int nLens[] = {0, 1, 32, 64, 80, 111, 112, 128, 200};
+    static const unsigned int nCounts[] = {1, 3, 4, 5, 8, 9, 17};
+
+    for (unsigned int i = 0; i < sizeof(nLens)/sizeof(nLens[0]); i++) {
+        for (unsigned int j = 0; j < sizeof(nCounts)/sizeof(nCounts[0]); j++) {
+            unsigned int nLen = nLens[i], nCount = nCounts[j];
+
+            vector<vector<unsigned char> > vData(nCount, vector<unsigned char>(nLen + 1));
+            vector<const unsigned char*> vpData(nCount);
+            for (unsigned int n = 0; n < nCount; n++) {
+                for (unsigned int k = 0; k < nLen; k++)
+                    vData[n][k] = rand();
+                vpData[n] = &vData[n][0];
+            }
+
+            vector<uint256> vHash(nCount);
+            Hash9xN(&vpData[0], nLen, &vHash[0], nCount);
+            for (unsigned int n = 0; n < nCount; n++)
+                BOOST_CHECK(vHash[n] == Hash9(vpData[n], vpData[n] + nLen));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hash9_lanes)
+{
+    unsigned int nLanes = Hash9Lanes();
+    BOOST_CHECK(nLanes == 4 || nLanes == 8);
+}
+
+BOOST_AUTO_TEST_CASE(hash9_midstate)
+{
+    // Mainnet genesis block header, nonce 28917698
+    vector<unsigned char> vHeader = ParseHex("010000000000000000000000000000000000000000000000000000000000000000000000c762a6567f3cc092f0684bb62b7e00a84890b990f07cc71a6bb58d64b98e02e0022ddb52f0ff0f1ec23fb901");
+    CHash9Midstate midstate(&vHeader[0]);
+    uint256 hash;
+    midstate.Hashes(&vHeader[0], 28917698, &hash, 1);
+    BOOST_CHECK_EQUAL(hash.ToString(), "00000ffd590b1485b3caadc19b22e6379c733355108f107a430458cdf3407ab6");
+
+    // Nonce ranges of any length, including ones that wrap around, and a
+    // changed nTime with the same midstate
+    static const unsigned int nCounts[] = {1, 3, 4, 5, 8, 9, 17};
+    static const unsigned int nStarts[] = {0, 28917690, 0xfffffffa};
+    for (unsigned int t = 0; t < 2; t++) {
+        vHeader[68] += t;
+        for (unsigned int i = 0; i < sizeof(nCounts)/sizeof(nCounts[0]); i++) {
+            for (unsigned int j = 0; j < sizeof(nStarts)/sizeof(nStarts[0]); j++) {
+                vector<uint256> vHash(nCounts[i]);
+                midstate.Hashes(&vHeader[0], nStarts[j], &vHash[0], nCounts[i]);
+                for (unsigned int n = 0; n < nCounts[i]; n++) {
+                    unsigned int nNonce = nStarts[j] + n;
+                    for (int k = 0; k < 4; k++)
+                        vHeader[76 + k] = (nNonce >> (8 * k)) & 0xff;
+                    BOOST_CHECK(vHash[n] == Hash9(vHeader.begin(), vHeader.end()));
+                }
+            }
+        }
+    }
+}
+
+static void Hash9Repeat(const vector<unsigned char>* pvData, const uint256* phashExpected, int* pnMismatches)
+{
+    for (int i = 0; i < 200; i++)
+        if (Hash9(pvData->begin(), pvData->end()) != *phashExpected)
+            (*pnMismatches)++;
+}
+
+BOOST_AUTO_TEST_CASE(hash9_threads)
+{
+    // Every thread hashes with its own context set
+    vector<unsigned char> vData(80);
+    for (unsigned int i = 0; i < vData.size(); i++)
+        vData[i] = i;
+    uint256 hashExpected = Hash9(vData.begin(), vData.end());
+
+    int nMismatches[4] = {0, 0, 0, 0};
+    boost::thread_group threads;
+    for (int i = 0; i < 4; i++)
+        threads.create_thread(boost::bind(&Hash9Repeat, &vData, &hashExpected, &nMismatches[i]));
+    threads.join_all();
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK_EQUAL(nMismatches[i], 0);
+}
+
+BOOST_AUTO_TEST_CASE(hash9_known_answers)
+{
+    // Mainnet genesis block header
+    vector<unsigned char> vHeader = ParseHex("010000000000000000000000000000000000000000000000000000000000000000000000c762a6567f3cc092f0684bb62b7e00a84890b990f07cc71a6bb58d64b98e02e0022ddb52f0ff0f1ec23fb901");
+    BOOST_CHECK_EQUAL(Hash9(vHeader.begin(), vHeader.end()).ToString(),
+                      "00000ffd590b1485b3caadc19b22e6379c733355108f107a430458cdf3407ab6");
+
+    // Prefixes of the byte sequence 00 01 02 ... ff
+    unsigned char pchData[256];
+    for (unsigned int i = 0; i < sizeof(pchData); i++)
+        pchData[i] = i;
+
+    static const struct {
+        unsigned int nLen;
+        const char* pszHash;
+    } vectors[] = {
+        {  0, "ba4e5867eb17cdc33dccb6cc7175256320e2b4627ec221a26e5783902072b551"},
+        {  1, "24400024faa3f8e097487f84cf7bb0bee6c92623fe6e791a78869805a11540ad"},
+        { 32, "9320875c711407060e037c5a95981a778ed82aa3aebac2e71045ada42c81733f"},
+        { 64, "40ebf93f912f988b0cd7b24ea231a587aed7648ac469000687faecd649d80676"},
+        { 80, "ceece3d4f75f36c26b50278c1ae635eef54fde24e49cea10e29ea3a97a762e41"},
+        {111, "b2421ac16c4615d530c597e77d3c754354c8e816cd846e4daee638a336f96a4f"},
+        {112, "a461b3d1af299e08ef978742a288a26db4fbf33b3ab0a9394715861d26664f02"},
+        {128, "f00eb6f9b8cde92acdc032708901450972317eaab7f2be574380a12da4d712f7"},
+        {200, "8f70644ab1d442e4df711ba68676e5f38524969bfa01f7573d2d081e99978b5d"},
+        {256, "06d8d831be8df4c1b03ee89c90cc50f04ce3d439bf33783a2cdf585f334ae0fe"},
+    };
+    for (unsigned int i = 0; i < sizeof(vectors)/sizeof(vectors[0]); i++)
+        BOOST_CHECK_EQUAL(Hash9(pchData, pchData + vectors[i].nLen).ToString(), vectors[i].pszHash);
+}
+
+// Groestl, ECHO and SHAvite have AES-NI code paths picked at runtime; check
+// each of them on its own so a mismatch points at the faulty stage
+BOOST_AUTO_TEST_CASE(aes_stages_known_answers)
+{
+    unsigned char pchData[256];
+    for (unsigned int i = 0; i < sizeof(pchData); i++)
+        pchData[i] = i;
+
+    static const unsigned int nLens[] = {0, 64, 127, 128, 200, 256};
+    static const char* pszGroestl[] = {
+        "6d3ad29d279110eef3adbd66de2a0345a77baede1557f5d099fce0c03d6dc2ba8e6d4a6633dfbd66053c20faa87d1a11f39a7fbe4a6c2f009801370308fc4ad8",
+        "6e8c9b90e36cea68c029a7d8b95b718c84205d81be227ba61510f567d46b83edd11f301bf1e7041be991b22fdbee82dbdce7ab0e0ee42a795ca965a439532a39",
+        "f61cea93f8dcb9f48a78f14c990cf4690735495d1e6685acc86ab4f56f39f808b3b2266120cd897a933e758aa40c81fef2d895eff52fe235b2025f4a7c910241",
+        "70b56b15a86cd65b19f4afe78f7b408b72287947cc0d28ba4189573fbe033cf9a3298127b460778feecca5794407539acc267b27732e4fbc21bc96fcf9f2f17a",
+        "ff6dabc4aacd1f3955daba7ee2f36b2e24cca8aef87bdf286ea77b2d86dc40526ca5290c0558e95b4f620d78241a2665ab300216016b66ae87c6dc2e216348bb",
+        "ce221dd8dcf42e5a9020f548d7e3348b254660418216fc0fbc726a000521103828eed3da29f90915072c958aa5763a1296b8d9dca8f22ec31b0f9bb108d9c68e",
+    };
+    static const char* pszEcho[] = {
+        "158f58cc79d300a9aa292515049275d051a28ab931726d0ec44bdd9faef4a702c36db9e7922fff077402236465833c5cc76af4efc352b4b44c7fa15aa0ef234e",
+        "2f7a64cec7e07c9d791f902b838e9a776c03da43ef8858e89c16bbfa7eff641d5e309d9a51e13177cbb86fb1021070c64763fa93b39824dafd773154cf2ec058",
+        "cfcccc96a4aa0d2417d564efbb0e691b47067fb5bf09d05d377692785cf55bba34129129a02262d9aa789dddde9dd4773dc85c04ef6624ea8e37334b157484f2",
+        "d37a5967e4ab8e69c2164486866e9159523be40ea4b852e2ff166c4a6577da194da5333d0556bbde82c6e620cf6f839cf5c0a5a08db6ac8e4c580afd6af4fa24",
+        "61c10247231339fe1649319067997f656a1a90a0482763a227378c96eaf07eb984018a897d0ed453729ca700d21753432c0cabef97ea9b32fcbd61268d0f7d11",
+        "73ca1dc9468fa4ecf4a75de87d425d35972a6e08aeeea396f951e9026426a6d3f1a3939336244f5c799a30f5ceb5c455af521aa4b445183fb5da875c666be02d",
+    };
+    static const char* pszShavite[] = {
+        "a485c1b2578459d1efc5dddd840bb0b4a650ac82fe68f58c4442ccda747da006b2d1dc6b4a4eb7d84ff91e1f466fef429d259acd995dddcad16fa545c7a6e5ba",
+        "4b53734538b113c1637104887e9f2150fa4ad9ec70552d8ed62f0134a47a2f4e8134b2366932983b4127cbcba59cda04bf6d0005b5ba04dea92879f15e80a28a",
+        "fba739b636fb4be81248e1cea093491080680769f80e946ff70f2de5614849cd76c7c18bcbc640d8f93b9af3b0649bbf3daccd268097e996873d3899d4ff1513",
+        "c67b6b19a26556a6f5eb1545816d393e494c236d9fe36685e182238daa026429dfc549caeb34d9ea959da1daf189bc16839430750902b5b6db4bf9b9daba0b56",
+        "c312d285cd9c597d7df9525133155f05aa94f206b31e2def255879b8bb27f25ccfaba516238c5de679545e7d0d88a5d0c0c975aae8a2e62369fcdeda4d02da42",
+        "19238736482393a2760171a19fdd900f831319e8fff1d120e723fc97647adf1f6f54efba31368ccdc300abec3474f10c0484b4622bf972315a9ba95529d7e5ff",
+    };
+
+    unsigned char pchHash[64];
+    for (unsigned int i = 0; i < sizeof(nLens)/sizeof(nLens[0]); i++) {
+        sph_groestl512_context ctx_groestl;
+        sph_groestl512_init(&ctx_groestl);
+        sph_groestl512(&ctx_groestl, pchData, nLens[i]);
+        sph_groestl512_close(&ctx_groestl, pchHash);
+        BOOST_CHECK_EQUAL(HexStr(pchHash, pchHash + sizeof(pchHash)), pszGroestl[i]);
+
+        sph_echo512_context ctx_echo;
+        sph_echo512_init(&ctx_echo);
+        sph_echo512(&ctx_echo, pchData, nLens[i]);
+        sph_echo512_close(&ctx_echo, pchHash);
+        BOOST_CHECK_EQUAL(HexStr(pchHash, pchHash + sizeof(pchHash)), pszEcho[i]);
+
+        sph_shavite512_context ctx_shavite;
+        sph_shavite512_init(&ctx_shavite);
+        sph_shavite512(&ctx_shavite, pchData, nLens[i]);
+        sph_shavite512_close(&ctx_shavite, pchHash);
+        BOOST_CHECK_EQUAL(HexStr(pchHash, pchHash + sizeof(pchHash)), pszShavite[i]);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
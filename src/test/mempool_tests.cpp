@@ -0,0 +1,221 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "key.h"
+#include "main.h"
+#include "script.h"
+
+using namespace std;
+
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+static CTransaction MakeTx(const uint256& hashPrev, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_entry_index)
+{
+    mempool.clear();
+
+    // Parent spends an output nobody has: not mineable, not indexed
+    CTransaction txParent = MakeTx(uint256(1), 10 * COIN);
+    uint256 hashParent = txParent.GetHash();
+    mempool.addUnchecked(hashParent, txParent);
+    BOOST_CHECK(mempool.mapTx[hashParent].fMissingInputs);
+    BOOST_CHECK(mempool.setByFeeRate.empty());
+    BOOST_CHECK(mempool.setByPriority.empty());
+
+    // Child takes its input value from the pool
+    CTransaction txChild = MakeTx(hashParent, 9 * COIN);
+    uint256 hashChild = txChild.GetHash();
+    mempool.addUnchecked(hashChild, txChild);
+    const CTxMemPoolEntry& child = mempool.mapTx[hashChild];
+    BOOST_CHECK(!child.fMissingInputs);
+    BOOST_CHECK(child.nFee == COIN);
+    BOOST_CHECK(child.setParents.size() == 1 && child.setParents.count(hashParent));
+    BOOST_CHECK(child.GetPriority(1000) == 0);
+    BOOST_CHECK(mempool.setByFeeRate.size() == 1);
+    BOOST_CHECK(mempool.setByFeeRate.begin()->second == hashChild);
+    BOOST_CHECK(mempool.setByPriority.size() == 1);
+
+    // Once the parent is gone without being mined, the child misses its input
+    mempool.remove(txParent);
+    BOOST_CHECK(mempool.mapTx[hashChild].fMissingInputs);
+    BOOST_CHECK(mempool.mapTx[hashChild].setParents.empty());
+    BOOST_CHECK(mempool.setByFeeRate.empty());
+    BOOST_CHECK(mempool.setByPriority.empty());
+
+    // A parent arriving after its child fills the child in
+    mempool.addUnchecked(hashParent, txParent);
+    BOOST_CHECK(!mempool.mapTx[hashChild].fMissingInputs);
+    BOOST_CHECK(mempool.mapTx[hashChild].nFee == COIN);
+    BOOST_CHECK(mempool.setByFeeRate.size() == 1);
+
+    mempool.remove(txParent, true);
+    BOOST_CHECK(mempool.mapTx.empty());
+    BOOST_CHECK(mempool.mapNextTx.empty());
+    BOOST_CHECK(mempool.setByFeeRate.empty());
+    BOOST_CHECK(mempool.setByPriority.empty());
+
+    mempool.clear();
+}
+
+// Pay-to-pubkey coins, one output of nValue per key, as if in the best block
+static uint256 AddTestCoins(const vector<CKey>& vKeys, int64 nValue)
+{
+    CTransaction txPrev;
+    txPrev.vin.resize(1);
+    txPrev.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    BOOST_FOREACH(const CKey& key, vKeys)
+        txPrev.vout.push_back(CTxOut(nValue, CScript() << key.GetPubKey() << OP_CHECKSIG));
+
+    LOCK(cs_main);
+    pcoinsTip->SetCoins(txPrev.GetHash(), CCoins(txPrev, pindexBest->nHeight));
+    return txPrev.GetHash();
+}
+
+// Spend all the coins of hashPrev to the first key. Input nBad gets a
+// signature by the wrong key, input nNonCanonical a valid signature with an
+// unknown hash type byte.
+static CTransaction MakeSignedTx(const uint256& hashPrev, const vector<CKey>& vKeys, int64 nValue,
+                                 int nBad = -1, int nNonCanonical = -1)
+{
+    CTransaction tx;
+    tx.vin.resize(vKeys.size());
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        tx.vin[i].prevout = COutPoint(hashPrev, i);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey.SetDestination(vKeys[0].GetPubKey().GetID());
+    tx.vout[0].nValue = nValue;
+
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        CScript scriptPubKey = CScript() << vKeys[i].GetPubKey() << OP_CHECKSIG;
+        int nHashType = (int)i == nNonCanonical ? 0x21 : SIGHASH_ALL;
+        uint256 hash = SignatureHash(scriptPubKey, tx, i, nHashType);
+        vector<unsigned char> vchSig;
+        BOOST_REQUIRE(((int)i == nBad ? keyOther : vKeys[i]).Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)nHashType);
+        tx.vin[i].scriptSig = CScript() << vchSig;
+    }
+    return tx;
+}
+
+static vector<CKey> MakeTestKeys(unsigned int nKeys)
+{
+    vector<CKey> vKeys(nKeys);
+    for (unsigned int i = 0; i < nKeys; i++)
+        vKeys[i].MakeNewKey(true);
+    return vKeys;
+}
+
+// Accept without cs_main, as the tx message handler does; returns the DoS
+// score of a rejection, -1 if the transaction got in
+static int TestAccept(CTransaction tx, bool* pfMissingInputs)
+{
+    CValidationState state;
+    if (mempool.accept(state, tx, true, false, pfMissingInputs, true))
+        return -1;
+    int nDoS = 0;
+    state.IsInvalid(nDoS);
+    return nDoS;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_accept_failures)
+{
+    mempool.clear();
+    int nScriptCheckThreadsSave = nScriptCheckThreads;
+    vector<CKey> vKeys = MakeTestKeys(4);
+
+    // serially, then on the script check threads: same outcome
+    for (int nParallel = 0; nParallel < 2; nParallel++)
+    {
+        nScriptCheckThreads = nParallel ? nScriptCheckThreadsSave : 0;
+        bool fMissingInputs = false;
+
+        // unknown inputs: an orphan, not an offence
+        BOOST_CHECK_EQUAL(TestAccept(MakeSignedTx(GetRandHash(), vKeys, COIN), &fMissingInputs), 0);
+        BOOST_CHECK(fMissingInputs);
+
+        // a bad signature is
+        uint256 hashPrev = AddTestCoins(vKeys, COIN);
+        BOOST_CHECK_EQUAL(TestAccept(MakeSignedTx(hashPrev, vKeys, COIN, 3), &fMissingInputs), 100);
+        BOOST_CHECK(!fMissingInputs);
+
+        // unless only the encoding is non-canonical
+        BOOST_CHECK_EQUAL(TestAccept(MakeSignedTx(hashPrev, vKeys, COIN, -1, 2), &fMissingInputs), 0);
+        BOOST_CHECK(!fMissingInputs);
+        BOOST_CHECK(mempool.mapTx.empty());
+
+        CTransaction tx = MakeSignedTx(hashPrev, vKeys, COIN);
+        BOOST_CHECK_EQUAL(TestAccept(tx, &fMissingInputs), -1);
+        BOOST_CHECK(mempool.exists(tx.GetHash()));
+
+        // already in, or spending the same coins
+        BOOST_CHECK_EQUAL(TestAccept(tx, &fMissingInputs), 0);
+        BOOST_CHECK_EQUAL(TestAccept(MakeSignedTx(hashPrev, vKeys, 2 * COIN), &fMissingInputs), 0);
+        BOOST_CHECK_EQUAL(mempool.mapTx.size(), 1U);
+
+        // spent in the chain
+        uint256 hashSpent = AddTestCoins(vKeys, COIN);
+        {
+            LOCK(cs_main);
+            CCoins coins;
+            BOOST_REQUIRE(pcoinsTip->GetCoins(hashSpent, coins));
+            coins.Spend(1);
+            pcoinsTip->SetCoins(hashSpent, coins);
+        }
+        BOOST_CHECK_EQUAL(TestAccept(MakeSignedTx(hashSpent, vKeys, COIN), &fMissingInputs), 0);
+        BOOST_CHECK(!fMissingInputs);
+
+        mempool.clear();
+    }
+
+    nScriptCheckThreads = nScriptCheckThreadsSave;
+}
+
+static void AcceptInThread(CTransaction tx, int* pnResult)
+{
+    *pnResult = TestAccept(tx, NULL);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_accept_concurrent)
+{
+    mempool.clear();
+    vector<CKey> vKeys = MakeTestKeys(4);
+
+    // Double spends racing through the unlocked stages: the insert lets
+    // exactly one in, and the loser isn't scored
+    for (int n = 0; n < 20; n++)
+    {
+        uint256 hashPrev = AddTestCoins(vKeys, COIN);
+        CTransaction tx1 = MakeSignedTx(hashPrev, vKeys, COIN);
+        CTransaction tx2 = MakeSignedTx(hashPrev, vKeys, 2 * COIN);
+        int nResult1 = 0, nResult2 = 0;
+        boost::thread thread1(boost::bind(&AcceptInThread, tx1, &nResult1));
+        boost::thread thread2(boost::bind(&AcceptInThread, tx2, &nResult2));
+        thread1.join();
+        thread2.join();
+
+        BOOST_CHECK((nResult1 == -1) != (nResult2 == -1));
+        BOOST_CHECK(nResult1 <= 0 && nResult2 <= 0);
+        BOOST_CHECK(mempool.exists(tx1.GetHash()) == (nResult1 == -1));
+        BOOST_CHECK(mempool.exists(tx2.GetHash()) == (nResult2 == -1));
+        BOOST_CHECK_EQUAL(mempool.mapNextTx.size(), vKeys.size());
+        mempool.clear();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
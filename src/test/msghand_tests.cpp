@@ -0,0 +1,157 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(msghand_tests)
+
+static CAddress TestAddress(unsigned int n)
+{
+    return CAddress(CService(CNetAddr(strprintf("10.0.0.%u", n)), 9999));
+}
+
+BOOST_AUTO_TEST_CASE(msghand_pinning)
+{
+    vector<CNode*> vNodes;
+    for (unsigned int i = 0; i < 8; i++)
+        vNodes.push_back(new CNode(INVALID_SOCKET, TestAddress(i + 1), "", true));
+
+    set<int> setHandlers;
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        // always the same thread, whatever the others are doing
+        int nHandler = GetMessageHandler(pnode, 4);
+        BOOST_CHECK(nHandler >= 0 && nHandler < 4);
+        BOOST_CHECK_EQUAL(GetMessageHandler(pnode, 4), nHandler);
+        BOOST_CHECK_EQUAL(GetMessageHandler(pnode, 1), 0);
+        setHandlers.insert(nHandler);
+    }
+    // consecutive nodes are spread over all threads
+    BOOST_CHECK_EQUAL(setHandlers.size(), 4U);
+
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        delete pnode;
+}
+
+static void HoldRecvLock(CNode* pnode, volatile bool* pfHolding, volatile bool* pfRelease)
+{
+    LOCK(pnode->cs_vRecvMsg);
+    *pfHolding = true;
+    while (!*pfRelease)
+        MilliSleep(1);
+}
+
+BOOST_AUTO_TEST_CASE(msghand_work_stealing)
+{
+    CNode node(INVALID_SOCKET, TestAddress(1), "", true);
+    int nOwner = GetMessageHandler(&node, 2);
+    int nHelper = 1 - nOwner;
+
+    // nothing waiting
+    BOOST_CHECK(!CanHelpWithMessages(&node, nHelper, 2));
+
+    {
+        LOCK(node.cs_vRecvMsg);
+        node.nRecvQueued = 2;
+    }
+    BOOST_CHECK(CanHelpWithMessages(&node, nHelper, 2));
+    // the node's own thread handles it in its own pass
+    BOOST_CHECK(!CanHelpWithMessages(&node, nOwner, 2));
+
+    // being received or handled by another thread
+    volatile bool fHolding = false, fRelease = false;
+    boost::thread holder(boost::bind(&HoldRecvLock, &node, &fHolding, &fRelease));
+    while (!fHolding)
+        MilliSleep(1);
+    BOOST_CHECK(!CanHelpWithMessages(&node, nHelper, 2));
+    fRelease = true;
+    holder.join();
+    BOOST_CHECK(CanHelpWithMessages(&node, nHelper, 2));
+
+    node.fDisconnect = true;
+    BOOST_CHECK(!CanHelpWithMessages(&node, nHelper, 2));
+}
+
+#ifndef WIN32
+// Handle the node's messages as its own thread or as a helper does in
+// ThreadMessageHandler, until none are left
+static void HandleTestMessages(CNode* pnode, int nThread, bool fOwner)
+{
+    while (true)
+    {
+        {
+            LOCK(pnode->cs_vRecvMsg);
+            if (pnode->nRecvQueued == 0)
+                return;
+        }
+        if (!fOwner && !CanHelpWithMessages(pnode, nThread, 2))
+            continue;
+        TRY_LOCK(pnode->cs_messageHandler, lockHandler);
+        if (!lockHandler)
+            continue;
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+            ProcessMessages(pnode);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(msghand_message_order)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode node(fds[0], TestAddress(1), "", true);
+    node.nVersion = PROTOCOL_VERSION;
+
+    // pings are answered with their nonce, in the order they are handled
+    const unsigned int nPings = 200;
+    {
+        LOCK(node.cs_vRecvMsg);
+        for (uint64 nonce = 0; nonce < nPings; nonce++)
+        {
+            CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+            ssPayload << nonce;
+            CSharedMessage msg = MakeSharedMessage("ping", ssPayload);
+            BOOST_REQUIRE(node.ReceiveMsgBytes(&(*msg)[0], msg->size()));
+        }
+        BOOST_CHECK_EQUAL(node.nRecvQueued, (int)nPings);
+    }
+
+    int nOwner = GetMessageHandler(&node, 2);
+    boost::thread owner(boost::bind(&HandleTestMessages, &node, nOwner, true));
+    boost::thread helper(boost::bind(&HandleTestMessages, &node, 1 - nOwner, false));
+    owner.join();
+    helper.join();
+    BOOST_CHECK(!node.fDisconnect);
+
+    const unsigned int nPongSize = CMessageHeader::HEADER_SIZE + sizeof(uint64);
+    vector<char> vRecv(nPings * nPongSize);
+    unsigned int nRead = 0;
+    while (nRead < vRecv.size())
+    {
+        int nBytes = recv(fds[1], &vRecv[nRead], vRecv.size() - nRead, 0);
+        BOOST_REQUIRE(nBytes > 0);
+        nRead += nBytes;
+    }
+    close(fds[1]);
+
+    CDataStream ss(&vRecv[0], &vRecv[0] + vRecv.size(), SER_NETWORK, PROTOCOL_VERSION);
+    for (uint64 nonce = 0; nonce < nPings; nonce++)
+    {
+        CMessageHeader hdr;
+        uint64 nonceRecv;
+        ss >> hdr >> nonceRecv;
+        BOOST_CHECK_EQUAL(hdr.GetCommand(), "pong");
+        BOOST_CHECK_EQUAL(nonceRecv, nonce);
+    }
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,138 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(relaycache_tests)
+
+static CSharedMessage MakeTestMessage(const char* pszCommand, unsigned int nSize)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    for (unsigned int i = 0; i < nSize; i++)
+        ss << (unsigned char)i;
+    return MakeSharedMessage(pszCommand, ss);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_message)
+{
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << string("payload") << 42;
+    CSharedMessage msg = MakeSharedMessage("tx", ssPayload);
+    BOOST_CHECK_EQUAL(msg->size(), CMessageHeader::HEADER_SIZE + ssPayload.size());
+
+    // The same framing as PushMessage
+    CDataStream ss(msg->begin(), msg->end(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr;
+    ss >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "tx");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(hdr.nChecksum, nChecksum);
+    BOOST_CHECK(vector<char>(ss.begin(), ss.end()) == vector<char>(ssPayload.begin(), ssPayload.end()));
+
+    // Empty payloads too
+    msg = MakeSharedMessage("mempool", CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(msg->size(), CMessageHeader::HEADER_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_add_find)
+{
+    CRelayCache cache(1000000, 60);
+    CInv inv1(MSG_TX, 1), inv2(MSG_TX, 2);
+    CSharedMessage msg1 = MakeTestMessage("tx", 10);
+    CSharedMessage msg2 = MakeTestMessage("tx", 20);
+
+    BOOST_CHECK(!cache.Find(inv1));
+    cache.Add(inv1, msg1);
+    BOOST_CHECK(cache.Find(inv1) == msg1);
+
+    // The first message for an inv is kept
+    cache.Add(inv1, msg2);
+    BOOST_CHECK(cache.Find(inv1) == msg1);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1U);
+    BOOST_CHECK_EQUAL(cache.GetSize(), msg1->size());
+
+    cache.Add(inv2, msg2);
+    BOOST_CHECK(cache.Find(inv2) == msg2);
+    BOOST_CHECK_EQUAL(cache.GetSize(), msg1->size() + msg2->size());
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_limits)
+{
+    int64 nStartTime = GetTime();
+    SetMockTime(nStartTime);
+
+    // Room for three of these messages
+    unsigned int nMessageSize = CMessageHeader::HEADER_SIZE + 100;
+    CRelayCache cache(3 * nMessageSize, 60);
+    for (int i = 1; i <= 5; i++)
+        cache.Add(CInv(MSG_TX, i), MakeTestMessage("tx", 100));
+
+    // The oldest went first
+    BOOST_CHECK_EQUAL(cache.GetCount(), 3U);
+    BOOST_CHECK_EQUAL(cache.GetSize(), 3 * nMessageSize);
+    BOOST_CHECK(!cache.Find(CInv(MSG_TX, 1)));
+    BOOST_CHECK(!cache.Find(CInv(MSG_TX, 2)));
+    BOOST_CHECK(cache.Find(CInv(MSG_TX, 3)));
+    BOOST_CHECK(cache.Find(CInv(MSG_TX, 5)));
+
+    // and all expire after their lifetime
+    SetMockTime(nStartTime + 30);
+    cache.Add(CInv(MSG_TX, 6), MakeTestMessage("tx", 1));
+    SetMockTime(nStartTime + 61);
+    BOOST_CHECK(!cache.Find(CInv(MSG_TX, 5)));
+    BOOST_CHECK(cache.Find(CInv(MSG_TX, 6)));
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1U);
+    SetMockTime(nStartTime + 91);
+    BOOST_CHECK(!cache.Find(CInv(MSG_TX, 6)));
+    BOOST_CHECK_EQUAL(cache.GetSize(), 0U);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_block_message)
+{
+    // Raw bytes from disk make the same message as a serialized block
+    CBlock block;
+    BOOST_CHECK(block.ReadFromDisk(pindexGenesisBlock));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    CSharedMessage msg = ReadBlockMessage(pindexGenesisBlock);
+    BOOST_CHECK(msg);
+    BOOST_CHECK(*msg == *MakeSharedMessage("block", ss));
+
+    // Blocks written before the message start switch have the old one
+    CDiskBlockPos pos = pindexGenesisBlock->GetBlockPos();
+    pos.nPos -= 8;
+    static const unsigned char pchOld[4] = { 0xfb, 0xc0, 0xb6, 0xdb };
+    unsigned char pchSaved[4];
+    FILE* file = OpenBlockFile(pos);
+    BOOST_CHECK(fread(pchSaved, 1, 4, file) == 4);
+    fseek(file, pos.nPos, SEEK_SET);
+    BOOST_CHECK(fwrite(pchOld, 1, 4, file) == 4);
+    fflush(file);
+    msg = ReadBlockMessage(pindexGenesisBlock);
+    BOOST_CHECK(msg && *msg == *MakeSharedMessage("block", ss));
+
+    // and with bad framing the block is read whole
+    fseek(file, pos.nPos + 4, SEEK_SET);
+    unsigned int nSize = 1;
+    BOOST_CHECK(fwrite(&nSize, 1, 4, file) == 4);
+    fflush(file);
+    msg = ReadBlockMessage(pindexGenesisBlock);
+    BOOST_CHECK(msg && *msg == *MakeSharedMessage("block", ss));
+
+    fseek(file, pos.nPos, SEEK_SET);
+    fwrite(pchSaved, 1, 4, file);
+    nSize = ss.size();
+    fwrite(&nSize, 1, 4, file);
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,10 +1,13 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 #include "base58.h"
 #include "util.h"
 #include "bitcoinrpc.h"
+#include "main.h"
+#include "net.h"
 
 using namespace std;
 using namespace json_spirit;
@@ -149,6 +152,113 @@ BOOST_AUTO_TEST_CASE(rpc_rawparams)
     BOOST_CHECK_THROW(CallRPC(string("sendrawtransaction ")+rawtx+" extra"), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_longpoll_slots)
+{
+    mapArgs["-rpcthreads"] = "3";
+    {
+        // one of the three threads is kept for other calls
+        CLongPollSlot slot1, slot2, slot3;
+        BOOST_CHECK(slot1.Take());
+        BOOST_CHECK(slot1.Take()); // held already, not taken twice
+        BOOST_CHECK(slot2.Take());
+        BOOST_CHECK(!slot3.Take());
+    }
+    {
+        // released by the polls above
+        CLongPollSlot slot1, slot2;
+        BOOST_CHECK(slot1.Take());
+        BOOST_CHECK(slot2.Take());
+    }
+    mapArgs.erase("-rpcthreads");
+}
+
+static void WaitForTemplateChangeThread(unsigned int nNotifyCount, int64 nTimeLimit, bool* pfDone)
+{
+    WaitForTemplateChange(nNotifyCount, nTimeLimit);
+    *pfDone = true;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_longpoll_wakeup)
+{
+    // no change: returns at the time limit
+    int64 nStart = GetTime();
+    WaitForTemplateChange(GetTemplateNotifyCount(), nStart + 1);
+    BOOST_CHECK(GetTime() >= nStart + 1);
+
+    // memory pool changes don't wake long polls
+    unsigned int nNotifyCount = GetTemplateNotifyCount();
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(uint256(1), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    mempool.addUnchecked(tx.GetHash(), tx);
+    mempool.remove(tx);
+    BOOST_CHECK_EQUAL(GetTemplateNotifyCount(), nNotifyCount);
+
+    // a new tip does, well before the time limit
+    bool fDone = false;
+    nStart = GetTime();
+    boost::thread waiter(boost::bind(&WaitForTemplateChangeThread, nNotifyCount, nStart + 60, &fDone));
+    MilliSleep(100);
+    NotifyTemplateChange();
+    waiter.join();
+    BOOST_CHECK(fDone);
+    BOOST_CHECK(GetTime() - nStart < 30);
+    BOOST_CHECK_EQUAL(GetTemplateNotifyCount(), nNotifyCount + 1);
+
+    // a notification between reading the count and waiting isn't lost
+    nStart = GetTime();
+    NotifyTemplateChange();
+    WaitForTemplateChange(nNotifyCount + 1, nStart + 60);
+    BOOST_CHECK(GetTime() - nStart < 30);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_getlockstats)
+{
+    // chain state readers and writers take cs_main
+    BOOST_CHECK(MessageNeedsChainLock("checkpoint"));
+    BOOST_CHECK(MessageNeedsChainLock("block"));
+    BOOST_CHECK(MessageNeedsChainLock("getdata"));
+    BOOST_CHECK(MessageNeedsChainLock("getblocks"));
+    BOOST_CHECK(MessageNeedsChainLock("mnw"));
+    BOOST_CHECK(MessageNeedsChainLock("unknowncmd"));
+    BOOST_CHECK(!MessageNeedsChainLock("ping"));
+    BOOST_CHECK(!MessageNeedsChainLock("verack"));
+    BOOST_CHECK(!MessageNeedsChainLock("addr"));
+    BOOST_CHECK(!MessageNeedsChainLock("dsee"));
+    BOOST_CHECK(!MessageNeedsChainLock("dseep"));
+    BOOST_CHECK(!MessageNeedsChainLock("dsq"));
+    // loose transactions take it themselves, around their script checks
+    BOOST_CHECK(!MessageNeedsChainLock("tx"));
+    BOOST_CHECK(!MessageNeedsChainLock("dstx"));
+
+    CNode node(INVALID_SOCKET, CAddress(CService("10.0.0.1", 9999)), "", true);
+    node.nVersion = PROTOCOL_VERSION;
+    const char* ppszCommands[] = { "verack", "unknowncmd", "verack" };
+    {
+        LOCK(node.cs_vRecvMsg);
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            CSharedMessage msg = MakeSharedMessage(ppszCommands[i], CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+            BOOST_REQUIRE(node.ReceiveMsgBytes(&(*msg)[0], msg->size()));
+        }
+        while (node.nRecvQueued > 0)
+            BOOST_REQUIRE(ProcessMessages(&node));
+    }
+
+    Value r;
+    BOOST_CHECK_NO_THROW(r = CallRPC("getlockstats"));
+    const Object& objVerack = find_value(r.get_obj(), "verack").get_obj();
+    BOOST_CHECK(find_value(objVerack, "count").get_int64() >= 2);
+    BOOST_CHECK(find_value(objVerack, "cs_main").get_bool() == false);
+    BOOST_CHECK(find_value(objVerack, "holdms").get_real() >= 0);
+    const Object& objUnknown = find_value(r.get_obj(), "unknowncmd").get_obj();
+    BOOST_CHECK(find_value(objUnknown, "count").get_int64() >= 1);
+    BOOST_CHECK(find_value(objUnknown, "cs_main").get_bool() == true);
+    BOOST_CHECK(find_value(objUnknown, "waitms").get_real() >= 0);
+}
+
 /*BOOST_AUTO_TEST_CASE(rpc_rawsign)
 {
     Value r;
@@ -0,0 +1,266 @@
+#include <boost/test/unit_test.hpp>
+
+#include "script.h"
+#include "secp256k1.h"
+
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(secp256k1_tests)
+
+// The same key in OpenSSL, to check the native code against
+class COpenSSLKey
+{
+public:
+    EC_KEY *pkey;
+
+    COpenSSLKey(const unsigned char sec[32]) {
+        pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+        const EC_GROUP *group = EC_KEY_get0_group(pkey);
+        BIGNUM *bn = BN_bin2bn(sec, 32, NULL);
+        EC_POINT *pub = EC_POINT_new(group);
+        EC_POINT_mul(group, pub, bn, NULL, NULL, NULL);
+        EC_KEY_set_private_key(pkey, bn);
+        EC_KEY_set_public_key(pkey, pub);
+        EC_POINT_free(pub);
+        BN_clear_free(bn);
+    }
+
+    ~COpenSSLKey() {
+        EC_KEY_free(pkey);
+    }
+
+    vector<unsigned char> GetPubKey(bool fCompressed) {
+        vector<unsigned char> vch(65);
+        EC_KEY_set_conv_form(pkey, fCompressed ? POINT_CONVERSION_COMPRESSED : POINT_CONVERSION_UNCOMPRESSED);
+        unsigned char *p = &vch[0];
+        vch.resize(i2o_ECPublicKey(pkey, &p));
+        return vch;
+    }
+};
+
+// DER encode r and s, minimally unless told otherwise
+static vector<unsigned char> EncodeDER(const unsigned char r[32], const unsigned char s[32], bool fNegativeR = false)
+{
+    vector<unsigned char> vch;
+    vch.push_back(0x30);
+    vch.push_back(0);
+    for (int n = 0; n < 2; n++) {
+        const unsigned char* p = (n == 0 ? r : s);
+        int nStart = 0;
+        while (nStart < 31 && p[nStart] == 0 && p[nStart + 1] < 0x80)
+            nStart++;
+        bool fPad = (p[nStart] & 0x80) != 0;
+        if (n == 0 && fNegativeR)
+            fPad = false;
+        vch.push_back(0x02);
+        vch.push_back(32 - nStart + (fPad ? 1 : 0));
+        if (fPad)
+            vch.push_back(0x00);
+        vch.insert(vch.end(), p + nStart, p + 32);
+    }
+    vch[1] = vch.size() - 2;
+    return vch;
+}
+
+static void RandomSecret(unsigned char sec[32])
+{
+    do {
+        RAND_bytes(sec, 32);
+        sec[0] &= 0x7f;
+    } while (sec[31] == 0);
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_openssl)
+{
+    for (int i = 0; i < 40; i++) {
+        unsigned char sec[32], hash[32], nonce[32];
+        RandomSecret(sec);
+        RAND_bytes(hash, 32);
+        RAND_bytes(nonce, 32);
+        COpenSSLKey key(sec);
+
+        for (int nCompressed = 0; nCompressed < 2; nCompressed++) {
+            bool fCompressed = (nCompressed == 1);
+
+            // Same public keys
+            unsigned char pub[65];
+            size_t publen;
+            BOOST_CHECK(ECPubKeyCreate(sec, fCompressed, pub, publen));
+            BOOST_CHECK(vector<unsigned char>(pub, pub + publen) == key.GetPubKey(fCompressed));
+            BOOST_CHECK(ECPubKeyIsValid(pub, publen));
+            unsigned char full[65];
+            BOOST_CHECK(ECPubKeyDecompress(pub, publen, full));
+            BOOST_CHECK(vector<unsigned char>(full, full + 65) == key.GetPubKey(false));
+
+            // Our signatures verify in OpenSSL, and OpenSSL's with us
+            unsigned char sig[72];
+            size_t siglen;
+            BOOST_CHECK(ECDSASign(hash, sec, nonce, sig, siglen));
+            BOOST_CHECK(ECDSA_verify(0, hash, 32, sig, siglen, key.pkey) == 1);
+            BOOST_CHECK(ECDSAVerify(hash, sig, siglen, pub, publen));
+
+            unsigned char sig2[80];
+            unsigned int siglen2 = sizeof(sig2);
+            BOOST_CHECK(ECDSA_sign(0, hash, 32, sig2, &siglen2, key.pkey) == 1);
+            BOOST_CHECK(ECDSAVerify(hash, sig2, siglen2, pub, publen));
+
+            // but not for another hash
+            hash[i % 32] ^= 1;
+            BOOST_CHECK(!ECDSAVerify(hash, sig2, siglen2, pub, publen));
+            hash[i % 32] ^= 1;
+
+            // Compact signatures give the key back
+            unsigned char sig64[64];
+            int recid;
+            BOOST_CHECK(ECDSASignCompact(hash, sec, nonce, sig64, recid));
+            unsigned char pubrec[65];
+            size_t pubreclen;
+            BOOST_CHECK(ECDSARecoverCompact(hash, sig64, recid, fCompressed, pubrec, pubreclen));
+            BOOST_CHECK(vector<unsigned char>(pubrec, pubrec + pubreclen) == vector<unsigned char>(pub, pub + publen));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_encodings)
+{
+    unsigned char sec[32], hash[32], nonce[32];
+    RandomSecret(sec);
+    RAND_bytes(hash, 32);
+    RAND_bytes(nonce, 32);
+    unsigned char pub[65];
+    size_t publen;
+    BOOST_CHECK(ECPubKeyCreate(sec, false, pub, publen));
+
+    unsigned char sig[72];
+    size_t siglen;
+    BOOST_CHECK(ECDSASign(hash, sec, nonce, sig, siglen));
+    vector<unsigned char> vchSig(sig, sig + siglen);
+
+    // Hybrid keys are taken if the parity matches
+    vector<unsigned char> vchHybrid(pub, pub + 65);
+    vchHybrid[0] = 0x06 | (pub[64] & 1);
+    BOOST_CHECK(ECDSAVerify(hash, &vchSig[0], vchSig.size(), &vchHybrid[0], 65));
+    vchHybrid[0] ^= 1;
+    BOOST_CHECK(!ECPubKeyIsValid(&vchHybrid[0], 65));
+
+    // Points off the curve are not
+    vector<unsigned char> vchBad(pub, pub + 65);
+    vchBad[64] ^= 1;
+    BOOST_CHECK(!ECPubKeyIsValid(&vchBad[0], 65));
+    BOOST_CHECK(!ECDSAVerify(hash, &vchSig[0], vchSig.size(), &vchBad[0], 65));
+
+    // Truncated signatures fail
+    for (size_t n = 0; n < vchSig.size() - 1; n++)
+        BOOST_CHECK(!ECDSAVerify(hash, &vchSig[0], n, pub, publen));
+
+    // High S values verify too: n - s
+    static const unsigned char N[32] = {
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFE,
+        0xBA,0xAE,0xDC,0xE6,0xAF,0x48,0xA0,0x3B,0xBF,0xD2,0x5E,0x8C,0xD0,0x36,0x41,0x41
+    };
+    unsigned char sig64[64];
+    int recid;
+    BOOST_CHECK(ECDSASignCompact(hash, sec, nonce, sig64, recid));
+    unsigned char s[32];
+    int borrow = 0;
+    for (int i = 31; i >= 0; i--) {
+        int d = N[i] - sig64[32 + i] - borrow;
+        borrow = d < 0;
+        s[i] = d & 0xff;
+    }
+    vector<unsigned char> vchHigh = EncodeDER(sig64, s);
+    BOOST_CHECK(ECDSAVerify(hash, &vchHigh[0], vchHigh.size(), pub, publen));
+
+    // Secret keys out of range
+    unsigned char zero[32] = {0};
+    BOOST_CHECK(!ECPubKeyCreate(zero, true, pub, publen));
+    BOOST_CHECK(!ECPubKeyCreate(N, true, pub, publen));
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_der)
+{
+    // Encodings that no OpenSSL version takes must not verify here either,
+    // as blocks are not checked for canonical signatures and any difference
+    // would split the chain. The ones OpenSSL took before 1.0.1k still verify,
+    // like the signatures the chain was validated with; the OpenSSL linked
+    // here may be newer, so those are not compared.
+    for (int i = 0; i < 20; i++) {
+        unsigned char sec[32], hash[32], nonce[32], sig64[64];
+        int recid;
+        RandomSecret(sec);
+        RAND_bytes(hash, 32);
+        // an R with its top bit set, to encode as a negative number
+        do {
+            RAND_bytes(nonce, 32);
+        } while (!ECDSASignCompact(hash, sec, nonce, sig64, recid) || !(sig64[0] & 0x80));
+        COpenSSLKey key(sec);
+        vector<unsigned char> vchPub = key.GetPubKey(true);
+
+        vector<vector<unsigned char> > vBad, vLax;
+        vector<unsigned char> vchSig = EncodeDER(sig64, sig64 + 32);
+        // negative R
+        vBad.push_back(EncodeDER(sig64, sig64 + 32, true));
+        // R padded with a zero it doesn't need
+        vector<unsigned char> vch = vchSig;
+        vch.insert(vch.begin() + 4, 0x00);
+        vch[3]++;
+        vch[1]++;
+        vLax.push_back(vch);
+        // trailing bytes, after the sequence or inside it
+        vch = vchSig;
+        vch.push_back(0x01);
+        vLax.push_back(vch);
+        vch[1]++;
+        vBad.push_back(vch);
+        // a sequence length that doesn't match
+        vch = vchSig;
+        vch[1]--;
+        vBad.push_back(vch);
+        vch[1] += 2;
+        vBad.push_back(vch);
+        // long form lengths
+        vch = vchSig;
+        vch.insert(vch.begin() + 1, 0x81);
+        vLax.push_back(vch);
+        vch = vchSig;
+        vch.insert(vch.begin() + 3, 0x81);
+        vch[1]++;
+        vLax.push_back(vch);
+        // an indefinite length, with and without its end marker
+        vch = vchSig;
+        vch[1] = 0x80;
+        vBad.push_back(vch);
+        vch.push_back(0x00);
+        vch.push_back(0x00);
+        vLax.push_back(vch);
+        // an empty integer
+        vch.clear();
+        vch.push_back(0x30);
+        vch.push_back(0x00);
+        vch.push_back(0x02);
+        vch.push_back(0x00);
+        vch.insert(vch.end(), vchSig.begin() + 4 + vchSig[3], vchSig.end());
+        vch[1] = vch.size() - 2;
+        vBad.push_back(vch);
+
+        BOOST_CHECK(ECDSAVerify(hash, &vchSig[0], vchSig.size(), &vchPub[0], vchPub.size()));
+        BOOST_CHECK(ECDSA_verify(0, hash, 32, &vchSig[0], vchSig.size(), key.pkey) == 1);
+        for (unsigned int n = 0; n < vBad.size(); n++) {
+            BOOST_CHECK_MESSAGE(!ECDSAVerify(hash, &vBad[n][0], vBad[n].size(), &vchPub[0], vchPub.size()), "vector " << n);
+            BOOST_CHECK_MESSAGE(ECDSA_verify(0, hash, 32, &vBad[n][0], vBad[n].size(), key.pkey) != 1, "vector " << n);
+        }
+        for (unsigned int n = 0; n < vLax.size(); n++) {
+            BOOST_CHECK_MESSAGE(ECDSAVerify(hash, &vLax[n][0], vLax[n].size(), &vchPub[0], vchPub.size()), "vector " << n);
+            // and they stay out of the memory pool
+            vector<unsigned char> vchWithHashType = vLax[n];
+            vchWithHashType.push_back(SIGHASH_ALL);
+            BOOST_CHECK_MESSAGE(!IsCanonicalSignature(vchWithHashType), "vector " << n);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
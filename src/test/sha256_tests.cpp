@@ -0,0 +1,63 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hash.h"
+#include "sha256.h"
+#include "util.h"
+
+#include <openssl/sha.h>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+static void TestVector(const string &strIn, const string &strHex)
+{
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)strIn.data(), strIn.size()).Finalize(hash);
+    BOOST_CHECK_EQUAL(HexStr(hash, hash + sizeof(hash)), strHex);
+}
+
+BOOST_AUTO_TEST_CASE(sha256_vectors)
+{
+    TestVector("", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    TestVector("abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    TestVector("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+               "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+BOOST_AUTO_TEST_CASE(sha256_openssl)
+{
+    vector<unsigned char> vData(2000);
+    for (unsigned int i = 0; i < vData.size(); i++)
+        vData[i] = insecure_rand();
+
+    // Any length, written in pieces of any size
+    for (unsigned int nLen = 0; nLen < vData.size(); nLen += 1 + GetRand(37)) {
+        unsigned char hash[CSHA256::OUTPUT_SIZE], hashExpected[CSHA256::OUTPUT_SIZE];
+        CSHA256 sha;
+        for (unsigned int nPos = 0; nPos < nLen; ) {
+            unsigned int nPart = min((unsigned int)GetRand(150), nLen - nPos);
+            sha.Write(&vData[nPos], nPart);
+            nPos += nPart;
+        }
+        sha.Finalize(hash);
+        SHA256(&vData[0], nLen, hashExpected);
+        BOOST_CHECK(memcmp(hash, hashExpected, sizeof(hash)) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // Every batch size, to go through each of the multi-way paths and the remainder
+    vector<uint256> vIn(40), vOut(20);
+    for (unsigned int i = 0; i < vIn.size(); i++)
+        vIn[i] = GetRandHash();
+
+    for (unsigned int nBlocks = 0; nBlocks <= vOut.size(); nBlocks++) {
+        SHA256D64(vOut[0].begin(), vIn[0].begin(), nBlocks);
+        for (unsigned int i = 0; i < nBlocks; i++)
+            BOOST_CHECK(vOut[i] == Hash(BEGIN(vIn[2*i]), END(vIn[2*i+1])));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
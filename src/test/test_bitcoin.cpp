@@ -27,7 +27,7 @@ struct TestingSetup {
         mapArgs["-datadir"] = pathTemp.string();
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
-        pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+        pcoinsTip = new CCoinsViewCache(*pcoinsdbview, false, false);
         InitBlockIndex();
         bool fFirstRun;
         pwalletMain = new CWallet("wallet.dat");
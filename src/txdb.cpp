@@ -53,15 +53,22 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    LogPrintf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    unsigned int nChanged = 0;
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        if (!(it->flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        // created and spent again before ever reaching the database
+        if ((it->flags & CCoinsCacheEntry::FRESH) && it->coins.IsPruned())
+            continue;
+        BatchWriteCoins(batch, it->txid, it->coins);
+        nChanged++;
+    }
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
 
+    LogPrintf("Committing %u changed transactions (of %u cached) to coin database...\n", nChanged, (unsigned int)mapCoins.Size());
     return db.WriteBatch(batch);
 }
 
@@ -193,48 +200,67 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Watch for genesis block
-                if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                    pindexGenesisBlock = pindexNew;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+    // Load mapBlockIndex, hashing the headers a batch at a time
+    std::vector<CDiskBlockIndex> vDiskIndex;
+    std::vector<CBlockHeader> vHeaders;
+    std::vector<uint256> vHash;
+    bool fMore = true;
+    while (fMore) {
+        vDiskIndex.clear();
+        vHeaders.clear();
+        while (vDiskIndex.size() < 1024) {
+            boost::this_thread::interruption_point();
+            if (!pcursor->Valid()) {
+                fMore = false;
+                break;
             }
-        } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType == 'b') {
+                    leveldb::Slice slValue = pcursor->value();
+                    CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                    CDiskBlockIndex diskindex;
+                    ssValue >> diskindex;
+                    vDiskIndex.push_back(diskindex);
+                    vHeaders.push_back(diskindex.GetBlockHeader());
+                    pcursor->Next();
+                } else {
+                    fMore = false;
+                    break; // if shutdown requested or finished loading block index
+                }
+            } catch (std::exception &e) {
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
+        }
+
+        CBlockHeader::GetHashes(vHeaders, vHash);
+        for (unsigned int i = 0; i < vDiskIndex.size(); i++) {
+            const CDiskBlockIndex& diskindex = vDiskIndex[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(vHash[i]);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && vHash[i] == hashGenesisBlock)
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex())
+                return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
         }
     }
     delete pcursor;
@@ -385,6 +385,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
         {
+            // cached darksend rounds that looked for this transaction are stale now
+            if (setDarksendRoundsMissing.count(hash))
+                ClearDarksendRounds();
+
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
 
@@ -581,10 +585,8 @@ int64 CWallet::IsDenominated(const CTxIn &txin) const
         {
             const CWalletTx& prev = (*mi).second;
             if (txin.prevout.n < prev.vout.size()){
-                BOOST_FOREACH(int64 d, darkSendDenominations){
-                    if(prev.vout[txin.prevout.n].nValue == d) {
-                        return true;
-                    }
+                if(IsDenominatedAmount(prev.vout[txin.prevout.n].nValue)) {
+                    return true;
                 }
             }
         }
@@ -592,6 +594,72 @@ int64 CWallet::IsDenominated(const CTxIn &txin) const
     return 0;
 }
 
+// Recursively determine the rounds of a given output (How deep is the darksend chain for a given output).
+// Results are memoized per depth. The ones computed while a transaction was missing from the wallet
+// (unknown parents, other people's darksend inputs) remember its txid, and AddToWallet() flushes the
+// cache if one of those turns up later.
+int CWallet::GetOutpointDarksendRounds(const COutPoint& outpoint, int rounds) const
+{
+    if(rounds >= 9) return rounds;
+
+    LOCK(cs_wallet);
+
+    std::pair<COutPoint, int> key = std::make_pair(outpoint, rounds);
+    std::map<std::pair<COutPoint, int>, int>::const_iterator mi = mapDarksendRounds.find(key);
+    if(mi != mapDarksendRounds.end()) return mi->second;
+
+    int nRounds = rounds-1;
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash);
+    if(it == mapWallet.end()) {
+        setDarksendRoundsMissing.insert(outpoint.hash);
+    } else {
+        const CWalletTx& tx = (*it).second;
+
+        if(outpoint.n >= tx.vout.size()) { // bounds check
+            nRounds = -4;
+        } else if(tx.vout[outpoint.n].nValue == DARKSEND_FEE) {
+            nRounds = -3;
+        } else if(rounds == 0 && !IsDenominatedAmount(tx.vout[outpoint.n].nValue)) {
+            //make sure the final output is non-denominate
+            nRounds = -2;
+        } else {
+            bool found = false;
+            BOOST_FOREACH(const CTxOut& out, tx.vout)
+                if(IsDenominatedAmount(out.nValue))
+                    found = true;
+
+            if(!found) {
+                nRounds = rounds;
+            } else {
+                // find my vin and look that up
+                BOOST_FOREACH(const CTxIn& in2, tx.vin) {
+                    // whether in2 is mine depends on its previous transaction
+                    if(!mapWallet.count(in2.prevout.hash))
+                        setDarksendRoundsMissing.insert(in2.prevout.hash);
+
+                    if(IsMine(in2)){
+                        int n = GetOutpointDarksendRounds(in2.prevout, rounds+1);
+                        if(n != -3) {
+                            nRounds = n;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    mapDarksendRounds.insert(make_pair(key, nRounds));
+    return nRounds;
+}
+
+void CWallet::ClearDarksendRounds()
+{
+    LOCK(cs_wallet);
+    mapDarksendRounds.clear();
+    setDarksendRoundsMissing.clear();
+}
+
 bool CWallet::IsChange(const CTxOut& txout) const
 {
     CTxDestination address;
@@ -1037,9 +1105,8 @@ int64 CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) const
 
             bool isDenom = false;
             for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                BOOST_FOREACH(int64 d, darkSendDenominations)
-                    if(pcoin->vout[i].nValue == d)
-                        isDenom = true;
+                if(IsDenominatedAmount(pcoin->vout[i].nValue))
+                    isDenom = true;
 
             if(onlyUnconfirmed){
                 if (!pcoin->IsFinal() || !pcoin->IsConfirmed()){
@@ -1117,10 +1184,7 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
                    int rounds = GetInputDarksendRounds(vin);
                    if(rounds >= nDarksendRounds) found = true;
                 } else if(coin_type == ONLY_NONDENOMINATED) {
-                    found = true;
-                    BOOST_FOREACH(int64 d, darkSendDenominations)
-                        if(pcoin->vout[i].nValue == d)
-                            found = false;
+                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
 
                 } else {
                     found = true;
@@ -1907,6 +1971,9 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    // the loaded keys and scripts decide which darksend inputs are ours
+    ClearDarksendRounds();
+
     return DB_LOAD_OK;
 }
 
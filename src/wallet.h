@@ -90,6 +90,11 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Darksend rounds memoized by (outpoint, recursion depth), and the txids
+    // those results were computed without (memory only, see GetOutpointDarksendRounds)
+    mutable std::map<std::pair<COutPoint, int>, int> mapDarksendRounds;
+    mutable std::set<uint256> setDarksendRoundsMissing;
+
 public:
     bool SelectCoins(int64 nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL, AvailableCoinsType coin_type=ALL_COINS) const;
     bool SelectCoinsDark(int64 nValueMin, int64 nValueMax, std::vector<CTxIn>& setCoinsRet, int64& nValueRet, int nDarksendRoundsMin, int nDarksendRoundsMax, bool& hasFeeInput) const;
@@ -229,6 +234,9 @@ public:
     bool IsMine(const CTxIn& txin) const;
     int64 GetDebit(const CTxIn& txin) const;
     int64 IsDenominated(const CTxIn &txin) const;
+    // Darksend chain depth of a wallet output, starting at depth rounds
+    int GetOutpointDarksendRounds(const COutPoint& outpoint, int rounds=0) const;
+    void ClearDarksendRounds();
     bool IsMine(const CTxOut& txout) const
     {
         return ::IsMine(*this, txout.scriptPubKey);
@@ -787,8 +795,7 @@ public:
     int Priority() const
     {
         if(tx->vout[i].nValue == DARKSEND_FEE) return -20000;
-        BOOST_FOREACH(int64 d, darkSendDenominations) 
-            if(tx->vout[i].nValue == d) return 10000;
+        if(IsDenominatedAmount(tx->vout[i].nValue)) return 10000;
         if(tx->vout[i].nValue < 1*COIN) return 20000;
 
         //nondenom return largest first